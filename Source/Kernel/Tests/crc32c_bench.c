@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Throughput of the CRC32C implementations, in GB/s, for buffer sizes from
+ * one basic header segment (48 bytes) up to 16 MB.  The fused copy and crc
+ * (crc32c_copy()) of each implementation is then compared against a copy
+ * followed by a separate crc pass over the copied data. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "crc32c_kernels.h"
+
+/* Largest buffer measured (bytes). */
+#define BENCH_MAX_SIZE (16*1024*1024)
+
+/* Minimum time spent measuring each kernel and size (seconds). */
+#define BENCH_MIN_TIME 0.2
+
+static const size_t sizes[] = { 48, 512, 4096, 8192, 65536, 262144,
+    1024*1024, 4*1024*1024, BENCH_MAX_SIZE };
+
+/* Keeps the results alive so the compiler can't drop the calls. */
+static volatile uint32_t sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Ways of running a kernel over a buffer. */
+enum bench_mode {
+    BENCH_CRC,          /* crc only */
+    BENCH_FUSED,        /* copy and crc in one pass */
+    BENCH_SEPARATE      /* memcpy, then crc of the copy */
+};
+
+/* Measure a kernel over size bytes of src (copying to dst, depending on the
+ mode) and return GB/s. */
+static double bench(const struct crc32c_kernel *kernel, enum bench_mode mode,
+                    unsigned char *dst, const unsigned char *src, size_t size)
+{
+    uint32_t crc = 0;
+    size_t iterations = 1, idx;
+    double start, elapsed;
+    
+    /* double the iterations until a run takes long enough to time */
+    for (;;) {
+        start = now();
+        for (idx = 0; idx < iterations; idx++) {
+            switch (mode) {
+            case BENCH_CRC:
+                crc = kernel->crc(crc, src, size);
+                break;
+            case BENCH_FUSED:
+                crc = kernel->copy(crc, dst, src, size);
+                break;
+            case BENCH_SEPARATE:
+                memcpy(dst, src, size);
+                crc = kernel->crc(crc, dst, size);
+                break;
+            }
+        }
+        elapsed = now() - start;
+        if (elapsed >= BENCH_MIN_TIME)
+            break;
+        iterations *= 2;
+    }
+    sink = crc;
+    return (double)size * iterations / elapsed / 1e9;
+}
+
+int main(void)
+{
+    struct crc32c_kernel kernels[CRC32C_MAX_KERNELS];
+    unsigned char *buf = (unsigned char *)malloc(BENCH_MAX_SIZE);
+    unsigned char *out = (unsigned char *)malloc(BENCH_MAX_SIZE);
+    unsigned count, idx, k;
+    size_t n;
+    
+    if (!buf || !out)
+        return 1;
+    
+    crc32c_init();
+    for (n = 0; n < BENCH_MAX_SIZE; n++)
+        buf[n] = (unsigned char)(n * 2654435761u >> 24);
+    
+    count = crc32c_kernels(kernels);
+    
+    printf("%10s", "size");
+    for (k = 0; k < count; k++)
+        printf("  %10s", kernels[k].name);
+    printf("   (GB/s, selected: %s)\n", crc32c_engine());
+    
+    for (idx = 0; idx < sizeof(sizes)/sizeof(sizes[0]); idx++) {
+        printf("%10zu", sizes[idx]);
+        for (k = 0; k < count; k++)
+            printf("  %10.2f", bench(&kernels[k], BENCH_CRC, NULL, buf, sizes[idx]));
+        printf("\n");
+    }
+    
+    printf("\n%10s", "size");
+    for (k = 0; k < count; k++)
+        printf("  %10s  %10s", "fused", "separate");
+    printf("   (copy and crc, GB/s)\n%10s", "");
+    for (k = 0; k < count; k++)
+        printf("  %22s", kernels[k].name);
+    printf("\n");
+    
+    for (idx = 0; idx < sizeof(sizes)/sizeof(sizes[0]); idx++) {
+        printf("%10zu", sizes[idx]);
+        for (k = 0; k < count; k++)
+            printf("  %10.2f  %10.2f",
+                   bench(&kernels[k], BENCH_FUSED, out, buf, sizes[idx]),
+                   bench(&kernels[k], BENCH_SEPARATE, out, buf, sizes[idx]));
+        printf("\n");
+    }
+    
+    free(out);
+    free(buf);
+    return 0;
+}
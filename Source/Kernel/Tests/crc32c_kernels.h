@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* The CRC32C implementations in crc32c.c, for the tests and benchmarks.
+ * crc32c.c is included here so that each implementation can be called
+ * directly, not only the one that crc32c_init() selects. */
+
+#ifndef __ISCSI_TESTS_CRC32C_KERNELS_H__
+#define __ISCSI_TESTS_CRC32C_KERNELS_H__
+
+#include "crc32c.c"
+
+/* A CRC32C implementation and its fused copy variant. */
+struct crc32c_kernel {
+    const char *name;
+    uint32_t (*crc)(uint32_t, const void *, size_t);
+    uint32_t (*copy)(uint32_t, void *, const void *, size_t);
+};
+
+/* Fill kernels with the implementations that this processor supports and
+ return how many there are.  crc32c_init() must have been called. */
+static unsigned crc32c_kernels(struct crc32c_kernel *kernels)
+{
+    unsigned count = 0;
+    
+    kernels[count].name = "table";
+    kernels[count].crc = crc32c_sw;
+    kernels[count++].copy = crc32c_copy_sw;
+    
+#if defined(__x86_64__)
+    if (crc32c_have_sse42()) {
+        kernels[count].name = "sse4.2";
+        kernels[count].crc = crc32c_sse42;
+        kernels[count++].copy = crc32c_copy_sse42;
+    }
+#elif (defined(__arm64__) || defined(__aarch64__)) && defined(__ARM_FEATURE_CRC32)
+    kernels[count].name = "armv8";
+    kernels[count].crc = crc32c_armv8;
+    kernels[count++].copy = crc32c_copy_armv8;
+#endif
+    
+    return count;
+}
+
+/* Largest number of kernels that crc32c_kernels() returns. */
+#define CRC32C_MAX_KERNELS 2
+
+#endif /* defined(__ISCSI_TESTS_CRC32C_KERNELS_H__) */
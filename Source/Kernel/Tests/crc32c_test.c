@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Bit-exact tests of the CRC32C implementations.  Every implementation
+ * available on this processor is checked against a bitwise reference over
+ * random contents, lengths, alignments and split points, and the fused
+ * copy variants are checked against a plain copy.  crcs combined with
+ * crc32c_combine() are checked against the crc of the whole buffer. */
+
+#include <stdio.h>
+
+#include "crc32c_kernels.h"
+
+/* Bytes of random data that the tests draw from (covers three-way blocks of
+ LONG bytes and the tails after them). */
+#define TEST_DATA_SIZE (3*LONG*2 + 4096)
+
+/* Number of random cases per test. */
+#define TEST_ROUNDS 2000
+
+static unsigned char data[TEST_DATA_SIZE + 64];
+static unsigned char copy[TEST_DATA_SIZE + 64];
+static unsigned failures = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while (0)
+
+/* Bitwise CRC-32C, the reference that the implementations must match. */
+static uint32_t crc32c_bitwise(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char *)buf;
+    int k;
+    
+    crc ^= 0xffffffff;
+    while (len--) {
+        crc ^= *next++;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    return crc ^ 0xffffffff;
+}
+
+/* xorshift64* generator, seeded for reproducible runs. */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Pick a length, favoring the boundaries of the interleaved blocks. */
+static size_t random_length(size_t limit)
+{
+    static const size_t edges[] = { 0, 1, 7, 8, 9, 63, 64, 3*SHORT - 1,
+        3*SHORT, 3*SHORT + 1, 3*LONG - 1, 3*LONG, 3*LONG + 1 };
+    size_t length;
+    
+    if (rng() % 4 == 0)
+        length = edges[rng() % (sizeof(edges)/sizeof(edges[0]))] + rng() % 16;
+    else
+        length = rng() % (limit + 1);
+    return length > limit ? limit : length;
+}
+
+/* The standard check value, CRC-32C of "123456789". */
+static void test_check_value(const struct crc32c_kernel *kernel)
+{
+    static const char check[] = "123456789";
+    unsigned char out[sizeof(check)];
+    
+    CHECK(kernel->crc(0, check, 9) == 0xe3069283,
+          "%s: check value %08x", kernel->name, kernel->crc(0, check, 9));
+    CHECK(kernel->copy(0, out, check, 9) == 0xe3069283,
+          "%s: copy check value", kernel->name);
+}
+
+/* Random lengths at random alignments against the reference. */
+static void test_reference(const struct crc32c_kernel *kernel)
+{
+    unsigned round;
+    
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        size_t offset = rng() % 64;
+        size_t length = random_length(TEST_DATA_SIZE);
+        uint32_t seed = rng() % 2 ? (uint32_t)rng() : 0;
+        uint32_t expected = crc32c_bitwise(seed, data + offset, length);
+        
+        CHECK(kernel->crc(seed, data + offset, length) == expected,
+              "%s: offset %zu length %zu", kernel->name, offset, length);
+    }
+}
+
+/* A crc continued across a random split matches the crc in one piece. */
+static void test_split(const struct crc32c_kernel *kernel)
+{
+    unsigned round;
+    
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        size_t length = random_length(TEST_DATA_SIZE);
+        size_t split = length ? rng() % (length + 1) : 0;
+        uint32_t whole = kernel->crc(0, data, length);
+        uint32_t crc = kernel->crc(0, data, split);
+        
+        crc = kernel->crc(crc, data + split, length - split);
+        CHECK(crc == whole, "%s: length %zu split %zu", kernel->name, length, split);
+    }
+}
+
+/* The fused copy produces the plain crc and an exact copy, and doesn't
+ write outside of the destination. */
+static void test_copy(const struct crc32c_kernel *kernel)
+{
+    unsigned round;
+    
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        size_t src = rng() % 64, dst = rng() % 32;
+        size_t length = random_length(TEST_DATA_SIZE - 32);
+        uint32_t seed = (uint32_t)rng();
+        
+        memset(copy, 0xa5, sizeof(copy));
+        CHECK(kernel->copy(seed, copy + dst, data + src, length) ==
+              kernel->crc(seed, data + src, length),
+              "%s: copy crc src %zu dst %zu length %zu", kernel->name, src, dst, length);
+        CHECK(memcmp(copy + dst, data + src, length) == 0,
+              "%s: copy data src %zu dst %zu length %zu", kernel->name, src, dst, length);
+        CHECK((dst == 0 || copy[dst - 1] == 0xa5) && copy[dst + length] == 0xa5,
+              "%s: copy overrun dst %zu length %zu", kernel->name, dst, length);
+    }
+}
+
+/* crcs of two pieces computed separately combine to the crc of both. */
+static void test_combine(void)
+{
+    unsigned round;
+    
+    CHECK(crc32c_combine(0x12345678, 0, 0) == 0x12345678, "combine: empty second block");
+    
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        size_t length = random_length(TEST_DATA_SIZE);
+        size_t split = length ? rng() % (length + 1) : 0;
+        uint32_t seed = rng() % 2 ? (uint32_t)rng() : 0;
+        uint32_t crc1 = crc32c(seed, data, split);
+        uint32_t crc2 = crc32c(0, data + split, length - split);
+        
+        CHECK(crc32c_combine(crc1, crc2, length - split) == crc32c_bitwise(seed, data, length),
+              "combine: length %zu split %zu", length, split);
+    }
+}
+
+/* The dispatched entry points, including crc32c_iovec() over random chains. */
+static void test_dispatch(void)
+{
+    unsigned round;
+    
+    printf("selected: %s\n", crc32c_engine());
+    CHECK(crc32c(0x12345678, NULL, 0) == 0x12345678, "empty buffer");
+    CHECK(crc32c_copy(0x12345678, copy, data, 0) == 0x12345678, "empty copy");
+    
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        struct iovec iov[8];
+        size_t length = random_length(TEST_DATA_SIZE);
+        size_t offset = 0;
+        unsigned count = 0;
+        
+        while (count < 7 && offset < length) {
+            size_t piece = rng() % (length - offset + 1);
+            iov[count].iov_base = data + offset;
+            iov[count++].iov_len = piece;
+            offset += piece;
+        }
+        iov[count].iov_base = data + offset;
+        iov[count++].iov_len = length - offset;
+        
+        CHECK(crc32c_iovec(0, iov, count) == crc32c_bitwise(0, data, length),
+              "iovec: length %zu in %u pieces", length, count);
+    }
+}
+
+int main(void)
+{
+    struct crc32c_kernel kernels[CRC32C_MAX_KERNELS];
+    unsigned count, idx;
+    size_t n;
+    
+    crc32c_init();
+    for (n = 0; n < sizeof(data); n++)
+        data[n] = (unsigned char)rng();
+    
+    count = crc32c_kernels(kernels);
+    for (idx = 0; idx < count; idx++) {
+        printf("kernel: %s\n", kernels[idx].name);
+        test_check_value(&kernels[idx]);
+        test_reference(&kernels[idx]);
+        test_split(&kernels[idx]);
+        test_copy(&kernels[idx]);
+    }
+    test_dispatch();
+    test_combine();
+    
+    printf("%s (%u failures)\n", failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Host-side stand-in for <IOKit/IOLib.h>.  Provides the kernel types and
+ * functions used by the kernel sources that are built into the tests, so
+ * that they can be compiled and run as ordinary programs. */
+
+#ifndef __ISCSI_TESTS_IOLIB_H__
+#define __ISCSI_TESTS_IOLIB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int8_t      SInt8;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+
+static inline void * IOMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void IOFree(void * address,size_t size)
+{
+    (void)size;
+    free(address);
+}
+
+/* Byte order conversions from <libkern/OSByteOrder.h>. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define OSSwapBigToHostInt16(x)     __builtin_bswap16(x)
+#define OSSwapBigToHostInt32(x)     __builtin_bswap32(x)
+#define OSSwapBigToHostInt64(x)     __builtin_bswap64(x)
+#else
+#define OSSwapBigToHostInt16(x)     ((UInt16)(x))
+#define OSSwapBigToHostInt32(x)     ((UInt32)(x))
+#define OSSwapBigToHostInt64(x)     ((UInt64)(x))
+#endif
+#define OSSwapHostToBigInt16(x)     OSSwapBigToHostInt16(x)
+#define OSSwapHostToBigInt32(x)     OSSwapBigToHostInt32(x)
+#define OSSwapHostToBigInt64(x)     OSSwapBigToHostInt64(x)
+
+/* Same (unsigned int) semantics as the kernel's min() and max(). */
+static inline unsigned int min(unsigned int a,unsigned int b)
+{
+    return (a < b) ? a : b;
+}
+
+static inline unsigned int max(unsigned int a,unsigned int b)
+{
+    return (a > b) ? a : b;
+}
+
+#endif /* defined(__ISCSI_TESTS_IOLIB_H__) */
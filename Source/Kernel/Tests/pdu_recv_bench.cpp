@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Throughput of the incremental PDU receive parser (iSCSIPDURecv* in
+ * iSCSIPDUKernel.cpp) over a recorded stream of data-in PDUs, received in
+ * reads of a fixed length, with and without data digests. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "pdu_stream.h"
+
+/* Number of PDUs in the stream. */
+static const unsigned kBenchPDUCount = 256;
+
+/* Minimum time spent measuring each case (seconds). */
+static const double kBenchMinTime = 0.2;
+
+static const UInt32 dataLengths[] = { 4096, 65536, 262144 };
+static size_t readSize;
+
+static UInt64 rngState = 0x13198a2e03707344ULL;
+
+static UInt64 Random()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t ReadFixed()
+{
+    return readSize;
+}
+
+static void CountPDU(iSCSIPDURecvContext * context,enum iSCSIPDURecvResults result,void * arg)
+{
+    (*(unsigned *)arg)++;
+}
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Receive the stream repeatedly and return GB/s. */
+static double Bench(const TestStream * stream,bool fused,UInt8 * data,size_t dataSize)
+{
+    size_t iterations = 1;
+    double elapsed;
+    
+    for(;;) {
+        unsigned count = 0;
+        double start = Now();
+        
+        for(size_t idx = 0; idx < iterations; idx++)
+            ReceiveTestStream(stream,ReadFixed,fused,data,dataSize,CountPDU,&count);
+        
+        elapsed = Now() - start;
+        if(count != iterations*stream->count)
+            return 0;
+        if(elapsed >= kBenchMinTime)
+            break;
+        iterations *= 2;
+    }
+    return (double)stream->length*iterations/elapsed/1e9;
+}
+
+int main()
+{
+    static const size_t readSizes[] = { 1500, 16384, 65536 };
+    const size_t dataSize = dataLengths[sizeof(dataLengths)/sizeof(dataLengths[0]) - 1];
+    UInt8 * data = (UInt8 *)malloc(dataSize);
+    
+    if(!data)
+        return 1;
+    
+    crc32c_init();
+    
+    printf("%8s  %8s  %12s  %12s  %12s   (GB/s, crc32c: %s)\n","segment","read",
+           "no digest","digest","fused digest",crc32c_engine());
+    
+    for(size_t len = 0; len < sizeof(dataLengths)/sizeof(dataLengths[0]); len++)
+    {
+        const TestStreamShape shape = { dataLengths[len], 0, false };
+        TestStream plain, digested;
+        BuildTestStream(&plain,kBenchPDUCount,&shape,false,false,Random);
+        BuildTestStream(&digested,kBenchPDUCount,&shape,false,true,Random);
+        
+        for(size_t read = 0; read < sizeof(readSizes)/sizeof(readSizes[0]); read++)
+        {
+            readSize = readSizes[read];
+            printf("%8u  %8zu  %12.2f  %12.2f  %12.2f\n",dataLengths[len],readSize,
+                   Bench(&plain,false,data,dataSize),Bench(&digested,false,data,dataSize),
+                   Bench(&digested,true,data,dataSize));
+        }
+        
+        FreeTestStream(&plain);
+        FreeTestStream(&digested);
+    }
+    
+    free(data);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Tests of the incremental PDU receive parser (iSCSIPDURecv* in
+ * iSCSIPDUKernel.cpp).  Streams of random PDUs, with and without digests,
+ * AHS, padding and empty data segments, are fed to the parser in reads of
+ * arbitrary lengths, from one byte at a time up to many PDUs at once.  Every
+ * PDU must come out intact and in order, and corrupted digests must be
+ * reported on the PDU that carries them. */
+
+#include <stdio.h>
+
+#include "pdu_stream.h"
+
+/* Number of PDUs in each test stream. */
+static const unsigned kTestPDUCount = 60;
+
+/* Largest data segment in the test streams (bytes). */
+static const UInt32 kTestMaxDataLength = 20000;
+
+static unsigned failures = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if(!(cond)) { \
+            failures++; \
+            printf("FAIL %s:%d: ",__FILE__,__LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+        } \
+    } while(0)
+
+/* xorshift64* generator, seeded for reproducible runs. */
+static UInt64 rngState = 0x243f6a8885a308d3ULL;
+
+static UInt64 Random()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545f4914f6cdd1dULL;
+}
+
+/* Read lengths, from single bytes to several PDUs at once. */
+static size_t ReadOneByte()     { return 1; }
+static size_t ReadTiny()        { return 1 + Random() % 7; }
+static size_t ReadSmall()       { return 1 + Random() % 100; }
+static size_t ReadHeader()      { return kiSCSIPDUBasicHeaderSegmentSize; }
+static size_t ReadLarge()       { return 1 + Random() % 70000; }
+
+static const struct {
+    const char * name;
+    size_t (*readLength)();
+} reads[] = {
+    { "1 byte", ReadOneByte },
+    { "1-7 bytes", ReadTiny },
+    { "1-100 bytes", ReadSmall },
+    { "48 bytes", ReadHeader },
+    { "1-70000 bytes", ReadLarge },
+};
+
+/* What a stream is expected to produce. */
+struct Expectation {
+    const TestStream * stream;
+    const char * name;
+    
+    /* Index of the next PDU expected. */
+    unsigned next;
+    
+    /* The PDU that carries a corrupted digest, if any, and the result that
+     * it is expected to produce. */
+    unsigned corruptPDU;
+    enum iSCSIPDURecvResults corruptResult;
+};
+
+static void CheckPDU(iSCSIPDURecvContext * context,enum iSCSIPDURecvResults result,void * arg)
+{
+    Expectation * expect = (Expectation *)arg;
+    
+    if(expect->next >= expect->stream->count) {
+        CHECK(false,"%s: extra PDU",expect->name);
+        return;
+    }
+    
+    const TestPDU * pdu = &expect->stream->pdus[expect->next];
+    const enum iSCSIPDURecvResults expected = (expect->next == expect->corruptPDU) ?
+                                              expect->corruptResult : kiSCSIPDURecvPDUComplete;
+    
+    CHECK(result == expected,"%s: PDU %u result %d, expected %d",
+          expect->name,expect->next,result,expected);
+    
+    if(result != kiSCSIPDURecvHeaderDigestError) {
+        CHECK(memcmp(&context->bhs,&pdu->bhs,sizeof(pdu->bhs)) == 0,
+              "%s: PDU %u header differs",expect->name,expect->next);
+        CHECK(context->dataLength == pdu->dataLength,
+              "%s: PDU %u data length %u, expected %u",
+              expect->name,expect->next,context->dataLength,pdu->dataLength);
+    }
+    
+    if(result == kiSCSIPDURecvPDUComplete && pdu->dataLength)
+        CHECK(memcmp(context->data,expect->stream->bytes + pdu->dataOffset,pdu->dataLength) == 0,
+              "%s: PDU %u data differs",expect->name,expect->next);
+    
+    expect->next++;
+}
+
+/* Every PDU of streams with each digest setting arrives intact, whatever
+ * the read lengths. */
+static void TestSplits(UInt8 * data)
+{
+    const TestStreamShape shape = { kTestMaxDataLength, 20, true };
+    
+    for(unsigned digests = 0; digests < 4; digests++)
+    {
+        TestStream stream;
+        BuildTestStream(&stream,kTestPDUCount,&shape,digests & 1,digests & 2,Random);
+        
+        for(unsigned fused = 0; fused < ((digests & 2) ? 2U : 1U); fused++)
+        {
+            for(size_t idx = 0; idx < sizeof(reads)/sizeof(reads[0]); idx++)
+            {
+                char name[128];
+                snprintf(name,sizeof(name),"header digest %d, data digest %d%s, reads of %s",
+                         stream.useHeaderDigest,stream.useDataDigest,
+                         fused ? " (fused)" : "",reads[idx].name);
+                
+                Expectation expect = { &stream,name,0,kTestPDUCount,kiSCSIPDURecvPDUComplete };
+                size_t consumed = ReceiveTestStream(&stream,reads[idx].readLength,fused,data,kTestMaxDataLength,CheckPDU,&expect);
+                
+                CHECK(consumed == stream.length,"%s: consumed %zu of %zu bytes",name,consumed,stream.length);
+                CHECK(expect.next == stream.count,"%s: received %u of %u PDUs",name,expect.next,stream.count);
+            }
+        }
+        FreeTestStream(&stream);
+    }
+}
+
+/* A corrupted data segment is reported on its PDU and the PDUs after it
+ * are still received. */
+static void TestDataDigestError(UInt8 * data)
+{
+    const TestStreamShape shape = { kTestMaxDataLength, 0, true };
+    
+    for(unsigned fused = 0; fused < 2; fused++)
+    {
+        TestStream stream;
+        BuildTestStream(&stream,kTestPDUCount,&shape,true,true,Random);
+        
+        unsigned corrupt = kTestPDUCount/2;
+        while(!stream.pdus[corrupt].dataLength)
+            corrupt++;
+        
+        const TestPDU * pdu = &stream.pdus[corrupt];
+        stream.bytes[pdu->dataOffset + Random() % pdu->dataLength] ^= 0x01;
+        
+        Expectation expect = { &stream,"data digest error",0,corrupt,kiSCSIPDURecvDataDigestError };
+        ReceiveTestStream(&stream,ReadSmall,fused,data,kTestMaxDataLength,CheckPDU,&expect);
+        
+        CHECK(expect.next == stream.count,"data digest error: received %u of %u PDUs",
+              expect.next,stream.count);
+        FreeTestStream(&stream);
+    }
+}
+
+/* A corrupted header is reported on its PDU, and nothing is received after
+ * it. */
+static void TestHeaderDigestError(UInt8 * data)
+{
+    const TestStreamShape shape = { kTestMaxDataLength, 4, true };
+    TestStream stream;
+    BuildTestStream(&stream,kTestPDUCount,&shape,true,false,Random);
+    
+    const unsigned corrupt = kTestPDUCount/2;
+    size_t offset = 0;
+    
+    // Find the PDU's header from the lengths of the PDUs before it
+    for(unsigned idx = 0; idx < corrupt; idx++) {
+        const TestPDU * pdu = &stream.pdus[idx];
+        offset += kiSCSIPDUBasicHeaderSegmentSize + pdu->bhs.totalAHSLength*4 + kiSCSIPDUDigestSize;
+        offset += (pdu->dataLength + 3) & ~3U;
+    }
+    
+    // Flip a bit of the initiator task tag
+    stream.bytes[offset + offsetof(iSCSIPDUTargetBHS,initiatorTaskTag)] ^= 0x80;
+    
+    Expectation expect = { &stream,"header digest error",0,corrupt,kiSCSIPDURecvHeaderDigestError };
+    ReceiveTestStream(&stream,ReadSmall,false,data,kTestMaxDataLength,CheckPDU,&expect);
+    
+    CHECK(expect.next == corrupt + 1,"header digest error: received %u PDUs, expected %u",
+          expect.next,corrupt + 1);
+    FreeTestStream(&stream);
+}
+
+int main()
+{
+    UInt8 * data = (UInt8 *)malloc(kTestMaxDataLength);
+    
+    if(!data)
+        return 1;
+    
+    crc32c_init();
+    
+    TestSplits(data);
+    TestDataDigestError(data);
+    TestHeaderDigestError(data);
+    
+    free(data);
+    printf("%s (%u failures)\n",failures ? "FAILED" : "passed",failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Builds byte streams of target PDUs for the receive parser tests and
+ * benchmarks, as they would arrive from the socket: basic header segment,
+ * AHS, header digest, data segment, padding and data digest. */
+
+#ifndef __ISCSI_TESTS_PDU_STREAM_H__
+#define __ISCSI_TESTS_PDU_STREAM_H__
+
+#include "iSCSIPDUKernel.h"
+#include "crc32c.h"
+
+using namespace iSCSIPDU;
+
+/*! A PDU in a test stream. */
+struct TestPDU {
+    
+    /*! The basic header segment that was sent. */
+    iSCSIPDUTargetBHS bhs;
+    
+    /*! Offset of the data segment in the stream. */
+    size_t dataOffset;
+    
+    /*! Length of the data segment (excluding padding). */
+    UInt32 dataLength;
+};
+
+/*! A stream of PDUs. */
+struct TestStream {
+    UInt8 * bytes;
+    size_t length;
+    TestPDU * pdus;
+    unsigned count;
+    bool useHeaderDigest;
+    bool useDataDigest;
+};
+
+/*! Describes the PDUs to put in a stream. */
+struct TestStreamShape {
+    
+    /*! Largest data segment (a PDU has no data segment one time in four). */
+    UInt32 maxDataLength;
+    
+    /*! Largest AHS, in four-byte words (zero for no AHS). */
+    UInt8 maxAHSWords;
+    
+    /*! Whether data segment lengths are picked at random, rather than
+     *  always maxDataLength. */
+    bool randomLengths;
+};
+
+/*! Builds a stream of PDUs with random contents.
+ *  @param stream the stream to build (free with FreeTestStream()).
+ *  @param count the number of PDUs.
+ *  @param shape the PDUs to build.
+ *  @param useHeaderDigest whether PDUs carry a header digest.
+ *  @param useDataDigest whether PDUs carry a data digest.
+ *  @param random source of random numbers. */
+static void BuildTestStream(TestStream * stream,
+                            unsigned count,
+                            const TestStreamShape * shape,
+                            bool useHeaderDigest,
+                            bool useDataDigest,
+                            UInt64 (*random)())
+{
+    const size_t maxPDULength = kiSCSIPDUBasicHeaderSegmentSize + shape->maxAHSWords*4 +
+                                shape->maxDataLength + 3 + 2*kiSCSIPDUDigestSize;
+    
+    stream->bytes = (UInt8 *)malloc(count*maxPDULength);
+    stream->pdus = (TestPDU *)malloc(count*sizeof(TestPDU));
+    stream->count = count;
+    stream->useHeaderDigest = useHeaderDigest;
+    stream->useDataDigest = useDataDigest;
+    
+    size_t offset = 0;
+    
+    for(unsigned idx = 0; idx < count; idx++)
+    {
+        TestPDU * pdu = &stream->pdus[idx];
+        UInt8 * start = stream->bytes + offset;
+        
+        // Random header fields, with the lengths filled in
+        UInt8 * header = (UInt8 *)&pdu->bhs;
+        for(size_t byte = 0; byte < sizeof(pdu->bhs); byte++)
+            header[byte] = (UInt8)random();
+        
+        UInt32 dataLength = shape->maxDataLength;
+        if(shape->randomLengths)
+            dataLength = (random() % 4 == 0) ? 0 : (UInt32)(random() % (shape->maxDataLength + 1));
+        
+        pdu->bhs.totalAHSLength = shape->maxAHSWords ? (UInt8)(random() % (shape->maxAHSWords + 1)) : 0;
+        pdu->bhs.dataSegmentLength[0] = (UInt8)(dataLength >> 16);
+        pdu->bhs.dataSegmentLength[1] = (UInt8)(dataLength >> 8);
+        pdu->bhs.dataSegmentLength[2] = (UInt8)dataLength;
+        pdu->dataLength = dataLength;
+        
+        memcpy(stream->bytes + offset,&pdu->bhs,sizeof(pdu->bhs));
+        offset += sizeof(pdu->bhs);
+        
+        for(UInt32 byte = 0; byte < pdu->bhs.totalAHSLength*4U; byte++)
+            stream->bytes[offset++] = (UInt8)random();
+        
+        if(useHeaderDigest) {
+            UInt32 digest = crc32c(0,start,stream->bytes + offset - start);
+            memcpy(stream->bytes + offset,&digest,sizeof(digest));
+            offset += sizeof(digest);
+        }
+        
+        if(!dataLength)
+            continue;
+        
+        pdu->dataOffset = offset;
+        for(UInt32 byte = 0; byte < dataLength; byte++)
+            stream->bytes[offset++] = (UInt8)random();
+        
+        // Padding is zeros and is covered by the data digest
+        while((offset - pdu->dataOffset) % kiSCSIPDUByteAlignment)
+            stream->bytes[offset++] = 0;
+        
+        if(useDataDigest) {
+            UInt32 digest = crc32c(0,stream->bytes + pdu->dataOffset,offset - pdu->dataOffset);
+            memcpy(stream->bytes + offset,&digest,sizeof(digest));
+            offset += sizeof(digest);
+        }
+    }
+    stream->length = offset;
+}
+
+/*! Frees a stream built by BuildTestStream(). */
+static void FreeTestStream(TestStream * stream)
+{
+    free(stream->bytes);
+    free(stream->pdus);
+}
+
+/*! Called for each PDU that a receive context completes.
+ *  @param context the receive context, holding the PDU.
+ *  @param result kiSCSIPDURecvPDUComplete, kiSCSIPDURecvDataDigestError or
+ *  kiSCSIPDURecvHeaderDigestError.
+ *  @param arg the argument passed to ReceiveTestStream(). */
+typedef void (*TestPDUHandler)(iSCSIPDURecvContext * context,
+                               enum iSCSIPDURecvResults result,
+                               void * arg);
+
+/*! Receives a stream through a receive context the way the HBA does, in
+ *  reads whose lengths are chosen by the caller.  Reading stops at a header
+ *  digest error, after which the stream can't be followed.
+ *  @param stream the stream to receive.
+ *  @param readLength returns the length of the next read from the socket.
+ *  @param fused whether to compute data digests while copying data, as
+ *  done when receiving with crc32c_copy().
+ *  @param data buffer that receives data segments.
+ *  @param dataSize the size of the data buffer; reading stops at a PDU
+ *  whose data segment would not fit.
+ *  @param handler called for each PDU.
+ *  @param arg passed to the handler.
+ *  @return the number of bytes of the stream that were consumed. */
+static size_t ReceiveTestStream(const TestStream * stream,
+                                size_t (*readLength)(),
+                                bool fused,
+                                UInt8 * data,
+                                size_t dataSize,
+                                TestPDUHandler handler,
+                                void * arg)
+{
+    iSCSIPDURecvContext context;
+    iSCSIPDURecvReset(&context,stream->useHeaderDigest,stream->useDataDigest);
+    
+    size_t offset = 0;
+    
+    while(offset < stream->length)
+    {
+        size_t remaining = readLength();
+        
+        if(remaining > stream->length - offset)
+            remaining = stream->length - offset;
+        
+        // Take the read a stage at a time
+        while(remaining)
+        {
+            size_t length = 0;
+            bool digested = false;
+            void * buffer = iSCSIPDURecvGetBuffer(&context,&length,&digested);
+            
+            if(length > remaining)
+                length = remaining;
+            
+            bool covered = digested && fused;
+            
+            if(covered)
+                context.dataDigest = crc32c_copy(context.dataDigest,buffer,stream->bytes + offset,length);
+            else
+                memcpy(buffer,stream->bytes + offset,length);
+            
+            offset += length;
+            remaining -= length;
+            
+            enum iSCSIPDURecvResults result = iSCSIPDURecvAdvance(&context,length,covered);
+            
+            switch(result)
+            {
+                case kiSCSIPDURecvMore:
+                    continue;
+                    
+                case kiSCSIPDURecvHeaderComplete:
+                    if(context.stage != kiSCSIPDURecvStageComplete) {
+                        if(context.dataLength > dataSize)
+                            return offset;
+                        iSCSIPDURecvSetDataBuffer(&context,data);
+                        continue;
+                    }
+                    result = kiSCSIPDURecvPDUComplete;
+                    break;
+                    
+                case kiSCSIPDURecvHeaderDigestError:
+                    handler(&context,result,arg);
+                    return offset;
+                    
+                default:
+                    break;
+            };
+            
+            handler(&context,result,arg);
+            iSCSIPDURecvReset(&context,stream->useHeaderDigest,stream->useDataDigest);
+        }
+    }
+    return offset;
+}
+
+#endif /* defined(__ISCSI_TESTS_PDU_STREAM_H__) */
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Stress test of iSCSITaskRing.  Several producer threads add tags to the
+ * ring while one consumer removes them, the way tasks are queued from the
+ * HBA's and the session's work loops and started by the connection's task
+ * queue.  Producers wake the consumer after each tag is published, as
+ * iSCSITaskQueue::queueTask() does with signalWorkAvailable(), and the
+ * consumer sleeps whenever it finds the ring empty.  The test checks that
+ * every tag is received once, in order for each producer, and that the
+ * consumer is never left asleep with tags in the ring (a lost wakeup).
+ *
+ * Build with ThreadSanitizer to check the ring's memory ordering
+ * ("make stress"). */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "iSCSITaskRing.h"
+
+/* Number of producer threads. */
+static const UInt32 kProducerCount = 4;
+
+/* Default total number of tags added by the producers. */
+static const UInt32 kDefaultTagCount = 8*1024*1024;
+
+/* Ring capacity (the size of a session's task slot table). */
+static const UInt32 kRingCapacity = 1024;
+
+/* Tags removed at a time, as in iSCSITaskQueue::sortStagedTasks(). */
+static const UInt32 kBatchSize = 16;
+
+/* Time the consumer sleeps before deciding that a wakeup was lost (ms). */
+static const long kWakeupTimeoutMs = 1000;
+
+/* A tag holds its producer in the top bits and a sequence number below. */
+static const UInt32 kProducerShift = 28;
+
+static iSCSITaskRing ring;
+static UInt32 tagsPerProducer;
+
+/* Stands in for the work loop's signalWorkAvailable() and sleep. */
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workSignal = PTHREAD_COND_INITIALIZER;
+static bool workAvailable = false;
+
+static void SignalWorkAvailable()
+{
+    pthread_mutex_lock(&workLock);
+    workAvailable = true;
+    pthread_cond_signal(&workSignal);
+    pthread_mutex_unlock(&workLock);
+}
+
+/* Sleeps until signaled.  Returns false if the timeout passed first. */
+static bool WaitForWork()
+{
+    struct timespec deadline;
+    bool signaled = true;
+    
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec += kWakeupTimeoutMs/1000;
+    deadline.tv_nsec += (kWakeupTimeoutMs % 1000)*1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    
+    pthread_mutex_lock(&workLock);
+    while(!workAvailable && signaled)
+        signaled = (pthread_cond_timedwait(&workSignal,&workLock,&deadline) == 0);
+    signaled = workAvailable;
+    workAvailable = false;
+    pthread_mutex_unlock(&workLock);
+    return signaled;
+}
+
+static void * Producer(void * arg)
+{
+    const UInt32 producer = (UInt32)(uintptr_t)arg;
+    
+    for(UInt32 sequence = 0; sequence < tagsPerProducer; sequence++)
+    {
+        // The ring can fill here (unlike in the kext, where it has a cell
+        // per task slot); wait for the consumer to make room
+        while(!ring.enqueue(producer << kProducerShift | sequence))
+            sched_yield();
+        
+        // Wake the consumer only once the tag is published
+        SignalWorkAvailable();
+    }
+    return NULL;
+}
+
+int main(int argc,char ** argv)
+{
+    UInt32 tagCount = (argc > 1) ? (UInt32)strtoul(argv[1],NULL,0) : kDefaultTagCount;
+    tagsPerProducer = tagCount/kProducerCount;
+    
+    if(!ring.init(kRingCapacity))
+        return 1;
+    
+    pthread_t producers[kProducerCount];
+    for(UInt32 idx = 0; idx < kProducerCount; idx++)
+        pthread_create(&producers[idx],NULL,Producer,(void *)(uintptr_t)idx);
+    
+    UInt32 nextSequence[kProducerCount] = { 0 };
+    UInt64 received = 0, expected = (UInt64)tagsPerProducer*kProducerCount;
+    UInt32 outOfOrder = 0, lostWakeups = 0, sleeps = 0;
+    
+    while(received < expected)
+    {
+        UInt32 tags[kBatchSize];
+        UInt32 count;
+        
+        // Take everything that has been published, as checkForWork() does
+        while((count = ring.dequeueBatch(tags,kBatchSize)))
+        {
+            for(UInt32 idx = 0; idx < count; idx++)
+            {
+                UInt32 producer = tags[idx] >> kProducerShift;
+                UInt32 sequence = tags[idx] & ((1U << kProducerShift) - 1);
+                
+                if(producer >= kProducerCount || sequence != nextSequence[producer]) {
+                    if(outOfOrder++ < 10)
+                        printf("FAIL: tag %#x out of order\n",tags[idx]);
+                    if(producer < kProducerCount)
+                        nextSequence[producer] = sequence;
+                }
+                if(producer < kProducerCount)
+                    nextSequence[producer]++;
+                received++;
+            }
+        }
+        
+        if(received == expected)
+            break;
+        
+        // Sleep until a producer signals; a timeout with tags waiting in the
+        // ring means their wakeup was lost
+        sleeps++;
+        if(!WaitForWork() && !ring.isEmpty())
+            lostWakeups++;
+    }
+    
+    for(UInt32 idx = 0; idx < kProducerCount; idx++)
+        pthread_join(producers[idx],NULL);
+    
+    bool passed = (outOfOrder == 0 && lostWakeups == 0 && ring.isEmpty());
+    
+    printf("%u producers, %llu tags, %u sleeps, %u out of order, %u lost wakeups\n",
+           kProducerCount,(unsigned long long)received,sleeps,outOfOrder,lostWakeups);
+    printf("%s\n",passed ? "passed" : "FAILED");
+    
+    ring.free();
+    return passed ? 0 : 1;
+}
@@ -1,7 +1,7 @@
-/* crc32c.c -- compute CRC-32C using the Intel crc32 instruction
+/* crc32c.c -- compute CRC-32C using the Intel or ARMv8 crc32 instructions
  * Copyright (C) 2013 Mark Adler
  * Original Version 1.1  1 Aug 2013  Mark Adler
- * Current  Version 1.2  2 Feb 2015
+ * Current  Version 1.4  16 Oct 2026
  */
 
 /*
@@ -25,19 +25,28 @@
  madler@alumni.caltech.edu
  */
 
-/* Use hardware CRC instruction on Intel SSE 4.2 processors.  This computes a
- CRC-32C, *not* the CRC-32 used by Ethernet and zip, gzip, etc.  A software
- version is provided as a fall-back, as well as for speed comparisons. */
+/* Use hardware CRC instruction on Intel SSE 4.2 and ARMv8 processors.  This
+ computes a CRC-32C, *not* the CRC-32 used by Ethernet and zip, gzip, etc.  A
+ software version is provided as a fall-back, as well as for speed
+ comparisons.  The implementation is selected at runtime by crc32c_init(). */
 
 /* Version history:
  1.0  10 Feb 2013  First version
  1.1   1 Aug 2013  Correct comments on why three crc instructions in parallel
  1.2  20 Dec 2014  Modified by Nareg Sinenian to include hardware CRC32C only
  1.3   4 Oct 2015  Modified by Nareg Sinenian to cast 64-bit vars to 32 bits.
+ 1.4  16 Oct 2026  Modified by the iSCSIInitiator contributors to restore a
+                   (slice-by-8) software version, add the ARMv8 crc32c
+                   instructions and select the fastest implementation
+                   supported by the processor at runtime.  Added a fused
+                   copy (crc32c_copy), crcs over buffer chains
+                   (crc32c_iovec) and combining of crcs (crc32c_combine).
  */
 
 #include "crc32c.h"
 
+#include <string.h>
+
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
@@ -148,20 +157,133 @@ static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
 static uint32_t crc32c_long[4][256];
 static uint32_t crc32c_short[4][256];
 
-/* Initialize tables for shifting crcs. */
-void crc32c_init()
+/* Tables for the slice-by-8 software crc. */
+static uint32_t crc32c_table[8][256];
+
+/* Construct the slice-by-8 tables.  crc32c_table[0] is the usual byte-wise
+ table; crc32c_table[k] advances a crc byte through k additional zero bytes. */
+static void crc32c_table_init(void)
 {
-    crc32c_zeros(crc32c_long, LONG);
-    crc32c_zeros(crc32c_short, SHORT);
+    uint32_t n, crc;
+    int k;
+    
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
 }
 
-/* Compute CRC-32C using the Intel hardware instruction. */
-uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
+/* Compute CRC-32C in software, eight bytes at a time (little-endian). */
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
 {
-    // NS modification - return initial value if buffer empty
-    if(!len || !buf)
-        return crc;
+    const unsigned char *next = (const unsigned char *)buf;
+    uint32_t hi;
+    
+    /* pre-process the crc */
+    crc ^= 0xffffffff;
+    
+    /* compute the crc for up to seven leading bytes to bring the data pointer
+     to an eight-byte boundary */
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
     
+    /* compute the crc on eight-byte units */
+    while (len >= 8) {
+        crc ^= (uint32_t)next[0] | (uint32_t)next[1] << 8 |
+               (uint32_t)next[2] << 16 | (uint32_t)next[3] << 24;
+        hi = (uint32_t)next[4] | (uint32_t)next[5] << 8 |
+             (uint32_t)next[6] << 16 | (uint32_t)next[7] << 24;
+        crc = crc32c_table[7][crc & 0xff] ^
+              crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^
+              crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][hi & 0xff] ^
+              crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^
+              crc32c_table[0][hi >> 24];
+        next += 8;
+        len -= 8;
+    }
+    
+    /* compute the crc for up to seven trailing bytes */
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    
+    /* return a post-processed crc */
+    return crc ^ 0xffffffff;
+}
+
+/* Copy len bytes from src to dst, computing CRC-32C of the data in software
+ as it is copied. */
+static uint32_t crc32c_copy_sw(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *next = (const unsigned char *)src;
+    uint32_t lo, hi;
+    
+    /* pre-process the crc */
+    crc ^= 0xffffffff;
+    
+    /* copy and compute the crc on eight-byte units */
+    while (len >= 8) {
+        memcpy(out, next, 8);
+        lo = (uint32_t)next[0] | (uint32_t)next[1] << 8 |
+             (uint32_t)next[2] << 16 | (uint32_t)next[3] << 24;
+        hi = (uint32_t)next[4] | (uint32_t)next[5] << 8 |
+             (uint32_t)next[6] << 16 | (uint32_t)next[7] << 24;
+        crc ^= lo;
+        crc = crc32c_table[7][crc & 0xff] ^
+              crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^
+              crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][hi & 0xff] ^
+              crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^
+              crc32c_table[0][hi >> 24];
+        out += 8;
+        next += 8;
+        len -= 8;
+    }
+    
+    /* copy and compute the crc for up to seven trailing bytes */
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next) & 0xff] ^ (crc >> 8);
+        *out++ = *next++;
+        len--;
+    }
+    
+    /* return a post-processed crc */
+    return crc ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+
+/* Check for the SSE 4.2 crc32 instruction (CPUID.01H:ECX bit 20). */
+static int crc32c_have_sse42(void)
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    
+    __asm__("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (ecx >> 20) & 1;
+}
+
+/* Compute CRC-32C using the Intel hardware instruction. */
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
     const unsigned char *next = (const unsigned char *)buf;
     const unsigned char *end;
     uint64_t crc0, crc1, crc2;      /* need to be 64 bits for crc32q */
@@ -244,3 +366,325 @@ uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
     /* return a post-processed crc */
     return (uint32_t)crc0 ^ 0xffffffff;
 }
+
+/* Copy len bytes from src to dst, computing CRC-32C of the data with the
+ Intel hardware instruction as it is copied.  Each eight-byte unit is loaded
+ once into a register, which is then both stored and fed to crc32q, so the
+ data is only read from memory once.  Three independent crcs are run on
+ SHORT*3 blocks as in crc32c_sse42(). */
+static uint32_t crc32c_copy_sse42(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *next = (const unsigned char *)src;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;      /* need to be 64 bits for crc32q */
+    uint64_t val0, val1, val2;
+    
+    /* pre-process the crc */
+    crc0 = crc ^ 0xffffffff;
+    
+    /* copy and compute the crc on SHORT*3 blocks */
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            memcpy(&val0, next, 8);
+            memcpy(&val1, next + SHORT, 8);
+            memcpy(&val2, next + SHORT*2, 8);
+            __asm__("crc32q\t" "%3, %0\n\t"
+                    "crc32q\t" "%4, %1\n\t"
+                    "crc32q\t" "%5, %2"
+                    : "=r"(crc0), "=r"(crc1), "=r"(crc2)
+                    : "r"(val0), "r"(val1), "r"(val2),
+                      "0"(crc0), "1"(crc1), "2"(crc2));
+            memcpy(out, &val0, 8);
+            memcpy(out + SHORT, &val1, 8);
+            memcpy(out + SHORT*2, &val2, 8);
+            next += 8;
+            out += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        next += SHORT*2;
+        out += SHORT*2;
+        len -= SHORT*3;
+    }
+    
+    /* copy and compute the crc on the remaining eight-byte units */
+    while (len >= 8) {
+        memcpy(&val0, next, 8);
+        __asm__("crc32q\t" "%1, %0"
+                : "=r"(crc0)
+                : "r"(val0), "0"(crc0));
+        memcpy(out, &val0, 8);
+        next += 8;
+        out += 8;
+        len -= 8;
+    }
+    
+    /* copy and compute the crc for up to seven trailing bytes */
+    while (len) {
+        __asm__("crc32b\t" "(%1), %0"
+                : "=r"(crc0)
+                : "r"(next), "0"(crc0));
+        *out++ = *next++;
+        len--;
+    }
+    
+    /* return a post-processed crc */
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#endif /* __x86_64__ */
+
+#if (defined(__arm64__) || defined(__aarch64__)) && defined(__ARM_FEATURE_CRC32)
+
+/* One step of the ARMv8 crc32c instructions on eight bytes and one byte. */
+#define CRC32CX(crc, ptr) \
+    __asm__("crc32cx\t%w0, %w0, %x1" : "+r"(crc) : "r"(*(const uint64_t *)(ptr)))
+#define CRC32CB(crc, ptr) \
+    __asm__("crc32cb\t%w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*(ptr)))
+
+/* Compute CRC-32C using the ARMv8 crc32c instructions.  This uses the same
+ three-way interleaving as the Intel version, which also suits the latency
+ of these instructions on Apple and Cortex-A cores. */
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char *)buf;
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+    
+    /* pre-process the crc */
+    crc0 = crc ^ 0xffffffff;
+    
+    /* bring the data pointer to an eight-byte boundary */
+    while (len && ((uintptr_t)next & 7) != 0) {
+        CRC32CB(crc0, next);
+        next++;
+        len--;
+    }
+    
+    /* three independent crcs on LONG bytes each, then combine */
+    while (len >= LONG*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            CRC32CX(crc0, next);
+            CRC32CX(crc1, next + LONG);
+            CRC32CX(crc2, next + LONG*2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+    
+    /* the same on SHORT*3 blocks */
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            CRC32CX(crc0, next);
+            CRC32CX(crc1, next + SHORT);
+            CRC32CX(crc2, next + SHORT*2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+    
+    /* remaining eight-byte units and trailing bytes */
+    while (len >= 8) {
+        CRC32CX(crc0, next);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        CRC32CB(crc0, next);
+        next++;
+        len--;
+    }
+    
+    /* return a post-processed crc */
+    return crc0 ^ 0xffffffff;
+}
+
+/* Copy len bytes from src to dst, computing CRC-32C of the data with the
+ ARMv8 crc32c instructions as it is copied (see crc32c_copy_sse42()). */
+static uint32_t crc32c_copy_armv8(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *next = (const unsigned char *)src;
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+    uint64_t val0, val1, val2;
+    
+    /* pre-process the crc */
+    crc0 = crc ^ 0xffffffff;
+    
+    /* copy and compute the crc on SHORT*3 blocks */
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            memcpy(&val0, next, 8);
+            memcpy(&val1, next + SHORT, 8);
+            memcpy(&val2, next + SHORT*2, 8);
+            __asm__("crc32cx\t%w0, %w0, %x1" : "+r"(crc0) : "r"(val0));
+            __asm__("crc32cx\t%w0, %w0, %x1" : "+r"(crc1) : "r"(val1));
+            __asm__("crc32cx\t%w0, %w0, %x1" : "+r"(crc2) : "r"(val2));
+            memcpy(out, &val0, 8);
+            memcpy(out + SHORT, &val1, 8);
+            memcpy(out + SHORT*2, &val2, 8);
+            next += 8;
+            out += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        out += SHORT*2;
+        len -= SHORT*3;
+    }
+    
+    /* remaining eight-byte units and trailing bytes */
+    while (len >= 8) {
+        memcpy(&val0, next, 8);
+        __asm__("crc32cx\t%w0, %w0, %x1" : "+r"(crc0) : "r"(val0));
+        memcpy(out, &val0, 8);
+        next += 8;
+        out += 8;
+        len -= 8;
+    }
+    while (len) {
+        CRC32CB(crc0, next);
+        *out++ = *next++;
+        len--;
+    }
+    
+    /* return a post-processed crc */
+    return crc0 ^ 0xffffffff;
+}
+
+#endif /* __arm64__ && __ARM_FEATURE_CRC32 */
+
+/* Implementation selected by crc32c_init(). */
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+static uint32_t (*crc32c_copy_impl)(uint32_t, void *, const void *, size_t) = crc32c_copy_sw;
+static const char *crc32c_impl_name = "table";
+
+/* Initialize tables for shifting crcs and select the fastest implementation
+ supported by this processor.  The carry-less multiply (PCLMULQDQ, PMULL)
+ variants are not used since they need the vector registers, which kernel
+ code may not touch. */
+void crc32c_init()
+{
+    crc32c_zeros(crc32c_long, LONG);
+    crc32c_zeros(crc32c_short, SHORT);
+    crc32c_table_init();
+    
+    crc32c_impl = crc32c_sw;
+    crc32c_copy_impl = crc32c_copy_sw;
+    crc32c_impl_name = "table";
+    
+#if defined(__x86_64__)
+    if (crc32c_have_sse42()) {
+        crc32c_impl = crc32c_sse42;
+        crc32c_copy_impl = crc32c_copy_sse42;
+        crc32c_impl_name = "sse4.2";
+    }
+#elif (defined(__arm64__) || defined(__aarch64__)) && defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_armv8;
+    crc32c_copy_impl = crc32c_copy_armv8;
+    crc32c_impl_name = "armv8";
+#endif
+}
+
+/* Combine the crc of two consecutive blocks: crc1 is the crc of the first
+ block and crc2 that of the second, len2 bytes long.  This applies len2 zero
+ bytes to crc1 using the same zeros operators as crc32c_zeros_op(), one
+ squaring per bit of len2, so no data needs to be read again.  The pre- and
+ post-processing of the two crcs cancel out. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    int n;
+    uint32_t row;
+    uint32_t even[32];      /* even-power-of-two zeros operator */
+    uint32_t odd[32];       /* odd-power-of-two zeros operator */
+    
+    /* degenerate case */
+    if (len2 == 0)
+        return crc1;
+    
+    /* put operator for one zero bit in odd */
+    odd[0] = POLY;
+    row = 1;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    
+    /* put operator for two zero bits in even, four zero bits in odd */
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    
+    /* apply len2 zeros to crc1 (first square will put the operator for one
+     zero byte, eight zero bits, in even) */
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    
+    return crc1 ^ crc2;
+}
+
+/* Compute CRC-32C over a chain of buffers, in order. */
+uint32_t crc32c_iovec(uint32_t crc, const struct iovec *iov, unsigned int count)
+{
+    unsigned int idx;
+    
+    for (idx = 0; idx < count; idx++)
+        crc = crc32c(crc, iov[idx].iov_base, iov[idx].iov_len);
+    return crc;
+}
+
+/* Get the name of the implementation selected by crc32c_init(). */
+const char * crc32c_engine()
+{
+    return crc32c_impl_name;
+}
+
+/* Compute CRC-32C using the implementation selected by crc32c_init(). */
+uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
+{
+    // NS modification - return initial value if buffer empty
+    if(!len || !buf)
+        return crc;
+    
+    return crc32c_impl(crc, buf, len);
+}
+
+/* Copy data and compute CRC-32C of it in a single pass, using the
+ implementation selected by crc32c_init(). */
+uint32_t crc32c_copy(uint32_t crc,void * dst,const void * src,size_t len)
+{
+    if(!len || !dst || !src)
+        return crc;
+    
+    return crc32c_copy_impl(crc, dst, src, len);
+}
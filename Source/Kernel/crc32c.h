@@ -12,10 +12,16 @@
 #define __ISCSI_INITIATOR_CRC32C_H__
 
 #include <IOKit/IOLib.h>
+#include <sys/uio.h>
 
-/*! Call once to initialize CRC32C. */
+/*! Call once to initialize CRC32C.  This also selects the fastest
+ *  implementation supported by the processor (see crc32c_engine()). */
 void crc32c_init();
 
+/*! Gets the name of the CRC32C implementation in use.
+ *  @return "sse4.2", "armv8" or "table" (software). */
+const char * crc32c_engine();
+
 /*! Computes the CRC32C checksum of data.
  *  @param crc the existing crc for prior data, if any,.
  *  @param buffer the buffer to compute
@@ -23,4 +29,29 @@ void crc32c_init();
  *  @return the new CRC32C checksum. */
 uint32_t crc32c(uint32_t crc,const void * buffer,size_t length);
 
+/*! Copies data and computes its CRC32C checksum in a single pass over the
+ *  source buffer.  The buffers must not overlap.
+ *  @param crc the existing crc for prior data, if any.
+ *  @param dst the buffer to copy to.
+ *  @param src the buffer to copy and compute.
+ *  @param length the number of bytes to copy.
+ *  @return the new CRC32C checksum. */
+uint32_t crc32c_copy(uint32_t crc,void * dst,const void * src,size_t length);
+
+/*! Computes the CRC32C checksum of a chain of buffers, as if they were
+ *  a single contiguous buffer (e.g., a data segment and its padding).
+ *  @param crc the existing crc for prior data, if any.
+ *  @param iov the buffers to compute, in order.
+ *  @param count the number of entries in iov.
+ *  @return the new CRC32C checksum. */
+uint32_t crc32c_iovec(uint32_t crc,const struct iovec * iov,unsigned int count);
+
+/*! Combines the CRC32C checksums of two consecutive blocks of data that
+ *  were computed independently, without reading the data again.
+ *  @param crc1 the checksum of the first block.
+ *  @param crc2 the checksum of the second block.
+ *  @param length2 the length of the second block.
+ *  @return the CRC32C checksum of both blocks. */
+uint32_t crc32c_combine(uint32_t crc1,uint32_t crc2,size_t length2);
+
 #endif
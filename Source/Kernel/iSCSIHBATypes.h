@@ -115,6 +115,85 @@ typedef struct {
 } iSCSIHBANotificationAsyncMessage;
 
 
+/*! Number of histogram buckets for each power of two of latency (the
+ *  buckets within a power of two are of equal width). */
+#define kiSCSIHBALatencySubBuckets 4
+
+/*! Number of buckets in a latency histogram.  Latencies are in microseconds
+ *  and bucketed as follows: latencies below kiSCSIHBALatencySubBuckets have
+ *  a bucket each; above that, each power of two [2^n, 2^(n+1)) is split into
+ *  kiSCSIHBALatencySubBuckets buckets of equal width, so that every bucket
+ *  is within 25% of the latencies it counts.  The last bucket also counts
+ *  latencies that are too large for the histogram (about two hours). */
+#define kiSCSIHBALatencyBuckets 128
+
+/*! Classes of tasks that latencies are recorded for separately. */
+enum iSCSIHBALatencyClasses {
+    
+    /*! Tasks that transfer data from the target (e.g., READ). */
+    kiSCSIHBALatencyClassRead = 0,
+    
+    /*! Tasks that transfer data to the target (e.g., WRITE). */
+    kiSCSIHBALatencyClassWrite = 1,
+    
+    /*! Tasks that transfer no data (e.g., TEST UNIT READY). */
+    kiSCSIHBALatencyClassOther = 2,
+    
+    /*! Number of latency classes. */
+    kiSCSIHBALatencyClassCount = 3
+};
+
+/*! Objects that latency statistics are kept for. */
+enum iSCSIHBALatencyScopes {
+    
+    /*! Statistics of the tasks sent over a connection. */
+    kiSCSIHBALatencyScopeConnection = 0,
+    
+    /*! Statistics of the tasks addressed to a logical unit. */
+    kiSCSIHBALatencyScopeLUN = 1
+};
+
+/*! Latency histogram and counters for one class of tasks. */
+typedef struct iSCSIHBALatencyHistogram {
+    
+    /*! Number of tasks completed. */
+    UInt64 taskCount;
+    
+    /*! Number of bytes transferred by the completed tasks. */
+    UInt64 byteCount;
+    
+    /*! Sum of the latencies of the completed tasks (microseconds). */
+    UInt64 totalLatencyUs;
+    
+    /*! Largest latency of a completed task (microseconds). */
+    UInt64 maxLatencyUs;
+    
+    /*! Number of tasks in each latency bucket (see kiSCSIHBALatencyBuckets). */
+    UInt64 buckets[kiSCSIHBALatencyBuckets];
+    
+} iSCSIHBALatencyHistogram;
+
+/*! Latency statistics of a connection or logical unit.  The kernel updates
+ *  these as tasks complete, without stopping I/O while they are read; the
+ *  counters are therefore not an atomic snapshot, but each is consistent.
+ *  The task rate (IOPS) and data rate are derived by dividing the difference
+ *  of two samples by the difference of their sample times. */
+typedef struct iSCSIHBALatencyStatistics {
+    
+    /*! When statistics collection began, as represented by the system
+     *  uptime (microseconds). */
+    UInt64 startTimeUs;
+    
+    /*! When the statistics were read, as represented by the system uptime
+     *  (microseconds). */
+    UInt64 sampleTimeUs;
+    
+    /*! Statistics for each class of task (see iSCSIHBALatencyClasses). */
+    iSCSIHBALatencyHistogram histograms[kiSCSIHBALatencyClassCount];
+    
+} iSCSIHBALatencyStatistics;
+
+
 /*! Function pointer indices.  These are the functions that can be called
  *	indirectly by calling IOCallScalarMethod(). */
 enum functionNames {
@@ -146,6 +225,7 @@ enum functionNames {
     kiSCSIGetPortalAddressForConnectionId,
     kiSCSIGetPortalPortForConnectionId,
     kiSCSIGetHostInterfaceForConnectionId,
+    kiSCSIGetLatencyStatistics,
 	kiSCSIInitiatorNumMethods
 };
 
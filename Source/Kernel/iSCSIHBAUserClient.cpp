@@ -30,7 +30,9 @@
 #include "iSCSIHBAUserClient.h"
 #include "iSCSITypesShared.h"
 #include "iSCSITypesKernel.h"
+#include "iSCSITaskQueue.h"
 #include <IOKit/IOLib.h>
+#include <IOKit/IOTimerEventSource.h>
 
 /*! Required IOKit macro that defines the constructors, destructors, etc. */
 OSDefineMetaClassAndStructors(iSCSIHBAUserClient,IOUserClient);
@@ -235,6 +237,13 @@ const IOExternalMethodDispatch iSCSIHBAUserClient::methods[kiSCSIInitiatorNumMet
         0,
         0,                                  // Returned connection count
         kIOUCVariableStructureSize // connection address structures
+    },
+    {
+        (IOExternalMethodAction) &iSCSIHBAUserClient::GetLatencyStatistics,
+        3,                                  // Session ID, scope, connection ID or LUN
+        0,
+        0,
+        sizeof(iSCSIHBALatencyStatistics)   // Latency statistics
     }
 };
 
@@ -579,7 +588,11 @@ IOReturn iSCSIHBAUserClient::SetSessionParameter(iSCSIHBAUserClient * target,
                 session->maxConnections = (ConnectionIdentifier)paramVal;
                 break;
             case kiSCSIHBASOMaxOutstandingR2T:
-                session->maxOutStandingR2T = paramVal;
+                // Each task can hold this many R2Ts (see iSCSIHBATaskData)
+                if(paramVal >= 1 && paramVal <= kiSCSIMaxOutstandingR2T)
+                    session->maxOutStandingR2T = paramVal;
+                else
+                    retVal = kIOReturnBadArgument;
                 break;
             case kiSCSIHBASOMaxBurstLength:
                 session->maxBurstLength = (UInt32)paramVal;
@@ -593,6 +606,25 @@ IOReturn iSCSIHBAUserClient::SetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 session->targetSessionId = paramVal;
                 break;
+            case kiSCSIHBASOConnectionSchedulingPolicy:
+                if(paramVal < kiSCSIConnectionSchedulingInvalid)
+                    session->connectionSchedulingPolicy = paramVal;
+                else
+                    retVal = kIOReturnBadArgument;
+                break;
+            case kiSCSIHBASOWorkLoopPolicy:
+                if(paramVal >= kiSCSIWorkLoopInvalid)
+                    retVal = kIOReturnBadArgument;
+                else {
+                    // Fails while any of the session's connections are active
+                    errno_t error = hba->SetSessionWorkLoopPolicy(session,(UInt8)paramVal);
+                    
+                    if(error == EBUSY)
+                        retVal = kIOReturnBusy;
+                    else if(error)
+                        retVal = kIOReturnNoMemory;
+                }
+                break;
 
             default:
                 retVal = kIOReturnBadArgument;
@@ -673,6 +705,12 @@ IOReturn iSCSIHBAUserClient::GetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 *paramVal = session->targetSessionId;
                 break;
+            case kiSCSIHBASOConnectionSchedulingPolicy:
+                *paramVal = session->connectionSchedulingPolicy;
+                break;
+            case kiSCSIHBASOWorkLoopPolicy:
+                *paramVal = session->workLoopPolicy;
+                break;
             default:
                 retVal = kIOReturnBadArgument;
         };
@@ -971,7 +1009,6 @@ IOReturn iSCSIHBAUserClient::RecvData(iSCSIHBAUserClient * target,
 }
 
 // TODO: Only allow user to set options when connection is inactive
-// TODO: optimize socket parameters based on connection options
 IOReturn iSCSIHBAUserClient::SetConnectionParameter(iSCSIHBAUserClient * target,
                                                     void * reference,
                                                     IOExternalMethodArguments * args)
@@ -1027,7 +1064,17 @@ IOReturn iSCSIHBAUserClient::SetConnectionParameter(iSCSIHBAUserClient * target,
                 connection->useHeaderDigest = paramVal;
                 break;
             case kiSCSIHBACOMaxRecvDataSegmentLength:
-                connection->maxRecvDataSegmentLength = (UInt32)paramVal;
+                // Renegotiated with the target if the connection is active
+                if(connection->taskQueue->isEnabled()) {
+                    errno_t error = hba->RenegotiateMaxRecvDataSegmentLength(session,connection,(UInt32)paramVal);
+                    
+                    if(error == EINVAL)
+                        retVal = kIOReturnBadArgument;
+                    else if(error)
+                        retVal = kIOReturnBusy;
+                }
+                else
+                    connection->maxRecvDataSegmentLength = (UInt32)paramVal;
                 break;
             case kiSCSIHBACOMaxSendDataSegmentLength:
                 connection->maxSendDataSegmentLength = (UInt32)paramVal;
@@ -1035,6 +1082,26 @@ IOReturn iSCSIHBAUserClient::SetConnectionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBACOInitialExpStatSN:
                 connection->expStatSN = (UInt32)paramVal;
                 break;
+            case kiSCSIHBACOTransmitFlushBytes:
+                connection->txFlushBytes = (UInt32)paramVal;
+                break;
+            case kiSCSIHBACOTransmitFlushLatency:
+                connection->txFlushLatencyUs = (UInt32)paramVal;
+                break;
+            case kiSCSIHBACOPingInterval:
+                connection->pingIntervalMs = (UInt32)paramVal;
+                
+                // Takes effect now if the connection is active
+                connection->pingTimerEventSource->cancelTimeout();
+                if(connection->pingIntervalMs && connection->taskQueue->isEnabled())
+                    connection->pingTimerEventSource->setTimeoutMS(connection->pingIntervalMs);
+                break;
+            case kiSCSIHBACOSocketBufferLimit:
+                connection->socketBufferLimit = (UInt32)paramVal;
+                break;
+            case kiSCSIHBACOSocketBufferSize:
+                connection->socketBufferSize = (UInt32)paramVal;
+                break;
                 
             default:
                 retVal = kIOReturnBadArgument;
@@ -1108,9 +1175,105 @@ IOReturn iSCSIHBAUserClient::GetConnectionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBACOInitialExpStatSN:
                 *paramVal = connection->expStatSN;
                 break;
+            case kiSCSIHBACORecvWakeupCount:
+                *paramVal = connection->recvWakeupCount;
+                break;
+            case kiSCSIHBACORecvPDUCount:
+                *paramVal = connection->recvPDUCount;
+                break;
+            case kiSCSIHBACORecvCallCount:
+                *paramVal = connection->recvCallCount;
+                break;
+            case kiSCSIHBACORecvByteCount:
+                *paramVal = connection->recvByteCount;
+                break;
+            case kiSCSIHBACOTransmitFlushBytes:
+                *paramVal = connection->txFlushBytes;
+                break;
+            case kiSCSIHBACOTransmitFlushLatency:
+                *paramVal = connection->txFlushLatencyUs;
+                break;
+            case kiSCSIHBACOSendPDUCount:
+                *paramVal = connection->sendPDUCount;
+                break;
+            case kiSCSIHBACOSendCallCount:
+                *paramVal = connection->sendCallCount;
+                break;
+            case kiSCSIHBACOSendByteCount:
+                *paramVal = connection->sendByteCount;
+                break;
+            case kiSCSIHBACOTaskPoolAllocationCount:
+                *paramVal = connection->taskQueue->getTaskPoolAllocationCount();
+                break;
+            case kiSCSIHBACOTaskPoolMissCount:
+                *paramVal = connection->taskQueue->getTaskPoolMissCount();
+                break;
+            case kiSCSIHBACOTaskPoolHighWaterMark:
+                *paramVal = connection->taskQueue->getTaskPoolHighWaterMark();
+                break;
+            case kiSCSIHBACOPingInterval:
+                *paramVal = connection->pingIntervalMs;
+                break;
+            case kiSCSIHBACOSmoothedRTT:
+                *paramVal = connection->smoothedRTTUs;
+                break;
+            case kiSCSIHBACORTTVariance:
+                *paramVal = connection->RTTVarianceUs;
+                break;
+            case kiSCSIHBACORTTSampleCount:
+                *paramVal = connection->RTTSampleCount;
+                break;
+            case kiSCSIHBACOSmoothedR2TLatency:
+                *paramVal = connection->smoothedR2TLatencyUs;
+                break;
+            case kiSCSIHBACOSocketBufferLimit:
+                *paramVal = connection->socketBufferLimit;
+                break;
+            case kiSCSIHBACOSocketBufferSize:
+                *paramVal = connection->socketBufferSize;
+                break;
+            case kiSCSIHBACOPathMaxSegmentSize:
+            case kiSCSIHBACOSocketRecvBufferSize:
+            case kiSCSIHBACOSocketSendBufferSize:
+            case kiSCSIHBACONoDelay:
+            case kiSCSIHBACOKeepAliveIdleTime:
+            case kiSCSIHBACOKeepAliveInterval:
+            case kiSCSIHBACOKeepAliveCount:
+            {
+                // Read the values back from the socket, so that values the
+                // system refused or adjusted are reported as applied
+                int level = IPPROTO_TCP, option = 0;
+                
+                switch(paramType) {
+                    case kiSCSIHBACOPathMaxSegmentSize:
+                        option = TCP_MAXSEG; break;
+                    case kiSCSIHBACOSocketRecvBufferSize:
+                        level = SOL_SOCKET; option = SO_RCVBUF; break;
+                    case kiSCSIHBACOSocketSendBufferSize:
+                        level = SOL_SOCKET; option = SO_SNDBUF; break;
+                    case kiSCSIHBACONoDelay:
+                        option = TCP_NODELAY; break;
+                    case kiSCSIHBACOKeepAliveIdleTime:
+                        option = TCP_KEEPALIVE; break;
+                    case kiSCSIHBACOKeepAliveInterval:
+                        option = TCP_KEEPINTVL; break;
+                    default:
+                        option = TCP_KEEPCNT; break;
+                };
+                
+                int value = 0;
+                int valueSize = sizeof(value);
+                errno_t error = sock_getsockopt(connection->socket,level,option,&value,&valueSize);
+                
+                if(paramType == kiSCSIHBACONoDelay)
+                    *paramVal = (!error && value != 0);
+                else
+                    *paramVal = (error || value < 0) ? 0 : value;
+                break;
+            }
                 
             default:
-                return kIOReturnBadArgument;
+                retVal = kIOReturnBadArgument;
         };
     }
     
@@ -1514,5 +1677,61 @@ IOReturn iSCSIHBAUserClient::GetHostInterfaceForConnectionId(iSCSIHBAUserClient
     return retVal;
 }
 
-
-
+IOReturn iSCSIHBAUserClient::GetLatencyStatistics(iSCSIHBAUserClient * target,
+                                                  void * reference,
+                                                  IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
+    UInt64 scope = args->scalarInput[1];
+    UInt64 identifier = args->scalarInput[2];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    if(scope == kiSCSIHBALatencyScopeConnection) {
+        if(identifier >= kiSCSIMaxConnectionsPerSession)
+            return kIOReturnBadArgument;
+    }
+    else if(scope != kiSCSIHBALatencyScopeLUN)
+        return kIOReturnBadArgument;
+    
+    IOLockLock(target->accessLock);
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    iSCSIHBALatencyStatistics * stats = NULL;
+    
+    if(session)
+    {
+        if(scope == kiSCSIHBALatencyScopeConnection) {
+            if(session->connections[identifier])
+                stats = &session->connections[identifier]->latencyStats;
+        }
+        // Statistics of a LUN exist once one of its tasks has completed
+        else if(identifier < session->kMaxLatencyStatsLUNs)
+            stats = __atomic_load_n(&session->lunLatencyStats[identifier],__ATOMIC_ACQUIRE);
+    }
+    
+    IOReturn retVal = kIOReturnNotFound;
+    
+    // The statistics are copied while tasks complete; see
+    // iSCSIHBALatencyStatistics for what that means for the copy
+    if(stats) {
+        retVal = kIOReturnSuccess;
+        
+        iSCSIHBALatencyStatistics * statsOut = (iSCSIHBALatencyStatistics *)args->structureOutput;
+        memcpy(statsOut,stats,sizeof(iSCSIHBALatencyStatistics));
+        
+        clock_sec_t secs;
+        clock_usec_t usecs;
+        clock_get_system_microtime(&secs,&usecs);
+        statsOut->sampleTimeUs = (UInt64)secs*1000000 + usecs;
+    }
+    
+    IOLockUnlock(target->accessLock);
+    
+    return retVal;
+}
@@ -154,6 +154,10 @@ public:
     static IOReturn GetHostInterfaceForConnectionId(iSCSIHBAUserClient * target,
                                                     void * reference,
                                                     IOExternalMethodArguments * args);
+    
+    static IOReturn GetLatencyStatistics(iSCSIHBAUserClient * target,
+                                         void * reference,
+                                         IOExternalMethodArguments * args);
 
     /*! Dispatched function invoked from user-space to send data
      *  over an existing, active connection. */
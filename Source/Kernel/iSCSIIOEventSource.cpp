@@ -75,17 +75,12 @@ bool iSCSIIOEventSource::checkForWork()
     // actual data is available at the port (as opposed to other socket events)
     iSCSIVirtualHBA * hba = (iSCSIVirtualHBA*)owner;
 
-    if(hba->isPDUAvailable(connection))
-    {
-        // Validate action & owner, then call action on our owner & pass in socket
-        if(action && owner)
-            (*action)(owner,session,connection);
-        
-        // Tell workloop thread to call us again (gives it a chance to handle
-        // other requests first)
-        if(hba->isPDUAvailable(connection))
-            return true;
-    }
+    // Validate action & owner, then call action on our owner & pass in socket.
+    // The action receives what it can without blocking and tells us whether
+    // to call it again (gives the workloop a chance to handle other requests
+    // first); a partially received PDU is picked up on the next signal.
+    if(action && owner && hba->isPDUAvailable(connection))
+        return ((iSCSIIOEventSource::Action)action)(hba,session,connection);
     
     // Tell workloop thread not to call us again until we signal again...
 	return false;
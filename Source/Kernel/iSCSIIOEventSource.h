@@ -59,8 +59,10 @@ class iSCSIIOEventSource : public IOEventSource
 public:
     
 	/*! Pointer to the method that is called (within the driver's workloop)
-	 *	when data becomes available at a network socket. */
-    typedef bool (*Action) (iSCSISession * session,
+	 *	when data becomes available at a network socket.  The method returns
+	 *	true if it should be called again (more data may be available). */
+    typedef bool (*Action) (iSCSIVirtualHBA * owner,
+                            iSCSISession * session,
                             iSCSIConnection * connection);
 	
 	/*! Initializes the event source with an owner and an action.
@@ -27,6 +27,7 @@
  */
 
 #include "iSCSIPDUKernel.h"
+#include "crc32c.h"
 
 namespace iSCSIPDU {
     
@@ -54,7 +55,7 @@ namespace iSCSIPDU {
         .dataTransferLength = 0 };
     
     const iSCSIPDUTaskMgmtReqBHS iSCSIPDUTaskMgmtReqBHSInit = {
-        .opCode             = kiSCSIPDUOpCodeTaskMgmtReq,
+        .opCode             = kiSCSIPDUOpCodeTaskMgmtReq | kiSCSIPDUImmediateDeliveryFlag,
         .function           = 0,
         .reserved           = 0,
         .totalAHSLength     = 0,
@@ -66,8 +67,27 @@ namespace iSCSIPDU {
         
     const iSCSIPDUSNACKReqBHS iSCSIPDUSNACKReqBHSInit {
         .opCode = kiSCSIPDUOpCodeSNACKReq,
-        .flags = 0,
+        .flags = kiSCSIPDUSNACKFinalFlag,
         .totalAHSLength = 0};
+    
+    const iSCSIPDULogoutReqBHS iSCSIPDULogoutReqBHSInit = {
+        .opCode             = kiSCSIPDUOpCodeLogoutReq | kiSCSIPDUImmediateDeliveryFlag,
+        .reasonCode         = kiSCSIPDULogoutReasonFlag,
+        .reserved           = 0,
+        .totalAHSLength     = 0,
+        .reserved2          = 0,
+        .initiatorTaskTag   = 0,
+        .CID                = 0,
+        .reserved3          = 0 };
+    
+    const iSCSIPDUTextReqBHS iSCSIPDUTextReqBHSInit = {
+        .opCode             = kiSCSIPDUOpCodeTextReq | kiSCSIPDUImmediateDeliveryFlag,
+        .flags              = kiSCSIPDUTextFinalFlag,
+        .reserved           = 0,
+        .totalAHSLength     = 0,
+        .LUN                = 0,
+        .initiatorTaskTag   = 0,
+        .targetTransferTag  = kiSCSIPDUTargetTransferTagReserved };
 
     const iSCSIPDUNOPOutBHS iSCSIPDUNOPOutBHSInit = {
         .opCode             = kiSCSIPDUOpCodeNOPOut,
@@ -94,6 +114,165 @@ namespace iSCSIPDU {
         .reserved = 0,
         .readDataLength = 0 };
     
+    void iSCSIPDURecvReset(iSCSIPDURecvContext * context,
+                           bool useHeaderDigest,
+                           bool useDataDigest)
+    {
+        memset(context,0,sizeof(iSCSIPDURecvContext));
+        context->stage = kiSCSIPDURecvStageHeader;
+        context->useHeaderDigest = useHeaderDigest;
+        context->useDataDigest = useDataDigest;
+    }
+    
+    void * iSCSIPDURecvGetBuffer(iSCSIPDURecvContext * context,
+                                 size_t * length,
+                                 bool * digested)
+    {
+        const UInt32 offset = context->stageOffset;
+        *digested = false;
+        
+        switch(context->stage)
+        {
+            case kiSCSIPDURecvStageHeader:
+                *length = kiSCSIPDUBasicHeaderSegmentSize - offset;
+                return (UInt8*)&context->bhs + offset;
+                
+            // The AHS is discarded, a piece at a time
+            case kiSCSIPDURecvStageAHS:
+                *length = min(context->ahsLength - offset,sizeof(context->scratch));
+                return context->scratch;
+                
+            case kiSCSIPDURecvStageHeaderDigest:
+            case kiSCSIPDURecvStageDataDigest:
+                *length = kiSCSIPDUDigestSize - offset;
+                return (UInt8*)&context->digest + offset;
+                
+            case kiSCSIPDURecvStageData:
+                *length = context->dataLength - offset;
+                *digested = context->useDataDigest;
+                return context->data ? context->data + offset : NULL;
+                
+            case kiSCSIPDURecvStagePadding:
+                *length = context->paddingLength - offset;
+                *digested = context->useDataDigest;
+                return context->scratch + offset;
+                
+            default:
+                *length = 0;
+                return NULL;
+        };
+    }
+    
+    void iSCSIPDURecvSetDataBuffer(iSCSIPDURecvContext * context,UInt8 * data)
+    {
+        context->data = data;
+    }
+    
+    /*! Moves a receive context past the data segment (and its padding). */
+    static enum iSCSIPDURecvResults iSCSIPDURecvEndData(iSCSIPDURecvContext * context)
+    {
+        context->stageOffset = 0;
+        
+        if(context->useDataDigest) {
+            context->stage = kiSCSIPDURecvStageDataDigest;
+            return kiSCSIPDURecvMore;
+        }
+        
+        context->stage = kiSCSIPDURecvStageComplete;
+        return kiSCSIPDURecvPDUComplete;
+    }
+    
+    /*! Moves a receive context past the header segment. */
+    static enum iSCSIPDURecvResults iSCSIPDURecvEndHeader(iSCSIPDURecvContext * context)
+    {
+        context->stageOffset = 0;
+        
+        if(context->dataLength)
+            context->stage = kiSCSIPDURecvStageData;
+        else
+            context->stage = kiSCSIPDURecvStageComplete;
+        
+        return kiSCSIPDURecvHeaderComplete;
+    }
+    
+    enum iSCSIPDURecvResults iSCSIPDURecvAdvance(iSCSIPDURecvContext * context,
+                                                  size_t length,
+                                                  bool digested)
+    {
+        size_t bufferLength;
+        bool covered;
+        UInt8 * buffer = (UInt8*)iSCSIPDURecvGetBuffer(context,&bufferLength,&covered);
+        
+        if(!buffer || length > bufferLength)
+            return kiSCSIPDURecvMore;
+        
+        // Keep running digests of the header and data segments
+        if(context->useHeaderDigest && context->stage <= kiSCSIPDURecvStageAHS)
+            context->headerDigest = crc32c(context->headerDigest,buffer,length);
+        
+        if(covered && !digested)
+            context->dataDigest = crc32c(context->dataDigest,buffer,length);
+        
+        context->stageOffset += length;
+        
+        if(length < bufferLength)
+            return kiSCSIPDURecvMore;
+        
+        // The current stage is complete (AHS is complete once all of its pieces
+        // have been received); move on to the next stage
+        switch(context->stage)
+        {
+            case kiSCSIPDURecvStageHeader:
+                context->ahsLength = context->bhs.totalAHSLength*4;
+                context->dataLength = (UInt32)iSCSIPDUGetDataSegmentLength(&context->bhs);
+                context->paddingLength = (4 - context->dataLength % 4) % 4;
+                context->stageOffset = 0;
+                
+                if(context->ahsLength) {
+                    context->stage = kiSCSIPDURecvStageAHS;
+                    return kiSCSIPDURecvMore;
+                }
+                // Fall through (no AHS)
+                
+            case kiSCSIPDURecvStageAHS:
+                if(context->stage == kiSCSIPDURecvStageAHS && context->stageOffset < context->ahsLength)
+                    return kiSCSIPDURecvMore;
+                
+                context->stageOffset = 0;
+                
+                if(context->useHeaderDigest) {
+                    context->stage = kiSCSIPDURecvStageHeaderDigest;
+                    return kiSCSIPDURecvMore;
+                }
+                return iSCSIPDURecvEndHeader(context);
+                
+            case kiSCSIPDURecvStageHeaderDigest:
+                if(context->digest != context->headerDigest) {
+                    context->stage = kiSCSIPDURecvStageComplete;
+                    return kiSCSIPDURecvHeaderDigestError;
+                }
+                return iSCSIPDURecvEndHeader(context);
+                
+            case kiSCSIPDURecvStageData:
+                if(context->paddingLength) {
+                    context->stage = kiSCSIPDURecvStagePadding;
+                    context->stageOffset = 0;
+                    return kiSCSIPDURecvMore;
+                }
+                return iSCSIPDURecvEndData(context);
+                
+            case kiSCSIPDURecvStagePadding:
+                return iSCSIPDURecvEndData(context);
+                
+            case kiSCSIPDURecvStageDataDigest:
+                context->stage = kiSCSIPDURecvStageComplete;
+                if(context->digest != context->dataDigest)
+                    return kiSCSIPDURecvDataDigestError;
+                return kiSCSIPDURecvPDUComplete;
+                
+            default:
+                return kiSCSIPDURecvMore;
+        };
+    }
+    
 };
-
-
@@ -97,6 +97,31 @@ namespace iSCSIPDU {
     
     static const UInt8 kiSCSIPDUTaskMgmtFuncTaskReassign = 0x08;
     
+    
+    ///////////////////// For for use with logout PDUs /////////////////////////
+    
+    static const UInt8 kiSCSIPDULogoutReasonFlag = 0x80;
+    
+    enum iSCSIPDULogoutReasons {
+        kiSCSIPDULogoutCloseSession = 0x00,
+        kiSCSIPDULogoutCloseConnection = 0x01,
+        kiSCSIPDULogoutRemoveConnectionForRecovery = 0x02
+    };
+    
+    enum iSCSIPDULogoutRspCodes {
+        kiSCSIPDULogoutRspSuccess = 0x00,
+        kiSCSIPDULogoutRspCIDNotFound = 0x01,
+        kiSCSIPDULogoutRspRecoveryUnsupported = 0x02,
+        kiSCSIPDULogoutRspCleanupFailed = 0x03
+    };
+    
+    
+    ////////////////////// For for use with text PDUs //////////////////////////
+    
+    static const UInt8 kiSCSIPDUTextFinalFlag = 0x80;
+    
+    static const UInt8 kiSCSIPDUTextContinueFlag = 0x40;
+    
     enum iSCSIPDUTaskMgmtRspCodes {
         kiSCSIPDUTaskMgmtFuncComplete = 0x00,
         kiSCSIPDUTaskMgmtInvalidTask  = 0x01,
@@ -122,6 +147,18 @@ namespace iSCSIPDU {
 
     static const UInt8 kiSCSIPDUDataInStatusFlag = 0x01;
     
+    
+    ////////////////////// For for use with SNACK request PDUs /////////////////
+    
+    static const UInt8 kiSCSIPDUSNACKFinalFlag = 0x80;
+    
+    enum iSCSIPDUSNACKTypes {
+        kiSCSIPDUSNACKTypeDataR2T = 0x00,
+        kiSCSIPDUSNACKTypeStatus = 0x01,
+        kiSCSIPDUSNACKTypeDataACK = 0x02,
+        kiSCSIPDUSNACKTypeRData = 0x03
+    };
+    
     /*! Basic header segment for a data in PDU. */
     typedef struct __iSCSIPDUDataInBHS {
         const UInt8 opCode;
@@ -228,6 +265,76 @@ namespace iSCSIPDU {
         UInt32 reserved5;
     } __attribute__((packed)) iSCSIPDUTaskMgmtRspBHS;
     
+    /*! Basic header segment for a logout request PDU. */
+    typedef struct __iSCSIPDULogoutReqBHS {
+        const UInt8 opCode;
+        UInt8 reasonCode;
+        UInt16 reserved;
+        UInt8 totalAHSLength;
+        UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+        UInt64 reserved2;
+        UInt32 initiatorTaskTag;
+        UInt16 CID;
+        UInt16 reserved3;
+        UInt32 cmdSN;
+        UInt32 expStatSN;
+        UInt64 reserved4;
+        UInt64 reserved5;
+    } __attribute__((packed)) iSCSIPDULogoutReqBHS;
+    
+    /*! Basic header segment for a logout response PDU. */
+    typedef struct __iSCSIPDULogoutRspBHS {
+        const UInt8 opCode;
+        UInt8 flags;
+        UInt8 response;
+        UInt8 reserved;
+        UInt8 totalAHSLength;
+        UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+        UInt64 reserved2;
+        UInt32 initiatorTaskTag;
+        UInt32 reserved3;
+        UInt32 statSN;
+        UInt32 expCmdSN;
+        UInt32 maxCmdSN;
+        UInt32 reserved4;
+        UInt16 time2Wait;
+        UInt16 time2Retain;
+        UInt32 reserved5;
+    } __attribute__((packed)) iSCSIPDULogoutRspBHS;
+    
+    /*! Basic header segment for a text request PDU. */
+    typedef struct __iSCSIPDUTextReqBHS {
+        const UInt8 opCode;
+        UInt8 flags;
+        UInt16 reserved;
+        UInt8 totalAHSLength;
+        UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+        UInt64 LUN;
+        UInt32 initiatorTaskTag;
+        UInt32 targetTransferTag;
+        UInt32 cmdSN;
+        UInt32 expStatSN;
+        UInt64 reserved2;
+        UInt64 reserved3;
+    } __attribute__((packed)) iSCSIPDUTextReqBHS;
+    
+    /*! Basic header segment for a text response PDU. */
+    typedef struct __iSCSIPDUTextRspBHS {
+        const UInt8 opCode;
+        UInt8 flags;
+        UInt16 reserved;
+        UInt8 totalAHSLength;
+        UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+        UInt64 LUN;
+        UInt32 initiatorTaskTag;
+        UInt32 targetTransferTag;
+        UInt32 statSN;
+        UInt32 expCmdSN;
+        UInt32 maxCmdSN;
+        UInt64 reserved2;
+        UInt32 reserved3;
+    } __attribute__((packed)) iSCSIPDUTextRspBHS;
+    
     /*! Basic header segment for an R2T PDU. */
     typedef struct __iSCSIPDUR2TBHS {
         const UInt8 opCode;
@@ -399,10 +506,133 @@ namespace iSCSIPDU {
         return length;
     }
     
+    ///////////////////// For use with incoming PDU streams ///////////////////
+    
+    /*! Stages of a PDU received from a target, in the order in which they
+     *  appear on the wire. */
+    enum iSCSIPDURecvStages {
+        kiSCSIPDURecvStageHeader = 0,
+        kiSCSIPDURecvStageAHS,
+        kiSCSIPDURecvStageHeaderDigest,
+        kiSCSIPDURecvStageData,
+        kiSCSIPDURecvStagePadding,
+        kiSCSIPDURecvStageDataDigest,
+        kiSCSIPDURecvStageComplete
+    };
+    
+    /*! Results of adding received bytes to a receive context. */
+    enum iSCSIPDURecvResults {
+        
+        /*! More bytes are needed to complete the PDU. */
+        kiSCSIPDURecvMore = 0,
+        
+        /*! The header segment (BHS, AHS and header digest) is complete.  If
+         *  the PDU has a data segment, a buffer must be set for it with
+         *  iSCSIPDURecvSetDataBuffer() before receiving more bytes; otherwise
+         *  the PDU is also complete. */
+        kiSCSIPDURecvHeaderComplete,
+        
+        /*! The PDU is complete. */
+        kiSCSIPDURecvPDUComplete,
+        
+        /*! The header digest did not match; the stream can't be trusted. */
+        kiSCSIPDURecvHeaderDigestError,
+        
+        /*! The data digest did not match; the PDU is complete but its data
+         *  segment should be discarded. */
+        kiSCSIPDURecvDataDigestError
+    };
+    
+    /*! Tracks a PDU that is received incrementally, as bytes become available.
+     *  The context performs no I/O: bytes are placed in the buffer returned by
+     *  iSCSIPDURecvGetBuffer() and then reported with iSCSIPDURecvAdvance(),
+     *  so any split of the byte stream may be fed to it. */
+    typedef struct __iSCSIPDURecvContext {
+        
+        /*! The current stage (see iSCSIPDURecvStages). */
+        UInt8 stage;
+        
+        /*! Whether a header digest follows the header segment. */
+        bool useHeaderDigest;
+        
+        /*! Whether a data digest follows the data segment. */
+        bool useDataDigest;
+        
+        /*! Number of bytes of the current stage received so far. */
+        UInt32 stageOffset;
+        
+        /*! The basic header segment. */
+        iSCSIPDUTargetBHS bhs;
+        
+        /*! Length of the AHS, in bytes (the AHS is discarded). */
+        UInt32 ahsLength;
+        
+        /*! Length of the data segment, in bytes (excluding padding). */
+        UInt32 dataLength;
+        
+        /*! Number of padding bytes that follow the data segment. */
+        UInt32 paddingLength;
+        
+        /*! Buffer that receives the data segment. */
+        UInt8 * data;
+        
+        /*! Holds discarded AHS and padding bytes. */
+        UInt8 scratch[64];
+        
+        /*! The digest received from the target. */
+        UInt32 digest;
+        
+        /*! CRC32C of the header segment received so far. */
+        UInt32 headerDigest;
+        
+        /*! CRC32C of the data segment and padding received so far. */
+        UInt32 dataDigest;
+        
+    } iSCSIPDURecvContext;
+    
+    /*! Prepares a receive context for the next PDU.
+     *  @param context the receive context.
+     *  @param useHeaderDigest whether PDUs carry a header digest.
+     *  @param useDataDigest whether PDUs carry a data digest. */
+    void iSCSIPDURecvReset(iSCSIPDURecvContext * context,
+                           bool useHeaderDigest,
+                           bool useDataDigest);
+    
+    /*! Gets the buffer that the next bytes of the stream belong in.
+     *  @param context the receive context.
+     *  @param length the number of bytes that the current stage still needs;
+     *  no more than this may be placed in the buffer.
+     *  @param digested set to true if the bytes are covered by the data digest.
+     *  The caller may then compute the digest while copying the bytes into the
+     *  buffer (see iSCSIPDURecvAdvance()).
+     *  @return the buffer, or NULL if the PDU is complete. */
+    void * iSCSIPDURecvGetBuffer(iSCSIPDURecvContext * context,
+                                 size_t * length,
+                                 bool * digested);
+    
+    /*! Sets the buffer that receives the data segment of the PDU.  This must be
+     *  called once the header is complete, if the PDU has a data segment.
+     *  @param context the receive context.
+     *  @param data a buffer of at least context->dataLength bytes. */
+    void iSCSIPDURecvSetDataBuffer(iSCSIPDURecvContext * context,UInt8 * data);
+    
+    /*! Accounts for bytes that were placed in the buffer returned by
+     *  iSCSIPDURecvGetBuffer().
+     *  @param context the receive context.
+     *  @param length the number of bytes received.
+     *  @param digested true if the caller has already added the bytes to
+     *  context->dataDigest (e.g., using crc32c_copy()).
+     *  @return the result of receiving the bytes. */
+    enum iSCSIPDURecvResults iSCSIPDURecvAdvance(iSCSIPDURecvContext * context,
+                                                  size_t length,
+                                                  bool digested);
+    
     extern const iSCSIPDUDataOutBHS iSCSIPDUDataOutBHSInit;
     extern const iSCSIPDUSCSICmdBHS iSCSIPDUSCSICmdBHSInit;
     extern const iSCSIPDUTaskMgmtReqBHS iSCSIPDUTaskMgmtReqBHSInit;
     extern const iSCSIPDUSNACKReqBHS iSCSIPDUSNACKReqBHSInit;
+    extern const iSCSIPDULogoutReqBHS iSCSIPDULogoutReqBHSInit;
+    extern const iSCSIPDUTextReqBHS iSCSIPDUTextReqBHSInit;
     extern const iSCSIPDUNOPOutBHS iSCSIPDUNOPOutBHSInit;
     extern const iSCSIPDUExtCDBAHS iSCSIPDUExtCDBAHSInit;
     extern const iSCSIPDUBiReadAHS iSCSIPDUBiReadAHSInit;
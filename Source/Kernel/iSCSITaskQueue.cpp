@@ -25,7 +25,6 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-
 #include "iSCSITaskQueue.h"
 
 #define super IOEventSource
@@ -33,8 +32,26 @@
 struct iSCSITask {
     queue_chain_t queueChain;
     UInt32 initiatorTaskTag;
+    
+    /*! Time by which the SCSI layer expects the task to complete (system
+     *  uptime, microseconds). */
+    UInt64 deadlineUs;
+    
+    /*! Flag that indicates if the task is an ORDERED task. */
+    bool barrier;
+    
+    /*! Flag that indicates if the task is sent as an immediate command (or
+     *  sends nothing), so that it may be started while the command window
+     *  is closed. */
+    bool immediate;
 };
 
+/*! Number of free entries the pool is kept filled to. */
+const UInt32 iSCSITaskQueue::kTaskPoolReserve = 64;
+
+/*! Number of tags removed from the submission ring at a time. */
+const UInt32 iSCSITaskQueue::kTaskRingBatchSize = 16;
+
 OSDefineMetaClassAndStructors(iSCSITaskQueue,IOEventSource);
 
 bool iSCSITaskQueue::init(iSCSIVirtualHBA * owner,
@@ -42,114 +59,634 @@ bool iSCSITaskQueue::init(iSCSIVirtualHBA * owner,
                           iSCSISession * session,
                           iSCSIConnection * connection)
 {
+    // Initialize task queues to store parallel SCSI tasks for processing
+    // (before anything can fail, since free() empties them)
+    queue_init(&headOfQueueLane);
+    queue_init(&simpleLane);
+    queue_init(&orderedLane);
+    queue_init(&outstandingQueue);
+    queue_init(&timeoutQueue);
+    queue_init(&taskPool);
+    
+    stagedTasks = NULL;
+    stagedTaskCount = stagedTaskIndex = 0;
+    
+    // Every tag queued on this connection holds one of the session's task
+    // slots, so a ring with a cell per slot never fills
+    if(!taskRing.init(iSCSIVirtualHBA::kMaxTaskSlots))
+        return false;
+    
 	// Initialize superclass, check validity and store socket handle
 	if(!super::init(owner,(IOEventSource::Action) action))
         return false;
+    
+    if(!(stagedTasks = (UInt32*)IOMalloc(kTaskRingBatchSize*sizeof(UInt32))))
+        return false;
+    
+    // Tasks are queued by the HBA's work loop, which need not be the
+    // work loop that this event source is attached to
+    if(!(queueLock = IOSimpleLockAlloc()))
+        return false;
 	
     iSCSITaskQueue::session = session;
     iSCSITaskQueue::connection = connection;
-    
-    // Initialize task queue to store parallel SCSI tasks for processing
-    queue_init(&taskQueue);
 
-    newTask = false;
+    outstandingTaskCount = 0;
+    newDataOut = false;
+    newTimeout = false;
+    
+    // Fill the pool of queue entries up front
+    taskPoolCount = 0;
+    tasksInUse = 0;
+    taskPoolHighWaterMark = 0;
+    taskPoolAllocationCount = 0;
+    taskPoolMissCount = 0;
+    taskPoolLow = false;
+    
+    refillTaskPool();
     
 	return true;
 }
 
+/*! Frees the queue's entries, including those in the pool. */
+void iSCSITaskQueue::free()
+{
+    iSCSITask * task = NULL;
+    
+    taskRing.free();
+    
+    if(stagedTasks)
+        IOFree(stagedTasks,kTaskRingBatchSize*sizeof(UInt32));
+    
+    while((task = removeNextLaneTask(true)))
+        IOFree(task,sizeof(iSCSITask));
+    
+    while(!queue_empty(&outstandingQueue)) {
+        queue_remove_first(&outstandingQueue,task,iSCSITask *,queueChain);
+        IOFree(task,sizeof(iSCSITask));
+    }
+    
+    while(!queue_empty(&timeoutQueue)) {
+        queue_remove_first(&timeoutQueue,task,iSCSITask *,queueChain);
+        IOFree(task,sizeof(iSCSITask));
+    }
+    
+    while(!queue_empty(&taskPool)) {
+        queue_remove_first(&taskPool,task,iSCSITask *,queueChain);
+        IOFree(task,sizeof(iSCSITask));
+    }
+    
+    if(queueLock)
+        IOSimpleLockFree(queueLock);
+    
+    super::free();
+}
+
+/*! Takes an entry from the pool, allocating one if the pool is empty.
+ *  @return the entry, or NULL if memory could not be allocated. */
+iSCSITask * iSCSITaskQueue::allocateTask()
+{
+    iSCSITask * task = NULL;
+    
+    IOSimpleLockLock(queueLock);
+    
+    if(!queue_empty(&taskPool)) {
+        queue_remove_first(&taskPool,task,iSCSITask *,queueChain);
+        taskPoolCount--;
+    }
+    
+    // Top up the pool on the next pass once it runs low
+    if(taskPoolCount < kTaskPoolReserve/2)
+        taskPoolLow = true;
+    
+    if(++tasksInUse > taskPoolHighWaterMark)
+        taskPoolHighWaterMark = tasksInUse;
+    
+    IOSimpleLockUnlock(queueLock);
+    
+    if(!task) {
+        if((task = (iSCSITask*)IOMalloc(sizeof(iSCSITask)))) {
+            OSAddAtomic64(1,&taskPoolAllocationCount);
+            OSAddAtomic64(1,&taskPoolMissCount);
+        }
+        else {
+            IOSimpleLockLock(queueLock);
+            tasksInUse--;
+            IOSimpleLockUnlock(queueLock);
+        }
+    }
+    
+    return task;
+}
+
+/*! Returns an entry to the pool (the queue lock must be held).
+ *  @param task the entry to return. */
+void iSCSITaskQueue::releaseTask(iSCSITask * task)
+{
+    // Entries are kept, so that the pool grows to the peak number of tasks
+    queue_enter(&taskPool,task,iSCSITask *,queueChain);
+    taskPoolCount++;
+    tasksInUse--;
+}
+
+/*! Allocates entries until the pool holds kTaskPoolReserve free entries. */
+void iSCSITaskQueue::refillTaskPool()
+{
+    taskPoolLow = false;
+    
+    while(taskPoolCount < kTaskPoolReserve)
+    {
+        iSCSITask * task = (iSCSITask*)IOMalloc(sizeof(iSCSITask));
+        
+        if(!task)
+            break;
+        
+        OSAddAtomic64(1,&taskPoolAllocationCount);
+        
+        IOSimpleLockLock(queueLock);
+        queue_enter(&taskPool,task,iSCSITask *,queueChain);
+        taskPoolCount++;
+        IOSimpleLockUnlock(queueLock);
+    }
+}
+
 /*! Queues a new iSCSI task for delayed processing.
  *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
 void iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag)
 {
-    // Signal the workloop thread that work is available only if this is
-    // the only task in the queue (otherwise the task preceding this is
-    // being processed; we'll get to this once that's done).
-    iSCSITask * task = (iSCSITask*)IOMalloc(sizeof(iSCSITask));
+    // The ring has a cell for each of the session's task slots, so it can
+    // only be full if a tag were queued twice
+    if(!taskRing.enqueue(initiatorTaskTag))
+        return;
+    
+    // Signal the workloop to process a new task (only once the tag has been
+    // published); the task is started as soon as the command window allows
+    // (see checkForWork())
+    if(getWorkLoop())
+        signalWorkAvailable();
+}
+
+/*! Removes a task from the queue (either the task has been successfully
+ *  completed or aborted).
+ *  @param initiatorTaskTag the iSCSI task tag of the task to remove.
+ *  @return true if the task was found and removed from the queue. */
+bool iSCSITaskQueue::completeTask(UInt32 initiatorTaskTag)
+{
+    iSCSITask * task = NULL;
+    bool found = false;
+    
+    IOSimpleLockLock(queueLock);
+    
+    // Completions may arrive in any order, so match the task by its tag
+    // rather than assuming it is at the head of the queue
+    queue_iterate(&outstandingQueue,task,iSCSITask *,queueChain)
+    {
+        if(task->initiatorTaskTag == initiatorTaskTag) {
+            found = true;
+            break;
+        }
+    }
+    
+    if(!found) {
+        IOSimpleLockUnlock(queueLock);
+        return false;
+    }
+    
+    queue_remove(&outstandingQueue,task,iSCSITask *,queueChain);
+    outstandingTaskCount--;
+    releaseTask(task);
+    
+    IOSimpleLockUnlock(queueLock);
+    
+    // If there are still tasks to process let the HBA know...
+    if(hasPendingTasks() && getWorkLoop())
+        signalWorkAvailable();
+    
+    return true;
+}
+
+/*! Adds a task that was started on another connection to the queue's
+ *  outstanding tasks, without starting it (see
+ *  iSCSIVirtualHBA::ReassignConnectionTasks()).
+ *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
+void iSCSITaskQueue::adoptTask(UInt32 initiatorTaskTag)
+{
+    iSCSITask * task = allocateTask();
+    
+    if(!task)
+        return;
+    
     task->initiatorTaskTag = initiatorTaskTag;
     
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    IOSimpleLockLock(queueLock);
+    queue_enter(&outstandingQueue,task,iSCSITask *,queueChain);
+    outstandingTaskCount++;
+    IOSimpleLockUnlock(queueLock);
+}
+
+/*! Removes a task from the queue, whether or not it has been started
+ *  (started tasks are removed first).  Used to flush the queue when a
+ *  connection is deactivated.
+ *  @param initiatorTaskTag the iSCSI task tag of the removed task.
+ *  @return true if a task was removed, false if the queue was empty. */
+bool iSCSITaskQueue::removeNextTask(UInt32 * initiatorTaskTag)
+{
+    iSCSITask * task = NULL;
     
-    bool firstTaskInQueue = false;
-    if(queue_empty(&taskQueue))
-        firstTaskInQueue = true;
+    bool found = true;
     
-    queue_enter(&taskQueue,task,iSCSITask *,queueChain);
+    // The work loop may be sorting and starting tasks as this runs
+    IOSimpleLockLock(queueLock);
     
-    // Signal the workloop to process a new task...
-    if(firstTaskInQueue) {
-        newTask = true;
+    // Outstanding tasks are older than those still waiting to be started
+    if(!queue_empty(&outstandingQueue)) {
+        queue_remove_first(&outstandingQueue,task,iSCSITask *,queueChain);
+        outstandingTaskCount--;
         
-        if(getWorkLoop())
-            signalWorkAvailable();
+        *initiatorTaskTag = task->initiatorTaskTag;
+        releaseTask(task);
     }
+    // Then tasks waiting in the lanes...
+    else if((task = removeNextLaneTask(true))) {
+        *initiatorTaskTag = task->initiatorTaskTag;
+        releaseTask(task);
+    }
+    // ...then tasks taken from the ring, then those still in it
+    else if(stagedTaskIndex < stagedTaskCount)
+        *initiatorTaskTag = stagedTasks[stagedTaskIndex++];
+    else
+        found = taskRing.dequeue(initiatorTaskTag);
+    
+    IOSimpleLockUnlock(queueLock);
+    
+    return found;
 }
 
-/*! Removes a task from the queue (either the task has been successfully
- *  completed or aborted).
- *  @return the iSCSI task tag for the task that was just completed. */
-UInt32 iSCSITaskQueue::completeCurrentTask()
+/*! Lets the queue know that the SCSI layer timed out a task.  The HBA's
+ *  timeout handling is run on the work loop that the queue is attached to
+ *  (see iSCSIVirtualHBA::HandleTaskTimeout()), since the task's connection
+ *  is only ever modified on that work loop.
+ *  @param initiatorTaskTag the iSCSI task tag of the task that timed out. */
+void iSCSITaskQueue::timeoutTask(UInt32 initiatorTaskTag)
 {
-    UInt32 taskTag = 0;
-    iSCSITask * task = NULL;
+    iSCSITask * task = allocateTask();
+    
+    if(!task)
+        return;
+    
+    task->initiatorTaskTag = initiatorTaskTag;
     
-    // Do nothing if the queue is empty
-    if(queue_empty(&taskQueue))
-        return taskTag;
+    IOSimpleLockLock(queueLock);
+    queue_enter(&timeoutQueue,task,iSCSITask *,queueChain);
+    newTimeout = true;
+    IOSimpleLockUnlock(queueLock);
     
-    // Remove the completed task (at the head of the queue) and then
-    // move onto the next task if one exists
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    if(getWorkLoop())
+        signalWorkAvailable();
+}
 
-    queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
+/*! Lets the queue know that the target has advanced MaxCmdSN, so that
+ *  tasks that were waiting for the command window to open may be started. */
+void iSCSITaskQueue::signalCommandWindowOpen()
+{
+    if(!hasPendingTasks())
+        return;
+    
+    if(getWorkLoop())
+        signalWorkAvailable();
+}
 
-    if(task) {
-        taskTag = task->initiatorTaskTag;
-        IOFree(task,sizeof(iSCSITask));
+/*! Lets the queue know that data-out PDUs have been queued for a task
+ *  (see iSCSIVirtualHBA::QueueDataOutForTask()), so that they are sent
+ *  on the next pass. */
+void iSCSITaskQueue::signalDataOutPending()
+{
+    newDataOut = true;
+    if(getWorkLoop())
+        signalWorkAvailable();
+}
+
+/*! Gets the number of tasks that have been started but not completed.
+ *  @return the number of outstanding tasks. */
+UInt32 iSCSITaskQueue::getOutstandingTaskCount()
+{
+    return outstandingTaskCount;
+}
+
+/*! Gets the number of queue entries that have been allocated, both to
+ *  fill the pool and when the pool was empty.
+ *  @return the number of allocations. */
+UInt64 iSCSITaskQueue::getTaskPoolAllocationCount()
+{
+    return taskPoolAllocationCount;
+}
+
+/*! Gets the number of tasks that were queued while the pool was empty
+ *  (each of these allocated an entry on the submission path).
+ *  @return the number of pool misses. */
+UInt64 iSCSITaskQueue::getTaskPoolMissCount()
+{
+    return taskPoolMissCount;
+}
+
+/*! Gets the largest number of queue entries that were in use at once.
+ *  @return the high-water mark. */
+UInt32 iSCSITaskQueue::getTaskPoolHighWaterMark()
+{
+    return taskPoolHighWaterMark;
+}
+
+/*! Gets whether tasks have been queued that haven't been started.  May
+ *  be called from any context.
+ *  @return true if tasks are waiting to be started. */
+bool iSCSITaskQueue::hasPendingTasks()
+{
+    IOSimpleLockLock(queueLock);
+    
+    bool pending = !queue_empty(&headOfQueueLane) || !queue_empty(&simpleLane) || !queue_empty(&orderedLane) ||
+                   stagedTaskIndex < stagedTaskCount || !taskRing.isEmpty();
+    
+    IOSimpleLockUnlock(queueLock);
+    
+    return pending;
+}
+
+/*! Sorts the tasks taken from the ring into the lanes, as long as entries
+ *  are available (those that remain are sorted on the next pass). */
+void iSCSITaskQueue::sortStagedTasks()
+{
+    while(stagedTaskIndex < stagedTaskCount || !taskRing.isEmpty())
+    {
+        // Leave the task staged if no entry is available; we try again
+        // on the next pass
+        iSCSITask * task = allocateTask();
+        
+        if(!task)
+            break;
+        
+        IOSimpleLockLock(queueLock);
+        
+        // Take the next batch of tags from the ring once the last batch
+        // has been sorted (the connection may have been flushed meanwhile)
+        if(stagedTaskIndex == stagedTaskCount) {
+            stagedTaskIndex = 0;
+            stagedTaskCount = taskRing.dequeueBatch(stagedTasks,kTaskRingBatchSize);
+        }
+        
+        if(stagedTaskIndex == stagedTaskCount) {
+            releaseTask(task);
+            IOSimpleLockUnlock(queueLock);
+            break;
+        }
+        
+        task->initiatorTaskTag = stagedTasks[stagedTaskIndex++];
+        enterLane(task);
+        
+        IOSimpleLockUnlock(queueLock);
+    }
+}
+
+/*! Adds a task to the lane for its task attribute (the queue lock must be
+ *  held).
+ *  @param task the entry for the task. */
+void iSCSITaskQueue::enterLane(iSCSITask * task)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    iSCSITaskSlot * slot = hba->FindTaskSlot(session,task->initiatorTaskTag);
+    SCSIParallelTaskIdentifier parallelTask = slot ? slot->parallelTask : NULL;
+    
+    task->barrier = false;
+    task->immediate = !parallelTask;
+    
+    // Requests other than SCSI tasks are sent as immediate commands; tasks
+    // that are gone are started (and flushed) right away as well
+    if(!parallelTask) {
+        queue_enter(&headOfQueueLane,task,iSCSITask *,queueChain);
+        return;
     }
     
-    // If there are still tasks to process let the HBA know...
-    if(!queue_empty(&taskQueue)) {
-        newTask = true;
-        if(getWorkLoop())
-            signalWorkAvailable();
+    // The deadline is the SCSI layer's timeout for the task
+    UInt32 timeoutMs = hba->GetTimeoutDuration(parallelTask);
+    
+    if(timeoutMs == 0)
+        timeoutMs = iSCSIVirtualHBA::kiSCSITaskTimeoutMs;
+    
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_system_microtime(&secs,&usecs);
+    
+    task->deadlineUs = (UInt64)secs*1000000 + usecs + (UInt64)timeoutMs*1000;
+    
+    switch(hba->GetTaskAttribute(parallelTask))
+    {
+        case kSCSITask_HEAD_OF_QUEUE:
+        case kSCSITask_ACA:
+            queue_enter(&headOfQueueLane,task,iSCSITask *,queueChain);
+            break;
+        case kSCSITask_ORDERED:
+            task->barrier = true;
+            queue_enter(&orderedLane,task,iSCSITask *,queueChain);
+            break;
+        default:
+            // SIMPLE tasks may not pass an ORDERED task queued before them
+            if(!queue_empty(&orderedLane))
+                queue_enter(&orderedLane,task,iSCSITask *,queueChain);
+            else
+                enterSimpleLane(task);
+    };
+}
+
+/*! Adds a SIMPLE task to the SIMPLE lane, ahead of the tasks with later
+ *  deadlines (the queue lock must be held).
+ *  @param task the entry for the task. */
+void iSCSITaskQueue::enterSimpleLane(iSCSITask * task)
+{
+    // Most tasks have the same timeout, so deadlines mostly follow the order
+    // in which tasks are queued; search from the tail
+    iSCSITask * prevTask = (iSCSITask *)queue_last(&simpleLane);
+    
+    while(!queue_end(&simpleLane,(queue_entry_t)prevTask) && prevTask->deadlineUs > task->deadlineUs)
+        prevTask = (iSCSITask *)queue_prev(&prevTask->queueChain);
+    
+    if(queue_end(&simpleLane,(queue_entry_t)prevTask))
+        queue_enter_first(&simpleLane,task,iSCSITask *,queueChain);
+    else
+        queue_insert_after(&simpleLane,task,prevTask,iSCSITask *,queueChain);
+}
+
+/*! Removes the task that should be started next from the lanes (the
+ *  queue lock must be held).
+ *  @param commandWindowOpen whether the target's command window permits
+ *  another non-immediate command; if not, only immediate requests are
+ *  removed.
+ *  @return the task's entry, or NULL if no task may be started. */
+iSCSITask * iSCSITaskQueue::removeNextLaneTask(bool commandWindowOpen)
+{
+    iSCSITask * task = NULL;
+    
+    // Immediate requests (e.g., task management requests and NOP-outs)
+    // don't take a place in the command window
+    if(!commandWindowOpen)
+    {
+        queue_iterate(&headOfQueueLane,task,iSCSITask *,queueChain)
+        {
+            if(task->immediate) {
+                queue_remove(&headOfQueueLane,task,iSCSITask *,queueChain);
+                return task;
+            }
+        }
+        return NULL;
+    }
+    
+    if(!queue_empty(&headOfQueueLane)) {
+        queue_remove_first(&headOfQueueLane,task,iSCSITask *,queueChain);
+        return task;
     }
-    return taskTag;
+    
+    if(!queue_empty(&simpleLane)) {
+        queue_remove_first(&simpleLane,task,iSCSITask *,queueChain);
+        return task;
+    }
+    
+    if(queue_empty(&orderedLane))
+        return NULL;
+    
+    // Every task queued before the ORDERED task at the front of the lane
+    // has been started; the SIMPLE tasks queued behind it (up to the next
+    // ORDERED task) may be started after it
+    queue_remove_first(&orderedLane,task,iSCSITask *,queueChain);
+    
+    while(!queue_empty(&orderedLane))
+    {
+        iSCSITask * nextTask = (iSCSITask *)queue_first(&orderedLane);
+        
+        if(nextTask->barrier)
+            break;
+        
+        queue_remove_first(&orderedLane,nextTask,iSCSITask *,queueChain);
+        enterSimpleLane(nextTask);
+    }
+    
+    return task;
 }
 
+/*! Gets whether the target's command window permits another
+ *  non-immediate command to be sent. */
+bool iSCSITaskQueue::isCommandWindowOpen()
+{
+    // Commands may be sent while CmdSN <= MaxCmdSN (serial number
+    // arithmetic, RFC1982).  A window of MaxCmdSN = ExpCmdSN - 1 is closed.
+    return (SInt32)(session->maxCmdSN - session->cmdSN) >= 0;
+}
 
 bool iSCSITaskQueue::checkForWork()
 {
     if(!isEnabled())
         return false;
     
-    // Check task flag before proceeding
-    if(!newTask)
-        return false;
+    // Check task flags before proceeding (queued tasks are found in the
+    // ring itself, so that a flag can't be cleared after a task is queued)
+    bool newTask = hasPendingTasks();
     
-    newTask = false;
+    if(!newTask && !newDataOut && !newTimeout)
+        return false;
 
     // Validate action & owner, then call action on our owner & pass in socket
     // this function will continue processing the task
-    if(action && owner) {
- 
-        UInt32 taskTag;
+    if(!action || !owner)
+        return false;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    iSCSITask * task = NULL;
+    
+    // Handle tasks that the SCSI layer timed out
+    if(newTimeout)
+    {
+        IOSimpleLockLock(queueLock);
+        newTimeout = false;
         
-        if(!onThread())
-            OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+        while(!queue_empty(&timeoutQueue))
+        {
+            queue_remove_first(&timeoutQueue,task,iSCSITask *,queueChain);
+            
+            UInt32 taskTag = task->initiatorTaskTag;
+            releaseTask(task);
+            IOSimpleLockUnlock(queueLock);
+            
+            hba->HandleTaskTimeout(session,connection,taskTag);
+            
+            IOSimpleLockLock(queueLock);
+        }
+        IOSimpleLockUnlock(queueLock);
         
-        if(queue_empty(&taskQueue))
+        // The connection may have been deactivated
+        if(!isEnabled())
             return false;
-        
-        iSCSITask * task = (iSCSITask *)queue_first(&taskQueue);
-        taskTag = task->initiatorTaskTag;
-        
-        (*action)(owner,session,connection,taskTag);
     }
-   
-    // Tell workloop thread not to call us again until we signal again...
-	return false;
+    
+    // PDUs sent during this pass are gathered into the connection's
+    // transmit queue
+    hba->BeginTransmitBatch(connection);
+    
+    // Send a slice of the data-out PDUs that are waiting (for R2Ts and
+    // unsolicited data); the rest are sent on later passes, after received
+    // PDUs have had a chance to be processed
+    if(newDataOut)
+        newDataOut = hba->SendQueuedDataOut(session,connection);
+    
+    // Start as many tasks as the command window allows while their PDUs
+    // are being gathered into the connection's transmit queue; once the
+    // queue is flushed (or if transmit coalescing is disabled) stop here.
+    // Immediate requests are started even if the command window is closed;
+    // other tasks wait until we are signaled that a response has advanced
+    // MaxCmdSN.
+    bool startable = true;
+    
+    if(newTask)
+    {
+        do {
+            // Sort the tasks queued since the last task was started, so that
+            // a HEAD_OF_QUEUE task (or a SIMPLE task with an earlier
+            // deadline) passes those that are already waiting
+            sortStagedTasks();
+            
+            IOSimpleLockLock(queueLock);
+            
+            if(!(task = removeNextLaneTask(isCommandWindowOpen()))) {
+                IOSimpleLockUnlock(queueLock);
+                startable = false;
+                break;
+            }
+            
+            // Move the next task to the outstanding queue before starting it, so
+            // that a completion arriving during the action is matched correctly
+            UInt32 taskTag = task->initiatorTaskTag;
+            
+            queue_enter(&outstandingQueue,task,iSCSITask *,queueChain);
+            outstandingTaskCount++;
+            IOSimpleLockUnlock(queueLock);
+            
+            (*action)(owner,session,connection,taskTag);
+        }
+        while(hba->isTransmitQueuePending(connection));
+    }
+    
+    // Call again if the transmit queue was flushed before the tasks that
+    // can be started were; a task queued (or a command window opened)
+    // after this check signals the workloop again
+    newTask = startable && hasPendingTasks();
+    
+    // Top up the pool of queue entries now that the tasks have been started
+    if(taskPoolLow)
+        refillTaskPool();
+    
+    if(hba->EndTransmitBatch(session,connection))
+        return false;
+    
+    // If more tasks can be started or data-out PDUs remain, ask the workloop
+    // to call us again (this gives other event sources a chance to run
+    // between passes); otherwise don't call us again until we signal again
+    return newTask || newDataOut || newTimeout;
 }
 
 /*! Removes all tasks from the queue. */
@@ -158,17 +695,27 @@ void iSCSITaskQueue::clearTasksFromQueue()
     // Ensure the event source is disabled before proceeding...
     disable();
     
-    // Iterate over queue and clear all tasks (free memory for each task)
+    // Iterate over queue and clear all tasks (return each to the pool)
     iSCSITask * task = NULL;
     
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    UInt32 initiatorTaskTag;
+    
+    IOSimpleLockLock(queueLock);
+    
+    stagedTaskCount = stagedTaskIndex = 0;
+    
+    while(taskRing.dequeue(&initiatorTaskTag));
     
-    while(!queue_empty(&taskQueue))
+    while((task = removeNextLaneTask(true)))
+        releaseTask(task);
+    
+    while(!queue_empty(&outstandingQueue))
     {
-        queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
+        queue_remove_first(&outstandingQueue,task,iSCSITask *, queueChain);
         if(task)
-            IOFree(task,sizeof(iSCSITask));
+            releaseTask(task);
     }
+    outstandingTaskCount = 0;
+    
+    IOSimpleLockUnlock(queueLock);
 }
-
@@ -36,15 +36,32 @@
 #include "iSCSIKernelClasses.h"
 #include "iSCSITypesKernel.h"
 #include "iSCSIVirtualHBA.h"
+#include "iSCSITaskRing.h"
 
 struct iSCSITask;
 
 /*! Provides an iSCSI task queue for an iSCSI HBA.  The HBA queues tasks as
  *  it receives them from the SCSI layer by calling queueTask().
- *  This queue will invoke a callback function gated against
- *  the HBA workloop to process new tasks as existing tasks are completed.
- *  Once the task is processed, the HBA should call completeCurrentTask() to 
- *  let the queue know that the task has been processed. */
+ *  This queue will invoke a callback function gated against the HBA workloop
+ *  to begin processing queued tasks.  Tasks are started for as long as the
+ *  command window advertised by the target (MaxCmdSN - CmdSN) permits, so
+ *  that many tasks may be outstanding on a connection at any one time.
+ *  Once a task has been processed, the HBA should call completeTask() with
+ *  the task's initiator task tag to let the queue know that the task is done.
+ *  The queue also sends the connection's queued data-out PDUs, a slice at a
+ *  time, so that write data is interleaved with receive processing.  Tasks
+ *  may be queued from any thread (the queue need not be attached to the
+ *  HBA's work loop): their tags are carried to the work loop by a lock-free
+ *  ring (see iSCSITaskRing), which the work loop drains in batches.  Tasks
+ *  are not started in the order they were queued: the work loop sorts them
+ *  into lanes by task attribute.  HEAD_OF_QUEUE and ACA tasks, and
+ *  immediate requests (which are started even while the command window is
+ *  closed), are started first, SIMPLE tasks earliest deadline first, and an ORDERED task is a
+ *  barrier that is started only once every task queued before it has been
+ *  (tasks queued after it wait behind it).  Entries for queued and started
+ *  tasks are taken from a pool that is refilled by the workloop and that
+ *  keeps every entry it has allocated, so that no memory is allocated per
+ *  task once the pool has grown to the connection's peak load. */
 class iSCSITaskQueue : public IOEventSource
 {
     OSDeclareDefaultStructors(iSCSITaskQueue);
@@ -77,12 +94,60 @@ public:
     
     /*! Removes a task from the queue (either the task has been successfully
      *  completed or aborted).
-     *  @return the iSCSI task tag for the task that was just completed. */
-    UInt32 completeCurrentTask();
+     *  @param initiatorTaskTag the iSCSI task tag of the task to remove.
+     *  @return true if the task was found and removed from the queue. */
+    bool completeTask(UInt32 initiatorTaskTag);
+    
+    /*! Adds a task that was started on another connection to the queue's
+     *  outstanding tasks, without starting it (see
+     *  iSCSIVirtualHBA::ReassignConnectionTasks()).
+     *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
+    void adoptTask(UInt32 initiatorTaskTag);
+    
+    /*! Removes a task from the queue, whether or not it has been started
+     *  (started tasks are removed first).  Used to flush the queue when a
+     *  connection is deactivated.
+     *  @param initiatorTaskTag the iSCSI task tag of the removed task.
+     *  @return true if a task was removed, false if the queue was empty. */
+    bool removeNextTask(UInt32 * initiatorTaskTag);
+    
+    /*! Lets the queue know that the SCSI layer timed out a task.  The HBA's
+     *  timeout handling is run on the work loop that the queue is attached to
+     *  (see iSCSIVirtualHBA::HandleTaskTimeout()), since the task's connection
+     *  is only ever modified on that work loop.
+     *  @param initiatorTaskTag the iSCSI task tag of the task that timed out. */
+    void timeoutTask(UInt32 initiatorTaskTag);
     
     /*! Removes all tasks from the queue. */
     void clearTasksFromQueue();
     
+    /*! Lets the queue know that the target has advanced MaxCmdSN, so that
+     *  tasks that were waiting for the command window to open may be started. */
+    void signalCommandWindowOpen();
+    
+    /*! Lets the queue know that data-out PDUs have been queued for a task
+     *  (see iSCSIVirtualHBA::QueueDataOutForTask()), so that they are sent
+     *  on the next pass. */
+    void signalDataOutPending();
+    
+    /*! Gets the number of tasks that have been started but not completed.
+     *  @return the number of outstanding tasks. */
+    UInt32 getOutstandingTaskCount();
+    
+    /*! Gets the number of queue entries that have been allocated, both to
+     *  fill the pool and when the pool was empty.
+     *  @return the number of allocations. */
+    UInt64 getTaskPoolAllocationCount();
+    
+    /*! Gets the number of tasks that were queued while the pool was empty
+     *  (each of these allocated an entry on the submission path).
+     *  @return the number of pool misses. */
+    UInt64 getTaskPoolMissCount();
+    
+    /*! Gets the largest number of queue entries that were in use at once.
+     *  @return the high-water mark. */
+    UInt32 getTaskPoolHighWaterMark();
+    
 protected:
     
     /*! Called by the attached work loop to check if there is any processing
@@ -90,18 +155,136 @@ protected:
 	 *	to by this object.
 	 *	@return true if there was work, false otherwise. */
 	virtual bool checkForWork();
+    
+    /*! Frees the queue's entries, including those in the pool. */
+    virtual void free();
 
 private:
     
+    /*! Number of free entries the pool is kept filled to. */
+    static const UInt32 kTaskPoolReserve;
+    
+    /*! Number of tags removed from the submission ring at a time. */
+    static const UInt32 kTaskRingBatchSize;
+    
+    /*! Gets whether tasks have been queued that haven't been started.  May
+     *  be called from any context.
+     *  @return true if tasks are waiting to be started. */
+    bool hasPendingTasks();
+    
+    /*! Takes an entry from the pool, allocating one if the pool is empty.
+     *  @return the entry, or NULL if memory could not be allocated. */
+    iSCSITask * allocateTask();
+    
+    /*! Returns an entry to the pool (the queue lock must be held).
+     *  @param task the entry to return. */
+    void releaseTask(iSCSITask * task);
+    
+    /*! Allocates entries until the pool holds kTaskPoolReserve free entries. */
+    void refillTaskPool();
+    
+    /*! Sorts the tasks taken from the ring into the lanes, as long as entries
+     *  are available (those that remain are sorted on the next pass). */
+    void sortStagedTasks();
+    
+    /*! Adds a task to the lane for its task attribute (the queue lock must
+     *  be held).
+     *  @param task the entry for the task. */
+    void enterLane(iSCSITask * task);
+    
+    /*! Adds a SIMPLE task to the SIMPLE lane, ahead of the tasks with later
+     *  deadlines (the queue lock must be held).
+     *  @param task the entry for the task. */
+    void enterSimpleLane(iSCSITask * task);
+    
+    /*! Removes the task that should be started next from the lanes (the
+     *  queue lock must be held).
+     *  @param commandWindowOpen whether the target's command window permits
+     *  another non-immediate command; if not, only immediate requests are
+     *  removed.
+     *  @return the task's entry, or NULL if no task may be started. */
+    iSCSITask * removeNextLaneTask(bool commandWindowOpen);
+    
+    /*! Gets whether the target's command window permits another
+     *  non-immediate command to be sent. */
+    bool isCommandWindowOpen();
+    
     /*! The iSCSI session associated with this event source. */
     iSCSISession * session;
     
     /*! The iSCSI connection associated with this event source. */
     iSCSIConnection * connection;
     
-    queue_head_t taskQueue;
+    /*! Tags of tasks that have been queued but not yet started. */
+    iSCSITaskRing taskRing;
+    
+    /*! Tags removed from the ring that haven't been sorted into the lanes
+     *  yet (no entry was available). */
+    UInt32 * stagedTasks;
+    
+    /*! Number of tags in stagedTasks. */
+    UInt32 stagedTaskCount;
+    
+    /*! Index of the next tag in stagedTasks to start. */
+    UInt32 stagedTaskIndex;
+    
+    /*! HEAD_OF_QUEUE and ACA tasks, and requests other than SCSI tasks
+     *  (NOP-outs, task management and text requests), in the order they
+     *  were queued. */
+    queue_head_t headOfQueueLane;
+    
+    /*! SIMPLE tasks that may be started, earliest deadline first. */
+    queue_head_t simpleLane;
+    
+    /*! ORDERED tasks that wait for the tasks queued before them to be
+     *  started, and the SIMPLE tasks queued behind them, in the order they
+     *  were queued. */
+    queue_head_t orderedLane;
+    
+    /*! Tasks that have been started and are awaiting completion. */
+    queue_head_t outstandingQueue;
+    
+    /*! Tasks that the SCSI layer timed out, awaiting the HBA's handling. */
+    queue_head_t timeoutQueue;
+    
+    /*! Protects the lanes, the staged tags and the ring's consumer side,
+     *  as well as the outstanding and timeout queues and the pool.  Tasks
+     *  are sorted and started on the work loop that the queue is attached
+     *  to, but completions and timeouts arrive on other work loops, and
+     *  removeNextTask() is called wherever a connection is deactivated;
+     *  every change to these is made with the lock held. */
+    IOSimpleLock * queueLock;
+    
+    /*! Number of tasks in the outstanding queue. */
+    UInt32 outstandingTaskCount;
+    
+    /*! Flag that indicates if data-out PDUs are waiting to be sent. */
+    bool newDataOut;
+    
+    /*! Flag that indicates if timed out tasks are waiting to be handled. */
+    bool newTimeout;
+    
+    /*! Free queue entries. */
+    queue_head_t taskPool;
+    
+    /*! Number of entries in the pool. */
+    UInt32 taskPoolCount;
+    
+    /*! Number of entries in the lanes and the outstanding and timeout
+     *  queues. */
+    UInt32 tasksInUse;
+    
+    /*! Largest number of entries that were in use at once. */
+    UInt32 taskPoolHighWaterMark;
+    
+    /*! Number of entries that have been allocated. */
+    UInt64 taskPoolAllocationCount;
+    
+    /*! Number of entries allocated because the pool was empty. */
+    UInt64 taskPoolMissCount;
     
-    bool newTask;
+    /*! Flag that indicates if the pool should be refilled. */
+    bool taskPoolLow;
     
 };
 
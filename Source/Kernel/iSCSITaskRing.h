@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_TASK_RING_H__
+#define __ISCSI_TASK_RING_H__
+
+#include <IOKit/IOLib.h>
+
+/*! A bounded, lock-free ring of initiator task tags.  Any number of threads
+ *  may add tags (enqueue()) while a single consumer removes them, in the
+ *  order in which they were added, one at a time or in batches
+ *  (dequeueBatch()).  Each cell carries a sequence number that tells
+ *  producers when the cell is free and the consumer when it holds a tag, so
+ *  that neither side ever waits on the other.  Producers claim a cell by
+ *  advancing the enqueue position with a compare-and-swap and publish the
+ *  tag with a release store of the cell's sequence number; the consumer
+ *  reads the sequence number with an acquire load before reading the tag.
+ *
+ *  A tag that has been claimed but not yet published hides the tags behind
+ *  it from the consumer, so producers must wake the consumer after
+ *  enqueue() returns (never before) for no tag to be left in the ring.
+ *
+ *  Besides the compiler's atomic builtins the ring depends only on IOMalloc()
+ *  and IOFree(), so that it can be built into a host-side test (see
+ *  Tests/task_ring_stress.cpp). */
+class iSCSITaskRing
+{
+public:
+    
+    /*! Allocates the ring's cells.
+     *  @param capacity the number of tags the ring holds (a power of two).
+     *  @return true if the ring was allocated. */
+    bool init(UInt32 capacity)
+    {
+        cells = NULL;
+        mask = 0;
+        enqueuePosition = 0;
+        dequeuePosition = 0;
+        
+        if(capacity < 2 || (capacity & (capacity - 1)))
+            return false;
+        
+        if(!(cells = (iSCSITaskRingCell *)IOMalloc(capacity*sizeof(iSCSITaskRingCell))))
+            return false;
+        
+        // A cell whose sequence number equals the enqueue position is free
+        for(UInt32 index = 0; index < capacity; index++) {
+            cells[index].sequence = index;
+            cells[index].initiatorTaskTag = 0;
+        }
+        
+        mask = capacity - 1;
+        return true;
+    }
+    
+    /*! Frees the ring's cells. */
+    void free()
+    {
+        if(cells)
+            IOFree(cells,(mask + 1)*sizeof(iSCSITaskRingCell));
+        cells = NULL;
+    }
+    
+    /*! Adds a tag to the ring.  May be called from any thread.
+     *  @param initiatorTaskTag the tag to add.
+     *  @return true if the tag was added, false if the ring was full. */
+    bool enqueue(UInt32 initiatorTaskTag)
+    {
+        iSCSITaskRingCell * cell;
+        UInt32 position = __atomic_load_n(&enqueuePosition,__ATOMIC_RELAXED);
+        
+        while(true)
+        {
+            cell = &cells[position & mask];
+            SInt32 difference = (SInt32)(__atomic_load_n(&cell->sequence,__ATOMIC_ACQUIRE) - position);
+            
+            // The cell is free; try to claim it (on failure position is
+            // reloaded with the current enqueue position)
+            if(difference == 0) {
+                if(__atomic_compare_exchange_n(&enqueuePosition,&position,position + 1,true,
+                                               __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                    break;
+            }
+            // The consumer hasn't removed the tag a full lap behind us
+            else if(difference < 0)
+                return false;
+            // Another producer claimed the cell first
+            else
+                position = __atomic_load_n(&enqueuePosition,__ATOMIC_RELAXED);
+        }
+        
+        cell->initiatorTaskTag = initiatorTaskTag;
+        __atomic_store_n(&cell->sequence,position + 1,__ATOMIC_RELEASE);
+        return true;
+    }
+    
+    /*! Removes up to a number of tags from the ring, oldest first.  Must only
+     *  be called by the consumer.
+     *  @param initiatorTaskTags array that receives the tags.
+     *  @param maxTags the size of the array.
+     *  @return the number of tags removed. */
+    UInt32 dequeueBatch(UInt32 * initiatorTaskTags,UInt32 maxTags)
+    {
+        UInt32 position = dequeuePosition;
+        UInt32 count = 0;
+        
+        while(count < maxTags)
+        {
+            iSCSITaskRingCell * cell = &cells[position & mask];
+            
+            // Stop at the first cell that hasn't been published
+            if(__atomic_load_n(&cell->sequence,__ATOMIC_ACQUIRE) != position + 1)
+                break;
+            
+            initiatorTaskTags[count++] = cell->initiatorTaskTag;
+            
+            // Hand the cell back to producers for their next lap
+            __atomic_store_n(&cell->sequence,position + mask + 1,__ATOMIC_RELEASE);
+            position++;
+        }
+        
+        __atomic_store_n(&dequeuePosition,position,__ATOMIC_RELAXED);
+        return count;
+    }
+    
+    /*! Removes the oldest tag from the ring.  Must only be called by the
+     *  consumer.
+     *  @param initiatorTaskTag the tag removed.
+     *  @return true if a tag was removed, false if the ring was empty. */
+    bool dequeue(UInt32 * initiatorTaskTag)
+    {
+        return dequeueBatch(initiatorTaskTag,1) == 1;
+    }
+    
+    /*! Gets whether the consumer's next tag has been published.  Exact when
+     *  called by the consumer; any other thread gets a snapshot.
+     *  @return true if the ring holds no tag that can be removed. */
+    bool isEmpty()
+    {
+        UInt32 position = __atomic_load_n(&dequeuePosition,__ATOMIC_RELAXED);
+        return __atomic_load_n(&cells[position & mask].sequence,__ATOMIC_ACQUIRE) != position + 1;
+    }
+    
+private:
+    
+    /*! A cell of the ring. */
+    struct iSCSITaskRingCell {
+        
+        /*! Position of the lap in which the cell may next be claimed (if
+         *  equal to the enqueue position) or read (if one more than the
+         *  dequeue position). */
+        UInt32 sequence;
+        
+        /*! The tag held by the cell. */
+        UInt32 initiatorTaskTag;
+    };
+    
+    /*! The ring's cells. */
+    iSCSITaskRingCell * cells;
+    
+    /*! Capacity of the ring minus one (positions wrap with the mask). */
+    UInt32 mask;
+    
+    /*! Next position that a producer claims.  Kept on its own cache line
+     *  so that producers don't contend with the consumer. */
+    UInt32 enqueuePosition __attribute__((aligned(64)));
+    
+    /*! Next position that the consumer reads (written only by the consumer). */
+    UInt32 dequeuePosition __attribute__((aligned(64)));
+};
+
+#endif /* defined(__ISCSI_TASK_RING_H__) */
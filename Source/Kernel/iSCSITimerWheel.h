@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_TIMER_WHEEL_H__
+#define __ISCSI_TIMER_WHEEL_H__
+
+#include <IOKit/IOLib.h>
+
+/*! A timer tracked by an iSCSITimerWheel.  Timers are embedded in the
+ *  objects they time (see iSCSITaskSlot), so that arming and canceling a
+ *  timer never allocates memory. */
+typedef struct iSCSITimerWheelEntry {
+    
+    /*! Next timer in the same bucket (or in the list of expired timers). */
+    struct iSCSITimerWheelEntry * next;
+    
+    /*! Previous timer in the same bucket (or in the list of expired timers). */
+    struct iSCSITimerWheelEntry * prev;
+    
+    /*! The list that holds the timer. */
+    struct iSCSITimerWheelEntry * * list;
+    
+    /*! Tick at which the timer expires. */
+    UInt64 expiryTick;
+    
+    /*! Initiator task tag of the task that the timer belongs to. */
+    UInt32 initiatorTaskTag;
+    
+    /*! Flag that indicates if the timer is in the wheel or in the list of
+     *  expired timers. */
+    bool armed;
+    
+} iSCSITimerWheelEntry;
+
+/*! A hierarchical timer wheel.  Timers that expire within the next
+ *  kSlotsPerLevel ticks are kept in the first level, one bucket per tick;
+ *  each higher level has buckets that cover kSlotsPerLevel times as many
+ *  ticks as the level below.  Arming and canceling a timer take constant
+ *  time, whatever the number of timers.  As the wheel advances, the
+ *  timers in a bucket of a higher level are moved down a level once the
+ *  first level wraps around to the ticks that the bucket covers.
+ *
+ *  The wheel doesn't keep time or lock itself: the owner advances it to
+ *  the current tick (see advance()), takes the timers that have expired
+ *  (see nextExpired()) and serializes access.  Besides the tick arithmetic
+ *  the wheel depends on nothing, so that it can be built into a host-side
+ *  test. */
+class iSCSITimerWheel
+{
+public:
+    
+    /*! Number of buckets in each level of the wheel. */
+    static const UInt32 kSlotsPerLevel = 64;
+    
+    /*! Number of bits of a tick that select a bucket within a level. */
+    static const UInt32 kSlotBits = 6;
+    
+    /*! Number of levels in the wheel. */
+    static const UInt32 kLevels = 3;
+    
+    /*! Number of ticks covered by the wheel; later expiries are clamped. */
+    static const UInt64 kMaxTicks = (1ULL << (kSlotBits*kLevels)) - 1;
+    
+    /*! Resets the wheel so that it holds no timers.
+     *  @param currentTick the current tick. */
+    void init(UInt64 currentTick)
+    {
+        for(UInt32 level = 0; level < kLevels; level++)
+            for(UInt32 slot = 0; slot < kSlotsPerLevel; slot++)
+                buckets[level][slot] = NULL;
+        
+        expired = NULL;
+        expiredTail = NULL;
+        expiredCount = 0;
+        armedCount = 0;
+        wheelTick = currentTick;
+    }
+    
+    /*! Arms a timer, or moves it if it was already armed.
+     *  @param entry the timer.
+     *  @param expiryTick the tick at which the timer expires.
+     *  @param currentTick the current tick. */
+    void arm(iSCSITimerWheelEntry * entry,UInt64 expiryTick,UInt64 currentTick)
+    {
+        cancel(entry);
+        
+        // An idle wheel is brought up to date without walking the ticks
+        // that went by
+        if(armedCount == 0)
+            wheelTick = currentTick;
+        
+        // Timers that are due expire on the next tick
+        if(expiryTick <= wheelTick)
+            expiryTick = wheelTick + 1;
+        
+        if(expiryTick - wheelTick > kMaxTicks)
+            expiryTick = wheelTick + kMaxTicks;
+        
+        entry->expiryTick = expiryTick;
+        entry->armed = true;
+        armedCount++;
+        
+        insert(entry);
+    }
+    
+    /*! Cancels a timer (has no effect if the timer isn't armed).
+     *  @param entry the timer. */
+    void cancel(iSCSITimerWheelEntry * entry)
+    {
+        if(!entry->armed)
+            return;
+        
+        if(entry->prev)
+            entry->prev->next = entry->next;
+        else
+            *entry->list = entry->next;
+        
+        if(entry->next)
+            entry->next->prev = entry->prev;
+        
+        if(entry->list == &expired) {
+            if(!entry->next)
+                expiredTail = entry->prev;
+            expiredCount--;
+        }
+        
+        entry->next = entry->prev = NULL;
+        entry->list = NULL;
+        entry->armed = false;
+        armedCount--;
+    }
+    
+    /*! Advances the wheel to the current tick.  Timers that have expired
+     *  are moved to the list of expired timers, oldest tick first.
+     *  @param currentTick the current tick. */
+    void advance(UInt64 currentTick)
+    {
+        while(wheelTick < currentTick && armedCount > expiredCount)
+        {
+            wheelTick++;
+            
+            // Move timers down from the higher levels when the level below
+            // wraps around
+            UInt64 tick = wheelTick;
+            
+            for(UInt32 level = 1; level < kLevels; level++)
+            {
+                if(tick & (kSlotsPerLevel - 1))
+                    break;
+                
+                tick >>= kSlotBits;
+                cascade(level,(UInt32)(tick & (kSlotsPerLevel - 1)));
+            }
+            
+            // Expire the timers in the bucket for this tick
+            iSCSITimerWheelEntry ** bucket = &buckets[0][wheelTick & (kSlotsPerLevel - 1)];
+            
+            while(*bucket)
+            {
+                iSCSITimerWheelEntry * entry = *bucket;
+                *bucket = entry->next;
+                
+                entry->list = &expired;
+                entry->prev = expiredTail;
+                entry->next = NULL;
+                
+                if(expiredTail)
+                    expiredTail->next = entry;
+                else
+                    expired = entry;
+                
+                expiredTail = entry;
+                expiredCount++;
+            }
+        }
+        
+        // Nothing is left to expire; skip ahead
+        if(armedCount == expiredCount)
+            wheelTick = currentTick;
+    }
+    
+    /*! Takes the next timer from the list of expired timers.  The timer is
+     *  no longer armed once it has been taken.
+     *  @return the timer, or NULL if no timers have expired. */
+    iSCSITimerWheelEntry * nextExpired()
+    {
+        iSCSITimerWheelEntry * entry = expired;
+        
+        if(entry)
+            cancel(entry);
+        
+        return entry;
+    }
+    
+    /*! Gets the number of ticks until the wheel must next be advanced: the
+     *  first tick whose bucket holds a timer, or the next time the first
+     *  level wraps around (when timers may be moved down to it).
+     *  @return the number of ticks from the wheel's current tick, or 0 if
+     *  no timers are armed. */
+    UInt64 ticksUntilNextExpiry()
+    {
+        if(armedCount == expiredCount)
+            return 0;
+        
+        for(UInt64 delta = 1; delta <= kSlotsPerLevel; delta++)
+        {
+            UInt64 tick = wheelTick + delta;
+            
+            if(buckets[0][tick & (kSlotsPerLevel - 1)] || !(tick & (kSlotsPerLevel - 1)))
+                return delta;
+        }
+        return kSlotsPerLevel;
+    }
+    
+    /*! Gets the tick that the wheel has been advanced to.
+     *  @return the tick. */
+    UInt64 getTick()
+    {
+        return wheelTick;
+    }
+    
+    /*! Gets the number of timers that are armed, including those that
+     *  have expired but haven't been taken.
+     *  @return the number of timers. */
+    UInt32 getArmedCount()
+    {
+        return armedCount;
+    }
+    
+private:
+    
+    /*! Adds an armed timer to the bucket that its expiry tick falls in,
+     *  relative to the wheel's current tick (the expiry tick may equal the
+     *  current tick while timers are moved down the wheel). */
+    void insert(iSCSITimerWheelEntry * entry)
+    {
+        UInt64 delta = entry->expiryTick - wheelTick;
+        UInt32 level;
+        
+        for(level = 0; level < kLevels - 1; level++)
+            if(delta < (1ULL << (kSlotBits*(level + 1))))
+                break;
+        
+        UInt32 slot = (UInt32)((entry->expiryTick >> (kSlotBits*level)) & (kSlotsPerLevel - 1));
+        iSCSITimerWheelEntry ** head = &buckets[level][slot];
+        
+        entry->list = head;
+        entry->prev = NULL;
+        entry->next = *head;
+        
+        if(*head)
+            (*head)->prev = entry;
+        
+        *head = entry;
+    }
+    
+    /*! Moves the timers in a bucket of a higher level down the wheel. */
+    void cascade(UInt32 level,UInt32 slot)
+    {
+        iSCSITimerWheelEntry * entry = buckets[level][slot];
+        buckets[level][slot] = NULL;
+        
+        while(entry)
+        {
+            iSCSITimerWheelEntry * next = entry->next;
+            insert(entry);
+            entry = next;
+        }
+    }
+    
+    /*! Buckets of timers, by level. */
+    iSCSITimerWheelEntry * buckets[kLevels][kSlotsPerLevel];
+    
+    /*! Timers that have expired but haven't been taken, oldest first. */
+    iSCSITimerWheelEntry * expired;
+    
+    /*! Last timer in the list of expired timers. */
+    iSCSITimerWheelEntry * expiredTail;
+    
+    /*! Number of timers in the list of expired timers. */
+    UInt32 expiredCount;
+    
+    /*! Number of timers that are armed. */
+    UInt32 armedCount;
+    
+    /*! Tick that the wheel has been advanced to. */
+    UInt64 wheelTick;
+};
+
+#endif /* defined(__ISCSI_TIMER_WHEEL_H__) */
@@ -31,11 +31,19 @@
 
 
 #include <IOKit/IOLib.h>
+#include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
 #include <sys/socket.h>
+#include <kern/queue.h>
 
 #include "iSCSITypesShared.h"
+#include "iSCSIHBATypes.h"
+#include "iSCSIPDUKernel.h"
+#include "iSCSITimerWheel.h"
 
 class iSCSITaskQueue;
+class IOMemoryMap;
+class IOWorkLoop;
+class IOTimerEventSource;
 class iSCSIIOEventSource;
 
 /*! Definition of a single connection that is associated with a particular
@@ -83,14 +91,6 @@ typedef struct iSCSIConnection {
      *  is a session option while the latter is a connection option. */
     UInt32 immediateDataLength;
     
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (seconds component). */
-    clock_sec_t taskStartTimeSec;
-    
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (microseconds component). */
-    clock_usec_t taskStartTimeUSec;
-    
     /*! Keeps track of the iSCSI data transfer rate of this connection,
      *  in units of bytes per second.  This number is obtained by averaging
      *  over 5 tasks. */
@@ -105,8 +105,54 @@ typedef struct iSCSIConnection {
     /*! Keeps track of the index in the above array should be populated next. */
     UInt8 bytesPerSecHistoryIdx;
     
-    /*! Keeps track of the connection latency (ms). */
-    UInt32 latency_ms;
+    /*! Smoothed round-trip time of the connection, measured with NOP-outs
+     *  (us, zero until the first measurement). */
+    UInt32 smoothedRTTUs;
+    
+    /*! Mean deviation of the round-trip time (us). */
+    UInt32 RTTVarianceUs;
+    
+    /*! Number of round-trip times measured. */
+    UInt64 RTTSampleCount;
+    
+    /*! Smoothed time the target takes to send the first R2T of a write,
+     *  less the time spent sending the write's unsolicited data (us, zero
+     *  until the first measurement). */
+    UInt32 smoothedR2TLatencyUs;
+    
+    /*! Interval between NOP-outs that measure the round-trip time and
+     *  check that the connection is alive (ms, zero disables). */
+    UInt32 pingIntervalMs;
+    
+    /*! Timer that sends the NOP-outs, attached to the session's work loop. */
+    IOTimerEventSource * pingTimerEventSource;
+    
+    /*! Size to set the socket send and receive buffers to (bytes), or zero
+     *  to leave them to the system and only grow them to fit the
+     *  connection's bandwidth-delay product (see
+     *  iSCSIVirtualHBA::ResizeSocketBuffers()). */
+    UInt32 socketBufferSize;
+    
+    /*! Explicit socket buffer size that was last applied to the socket
+     *  (bytes), or zero if none was. */
+    UInt32 socketBufferSizeApplied;
+    
+    /*! Largest size that the socket buffers are grown to from the
+     *  connection's bandwidth-delay product (bytes). */
+    UInt32 socketBufferLimit;
+    
+    /*! Latency statistics of the tasks completed on this connection (see
+     *  iSCSIVirtualHBA::RecordTaskStatistics()). */
+    iSCSIHBALatencyStatistics latencyStats;
+    
+    /*! Flag that indicates if a NOP-out is outstanding on the connection
+     *  (sent periodically, or because a task missed its deadline). */
+    bool livenessProbePending;
+    
+    /*! Flag that indicates if a text request that renegotiates the
+     *  connection's MaxRecvDataSegmentLength is outstanding (only one text
+     *  negotiation may be in progress on a connection). */
+    bool textNegotiationPending;
     
     //////////////////// Configured Connection Parameters /////////////////////
     
@@ -133,11 +179,308 @@ typedef struct iSCSIConnection {
     
     /*! Maximum data segment length initiator can receive. */
     UInt32 maxRecvDataSegmentLength;
+    
+    /*! Bounce buffer used to receive data segments that cannot be received
+     *  directly into a task's data buffer (sized to hold one data segment
+     *  of maxRecvDataSegmentLength bytes). */
+    UInt8 * dataRecvBuffer;
+    
+    /*! Size of the bounce buffer, in bytes. */
+    UInt32 dataRecvBufferSize;
+    
+    /*! Bounce buffer used to send data segments from task data buffers
+     *  that cannot be mapped (sized to hold one data segment of
+     *  maxSendDataSegmentLength bytes). */
+    UInt8 * dataSendBuffer;
+    
+    /*! Size of the send bounce buffer, in bytes. */
+    UInt32 dataSendBufferSize;
+    
+    /*! State of the PDU that is being received on this connection; PDUs are
+     *  received in pieces as data arrives at the socket. */
+    iSCSIPDU::iSCSIPDURecvContext recvContext;
+    
+    /*! Staging buffer that socket data is received into in large chunks, so
+     *  that many small PDUs can be taken from a single receive (large data
+     *  segments are received directly and bypass this buffer). */
+    UInt8 * recvBuffer;
+    
+    /*! Size of the staging buffer, in bytes. */
+    UInt32 recvBufferSize;
+    
+    /*! Offset of the first staged byte that has not been processed. */
+    UInt32 recvBufferOffset;
+    
+    /*! Number of bytes in the staging buffer. */
+    UInt32 recvBufferLength;
+    
+    /*! Number of times the connection was woken up to receive data. */
+    UInt64 recvWakeupCount;
+    
+    /*! Number of PDUs received in the full feature phase. */
+    UInt64 recvPDUCount;
+    
+    /*! Number of socket receive calls that returned data. */
+    UInt64 recvCallCount;
+    
+    /*! Number of bytes returned by socket receive calls. */
+    UInt64 recvByteCount;
+
+    /*! Transmit queue.  While a batch is open (see BeginTransmitBatch()),
+     *  PDUs are copied into this buffer and sent together with a single
+     *  socket call when the batch is flushed. */
+    UInt8 * txBuffer;
+
+    /*! Size of the transmit queue, in bytes. */
+    UInt32 txBufferSize;
+
+    /*! Number of bytes in the transmit queue. */
+    UInt32 txBufferLength;
 
+    /*! Number of PDUs in the transmit queue. */
+    UInt32 txQueuedPDUs;
+
+    /*! Flag that indicates if PDUs are being gathered into the queue. */
+    bool txBatchOpen;
+
+    /*! When the oldest PDU in the transmit queue was queued, as represented
+     *  by the system uptime (seconds component). */
+    clock_sec_t txQueueStartSec;
+
+    /*! When the oldest PDU in the transmit queue was queued, as represented
+     *  by the system uptime (microseconds component). */
+    clock_usec_t txQueueStartUSec;
+
+    /*! The transmit queue is flushed once it holds this many bytes (zero
+     *  disables transmit coalescing). */
+    UInt32 txFlushBytes;
+
+    /*! The transmit queue is flushed once its oldest PDU has waited this
+     *  many microseconds. */
+    UInt32 txFlushLatencyUs;
+
+    /*! Number of PDUs sent in the full feature phase. */
+    UInt64 sendPDUCount;
+
+    /*! Number of socket send calls made in the full feature phase. */
+    UInt64 sendCallCount;
+
+    /*! Number of bytes sent in the full feature phase. */
+    UInt64 sendByteCount;
     
+    /*! Tasks that have data-out sequences waiting to be sent (see
+     *  iSCSIHBATaskData).  Tasks take turns sending a data-out PDU. */
+    queue_head_t dataOutQueue;
+
+
 } iSCSIConnection;
 
 
+/*! A sequence of data-out PDUs to be sent for a task, either solicited by
+ *  an R2T or unsolicited. */
+typedef struct iSCSIHBADataOutSequence {
+    
+    /*! Target transfer tag of the R2T (reserved for unsolicited data). */
+    UInt32 targetTransferTag;
+    
+    /*! Offset of the next byte to send. */
+    UInt32 dataOffset;
+    
+    /*! Number of bytes left to send. */
+    UInt32 dataLength;
+    
+    /*! Data sequence number of the next data-out PDU. */
+    UInt32 dataSN;
+    
+} iSCSIHBADataOutSequence;
+
+
+/*! Stages of moving a task to another connection after the connection it
+ *  was sent on failed (error recovery level 2). */
+enum iSCSITaskReassignStates {
+    
+    /*! The task is not being moved. */
+    kiSCSITaskReassignNone = 0,
+    
+    /*! Waiting for the failed connection to be logged out. */
+    kiSCSITaskReassignWaitingForLogout = 1,
+    
+    /*! Waiting for a task slot to send the TASK REASSIGN request in. */
+    kiSCSITaskReassignWaitingForRequest = 2,
+    
+    /*! The TASK REASSIGN request has been queued. */
+    kiSCSITaskReassignRequested = 3
+};
+
+
+/*! HBA-specific data that is stored with every SCSI parallel task (see
+ *  ReportHBASpecificTaskDataSize() and GetHBADataPointer()). */
+typedef struct iSCSIHBATaskData {
+    
+    /*! The connection that the task was assigned to. */
+    ConnectionIdentifier connectionId;
+    
+    /*! Keeps track of when processing began for the task, as represented
+     *  by the system uptime (seconds component). */
+    clock_sec_t startTimeSec;
+    
+    /*! Keeps track of when processing began for the task, as represented
+     *  by the system uptime (microseconds component). */
+    clock_usec_t startTimeUSec;
+    
+    /*! Kernel mapping of the task's data buffer, used to transfer PDU data
+     *  segments without an intermediate copy (NULL if not mapped). */
+    IOMemoryMap * dataMap;
+    
+    /*! The iSCSI initiator task tag of the task. */
+    UInt32 initiatorTaskTag;
+    
+    /*! LUN field for data-out PDUs sent for the task. */
+    UInt64 LUN;
+    
+    /*! Links the task into its connection's data-out queue. */
+    queue_chain_t dataOutChain;
+    
+    /*! Flag that indicates if the task is in its connection's data-out queue. */
+    bool dataOutQueued;
+    
+    /*! Size of the data-out sequence queue (one sequence per outstanding
+     *  R2T, plus unsolicited data). */
+    static const UInt8 kMaxDataOutSequences = kiSCSIMaxOutstandingR2T + 1;
+    
+    /*! Data-out sequences waiting to be sent, in the order they are sent. */
+    iSCSIHBADataOutSequence dataOutSequences[kMaxDataOutSequences];
+    
+    /*! Index of the sequence that is being sent. */
+    UInt8 dataOutHead;
+    
+    /*! Number of sequences waiting to be sent. */
+    UInt8 dataOutCount;
+    
+    /*! Number of bytes queued as unsolicited data-out PDUs when the task
+     *  began. */
+    UInt32 unsolicitedDataLength;
+    
+    /*! Flag that indicates if the time the target took to send the task's
+     *  first R2T was measured (see
+     *  iSCSIVirtualHBA::UpdateConnectionR2TLatency()). */
+    bool R2TLatencySampled;
+    
+    /*! DataSN (or R2TSN) of the next data-in PDU (or R2T) expected for the
+     *  task; data-in PDUs and R2Ts share a sequence (error recovery level 1
+     *  and above). */
+    UInt32 expDataSN;
+    
+    /*! Number of data-in PDUs and R2Ts that were requested again with a
+     *  SNACK and have not arrived yet. */
+    UInt32 missingDataPDUs;
+    
+    /*! Flag that indicates if the task's status arrived while PDUs were
+     *  missing; the task is completed once they arrive. */
+    bool completionPending;
+    
+    /*! Status of the task, if completion is pending. */
+    SCSITaskStatus pendingTaskStatus;
+    
+    /*! Service response of the task, if completion is pending. */
+    SCSIServiceResponse pendingServiceResponse;
+    
+    /*! Flag that indicates if the target asked for data-in PDUs to be
+     *  acknowledged while PDUs were missing; the acknowledgement is sent
+     *  once they arrive. */
+    bool dataACKPending;
+    
+    /*! Target transfer tag of the data-in PDU to acknowledge. */
+    UInt32 dataACKTargetTransferTag;
+    
+    /*! LUN field of the data-in PDU to acknowledge. */
+    UInt64 dataACKLUN;
+    
+    /*! DataSN of the PDU that follows the last PDU to acknowledge. */
+    UInt32 dataACKBegRun;
+    
+    /*! Stage of moving the task to another connection (see
+     *  iSCSITaskReassignStates). */
+    UInt8 reassignState;
+    
+    /*! The connection that failed while the task was outstanding on it
+     *  (valid while the task is being moved). */
+    ConnectionIdentifier failedConnectionId;
+    
+} iSCSIHBATaskData;
+
+
+/*! Lists of free task slots.  A range of slots is reserved for latency
+ *  measurements and task management requests, so that these can be sent
+ *  even when SCSI tasks occupy every other slot. */
+enum iSCSITaskSlotPools {
+    
+    /*! Slots used by SCSI tasks. */
+    kiSCSITaskSlotPoolSCSI = 0,
+    
+    /*! Slots reserved for latency measurements and task management. */
+    kiSCSITaskSlotPoolReserved = 1,
+    
+    /*! Number of slot lists. */
+    kiSCSITaskSlotPoolCount = 2
+};
+
+/*! An entry in a session's table of tasks, indexed by the slot number that
+ *  makes up the low bits of each task's initiator task tag.  The slot maps
+ *  the tag back to the task's type, logical unit and SCSI task; finding the
+ *  task that an incoming PDU belongs to is a single indexed load. */
+typedef struct iSCSITaskSlot {
+    
+    /*! Initiator task tag of the task that occupies the slot (the tag
+     *  includes a generation number, so stale tags do not match). */
+    UInt32 initiatorTaskTag;
+    
+    /*! Generation number of the slot, advanced each time it is freed. */
+    UInt32 generation;
+    
+    /*! Next slot in the list of free slots. */
+    UInt16 nextFreeSlot;
+    
+    /*! Type of the task (see iSCSIVirtualHBA::InitiatorTaskTypes). */
+    UInt8 taskType;
+    
+    /*! Function code of a task management request. */
+    UInt8 taskMgmtFunction;
+    
+    /*! Initiator task tag of the task that a task management request
+     *  refers to (abort task and task reassign requests only). */
+    UInt32 referencedTaskTag;
+    
+    /*! The connection that a logout request removes (logout requests only). */
+    ConnectionIdentifier logoutConnectionId;
+    
+    /*! Flag that indicates if the target accepted a logout request; the
+     *  request is held until Time2Wait has elapsed (logout requests only). */
+    bool logoutComplete;
+    
+    /*! MaxRecvDataSegmentLength declared by a text request (text requests
+     *  only). */
+    UInt32 textMaxRecvDataSegmentLength;
+    
+    /*! The logical unit that the task is addressed to. */
+    SCSILogicalUnitNumber LUN;
+    
+    /*! The SCSI task that occupies the slot (NULL if the slot is free or
+     *  holds a latency measurement or task management request). */
+    SCSIParallelTaskIdentifier parallelTask;
+    
+    /*! HBA-specific data of the task (start timestamp and transfer state). */
+    iSCSIHBATaskData * taskData;
+    
+    /*! The connection that the task was assigned to. */
+    iSCSIConnection * connection;
+    
+    /*! Deadline of the task (see iSCSIVirtualHBA::ArmTaskTimer()). */
+    iSCSITimerWheelEntry timer;
+    
+} iSCSITaskSlot;
+
+
 /*! Definition of a single iSCSI session.  Each session is comprised of one
  *  or more connections as defined by the struct iSCSIConnection.  Each session
  *  is further associated with an initiator session ID (ISID), a target session
@@ -167,6 +510,64 @@ typedef struct iSCSISession {
      *  exists and is backing the the iSCSI session. */
     bool active;
     
+    /*! Policy used to assign new tasks to connections (see
+     *  enum iSCSIConnectionSchedulingPolicies). */
+    UInt8 connectionSchedulingPolicy;
+    
+    /*! Index of the connection that the last task was assigned to (used by
+     *  the round-robin scheduling policy). */
+    UInt32 lastScheduledConnectionIdx;
+    
+    /*! Policy used to select the session's work loop (see
+     *  enum iSCSIWorkLoopPolicies). */
+    UInt8 workLoopPolicy;
+    
+    /*! The work loop that the event sources of the session's connections
+     *  are attached to (either the HBA's work loop or one from its pool). */
+    IOWorkLoop * workLoop;
+    
+    /*! Tasks in progress, indexed by the slot number in their initiator
+     *  task tags. */
+    iSCSITaskSlot * taskSlots;
+    
+    /*! First slot in each list of free slots (slots are reused in the order
+     *  they are freed, so that a stale tag is unlikely to match).  SCSI tasks
+     *  and reserved tasks are allocated from separate lists. */
+    UInt16 freeTaskSlot[kiSCSITaskSlotPoolCount];
+    
+    /*! Last slot in each list of free slots. */
+    UInt16 lastFreeTaskSlot[kiSCSITaskSlotPoolCount];
+    
+    /*! Protects the list of free slots and the task timers (tasks are
+     *  started and completed on different threads). */
+    IOSimpleLock * taskSlotLock;
+    
+    /*! Deadlines of the tasks in progress (the timers are kept in the
+     *  task slots). */
+    iSCSITimerWheel taskTimers;
+    
+    /*! Timer that advances taskTimers, attached to the session's work loop. */
+    IOTimerEventSource * taskTimerEventSource;
+    
+    /*! Tick that taskTimerEventSource is scheduled for (0 if it isn't). */
+    UInt64 taskTimerScheduledTick;
+    
+    /*! Number of task latencies recorded (see
+     *  iSCSIVirtualHBA::RecordTaskStatistics()). */
+    UInt32 taskLatencySamples;
+    
+    /*! Time a task may go without progress before the connection is
+     *  checked, derived from the connections' latency statistics (ms). */
+    UInt32 taskDeadlineMs;
+    
+    /*! Number of logical units that latency statistics are kept for;
+     *  tasks addressed to higher LUNs are only counted by their connection. */
+    static const UInt8 kMaxLatencyStatsLUNs = 64;
+    
+    /*! Latency statistics of the tasks addressed to each logical unit,
+     *  indexed by LUN (allocated when a LUN's first task completes). */
+    iSCSIHBALatencyStatistics * lunLatencyStats[kMaxLatencyStatsLUNs];
+    
     //////////////////// Configured Session Parameters /////////////////////
     
     /*! Time to retain. */
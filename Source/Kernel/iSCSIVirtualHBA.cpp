@@ -37,8 +37,13 @@
 #include <sys/ioctl.h>
 #include <sys/unistd.h>
 #include <sys/select.h>
+#include <sys/kpi_mbuf.h>
+#include <libkern/libkern.h>
 
 #include <IOKit/IORegistryEntry.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
 
 // Use DBLog() for debug outputs and IOLog() for all outputs
 // DBLog() is only enabled for debug builds
@@ -61,17 +66,20 @@ const UInt16 iSCSIVirtualHBA::kMaxConnectionsPerSession = kiSCSIMaxConnectionsPe
 /*! Maximum number of session allowed (globally). */
 const UInt16 iSCSIVirtualHBA::kMaxSessions = kiSCSIMaxSessions;
 
-/*! Highest LUN supported by the virtual HBA.  Due to internal design 
- *  contraints, this number should never exceed 2**8 - 1 or 255 (8-bits). */
-const SCSILogicalUnitNumber iSCSIVirtualHBA::kHighestLun = 63;
+/*! Highest LUN supported by the virtual HBA (the highest LUN that can be
+ *  expressed using the flat space addressing method). */
+const SCSILogicalUnitNumber iSCSIVirtualHBA::kHighestLun = 16383;
 
 /*! Highest SCSI device ID supported by the HBA.  SCSI device identifiers are
  *  just the session identifiers. */
 const SCSIDeviceIdentifier iSCSIVirtualHBA::kHighestSupportedDeviceId = kMaxSessions - 1;
 
 /*! Maximum number of SCSI tasks the HBA can handle.  Increasing this number will
- *  increase the wired memory consumed by this kernel extension. */
-const UInt32 iSCSIVirtualHBA::kMaxTaskCount = 10;
+ *  increase the wired memory consumed by this kernel extension.  The SCSI
+ *  family sizes its task pool from this value when the controller starts;
+ *  the number of tasks actually outstanding on each connection is bounded by
+ *  the command window that the target advertises (see iSCSITaskQueue). */
+const UInt32 iSCSIVirtualHBA::kMaxTaskCount = 128;
 
 /*! Number of bytes that are transmitted before we calculate an average speed
  *  for the connection (1024^2 = 1048576). */
@@ -80,9 +88,77 @@ const UInt32 iSCSIVirtualHBA::kNumBytesPerAvgBW = 1048576;
 /*! Default task timeout for new tasks (milliseconds). */
 const UInt32 iSCSIVirtualHBA::kiSCSITaskTimeoutMs = 20000;
 
+/*! Duration of a tick of the task timer wheels (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kTaskTimerTickMs = 10;
+
+/*! Shortest task deadline (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kTaskDeadlineMinMs = 1000;
+
+/*! Multiple of the 99.9th percentile task latency used as the deadline. */
+const UInt32 iSCSIVirtualHBA::kTaskDeadlineMultiplier = 4;
+
+/*! Default interval between NOP-outs sent on a connection (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kPingIntervalMs = 5000;
+
+/*! Multiple of the round-trip time, plus kUnsolicitedDataR2TSlackUs, that
+ *  the wait for a target's first R2T may reach before large writes stop
+ *  sending unsolicited data. */
+const UInt32 iSCSIVirtualHBA::kUnsolicitedDataR2TLatencyFactor = 4;
+
+/*! Time allowed for a target to solicit data, on top of the round-trip
+ *  time, before large writes stop sending unsolicited data (microseconds). */
+const UInt32 iSCSIVirtualHBA::kUnsolicitedDataR2TSlackUs = 1000;
+
+/*! Default limit on the size that a connection's socket buffers are
+ *  grown to from its bandwidth-delay product (bytes). */
+const UInt32 iSCSIVirtualHBA::kSocketBufferLimit = 4194304;
+
+/*! Multiple of the bandwidth-delay product that the socket buffers are
+ *  sized to (the measured throughput understates the path's capacity). */
+const UInt32 iSCSIVirtualHBA::kSocketBufferBDPMultiple = 2;
+
+/*! Number of unanswered TCP keepalive probes after which a connection is
+ *  dropped. */
+const UInt32 iSCSIVirtualHBA::kKeepAliveProbeCount = 4;
+
+/*! Number of task latencies recorded before deadlines are derived
+ *  from them. */
+const UInt32 iSCSIVirtualHBA::kTaskDeadlineMinSamples = 1024;
+
+/*! Number of task latencies recorded between deadline updates. */
+const UInt32 iSCSIVirtualHBA::kTaskDeadlineUpdateInterval = 64;
+
 /*! Default TCP timeout for new connections (seconds). */
 const UInt32 iSCSIVirtualHBA::kiSCSITCPTimeoutSec = 1;
 
+const UInt32 iSCSIVirtualHBA::kMaxPDUsPerReceive = 32;
+
+const UInt32 iSCSIVirtualHBA::kRecvBufferSize = 65536;
+
+const UInt32 iSCSIVirtualHBA::kMaxRenegotiatedDataSegmentLength = 1048576;
+
+const UInt32 iSCSIVirtualHBA::kRecvDirectThreshold = 16384;
+
+const UInt32 iSCSIVirtualHBA::kTransmitBufferSize = 65536;
+
+const UInt32 iSCSIVirtualHBA::kTransmitCopyThreshold = 8192;
+
+const UInt32 iSCSIVirtualHBA::kTransmitFlushBytes = 32768;
+
+const UInt32 iSCSIVirtualHBA::kTransmitFlushLatencyUs = 500;
+
+const UInt32 iSCSIVirtualHBA::kMaxDataOutPDUsPerPass = 16;
+
+const UInt8 iSCSIVirtualHBA::kTaskSlotBits = 10;
+
+const UInt16 iSCSIVirtualHBA::kMaxTaskSlots = 1 << kTaskSlotBits;
+
+const UInt16 iSCSIVirtualHBA::kReservedTaskSlots = 32;
+
+const UInt32 iSCSIVirtualHBA::kTaskSlotGenerationMask = 0xFFFFFFFF >> kTaskSlotBits;
+
+const UInt16 iSCSIVirtualHBA::kMaxSessionWorkLoops = 16;
+
 
 OSDefineMetaClassAndStructors(iSCSIVirtualHBA,IOSCSIParallelInterfaceController);
 
@@ -178,17 +254,15 @@ SCSIServiceResponse iSCSIVirtualHBA::AbortTaskRequest(SCSITargetIdentifier targe
     
     DBLog("iscsi: Abort task request (TID: %llu, LUN: %llu)\n",targetId,LUN);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTask);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTask;
-    bhs.referencedTaskTag = OSSwapHostToBigInt32((UInt32)taggedTaskID);
-
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    // Look up the initiator task tag of the task to abort
+    UInt32 referencedTaskTag = FindInitiatorTaskTagForTaggedTask(session,LUN,taggedTaskID);
     
-	return kSCSIServiceResponse_Request_In_Process;
+    // The task has already completed
+    if(referencedTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return kSCSIServiceResponse_TASK_COMPLETE;
+
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,LUN,kiSCSIPDUTaskMgmtFuncAbortTask,referencedTaskTag);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::AbortTaskSetRequest(SCSITargetIdentifier targetId,
@@ -201,16 +275,8 @@ SCSIServiceResponse iSCSIVirtualHBA::AbortTaskSetRequest(SCSITargetIdentifier ta
     
     DBLog("iscsi: Abort task set request (TID: %llu, LUN: %llu)\n",targetId,LUN);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTaskSet);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTaskSet;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,LUN,kiSCSIPDUTaskMgmtFuncAbortTaskSet,kiSCSIPDUInitiatorTaskTagReserved);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::ClearACARequest(SCSITargetIdentifier targetId,
@@ -223,16 +289,8 @@ SCSIServiceResponse iSCSIVirtualHBA::ClearACARequest(SCSITargetIdentifier target
     
     DBLog("iscsi: Clear ACA request (TID: %llu, LUN: %llu)\n",targetId,LUN);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearACA);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearACA;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,LUN,kiSCSIPDUTaskMgmtFuncClearACA,kiSCSIPDUInitiatorTaskTagReserved);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::ClearTaskSetRequest(SCSITargetIdentifier targetId,
@@ -245,16 +303,8 @@ SCSIServiceResponse iSCSIVirtualHBA::ClearTaskSetRequest(SCSITargetIdentifier ta
     
     DBLog("iscsi: Clear task set request (TID: %llu, LUN: %llu)\n",targetId,LUN);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearTaskSet);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearTaskSet;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,LUN,kiSCSIPDUTaskMgmtFuncClearTaskSet,kiSCSIPDUInitiatorTaskTagReserved);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::LogicalUnitResetRequest(SCSITargetIdentifier targetId,
@@ -267,16 +317,8 @@ SCSIServiceResponse iSCSIVirtualHBA::LogicalUnitResetRequest(SCSITargetIdentifie
     
     DBLog("iscsi: LUN reset request (TID: %llu, LUN: %llu)\n",targetId,LUN);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncLUNReset);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncLUNReset;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,LUN,kiSCSIPDUTaskMgmtFuncLUNReset,kiSCSIPDUInitiatorTaskTagReserved);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::TargetResetRequest(SCSITargetIdentifier targetId)
@@ -288,15 +330,8 @@ SCSIServiceResponse iSCSIVirtualHBA::TargetResetRequest(SCSITargetIdentifier tar
     
     DBLog("iscsi: Target reset request (TID: %llu)\n",targetId);
 
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncTargetWarmReset;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,0,kiSCSIPDUTaskMgmtFuncTargetWarmReset);
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    // Queue a SCSI target management request
+	return SendTaskMgmtRequest(session,0,kiSCSIPDUTaskMgmtFuncTargetWarmReset,kiSCSIPDUInitiatorTaskTagReserved);
 }
 
 SCSIInitiatorIdentifier iSCSIVirtualHBA::ReportInitiatorIdentifier()
@@ -317,9 +352,9 @@ UInt32 iSCSIVirtualHBA::ReportMaximumTaskCount()
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificTaskDataSize()
 {
-    // Due to a bug (feature?) in the SCSI family driver, this value cannot
-    // be zero, even if task data is not required.
-	return 1;
+    // Each task carries the connection it was assigned to and the time at
+    // which it was started (see iSCSIHBATaskData)
+	return sizeof(iSCSIHBATaskData);
 }
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificDeviceDataSize()
@@ -342,7 +377,8 @@ bool iSCSIVirtualHBA::InitializeController()
     
     // Initialize CRC32C
     crc32c_init();
-    
+    DBLog("iscsi: Using %s CRC32C implementation\n",crc32c_engine());
+
     // Setup session & target list
     sessionList = (iSCSISession **)IOMalloc(kMaxSessions*sizeof(iSCSISession*));
     targetList  = OSDictionary::withCapacity(kMaxSessions);
@@ -352,6 +388,17 @@ bool iSCSIVirtualHBA::InitializeController()
     
     memset(sessionList,0,kMaxSessions*sizeof(iSCSISession *));
     
+    // Setup the pool of work loops for sessions that have their own (the
+    // work loops themselves are created as they are needed)
+    sessionWorkLoops = (IOWorkLoop **)IOMalloc(kMaxSessionWorkLoops*sizeof(IOWorkLoop*));
+    sessionWorkLoopUsers = (UInt32 *)IOMalloc(kMaxSessionWorkLoops*sizeof(UInt32));
+    
+    if(!sessionWorkLoops || !sessionWorkLoopUsers)
+        return false;
+    
+    memset(sessionWorkLoops,0,kMaxSessionWorkLoops*sizeof(IOWorkLoop*));
+    memset(sessionWorkLoopUsers,0,kMaxSessionWorkLoops*sizeof(UInt32));
+    
     // Set product name.
     SetHBAProperty(kIOPropertyProductNameKey,OSString::withCString(ISCSI_PRODUCT_NAME));
     SetHBAProperty(kIOPropertyProductRevisionLevelKey,OSString::withCString(ISCSI_PRODUCT_REVISION_LEVEL));
@@ -377,6 +424,19 @@ void iSCSIVirtualHBA::TerminateController()
     // Free up our list of sessions and targets
     IOFree(sessionList,kMaxSessions*sizeof(iSCSISession*));
     targetList->free();
+    
+    // Release the pool of session work loops
+    if(sessionWorkLoops)
+    {
+        for(UInt16 idx = 0; idx < kMaxSessionWorkLoops; idx++)
+            if(sessionWorkLoops[idx])
+                sessionWorkLoops[idx]->release();
+        
+        IOFree(sessionWorkLoops,kMaxSessionWorkLoops*sizeof(IOWorkLoop*));
+    }
+    
+    if(sessionWorkLoopUsers)
+        IOFree(sessionWorkLoopUsers,kMaxSessionWorkLoops*sizeof(UInt32));
 }
 
 bool iSCSIVirtualHBA::StartController()
@@ -401,7 +461,7 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Determine the target identifier (session identifier) and connection
     // associated with this task and remove the task from the task queue.
     SessionIdentifier sessionId = (UInt16)GetTargetIdentifier(task);
-    ConnectionIdentifier connectionId = *((UInt32*)GetHBADataPointer(task));
+    ConnectionIdentifier connectionId = ((iSCSIHBATaskData*)GetHBADataPointer(task))->connectionId;
     
     if(connectionId >= kMaxConnectionsPerSession)
         return;
@@ -417,18 +477,38 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Note: task tag is always 32-bits, even though the SCSI stack allows for 64-bit storage of the tag
     DBLog("iscsi: Task timeout for task %#x (sid: %d, cid: %d)\n",(UInt32)GetControllerTaskIdentifier(task),sessionId,connectionId);
 
+    // The timeout is handled on the work loop that processes the session's
+    // I/O (see HandleTaskTimeout())
+    connection->taskQueue->timeoutTask((UInt32)GetControllerTaskIdentifier(task));
+}
+
+/*! Handles a task that the SCSI layer timed out.  Called by the task's
+ *  connection's task queue (see HandleTimeout()), on the work loop that
+ *  processes the session's I/O.
+ *  @param session the session associated with the task.
+ *  @param connection the connection associated with the task.
+ *  @param initiatorTaskTag the initiator task tag of the task. */
+void iSCSIVirtualHBA::HandleTaskTimeout(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        UInt32 initiatorTaskTag)
+{
+    SCSIParallelTaskIdentifier task = FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
+    
+    // The task completed after it timed out
+    if(!task)
+        return;
     
     // If the task timeout is due to a broken connection, handle it.
     // Otherwise the target may be taking too long, just report it up the
     // driver stack
     struct sockaddr peername;
     if(sock_getpeername(connection->socket,&peername,sizeof(peername))) {
-        HandleConnectionTimeout(sessionId,connectionId);
+        HandleConnectionTimeout(session->sessionId,connection->cid);
         return;
     }
 
-    // Let task queue know that the last (current) task should be removed
-    connection->taskQueue->completeCurrentTask();
+    // Let task queue know that the task should be removed
+    connection->taskQueue->completeTask(initiatorTaskTag);
     
     // Notify the SCSI stack that the task could not be delivered
     CompleteParallelTask(session,
@@ -438,797 +518,3241 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
                          kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
 }
 
-/*! Handles connection timeouts.
- *  @param sessionId the session associated with the timed-out connection.
- *  @param connectionId the connection that timed out. */
-void iSCSIVirtualHBA::HandleConnectionTimeout(SessionIdentifier sessionId,ConnectionIdentifier connectionId)
+/*! Fails a SCSI task whose PDUs from the target break the negotiated
+ *  protocol (e.g., an R2T beyond MaxOutstandingR2T).  The error is
+ *  logged and the task is returned to the SCSI layer as a delivery
+ *  failure.  Must be called on the session's work loop.
+ *  @param session the session associated with the task.
+ *  @param connection the connection associated with the task.
+ *  @param parallelTask the task to fail.
+ *  @param reason describes the protocol error, for the log. */
+void iSCSIVirtualHBA::HandleTaskProtocolError(iSCSISession * session,
+                                              iSCSIConnection * connection,
+                                              SCSIParallelTaskIdentifier parallelTask,
+                                              const char * reason)
 {
-    // If this is the last connection, release the session...
-    iSCSISession * session;
+    UInt32 initiatorTaskTag = ((iSCSIHBATaskData*)GetHBADataPointer(parallelTask))->initiatorTaskTag;
     
-    if(!(session = sessionList[sessionId]))
-       return;
+    IOLog("iscsi: Protocol error for task %#x: %s (sid: %d, cid: %d)\n",
+          initiatorTaskTag,reason,session->sessionId,connection->cid);
+    
+    connection->taskQueue->completeTask(initiatorTaskTag);
+    
+    CompleteParallelTask(session,
+                         connection,
+                         parallelTask,
+                         kSCSITaskStatus_DeliveryFailure,
+                         kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+}
 
-    DBLog("iscsi: Connection timeout (sid: %d, cid: %d)\n",sessionId,connectionId);
+/*! Sets the deadline of a task in the session's timer wheel, replacing
+ *  any deadline the task already has.  Must be called on the session's
+ *  work loop.
+ *  @param session the session associated with the task.
+ *  @param initiatorTaskTag the initiator task tag of the task.
+ *  @param timeoutMs time from now until the deadline (ms). */
+void iSCSIVirtualHBA::ArmTaskTimer(iSCSISession * session,
+                                   UInt32 initiatorTaskTag,
+                                   UInt32 timeoutMs)
+{
+    iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
     
-    ConnectionIdentifier connectionCount = 0;
-    for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
-        if(session->connections[connectionId])
-            connectionCount++;
+    if(!slot)
+        return;
     
-    // In the future add recovery here...
-    if(connectionCount > 1)
-        DeactivateConnection(sessionId,connectionId);
-    else
-        DeactivateAllConnections(sessionId);
+    UInt64 currentTick = GetTaskTimerTick();
+    UInt64 expiryTick = currentTick + (timeoutMs + kTaskTimerTickMs - 1)/kTaskTimerTickMs;
+    
+    // The timer is canceled when the slot is released, which may happen on
+    // another thread (see ReleaseTaskSlot())
+    IOSimpleLockLock(session->taskSlotLock);
+    
+    slot->timer.initiatorTaskTag = initiatorTaskTag;
+    session->taskTimers.arm(&slot->timer,expiryTick,currentTick);
+    
+    // Bring the timer event source forward if this deadline comes first
+    // (the event source only runs on this work loop, so it can't race us)
+    expiryTick = slot->timer.expiryTick;
+    
+    bool schedule = (session->taskTimerScheduledTick == 0 ||
+                     expiryTick < session->taskTimerScheduledTick);
+    
+    if(schedule)
+        session->taskTimerScheduledTick = expiryTick;
+    
+    IOSimpleLockUnlock(session->taskSlotLock);
+    
+    if(schedule)
+        session->taskTimerEventSource->setTimeoutMS(expiryTick > currentTick ?
+            (UInt32)(expiryTick - currentTick)*kTaskTimerTickMs : kTaskTimerTickMs);
+}
 
-    // Send a notification to the daemon; if the daemon does not respond then
-    // release the session or connection as appropriate
-    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)getClient();
+/*! Called by a session's timer event source, on the session's work loop,
+ *  when a task deadline may have passed.
+ *  @param owner an instance of this class.
+ *  @param sender the session's timer event source. */
+void iSCSIVirtualHBA::TaskTimerExpired(OSObject * owner,IOTimerEventSource * sender)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
     
-    if(client)
-        client->sendTimeoutMessageNotification(sessionId,connectionId);
-    else
+    if(!hba)
+        return;
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kMaxSessions; sessionId++)
     {
-        if(connectionCount > 1)
-            ReleaseConnection(sessionId,connectionId);
-        else
-            ReleaseSession(sessionId);
+        iSCSISession * session = hba->sessionList[sessionId];
+        
+        if(session && session->taskTimerEventSource == sender) {
+            hba->ProcessTaskTimers(session);
+            return;
+        }
     }
 }
 
-SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentifier parallelTask)
+/*! Advances a session's timer wheel to the current time, handles the
+ *  deadlines that have passed and schedules the next pass.
+ *  @param session the session. */
+void iSCSIVirtualHBA::ProcessTaskTimers(iSCSISession * session)
 {
-    // Here we set an (iSCSI) initiator task tag for the SCSI task and queue
-    // the iSCSI task for later processing
-    SCSITargetIdentifier targetId   = GetTargetIdentifier(parallelTask);
-    SCSILogicalUnitNumber LUN       = GetLogicalUnitNumber(parallelTask);
-    SCSITaggedTaskIdentifier taskId = GetTaggedTaskIdentifier(parallelTask);
+    const SessionIdentifier sessionId = session->sessionId;
+    iSCSITimerWheelEntry * timer;
     
-    iSCSISession * session = sessionList[(SessionIdentifier)targetId];
-    
-    if(!session)
-        return kSCSIServiceResponse_FUNCTION_REJECTED;
+    IOSimpleLockLock(session->taskSlotLock);
     
-    // Determine which connection this task should be assigned to based on
-    // bitrate and processing load; we do this by looking at the amount of
-    // data each connection needs to transfer
-    iSCSIConnection * connection = NULL;
-    size_t minTimeToTransfer = INT64_MAX;
+    session->taskTimerScheduledTick = 0;
+    session->taskTimers.advance(GetTaskTimerTick());
     
-    for(UInt32 idx = 0; idx < kiSCSIMaxConnectionsPerSession; idx++)
+    while((timer = session->taskTimers.nextExpired()))
     {
-        iSCSIConnection * conn = session->connections[idx];
-        
-        // If this connection slot doesn't exist or isn't enabled, move on...
-        if(!conn || !conn->taskQueue->isEnabled())
-            continue;
+        UInt32 initiatorTaskTag = timer->initiatorTaskTag;
+        IOSimpleLockUnlock(session->taskSlotLock);
         
-        if(conn->bytesPerSecond == 0) {
-            connection = conn;
-            break;
-        }
+        HandleTaskDeadline(session,initiatorTaskTag);
         
-        size_t timeToTransfer = conn->dataToTransfer / conn->bytesPerSecond;
+        // A timed out connection may have taken the session with it
+        if(sessionList[sessionId] != session)
+            return;
         
-        if(timeToTransfer <= minTimeToTransfer) {
-            minTimeToTransfer = timeToTransfer;
-            connection = conn;
-        }
+        IOSimpleLockLock(session->taskSlotLock);
     }
     
-    connection = session->connections[0];
-    if(!connection || !connection->dataRecvEventSource)
-        return kSCSIServiceResponse_FUNCTION_REJECTED;
-    
-    // Associate a connection identifier with this task; this is used to
-    // maintain the connection associated with a task when only task information
-    // is available (e.g., in the case of a task timeout).
-    *((UInt32*)GetHBADataPointer(parallelTask)) = 0;
-    
-    // Add the amount of data that we need to transfer to this connection
-    OSAddAtomic64(GetRequestedDataTransferCount(parallelTask),&connection->dataToTransfer);
-
-    // Build and set iSCSI initiator task tag
-    UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeSCSITask,LUN,taskId);
-    SetControllerTaskIdentifier(parallelTask,initiatorTaskTag);
+    // Come back when the next deadline may have passed (unless a deadline
+    // that was set meanwhile brought the event source forward already)
+    UInt64 ticks = session->taskTimers.ticksUntilNextExpiry();
+    UInt64 nextTick = session->taskTimers.getTick() + ticks;
     
-    DBLog("iscsi: Transfer size: %llu (sid: %d, cid: %d)\n",
-          connection->dataToTransfer,session->sessionId,connection->cid);
+    if(ticks && (session->taskTimerScheduledTick == 0 || nextTick < session->taskTimerScheduledTick))
+        session->taskTimerScheduledTick = nextTick;
+    else
+        ticks = 0;
     
-    // Queue task in the event source (we'll remove it from the queue when were
-    // done processing the task)
-    connection->taskQueue->queueTask(initiatorTaskTag);
+    IOSimpleLockUnlock(session->taskSlotLock);
     
-    DBLog("iscsi: Queued task %#x (sid: %d, cid: %d)\n",
-          initiatorTaskTag,session->sessionId,connection->cid);
-
-    return kSCSIServiceResponse_Request_In_Process;
+    if(ticks)
+        session->taskTimerEventSource->setTimeoutMS((UInt32)ticks*kTaskTimerTickMs);
 }
 
-void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
-                                                iSCSISession * session,
-                                                iSCSIConnection * connection,
-                                                UInt32 initiatorTaskTag)
+/*! Handles a task that missed its deadline.  A NOP-out that goes
+ *  unanswered means the connection is dead, and the connection is
+ *  timed out.  Any other task only means that the target is slow or
+ *  that the connection is dead, so a NOP-out is sent to find out; slow
+ *  tasks are left to the SCSI layer's timeout (see HandleTimeout()).
+ *  @param session the session associated with the task.
+ *  @param initiatorTaskTag the initiator task tag of the task. */
+void iSCSIVirtualHBA::HandleTaskDeadline(iSCSISession * session,UInt32 initiatorTaskTag)
 {
-    // Task tag corresponding to a connection timeout measurement
-    if(owner->ParseInitiatorTaskTagForTaskType(initiatorTaskTag) == kInitiatorTaskTypeLatency)  {
-        owner->MeasureConnectionLatency(session,connection);
+    iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
+    
+    if(!slot || !slot->connection)
         return;
-    }
     
-    // Grab parallel task associated with this iSCSI task
-    SCSIParallelTaskIdentifier parallelTask =
-        owner->FindTaskForControllerIdentifier(session->sessionId,initiatorTaskTag);
+    iSCSIConnection * connection = slot->connection;
     
-    if(!parallelTask)  {
-        DBLog("iscsi: Task not found, flushing stream (BeginTaskOnWorkloopThread) (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
+    if(slot->taskType == kInitiatorTaskTypeLatency) {
+        DBLog("iscsi: NOP-out %#x unanswered (sid: %d, cid: %d)\n",
+              initiatorTaskTag,session->sessionId,connection->cid);
+        
+        HandleConnectionTimeout(session->sessionId,connection->cid);
         return;
     }
     
-    // Extract information about this SCSI task
-    SCSITaskAttribute attribute     = owner->GetTaskAttribute(parallelTask);
-    UInt8   transferDirection       = owner->GetDataTransferDirection(parallelTask);
-    UInt32  transferSize            = (UInt32)owner->GetRequestedDataTransferCount(parallelTask);
-    UInt8   cdbSize                 = owner->GetCommandDescriptorBlockSize(parallelTask);
+    // Either Time2Wait has elapsed after a logout, or the logout went
+    // unanswered
+    if(slot->taskType == kInitiatorTaskTypeLogout) {
+        FinishConnectionRecovery(session,connection,initiatorTaskTag,slot->logoutComplete);
+        return;
+    }
     
-    DBLog("iscsi: Starting task %#x (sid: %d, cid: %d)\n",
-          initiatorTaskTag,session->sessionId,connection->cid);
+    // The connection keeps its current lengths if a text request goes
+    // unanswered
+    if(slot->taskType == kInitiatorTaskTypeText) {
+        FinishTextRequest(session,connection,initiatorTaskTag);
+        return;
+    }
     
-    // Timestamp the connection indicating when we started processing the task
-    clock_get_system_microtime(&(connection->taskStartTimeSec),
-                               &(connection->taskStartTimeUSec));
+    DBLog("iscsi: Task %#x missed its %d ms deadline (sid: %d, cid: %d)\n",
+          initiatorTaskTag,session->taskDeadlineMs,session->sessionId,connection->cid);
     
-    iSCSIPDUSCSICmdBHS bhs  = iSCSIPDUSCSICmdBHSInit;
-    bhs.dataTransferLength  = OSSwapHostToBigInt32(transferSize);
+    // One NOP-out at a time is enough to check the connection
+    if(!connection->livenessProbePending)
+        connection->livenessProbePending = QueueLatencyProbe(session,connection);
     
-    owner->GetLogicalUnitBytes(parallelTask,(SCSILogicalUnitBytes*)&bhs.LUN);
+    // Keep watching the task, in case the connection dies later
+    ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+}
 
-    // The initiator task tag is just LUN and task identifier
-    bhs.initiatorTaskTag = initiatorTaskTag;
-    
-    if(transferDirection == kSCSIDataTransfer_FromInitiatorToTarget)
-        bhs.flags |= kiSCSIPDUSCSICmdFlagWrite;
-    else if(transferDirection == kSCSIDataTransfer_FromTargetToInitiator)
-        bhs.flags |= kiSCSIPDUSCSICmdFlagRead;
-    
-    // For CDB sizes less than 16 bytes, plug directly into SCSI command PDU
-    // (Currently, OS X doesn't support CDB's larger than 16 bytes, so
-    // there's no need for an iSCSI additional header segment for spillover).
-    switch(cdbSize) {
-        case kSCSICDBSize_6Byte:
-        case kSCSICDBSize_10Byte:
-        case kSCSICDBSize_12Byte:
-        case kSCSICDBSize_16Byte:
-            owner->GetCommandDescriptorBlock(parallelTask,&bhs.CDB);
-            break;
-    };
-    
-    // Setup the task attribute for this PDU
-    switch(attribute) {
-        case kSCSITask_ACA:
-            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrACA; break;
-        case kSCSITask_HEAD_OF_QUEUE:
-            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrHead; break;
-        case kSCSITask_ORDERED:
-            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrOrdered; break;
-        case kSCSITask_SIMPLE:
-            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrSimple; break;
-    };
+/*! Queues a NOP-out that measures the latency of a connection (see
+ *  MeasureConnectionLatency()), with a deadline for the target's answer.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to measure.
+ *  @return true if the NOP-out was queued, false if the reserved task
+ *  slots are all in use. */
+bool iSCSIVirtualHBA::QueueLatencyProbe(iSCSISession * session,iSCSIConnection * connection)
+{
+    UInt32 initiatorTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeLatency,0,connection,NULL);
     
-    // Default timeout for new tasks...
-    owner->SetTimeoutForTask(parallelTask,kiSCSITaskTimeoutMs);
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return false;
     
-    // For non-WRITE commands, send off SCSI command PDU immediately.
-    if(transferDirection != kSCSIDataTransfer_FromInitiatorToTarget) {
-        bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
-        return;
-    }
+    // The deadline starts when the NOP-out is queued rather than sent, so
+    // that a NOP-out held back by a closed command window also times out
+    ArmTaskTimer(session,initiatorTaskTag,GetPingTimeoutMs(session,connection));
+    connection->taskQueue->queueTask(initiatorTaskTag);
+    return true;
+}
+
+/*! Called by a connection's ping timer, on the session's work loop, to
+ *  send a NOP-out on the connection (unless one is outstanding).
+ *  @param owner an instance of this class.
+ *  @param sender the connection's ping timer. */
+void iSCSIVirtualHBA::PingTimerExpired(OSObject * owner,IOTimerEventSource * sender)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
     
-    // If there is no unsolicited data to send, simply send the WRITE
-    // command and return.
-    if(session->initialR2T && !session->immediateData) {
-        bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+    if(!hba)
         return;
-    }
     
-    // At this point either immediate data, data-out PDUs or both
-    // are going to be sent out.
-    IOMemoryDescriptor  * dataDesc  = owner->GetDataBuffer(parallelTask);
-    UInt32 dataOffset = 0, dataLength = 0;
-    
-    // First use immediate data to send data with command PDU...
-    if(session->immediateData) {
-        
-        // Either send the max allowed data (immediate data length) or
-        // all of the data if it is lesser than the max allowed limit
-        dataLength = min(connection->immediateDataLength,transferSize);
-        
-        UInt8 * data = (UInt8*)IOMalloc(dataLength);
-        dataDesc->readBytes(dataOffset,data,dataLength);
-        
-        // If we need to wait for an R2T or we've transferred all data
-        // as immediate data then no additional data will follow this PDU...
-        if(session->initialR2T || dataLength == transferSize)
-            bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
-
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,data,dataLength);
-        dataOffset += dataLength;
+    for(SessionIdentifier sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        iSCSISession * session = hba->sessionList[sessionId];
         
-        owner->IncrementRealizedDataTransferCount(parallelTask,dataLength);
-        connection->dataToTransfer -= dataLength;
+        if(!session)
+            continue;
         
-        IOFree(data,dataLength);
-    }
-    else {
-        // No immediate data (but there will be data-out following this)
-        // just send the WRITE command without immediate data
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
-    }
-
-    // Follow up with data out PDUs up to the firstBurstLength bytes if...
-    if(!session->initialR2T &&                     // Initial R2T = No
-       dataOffset < session->firstBurstLength &&   // Haven't hit burst limit
-       dataOffset < transferSize)                  // Data left to send
-    {
-        // Determine amount of data left to transfer and send data out PDUs
-        dataLength = min(session->firstBurstLength-dataOffset,transferSize-dataOffset);
-        
-        owner->ProcessDataOutForTask(session,connection,parallelTask,dataOffset,dataLength,bhs.LUN,
-                                     initiatorTaskTag,kiSCSIPDUTargetTransferTagReserved);
-    }
-}
-
-bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
-                                                  iSCSISession * session,
-                                                  iSCSIConnection * connection)
-{
-    // Quit if the connection isn't active (if it is not in full feature phase)
-    if(!owner || !session || !connection)
-        return true;
- 
-    // Grab incoming bhs (we are guaranteed to have a basic header at this
-    // point (iSCSIIOEventSource ensures that this is the case)
-    iSCSIPDUTargetBHS bhs;
-    
-    if(owner->RecvPDUHeader(session,connection,&bhs,0))
-    {
-        DBLog("iscsi: Failed to get PDU header (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-        return true;
-    }
-    else
-        DBLog("iscsi: Received PDU type %#x (sid: %d, cid: %d)\n",
-              bhs.opCode,session->sessionId,connection->cid);
-
-    // Determine the kind of PDU that was received and process accordingly
-    enum iSCSIPDUTargetOpCodes opCode = (iSCSIPDUTargetOpCodes)bhs.opCode;
-    switch(opCode)
-    {
-        // Process a SCSI response
-        case kiSCSIPDUOpCodeSCSIRsp:
-            owner->ProcessSCSIResponse(session,connection,(iSCSIPDUSCSIRspBHS*)&bhs);
-        break;
-            
-        case kiSCSIPDUOpCodeDataIn:
-            owner->ProcessDataIn(session,connection,(iSCSIPDUDataInBHS*)&bhs);
-        break;
-            
-        case kiSCSIPDUOpCodeAsyncMsg:
-            owner->ProcessAsyncMsg(session,connection,(iSCSIPDUAsyncMsgBHS*)&bhs);
-            break;
-            
-        case kiSCSIPDUOpCodeNOPIn:
-            owner->ProcessNOPIn(session,connection,(iSCSIPDUNOPInBHS*)&bhs);
-            break;
-            
-        case kiSCSIPDUOpCodeR2T:
-            owner->ProcessR2T(session,connection,(iSCSIPDUR2TBHS*)&bhs);
-            break;
+        for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+        {
+            iSCSIConnection * connection = session->connections[connectionId];
             
-        case kiSCSIPDUOpCodeReject:
-            owner->ProcessReject(session,connection,(iSCSIPDURejectBHS*)&bhs);
-            break;
+            if(!connection || connection->pingTimerEventSource != sender)
+                continue;
             
-        case kiSCSIPDUOpCodeTaskMgmtRsp:
-            owner->ProcessTaskMgmtRsp(session,connection,(iSCSIPDUTaskMgmtRspBHS*)&bhs);
-            break;
+            // Idle connections are pinged as well, so that a dead connection
+            // is found before a task is sent on it
+            if(connection->taskQueue->isEnabled() && !connection->livenessProbePending)
+                connection->livenessProbePending = hba->QueueLatencyProbe(session,connection);
             
-        // Catch-all for anything else...
-        default: break;
-    };
-    return true;
+            if(connection->pingIntervalMs)
+                sender->setTimeoutMS(connection->pingIntervalMs);
+            return;
+        }
+    }
 }
 
-/** This function has been overloaded to provide additional task-timing
- *  support for multiple connections.
- *  @param parallelRequest the request to complete.
- *  @param completionStatus status of the request.
- *  @param serviceResponse the SCSI service response. */
-void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
-                                           iSCSIConnection * connection,
-                                           SCSIParallelTaskIdentifier parallelRequest,
-                                           SCSITaskStatus completionStatus,
-                                           SCSIServiceResponse serviceResponse)
+/*! Adds a round-trip time measurement to a connection's smoothed
+ *  round-trip time and mean deviation (as TCP does, see RFC6298).
+ *  @param connection the connection.
+ *  @param RTTUs the measured round-trip time (us). */
+void iSCSIVirtualHBA::UpdateConnectionRTT(iSCSIConnection * connection,UInt32 RTTUs)
 {
-    if(GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_NoDataTransfer) {
-        super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
-        return;
+    if(connection->RTTSampleCount == 0) {
+        connection->smoothedRTTUs = RTTUs;
+        connection->RTTVarianceUs = RTTUs / 2;
     }
-
-    // Compute the time it took to complete this task; first grab the timestamp
-    // when task was first started
-    clock_usec_t usecs;
-    clock_sec_t  secs;
-    clock_get_system_microtime(&secs,&usecs);
-    
-    UInt64 duration_usecs = (secs  - connection->taskStartTimeSec)*1e6 +
-                            (usecs - connection->taskStartTimeUSec);
-    
-    // Calculate transfer speed over entire task...
-    UInt64 bytesTransferred = GetRequestedDataTransferCount(parallelRequest);
-
-    // Add newest measurement to list (overwriting oldest one)
-    connection->bytesPerSecondHistory[connection->bytesPerSecHistoryIdx]
-        = (UInt32)(bytesTransferred / (duration_usecs / 1.0e6));
-    
-    // Advance index so next oldest record is overwritten next time (roll over)
-    connection->bytesPerSecHistoryIdx++;
-    if(connection->bytesPerSecHistoryIdx == connection->kBytesPerSecAvgWindowSize)
-    {
-        connection->bytesPerSecHistoryIdx = 0;
+    else {
+        UInt32 deviation = (connection->smoothedRTTUs > RTTUs) ? connection->smoothedRTTUs - RTTUs
+                                                                : RTTUs - connection->smoothedRTTUs;
         
-        // Queue a latency measurement operation
-        UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0,0);
-        connection->taskQueue->queueTask(initiatorTaskTag);
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R
+        connection->RTTVarianceUs = (UInt32)(((UInt64)connection->RTTVarianceUs*3 + deviation) / 4);
+        connection->smoothedRTTUs = (UInt32)(((UInt64)connection->smoothedRTTUs*7 + RTTUs) / 8);
     }
     
-    // Iterate over last few points, compute peak value
-    connection->bytesPerSecond = 0;
-    for(UInt8 i = 0; i < connection->kBytesPerSecAvgWindowSize; i++)
-        if(connection->bytesPerSecond < connection->bytesPerSecondHistory[i])
-            connection->bytesPerSecond = connection->bytesPerSecondHistory[i];
-    
-    DBLog("iscsi: Bytes per second: %d (sid: %d, cid: %d)\n",
-          connection->bytesPerSecond,session->sessionId,connection->cid);
-
-    super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
+    connection->RTTSampleCount++;
 }
 
-void iSCSIVirtualHBA::ProcessTaskMgmtRsp(iSCSISession * session,
-                                         iSCSIConnection * connection,
-                                         iSCSIPDU::iSCSIPDUTaskMgmtRspBHS * bhs)
+/*! Applies the socket policy of a connection as it enters the full
+ *  feature phase.  Nagle's algorithm is disabled, since PDUs are already
+ *  gathered into batches (see BeginTransmitBatch()).  TCP keepalive is
+ *  enabled so that a dead connection is dropped within the session's
+ *  DefaultTime2Retain, while its tasks can still be moved to another
+ *  connection, even if NOP-outs are disabled.  An explicit socket buffer
+ *  size is applied now (see ResizeSocketBuffers()).
+ *  @param session the session associated with the connection.
+ *  @param connection the connection. */
+void iSCSIVirtualHBA::ApplySocketPolicy(iSCSISession * session,iSCSIConnection * connection)
 {
-    // Extract LUN and function code from task tag
-    UInt8 taskMgmtFunction = ParseInitiatorTaskTagForTaskId(bhs->initiatorTaskTag);
-    UInt64 LUN = ParseInitiatorTaskTagForLUN(bhs->initiatorTaskTag);
+    int value = 1;
+    sock_setsockopt(connection->socket,IPPROTO_TCP,TCP_NODELAY,&value,sizeof(value));
     
-    // Setup the SCSI response code based on response from PDU
-    SCSIServiceResponse serviceResponse;
-    enum iSCSIPDUTaskMgmtRspCodes rspCode = (iSCSIPDUTaskMgmtRspCodes)bhs->response;
+    // The idle time and the probes each take half of the time allowed; with
+    // no time to retain tasks, the task timeout is allowed instead
+    UInt32 detectionTimeSec = session->defaultTime2Retain;
     
-    switch(rspCode)
-    {
-        case kiSCSIPDUTaskMgmtFuncComplete:
-            serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
-        break;
-        case kiSCSIPDUTaskMgmtFuncRejected:
-            serviceResponse = kSCSIServiceResponse_FUNCTION_REJECTED;
-        break;
-        case kiSCSIPDUTaskMgmtInvalidLUN:
-        case kiSCSIPDUTaskMgmtAuthFail:
-        case kiSCSIPDUTaskMgmtFuncUnsupported:
-        case kiSCSIPDUTaskMgmtInvalidTask:
-        case kiSCSIPDUTaskMgmtReassignUnsupported:
-        case kiSCSIPDUTaskMgmtTaskAllegiant:
-        default:
-            serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-        break;
-    };
-
-    // Tell the SCSI stack that the function completed or failed
-    if(taskMgmtFunction == kiSCSIPDUTaskMgmtFuncAbortTask)
-        CompleteAbortTask(session->sessionId, LUN, 0, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncAbortTaskSet)
-        CompleteAbortTaskSet(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncClearACA)
-        CompleteClearACA(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncClearTaskSet)
-        CompleteClearTaskSet(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncLUNReset)
-        CompleteLogicalUnitReset(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncTargetWarmReset)
-        CompleteTargetReset(session->sessionId, serviceResponse);
+    if(detectionTimeSec == 0)
+        detectionTimeSec = kiSCSITaskTimeoutMs / 1000;
     
-    // Task is complete, remove it from the queue
-    connection->taskQueue->completeCurrentTask();
+    int idleTimeSec = max(detectionTimeSec / 2,1);
+    int intervalSec = max(detectionTimeSec / (2*kKeepAliveProbeCount),1);
+    int probeCount = kKeepAliveProbeCount;
+    
+    sock_setsockopt(connection->socket,SOL_SOCKET,SO_KEEPALIVE,&value,sizeof(value));
+    sock_setsockopt(connection->socket,IPPROTO_TCP,TCP_KEEPALIVE,&idleTimeSec,sizeof(idleTimeSec));
+    sock_setsockopt(connection->socket,IPPROTO_TCP,TCP_KEEPINTVL,&intervalSec,sizeof(intervalSec));
+    sock_setsockopt(connection->socket,IPPROTO_TCP,TCP_KEEPCNT,&probeCount,sizeof(probeCount));
+    
+    ResizeSocketBuffers(connection);
 }
 
-void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
-                                   iSCSIConnection * connection,
-                                   iSCSIPDU::iSCSIPDUNOPInBHS * bhs)
+/*! Sizes a connection's socket send and receive buffers.  An explicit
+ *  size set through the user client is applied once, when it changes.
+ *  Otherwise a buffer is set only if kSocketBufferBDPMultiple times the
+ *  bandwidth-delay product, measured from the connection's throughput and
+ *  smoothed round-trip time, is larger than the buffer's current size, up
+ *  to the connection's socket buffer limit.  Setting a buffer turns off
+ *  the system's autotuning of it, so a buffer the system has already
+ *  grown is left alone, and buffers are never shrunk, since that would
+ *  close the TCP window on data already in flight.
+ *  @param connection the connection. */
+void iSCSIVirtualHBA::ResizeSocketBuffers(iSCSIConnection * connection)
 {
-    const size_t length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+    UInt64 bufferSize = connection->socketBufferSize;
+    const bool explicitSize = (bufferSize != 0);
     
-    // Grab data payload (could be ping data or other data, if it exists)
-    UInt8 data[length];
-
-    if(length > 0 && RecvPDUData(session,connection,data,length,MSG_WAITALL) != 0) {
-        DBLog("iscsi: Failed to retreive NOP in data (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
+    // The system may round an explicit size, so it is compared against
+    // the size last applied rather than the live sizes
+    if(explicitSize && bufferSize == connection->socketBufferSizeApplied)
         return;
-    }
     
-    // Response to a previous ping from this initiator
-    if(bhs->targetTransferTag == kiSCSIPDUTargetTransferTagReserved)
+    if(!explicitSize)
     {
-        // Will use this to calculate latency; our initiated NOP contained
-        // a timestamp that is sent back to us
-        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t)))
+        if(connection->bytesPerSecond == 0 || connection->smoothedRTTUs == 0)
             return;
         
-        clock_sec_t secs_stamp, secs;
-        clock_usec_t usecs_stamp, usecs;
+        bufferSize = (UInt64)connection->bytesPerSecond*connection->smoothedRTTUs/1000000*kSocketBufferBDPMultiple;
         
-        // Grab timestamp from NOP-in PDU
-        memcpy(&secs_stamp,data,sizeof(secs_stamp));
-        memcpy(&usecs_stamp,data+sizeof(secs_stamp),sizeof(usecs_stamp));
-        
-        // Grab current system uptime
-        clock_get_system_microtime(&secs,&usecs);
+        if(bufferSize > connection->socketBufferLimit)
+            bufferSize = connection->socketBufferLimit;
+    }
     
-        connection->latency_ms = (secs - secs_stamp)*1e3 + (usecs - usecs_stamp)/1e3;
+    // Otherwise compare against the live sizes, which autotuning may have
+    // grown.  Either buffer may be refused if it exceeds the system's
+    // limit; the applied sizes can be read back through the user client
+    const int options[] = { SO_SNDBUF, SO_RCVBUF };
+    int value = (int)bufferSize;
+    
+    for(size_t idx = 0; idx < sizeof(options)/sizeof(options[0]); idx++)
+    {
+        int currentSize = 0;
+        int valueSize = sizeof(currentSize);
         
-        DBLog("iscsi: Connection latency: %d ms (sid: %d, cid: %d)\n",
-              connection->latency_ms,session->sessionId,connection->cid);
+        if(!explicitSize &&
+           (sock_getsockopt(connection->socket,SOL_SOCKET,options[idx],&currentSize,&valueSize) ||
+            currentSize >= value))
+            continue;
         
-        // Remove latency measurement task from queue
-        connection->taskQueue->completeCurrentTask();
+        sock_setsockopt(connection->socket,SOL_SOCKET,options[idx],&value,sizeof(value));
     }
-    // The target initiated this ping, just copy parameters and respond
-    else {
+    
+    if(explicitSize)
+        connection->socketBufferSizeApplied = (UInt32)bufferSize;
+}
 
-        iSCSIPDUNOPOutBHS bhsRsp = iSCSIPDUNOPOutBHSInit;
-        bhsRsp.opCode |= kiSCSIPDUImmediateDeliveryFlag;
-        bhsRsp.LUN = bhs->LUN;
-        bhsRsp.targetTransferTag = bhs->targetTransferTag;
-        bhsRsp.initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
-        
-        if(SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsRsp,NULL,data,length))
-            DBLog("iscsi: Failed to send NOP response (sid: %d, cid: %d)\n",
-                  session->sessionId,connection->cid);
-    }
+/*! Adds a measurement of the time a target took to send the first R2T
+ *  of a write to the connection's smoothed R2T latency.
+ *  @param connection the connection.
+ *  @param latencyUs the measured latency (us). */
+void iSCSIVirtualHBA::UpdateConnectionR2TLatency(iSCSIConnection * connection,UInt32 latencyUs)
+{
+    // SRTT-style smoothing (7/8 old + 1/8 new); zero means no measurement
+    if(connection->smoothedR2TLatencyUs == 0)
+        connection->smoothedR2TLatencyUs = latencyUs ? latencyUs : 1;
+    else
+        connection->smoothedR2TLatencyUs =
+            (UInt32)(((UInt64)connection->smoothedR2TLatencyUs*7 + latencyUs) / 8);
 }
 
-void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
-                                          iSCSIConnection * connection,
-                                          iSCSIPDU::iSCSIPDUSCSIRspBHS * bhs)
+/*! Gets the time to wait for a NOP-out to be answered before the
+ *  connection is timed out.  This is the retransmission timeout derived
+ *  from the connection's round-trip time (see UpdateConnectionRTT()),
+ *  clamped between kTaskDeadlineMinMs and kiSCSITaskTimeoutMs, or the
+ *  session's task deadline until the round-trip time is known.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection.
+ *  @return the timeout (ms). */
+UInt32 iSCSIVirtualHBA::GetPingTimeoutMs(iSCSISession * session,iSCSIConnection * connection)
 {
-    // Byte size of sense data (SAM)
-    const UInt8 senseDataHeaderSize = 2;
+    if(connection->RTTSampleCount == 0)
+        return session->taskDeadlineMs;
     
-    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
-    UInt8 data[length];
-    memset(data, length, 0);
-    if(length > 0) {
-        if(RecvPDUData(session,connection,data,length,MSG_WAITALL))
-            DBLog("iscsi: Error retrieving data segment (sid: %d, cid: %d)\n",
-                  session->sessionId,connection->cid);
-        else
-            DBLog("iscsi: Received sense data (sid: %d, cid: %d)\n",
-                  session->sessionId,connection->cid);
-    }
+    // RTO = SRTT + 4 * RTTVAR
+    UInt64 timeoutMs = ((UInt64)connection->smoothedRTTUs + 4*(UInt64)connection->RTTVarianceUs) / 1000;
+    
+    if(timeoutMs < kTaskDeadlineMinMs)
+        timeoutMs = kTaskDeadlineMinMs;
+    else if(timeoutMs > kiSCSITaskTimeoutMs)
+        timeoutMs = kiSCSITaskTimeoutMs;
+    
+    return (UInt32)timeoutMs;
+}
 
-    // Grab parallel task associated with this PDU, indexed by task tag
-    SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+/*! Computes the time a task of a session may go without progress
+ *  before its connection is checked: kTaskDeadlineMultiplier times the
+ *  99.9th percentile of the latencies counted by the latency statistics
+ *  of the session's connections, clamped between kTaskDeadlineMinMs and
+ *  kiSCSITaskTimeoutMs.  Until enough latencies have been recorded
+ *  kiSCSITaskTimeoutMs is used.
+ *  @param session the session. */
+void iSCSIVirtualHBA::UpdateTaskDeadline(iSCSISession * session)
+{
+    // Connection statistics start over when a connection is replaced, so
+    // the deadline also follows changes in the target's latency
+    UInt64 taskCount = 0;
     
-    if(!parallelTask)
+    for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
     {
-        DBLog("iscsi: Task not found, flushing stream (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
+        iSCSIConnection * connection = session->connections[connectionId];
         
-        // Flush stream
-        UInt8 buffer[length];
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+        if(!connection)
+            continue;
         
+        for(UInt8 latencyClass = 0; latencyClass < kiSCSIHBALatencyClassCount; latencyClass++)
+            taskCount += connection->latencyStats.histograms[latencyClass].taskCount;
+    }
+    
+    if(taskCount < kTaskDeadlineMinSamples) {
+        session->taskDeadlineMs = kiSCSITaskTimeoutMs;
         return;
     }
     
-    SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
-
-    // Process sense data if the PDU came with any...
-    bool senseDataPresent = false;
-    if(length >= senseDataHeaderSize)
+    // Find the bucket that holds the 99.9th percentile, counting down
+    // from the slowest tasks; its upper bound is used for the percentile
+    UInt64 tail = taskCount / 1000;
+    UInt64 count = 0;
+    UInt8 bucket = kiSCSIHBALatencyBuckets;
+    
+    while(bucket > 0 && count <= tail)
     {
-        // First two bytes of the data segment are the size of the sense data
-        UInt16 senseDataLength = *((UInt16*)&data[0]);
-        senseDataLength = OSSwapBigToHostInt16(senseDataLength);
-        
-        if(length < senseDataLength + senseDataHeaderSize) {
-            DBLog("iscsi: Received invalid sense data (sid: %d, cid: %d)\n",
-                  session->sessionId,connection->cid);
-        }
-        else {
-        
-            // Remaining data is sense data, advance pointer by two bytes to get this
-            SCSI_Sense_Data * newSenseData = (SCSI_Sense_Data *)(data + senseDataHeaderSize);
+        bucket--;
         
-            // Incorporate sense data into the task
-            SetAutoSenseData(parallelTask,newSenseData,senseDataLength);
+        for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+        {
+            iSCSIConnection * connection = session->connections[connectionId];
             
-            senseDataPresent = true;
+            if(!connection)
+                continue;
             
-            DBLog("iscsi: Processed sense data (sid: %d, cid: %d)\n",
-                  session->sessionId,connection->cid);
+            for(UInt8 latencyClass = 0; latencyClass < kiSCSIHBALatencyClassCount; latencyClass++)
+                count += connection->latencyStats.histograms[latencyClass].buckets[bucket];
         }
     }
     
-    // Set the SCSI completion status and service response, let SCSI stack
-    // know that we're done with this task...
+    UInt64 deadlineMs = (GetLatencyBucketLimit(bucket) * kTaskDeadlineMultiplier) / 1000;
     
-    SCSITaskStatus completionStatus = (SCSITaskStatus)bhs->status;
+    if(deadlineMs < kTaskDeadlineMinMs)
+        deadlineMs = kTaskDeadlineMinMs;
+    else if(deadlineMs > kiSCSITaskTimeoutMs)
+        deadlineMs = kiSCSITaskTimeoutMs;
     
-    // If sense data has been included along with a check condition response,
-    // the macOS SCSI stack expects that the task status is "GOOD". Otherwise,
-    // it queries for auto sense data.
-    if(completionStatus == kSCSITaskStatus_CHECK_CONDITION && senseDataPresent)
-        completionStatus = kSCSITaskStatus_GOOD;
+    if(session->taskDeadlineMs != deadlineMs)
+        DBLog("iscsi: Task deadline %llu ms (sid: %d)\n",deadlineMs,session->sessionId);
     
-    SCSIServiceResponse serviceResponse;
+    session->taskDeadlineMs = (UInt32)deadlineMs;
+}
 
-    if(bhs->response == kiSCSIPDUSCSICmdCompleted)
-        serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
-    else
-        serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
-    CompleteParallelTask(session,connection,parallelTask,completionStatus,serviceResponse);
-    
-    // Task is complete, remove it from the queue
-    connection->taskQueue->completeCurrentTask();
+/*! Gets the current time in ticks of the task timer wheels.
+ *  @return the current tick. */
+UInt64 iSCSIVirtualHBA::GetTaskTimerTick()
+{
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_system_microtime(&secs,&usecs);
     
-    DBLog("iscsi: Processed SCSI response (sid: %d, cid: %d)\n",
-          session->sessionId,connection->cid);
-
+    return ((UInt64)secs*1000 + usecs/1000) / kTaskTimerTickMs;
 }
 
-void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
-                                    iSCSIConnection * connection,
-                                    iSCSIPDU::iSCSIPDUDataInBHS * bhs)
+/*! Adds a completed task to the latency statistics of the connection
+ *  it was sent on and of the logical unit it was addressed to.  This is
+ *  called only from the session's work loop, so the statistics have a
+ *  single writer and are updated without locks.  The session's task
+ *  deadline is periodically recomputed from the statistics.
+ *  @param session the session associated with the task.
+ *  @param connection the connection the task was sent on.
+ *  @param parallelTask the completed task.
+ *  @param latencyUs the time the task took to complete (microseconds). */
+void iSCSIVirtualHBA::RecordTaskStatistics(iSCSISession * session,
+                                           iSCSIConnection * connection,
+                                           SCSIParallelTaskIdentifier parallelTask,
+                                           UInt64 latencyUs)
 {
-    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
-
-    // Grab parallel task associated with this PDU, indexed by task tag
-    SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+    UInt8 latencyClass = kiSCSIHBALatencyClassOther;
     
-    if(length == 0)
+    switch(GetDataTransferDirection(parallelTask))
     {
-        DBLog("iscsi: Missing data segment in data-in PDU (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-        return;
-    }
+        case kSCSIDataTransfer_FromTargetToInitiator:
+            latencyClass = kiSCSIHBALatencyClassRead;
+            break;
+        case kSCSIDataTransfer_FromInitiatorToTarget:
+            latencyClass = kiSCSIHBALatencyClassWrite;
+            break;
+    };
     
-    UInt8 buffer[length];
+    // The LUN statistics are allocated here rather than when the LUN is
+    // found, since the HBA isn't told about LUNs; the pointer is published
+    // after the statistics are initialized, for readers in the user client
+    SCSILogicalUnitNumber LUN = GetLogicalUnitNumber(parallelTask);
+    iSCSIHBALatencyStatistics * lunStats = NULL;
     
-    // If task not found, flush stream
-    if(!parallelTask)
+    if(LUN < session->kMaxLatencyStatsLUNs)
     {
-        DBLog("iscsi: Task not found (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
-        return;
+        if(!(lunStats = session->lunLatencyStats[LUN]))
+        {
+            if((lunStats = (iSCSIHBALatencyStatistics*)IOMalloc(sizeof(iSCSIHBALatencyStatistics)))) {
+                ResetLatencyStatistics(lunStats);
+                __atomic_store_n(&session->lunLatencyStats[LUN],lunStats,__ATOMIC_RELEASE);
+            }
+        }
     }
     
-    // System buffer offset for this PDU data segment...
-    UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+    UInt64 bytesTransferred = GetRealizedDataTransferCount(parallelTask);
+    UInt8 bucket = GetLatencyBucket(latencyUs);
     
-    if(RecvPDUData(session,connection,buffer,length,0))
-        DBLog("iscsi: Error in retrieving data segment length (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-    else {
-        IOMemoryDescriptor  * dataDesc = GetDataBuffer(parallelTask);
-        dataDesc->writeBytes(dataOffset,buffer,length);
-        SetRealizedDataTransferCount(parallelTask,dataOffset+length);
-        connection->dataToTransfer -= length;
-    }
+    iSCSIHBALatencyHistogram * histograms[] = {
+        &connection->latencyStats.histograms[latencyClass],
+        lunStats ? &lunStats->histograms[latencyClass] : NULL
+    };
     
-    // If the PDU contains a status response, complete this task
-    if((bhs->flags & kiSCSIPDUDataInFinalFlag) && (bhs->flags & kiSCSIPDUDataInStatusFlag))
+    for(UInt8 idx = 0; idx < sizeof(histograms)/sizeof(histograms[0]); idx++)
     {
-        SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
+        iSCSIHBALatencyHistogram * histogram = histograms[idx];
         
-        CompleteParallelTask(session,
-                             connection,
+        if(!histogram)
+            continue;
+        
+        histogram->taskCount++;
+        histogram->byteCount += bytesTransferred;
+        histogram->totalLatencyUs += latencyUs;
+        histogram->buckets[bucket]++;
+        
+        if(histogram->maxLatencyUs < latencyUs)
+            histogram->maxLatencyUs = latencyUs;
+    }
+    
+    if(++session->taskLatencySamples % kTaskDeadlineUpdateInterval == 0)
+        UpdateTaskDeadline(session);
+}
+
+/*! Resets latency statistics, marking the current time as the time
+ *  that collection began.
+ *  @param stats the statistics to reset. */
+void iSCSIVirtualHBA::ResetLatencyStatistics(iSCSIHBALatencyStatistics * stats)
+{
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_system_microtime(&secs,&usecs);
+    
+    memset(stats,0,sizeof(iSCSIHBALatencyStatistics));
+    stats->startTimeUs = (UInt64)secs*1000000 + usecs;
+}
+
+/*! Gets the latency histogram bucket that counts a latency (see
+ *  kiSCSIHBALatencyBuckets).
+ *  @param latencyUs the latency (microseconds).
+ *  @return the bucket index. */
+UInt8 iSCSIVirtualHBA::GetLatencyBucket(UInt64 latencyUs)
+{
+    const UInt8 subBucketBits = __builtin_ctz(kiSCSIHBALatencySubBuckets);
+    
+    if(latencyUs < kiSCSIHBALatencySubBuckets)
+        return (UInt8)latencyUs;
+    
+    // The power of two selects a group of buckets, and the bits that
+    // follow the leading one select the bucket within the group
+    UInt8 exponent = 63 - __builtin_clzll(latencyUs);
+    UInt64 subBucket = (latencyUs >> (exponent - subBucketBits)) - kiSCSIHBALatencySubBuckets;
+    UInt64 bucket = (exponent - subBucketBits + 1)*kiSCSIHBALatencySubBuckets + subBucket;
+    
+    if(bucket >= kiSCSIHBALatencyBuckets)
+        bucket = kiSCSIHBALatencyBuckets - 1;
+    
+    return (UInt8)bucket;
+}
+
+/*! Gets the largest latency that a latency histogram bucket counts (see
+ *  kiSCSIHBALatencyBuckets).
+ *  @param bucket the bucket index.
+ *  @return the latency (microseconds). */
+UInt64 iSCSIVirtualHBA::GetLatencyBucketLimit(UInt8 bucket)
+{
+    const UInt8 subBucketBits = __builtin_ctz(kiSCSIHBALatencySubBuckets);
+    
+    if(bucket < kiSCSIHBALatencySubBuckets)
+        return bucket;
+    
+    UInt8 group = bucket >> subBucketBits;
+    UInt64 subBucket = bucket & (kiSCSIHBALatencySubBuckets - 1);
+    
+    return ((kiSCSIHBALatencySubBuckets + subBucket + 1) << (group - 1)) - 1;
+}
+
+/*! Handles connection timeouts.
+ *  @param sessionId the session associated with the timed-out connection.
+ *  @param connectionId the connection that timed out. */
+void iSCSIVirtualHBA::HandleConnectionTimeout(SessionIdentifier sessionId,ConnectionIdentifier connectionId)
+{
+    // If this is the last connection, release the session...
+    iSCSISession * session;
+    
+    if(!(session = sessionList[sessionId]))
+       return;
+
+    DBLog("iscsi: Connection timeout (sid: %d, cid: %d)\n",sessionId,connectionId);
+    
+    ConnectionIdentifier connectionCount = 0;
+    for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+        if(session->connections[connectionId])
+            connectionCount++;
+    
+    // At error recovery level 2 the connection's tasks are moved to another
+    // connection rather than failed
+    if(connectionCount > 1) {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(connection)
+            ReassignConnectionTasks(session,connection);
+        
+        DeactivateConnection(sessionId,connectionId);
+    }
+    else
+        DeactivateAllConnections(sessionId);
+
+    // Send a notification to the daemon; if the daemon does not respond then
+    // release the session or connection as appropriate
+    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)getClient();
+    
+    if(client)
+        client->sendTimeoutMessageNotification(sessionId,connectionId);
+    else
+    {
+        if(connectionCount > 1)
+            ReleaseConnection(sessionId,connectionId);
+        else
+            ReleaseSession(sessionId);
+    }
+}
+
+SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentifier parallelTask)
+{
+    // Here we set an (iSCSI) initiator task tag for the SCSI task and queue
+    // the iSCSI task for later processing
+    SCSITargetIdentifier targetId   = GetTargetIdentifier(parallelTask);
+    SCSILogicalUnitNumber LUN       = GetLogicalUnitNumber(parallelTask);
+    
+    iSCSISession * session = sessionList[(SessionIdentifier)targetId];
+    
+    if(!session)
+        return kSCSIServiceResponse_FUNCTION_REJECTED;
+    
+    // Determine which connection this task should be assigned to based on
+    // the scheduling policy configured for this session
+    iSCSIConnection * connection = SelectConnectionForTask(session,parallelTask);
+    
+    if(!connection)
+        return kSCSIServiceResponse_FUNCTION_REJECTED;
+    
+    // Associate a connection identifier with this task; this is used to
+    // maintain the connection associated with a task when only task information
+    // is available (e.g., in the case of a task timeout).
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    taskData->connectionId = connection->cid;
+    taskData->dataMap = NULL;
+    taskData->dataOutQueued = false;
+    taskData->dataOutHead = 0;
+    taskData->dataOutCount = 0;
+    taskData->unsolicitedDataLength = 0;
+    taskData->R2TLatencySampled = false;
+    taskData->expDataSN = 0;
+    taskData->missingDataPDUs = 0;
+    taskData->completionPending = false;
+    taskData->dataACKPending = false;
+    taskData->reassignState = kiSCSITaskReassignNone;
+    
+    // Build and set iSCSI initiator task tag; the tag refers to the slot that
+    // holds the task, so that PDUs are matched to the task with a single lookup
+    UInt32 initiatorTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeSCSITask,LUN,connection,parallelTask);
+    
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return kSCSIServiceResponse_FUNCTION_REJECTED;
+    
+    SetControllerTaskIdentifier(parallelTask,initiatorTaskTag);
+    taskData->initiatorTaskTag = initiatorTaskTag;
+    
+    // Add the amount of data that we need to transfer to this connection
+    OSAddAtomic64(GetRequestedDataTransferCount(parallelTask),&connection->dataToTransfer);
+    
+    DBLog("iscsi: Transfer size: %llu (sid: %d, cid: %d)\n",
+          connection->dataToTransfer,session->sessionId,connection->cid);
+    
+    // Queue task in the event source (we'll remove it from the queue when were
+    // done processing the task)
+    connection->taskQueue->queueTask(initiatorTaskTag);
+    
+    DBLog("iscsi: Queued task %#x (sid: %d, cid: %d)\n",
+          initiatorTaskTag,session->sessionId,connection->cid);
+
+    return kSCSIServiceResponse_Request_In_Process;
+}
+
+void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
+                                                iSCSISession * session,
+                                                iSCSIConnection * connection,
+                                                UInt32 initiatorTaskTag)
+{
+    iSCSITaskSlot * slot = owner->FindTaskSlot(session,initiatorTaskTag);
+    
+    // Task tag corresponding to a connection timeout measurement
+    if(slot && slot->taskType == kInitiatorTaskTypeLatency)  {
+        owner->MeasureConnectionLatency(session,connection,initiatorTaskTag);
+        return;
+    }
+    
+    // Task tag corresponding to a task management request
+    if(slot && slot->taskType == kInitiatorTaskTypeTaskMgmt)  {
+        owner->BeginTaskMgmtRequest(session,connection,slot);
+        return;
+    }
+    
+    // Task tag corresponding to the logout of a failed connection
+    if(slot && slot->taskType == kInitiatorTaskTypeLogout)  {
+        owner->BeginLogoutRequest(session,connection,slot);
+        return;
+    }
+    
+    // Task tag corresponding to a renegotiation of MaxRecvDataSegmentLength
+    if(slot && slot->taskType == kInitiatorTaskTypeText)  {
+        owner->BeginTextRequest(session,connection,slot);
+        return;
+    }
+    
+    // Grab parallel task associated with this iSCSI task
+    SCSIParallelTaskIdentifier parallelTask = slot ? slot->parallelTask : NULL;
+    
+    if(!parallelTask)  {
+        DBLog("iscsi: Task not found, flushing stream (BeginTaskOnWorkloopThread) (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        connection->taskQueue->completeTask(initiatorTaskTag);
+        return;
+    }
+    
+    // Extract information about this SCSI task
+    SCSITaskAttribute attribute     = owner->GetTaskAttribute(parallelTask);
+    UInt8   transferDirection       = owner->GetDataTransferDirection(parallelTask);
+    UInt32  transferSize            = (UInt32)owner->GetRequestedDataTransferCount(parallelTask);
+    UInt8   cdbSize                 = owner->GetCommandDescriptorBlockSize(parallelTask);
+    
+    DBLog("iscsi: Starting task %#x (sid: %d, cid: %d)\n",
+          initiatorTaskTag,session->sessionId,connection->cid);
+    
+    // Timestamp the task indicating when we started processing it (many
+    // tasks may be outstanding on the connection at once)
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)owner->GetHBADataPointer(parallelTask);
+    clock_get_system_microtime(&(taskData->startTimeSec),
+                               &(taskData->startTimeUSec));
+    
+    iSCSIPDUSCSICmdBHS bhs  = iSCSIPDUSCSICmdBHSInit;
+    bhs.dataTransferLength  = OSSwapHostToBigInt32(transferSize);
+    
+    owner->GetLogicalUnitBytes(parallelTask,(SCSILogicalUnitBytes*)&bhs.LUN);
+
+    // The initiator task tag is just LUN and task identifier
+    bhs.initiatorTaskTag = initiatorTaskTag;
+    
+    if(transferDirection == kSCSIDataTransfer_FromInitiatorToTarget)
+        bhs.flags |= kiSCSIPDUSCSICmdFlagWrite;
+    else if(transferDirection == kSCSIDataTransfer_FromTargetToInitiator)
+        bhs.flags |= kiSCSIPDUSCSICmdFlagRead;
+    
+    // For CDB sizes less than 16 bytes, plug directly into SCSI command PDU
+    // (Currently, OS X doesn't support CDB's larger than 16 bytes, so
+    // there's no need for an iSCSI additional header segment for spillover).
+    switch(cdbSize) {
+        case kSCSICDBSize_6Byte:
+        case kSCSICDBSize_10Byte:
+        case kSCSICDBSize_12Byte:
+        case kSCSICDBSize_16Byte:
+            owner->GetCommandDescriptorBlock(parallelTask,&bhs.CDB);
+            break;
+    };
+    
+    // Setup the task attribute for this PDU
+    switch(attribute) {
+        case kSCSITask_ACA:
+            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrACA; break;
+        case kSCSITask_HEAD_OF_QUEUE:
+            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrHead; break;
+        case kSCSITask_ORDERED:
+            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrOrdered; break;
+        case kSCSITask_SIMPLE:
+            bhs.flags |= kiSCSIPDUSCSICmdTaskAttrSimple; break;
+    };
+    
+    // The SCSI layer's timeout is a backstop; the task's deadline (derived
+    // from the latencies observed on this session) is what detects a dead
+    // connection (see HandleTaskDeadline())
+    owner->SetTimeoutForTask(parallelTask,kiSCSITaskTimeoutMs);
+    owner->ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+    
+    // Map the task's buffer so that data-in PDUs can be received directly
+    // into it and data-out PDUs can be sent directly from it
+    if(transferDirection != kSCSIDataTransfer_NoDataTransfer)
+        owner->MapDataBufferForTask(parallelTask);
+    
+    // For non-WRITE commands, send off SCSI command PDU immediately.
+    if(transferDirection != kSCSIDataTransfer_FromInitiatorToTarget) {
+        bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
+        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+        return;
+    }
+    
+    UInt32 dataLength = 0;
+    const void * data = NULL;
+    
+    // First use immediate data to send data with command PDU...
+    if(session->immediateData) {
+        
+        // Either send the max allowed data (immediate data length) or
+        // all of the data if it is lesser than the max allowed limit
+        dataLength = min(connection->immediateDataLength,transferSize);
+        
+        data = owner->GetDataOutBuffer(connection,parallelTask,0,dataLength);
+        
+        // Send the command without immediate data if the buffer is unavailable
+        // (the data will follow in data-out PDUs instead)
+        if(!data)
+            dataLength = 0;
+    }
+    
+    // ...then follow up with unsolicited data-out PDUs up to the
+    // firstBurstLength bytes, unless the target is better left to solicit
+    // the data (the immediate data length never exceeds the first burst)
+    UInt32 unsolicitedLength = 0;
+    
+    if(!session->initialR2T && owner->ShouldSendUnsolicitedData(session,connection,transferSize))
+        unsolicitedLength = min(session->firstBurstLength,transferSize) - dataLength;
+    
+    // If we need to wait for an R2T or we've transferred all data
+    // as immediate data then no additional data will follow this PDU...
+    if(unsolicitedLength == 0)
+        bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
+    
+    owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,data,dataLength);
+    
+    owner->IncrementRealizedDataTransferCount(parallelTask,dataLength);
+    OSAddAtomic64(-(SInt64)dataLength,&connection->dataToTransfer);
+    
+    if(unsolicitedLength != 0) {
+        taskData->unsolicitedDataLength = unsolicitedLength;
+        
+        if(!owner->QueueDataOutForTask(session,connection,parallelTask,dataLength,unsolicitedLength,bhs.LUN,
+                                       kiSCSIPDUTargetTransferTagReserved))
+            owner->HandleTaskProtocolError(session,connection,parallelTask,"unsolicited data not queued");
+    }
+}
+
+bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
+                                                  iSCSISession * session,
+                                                  iSCSIConnection * connection)
+{
+    // Quit if the connection isn't active (if it is not in full feature phase)
+    if(!owner || !session || !connection)
+        return false;
+    
+    const SessionIdentifier sessionId = session->sessionId;
+    const ConnectionIdentifier connectionId = connection->cid;
+    iSCSIPDURecvContext * context = &connection->recvContext;
+    
+    connection->recvWakeupCount++;
+    
+    // Responses to received PDUs (e.g., data-out PDUs for R2Ts and NOP-Outs)
+    // are gathered and sent together when this pass ends
+    owner->BeginTransmitBatch(connection);
+    
+    // Receive whatever is available at the socket, a piece of a PDU at a time,
+    // and process PDUs as they are completed.  Data is received in large
+    // chunks into the staging buffer and PDUs are taken from there, except for
+    // large data segments, which are received directly into their destination.
+    // The PDU in progress is kept in the connection's receive context if the
+    // socket runs dry.
+    for(UInt32 pduCount = 0; pduCount < kMaxPDUsPerReceive;)
+    {
+        size_t length = 0;
+        bool digested = false;
+        void * buffer = iSCSIPDURecvGetBuffer(context,&length,&digested);
+        
+        size_t bytesRecv = 0;
+        errno_t error = 0;
+        bool staged = true;
+        
+        if(connection->recvBufferOffset == connection->recvBufferLength)
+        {
+            staged = !(context->stage == kiSCSIPDURecvStageData && length >= kRecvDirectThreshold);
+            
+            if(staged)
+                error = owner->RecvPDUBytes(connection,connection->recvBuffer,
+                                            connection->recvBufferSize,NULL,&bytesRecv);
+            else
+                error = owner->RecvPDUBytes(connection,buffer,length,
+                                            digested ? &context->dataDigest : NULL,
+                                            &bytesRecv);
+            
+            // Nothing more at the socket for now
+            if(error == EWOULDBLOCK) {
+                owner->EndTransmitBatch(session,connection);
+                return false;
+            }
+            
+            // Connection problems (or the target closed the connection)
+            if(error || bytesRecv == 0) {
+                DBLog("iscsi: Failed to receive PDU, error %d (sid: %d, cid: %d)\n",
+                      error,sessionId,connectionId);
+                owner->HandleConnectionTimeout(sessionId,connectionId);
+                return false;
+            }
+            
+            connection->recvCallCount++;
+            connection->recvByteCount += bytesRecv;
+            
+            if(staged) {
+                connection->recvBufferOffset = 0;
+                connection->recvBufferLength = (UInt32)bytesRecv;
+            }
+        }
+        
+        // Take what the current stage needs from the staging buffer
+        if(staged)
+        {
+            const UInt8 * src = connection->recvBuffer + connection->recvBufferOffset;
+            bytesRecv = min(length,connection->recvBufferLength - connection->recvBufferOffset);
+            
+            if(digested)
+                context->dataDigest = crc32c_copy(context->dataDigest,buffer,src,bytesRecv);
+            else
+                memcpy(buffer,src,bytesRecv);
+            
+            connection->recvBufferOffset += bytesRecv;
+        }
+        
+        switch(iSCSIPDURecvAdvance(context,bytesRecv,digested))
+        {
+            case kiSCSIPDURecvMore:
+                continue;
+                
+            case kiSCSIPDURecvHeaderComplete:
+                DBLog("iscsi: Received PDU type %#x (sid: %d, cid: %d)\n",
+                      context->bhs.opCode,sessionId,connectionId);
+                
+                if(!owner->BeginPDU(session,connection)) {
+                    owner->HandleConnectionTimeout(sessionId,connectionId);
+                    return false;
+                }
+                
+                // Wait for the data segment, if there is one
+                if(context->stage != kiSCSIPDURecvStageComplete)
+                    continue;
+                break;
+                
+            case kiSCSIPDURecvPDUComplete:
+                break;
+                
+            // The PDU can't be located in the stream; drop the connection
+            case kiSCSIPDURecvHeaderDigestError:
+                DBLog("iscsi: Failed header digest (sid: %d, cid: %d)\n",sessionId,connectionId);
+                owner->HandleConnectionTimeout(sessionId,connectionId);
+                return false;
+                
+            // Discard the PDU and ask the target to send it again
+            case kiSCSIPDURecvDataDigestError:
+                DBLog("iscsi: Failed data digest (sid: %d, cid: %d)\n",sessionId,connectionId);
+                owner->HandleDataDigestError(session,connection);
+                iSCSIPDURecvReset(context,connection->useHeaderDigest,connection->useDataDigest);
+                pduCount++;
+                continue;
+        };
+        
+        owner->ProcessPDU(session,connection);
+        connection->recvPDUCount++;
+        pduCount++;
+        
+        // Processing a PDU may release or deactivate the connection (e.g.,
+        // asynchronous messages); stop if that happened
+        if(owner->sessionList[sessionId] != session ||
+           session->connections[connectionId] != connection)
+            return false;
+        
+        // Send what was batched so far if the connection still exists
+        if(!connection->dataRecvEventSource->isEnabled()) {
+            owner->EndTransmitBatch(session,connection);
+            return false;
+        }
+        
+        iSCSIPDURecvReset(context,connection->useHeaderDigest,connection->useDataDigest);
+    }
+    
+    // Give other connections a chance; we'll be called again
+    if(owner->EndTransmitBatch(session,connection))
+        return false;
+    
+    return isPDUAvailable(connection);
+}
+
+/*! Called once the header of an incoming PDU has been received.  Updates
+ *  sequence numbers and selects the buffer that will receive the data
+ *  segment of the PDU, if any (data-in PDUs are received directly into
+ *  the task's buffer when possible).
+ *  @param session the session that is receiving the PDU.
+ *  @param connection the connection that is receiving the PDU.
+ *  @return true if the PDU may be received, false if the header is
+ *  invalid and the connection should be dropped. */
+bool iSCSIVirtualHBA::BeginPDU(iSCSISession * session,iSCSIConnection * connection)
+{
+    iSCSIPDURecvContext * context = &connection->recvContext;
+    
+    UpdateSequenceNumbers(session,connection,&context->bhs);
+    
+    if(context->dataLength == 0)
+        return true;
+    
+    // The target may not send more than we declared we can receive
+    if(context->dataLength > connection->dataRecvBufferSize)
+    {
+        DBLog("iscsi: Data segment exceeds MaxRecvDataSegmentLength (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        return false;
+    }
+    
+    UInt8 * data = connection->dataRecvBuffer;
+    
+    // Receive data-in segments directly into the task's buffer if it has
+    // been mapped; otherwise they go to the bounce buffer and are copied
+    if(context->bhs.opCode == kiSCSIPDUOpCodeDataIn)
+    {
+        iSCSIPDUDataInBHS * bhs = (iSCSIPDUDataInBHS*)&context->bhs;
+        SCSIParallelTaskIdentifier parallelTask =
+            FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+        
+        if(parallelTask)
+        {
+            iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+            IOMemoryMap * dataMap = taskData->dataMap;
+            UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+            
+            if(dataMap && (UInt64)dataOffset + context->dataLength <= dataMap->getLength())
+                data = (UInt8*)dataMap->getVirtualAddress() + dataOffset;
+        }
+    }
+    
+    iSCSIPDURecvSetDataBuffer(context,data);
+    return true;
+}
+
+/*! Processes a PDU once it has been received in full.
+ *  @param session the session that received the PDU.
+ *  @param connection the connection that received the PDU. */
+void iSCSIVirtualHBA::ProcessPDU(iSCSISession * session,iSCSIConnection * connection)
+{
+    iSCSIPDUTargetBHS * bhs = &connection->recvContext.bhs;
+    UInt8 * data = connection->recvContext.data;
+    
+    // Determine the kind of PDU that was received and process accordingly
+    enum iSCSIPDUTargetOpCodes opCode = (iSCSIPDUTargetOpCodes)bhs->opCode;
+    switch(opCode)
+    {
+        // Process a SCSI response
+        case kiSCSIPDUOpCodeSCSIRsp:
+            ProcessSCSIResponse(session,connection,(iSCSIPDUSCSIRspBHS*)bhs,data);
+        break;
+            
+        case kiSCSIPDUOpCodeDataIn:
+            ProcessDataIn(session,connection,(iSCSIPDUDataInBHS*)bhs,data);
+        break;
+            
+        case kiSCSIPDUOpCodeAsyncMsg:
+            ProcessAsyncMsg(session,connection,(iSCSIPDUAsyncMsgBHS*)bhs,data);
+            break;
+            
+        case kiSCSIPDUOpCodeNOPIn:
+            ProcessNOPIn(session,connection,(iSCSIPDUNOPInBHS*)bhs,data);
+            break;
+            
+        case kiSCSIPDUOpCodeR2T:
+            ProcessR2T(session,connection,(iSCSIPDUR2TBHS*)bhs);
+            break;
+            
+        case kiSCSIPDUOpCodeReject:
+            ProcessReject(session,connection,(iSCSIPDURejectBHS*)bhs,data);
+            break;
+            
+        case kiSCSIPDUOpCodeTaskMgmtRsp:
+            ProcessTaskMgmtRsp(session,connection,(iSCSIPDUTaskMgmtRspBHS*)bhs);
+            break;
+            
+        case kiSCSIPDUOpCodeLogoutRsp:
+            ProcessLogoutRsp(session,connection,(iSCSIPDULogoutRspBHS*)bhs);
+            break;
+            
+        case kiSCSIPDUOpCodeTextRsp:
+            ProcessTextRsp(session,connection,(iSCSIPDUTextRspBHS*)bhs,data);
+            break;
+            
+        // Catch-all for anything else...
+        default: break;
+    };
+}
+
+/** This function has been overloaded to provide additional task-timing
+ *  support for multiple connections.
+ *  @param parallelRequest the request to complete.
+ *  @param completionStatus status of the request.
+ *  @param serviceResponse the SCSI service response. */
+void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
+                                           iSCSIConnection * connection,
+                                           SCSIParallelTaskIdentifier parallelRequest,
+                                           SCSITaskStatus completionStatus,
+                                           SCSIServiceResponse serviceResponse)
+{
+    DequeueDataOutForTask(connection,parallelRequest);
+    UnmapDataBufferForTask(parallelRequest);
+    ReleaseTaskSlot(session,((iSCSIHBATaskData*)GetHBADataPointer(parallelRequest))->initiatorTaskTag);
+    
+    // Compute the time it took to complete this task; first grab the timestamp
+    // when task was first started
+    clock_usec_t usecs;
+    clock_sec_t  secs;
+    clock_get_system_microtime(&secs,&usecs);
+    
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelRequest);
+    
+    UInt64 duration_usecs = (secs  - taskData->startTimeSec)*1e6 +
+                            (usecs - taskData->startTimeUSec);
+    
+    // Task deadlines are derived from the latencies of tasks the target
+    // answered (tasks that failed locally say nothing about the target)
+    if(serviceResponse == kSCSIServiceResponse_TASK_COMPLETE) {
+        RecordTaskStatistics(session,connection,parallelRequest,duration_usecs);
+    }
+    
+    if(GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_NoDataTransfer) {
+        ReturnParallelTask(parallelRequest,completionStatus,serviceResponse);
+        return;
+    }
+    
+    // Calculate transfer speed over entire task...
+    UInt64 bytesTransferred = GetRequestedDataTransferCount(parallelRequest);
+
+    // Add newest measurement to list (overwriting oldest one)
+    connection->bytesPerSecondHistory[connection->bytesPerSecHistoryIdx]
+        = (UInt32)(bytesTransferred / (duration_usecs / 1.0e6));
+    
+    // Advance index so next oldest record is overwritten next time (roll over)
+    connection->bytesPerSecHistoryIdx++;
+    if(connection->bytesPerSecHistoryIdx == connection->kBytesPerSecAvgWindowSize)
+        connection->bytesPerSecHistoryIdx = 0;
+    
+    // Iterate over last few points, compute peak value
+    connection->bytesPerSecond = 0;
+    for(UInt8 i = 0; i < connection->kBytesPerSecAvgWindowSize; i++)
+        if(connection->bytesPerSecond < connection->bytesPerSecondHistory[i])
+            connection->bytesPerSecond = connection->bytesPerSecondHistory[i];
+    
+    DBLog("iscsi: Bytes per second: %d (sid: %d, cid: %d)\n",
+          connection->bytesPerSecond,session->sessionId,connection->cid);
+
+    ReturnParallelTask(parallelRequest,completionStatus,serviceResponse);
+}
+
+/*! Maps the data buffer of a task into the kernel's address space so
+ *  that PDU data segments can be transferred to and from the buffer
+ *  directly.  The mapping is kept until the task is completed.
+ *  @param parallelTask the task whose data buffer should be mapped.
+ *  @return true if the buffer was mapped. */
+bool iSCSIVirtualHBA::MapDataBufferForTask(SCSIParallelTaskIdentifier parallelTask)
+{
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    
+    if(taskData->dataMap)
+        return true;
+    
+    IOMemoryDescriptor * dataDesc = GetDataBuffer(parallelTask);
+    
+    if(!dataDesc)
+        return false;
+    
+    // The mapping covers the whole buffer; the SCSI family has already
+    // prepared (wired) the descriptor before handing the task to us
+    taskData->dataMap = dataDesc->createMappingInTask(kernel_task,0,kIOMapAnywhere);
+    
+    if(!taskData->dataMap)
+        DBLog("iscsi: Failed to map data buffer, using bounce buffer (ITT: %#x)\n",
+              (UInt32)GetControllerTaskIdentifier(parallelTask));
+    
+    return (taskData->dataMap != NULL);
+}
+
+/*! Releases the mapping created by MapDataBufferForTask(), if any.
+ *  @param parallelTask the task whose data buffer should be unmapped. */
+void iSCSIVirtualHBA::UnmapDataBufferForTask(SCSIParallelTaskIdentifier parallelTask)
+{
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    
+    if(taskData->dataMap) {
+        taskData->dataMap->release();
+        taskData->dataMap = NULL;
+    }
+}
+
+/*! Gets a pointer to a range of a task's data buffer that is to be sent
+ *  to the target.  The pointer refers to the task's mapped buffer when
+ *  possible; otherwise the data is copied into the connection's send
+ *  bounce buffer.  The pointer is valid until the next call.
+ *  @param connection the connection the data will be sent on.
+ *  @param parallelTask the task whose data is to be sent.
+ *  @param dataOffset offset of the data in the task's buffer.
+ *  @param dataLength number of bytes to send.
+ *  @return a pointer to the data, or NULL if it is not available. */
+const void * iSCSIVirtualHBA::GetDataOutBuffer(iSCSIConnection * connection,
+                                               SCSIParallelTaskIdentifier parallelTask,
+                                               UInt32 dataOffset,
+                                               UInt32 dataLength)
+{
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    IOMemoryMap * dataMap = taskData->dataMap;
+    
+    if(dataMap && (UInt64)dataOffset + dataLength <= dataMap->getLength())
+        return (const UInt8*)dataMap->getVirtualAddress() + dataOffset;
+    
+    if(dataLength > connection->dataSendBufferSize)
+        return NULL;
+    
+    if(GetDataBuffer(parallelTask)->readBytes(dataOffset,connection->dataSendBuffer,dataLength) != dataLength)
+        return NULL;
+    
+    return connection->dataSendBuffer;
+}
+
+/*! Sends the buffers described by an iovec array, computing the CRC32C
+ *  of a range of entries as they are copied into socket buffers.  The
+ *  entry that follows the range must be a four-byte data digest; it is
+ *  filled in with the result before it is sent.
+ *  @param connection the connection to send on.
+ *  @param iovec the buffers to send.
+ *  @param iovecCnt the number of entries in iovec.
+ *  @param digestIovecIdx the first entry covered by the digest.
+ *  @param digestIovecCnt the number of entries covered by the digest.
+ *  @param bytesSent the number of bytes that were sent.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::SendWithDigest(iSCSIConnection * connection,
+                                        struct iovec * iovec,
+                                        unsigned int iovecCnt,
+                                        unsigned int digestIovecIdx,
+                                        unsigned int digestIovecCnt,
+                                        size_t * bytesSent)
+{
+    const unsigned int digestIdx = digestIovecIdx + digestIovecCnt;
+    
+    if(digestIdx >= iovecCnt || iovec[digestIdx].iov_len != sizeof(UInt32))
+        return EINVAL;
+    
+    size_t length = 0;
+    for(unsigned int idx = 0; idx < iovecCnt; idx++)
+        length += iovec[idx].iov_len;
+    
+    // If a packet can't be had, compute the digest separately and let the
+    // socket layer do the copy
+    mbuf_t packet = NULL;
+    
+    if(mbuf_allocpacket(MBUF_WAITOK,length,NULL,&packet))
+    {
+        struct msghdr msg;
+        memset(&msg,0,sizeof(struct msghdr));
+        msg.msg_iov = iovec;
+        msg.msg_iovlen = iovecCnt;
+        
+        *(UInt32*)iovec[digestIdx].iov_base = crc32c_iovec(0,&iovec[digestIovecIdx],digestIovecCnt);
+        return sock_send(connection->socket,&msg,0,bytesSent);
+    }
+    
+    // Copy each buffer into the packet, computing the digest on the way
+    UInt32 digest = 0;
+    mbuf_t mbuf = packet;
+    size_t mbufOffset = 0;
+    
+    for(unsigned int idx = 0; idx < iovecCnt; idx++)
+    {
+        if(idx == digestIdx)
+            *(UInt32*)iovec[idx].iov_base = digest;
+        
+        const UInt8 * src = (const UInt8 *)iovec[idx].iov_base;
+        size_t remaining = iovec[idx].iov_len;
+        
+        while(remaining && mbuf)
+        {
+            if(mbufOffset == mbuf_maxlen(mbuf)) {
+                mbuf_setlen(mbuf,mbufOffset);
+                mbuf = mbuf_next(mbuf);
+                mbufOffset = 0;
+                continue;
+            }
+            
+            size_t bytes = min(remaining,mbuf_maxlen(mbuf) - mbufOffset);
+            UInt8 * dst = (UInt8 *)mbuf_data(mbuf) + mbufOffset;
+            
+            if(idx >= digestIovecIdx && idx < digestIdx)
+                digest = crc32c_copy(digest,dst,src,bytes);
+            else
+                memcpy(dst,src,bytes);
+            
+            src += bytes;
+            remaining -= bytes;
+            mbufOffset += bytes;
+        }
+    }
+    
+    // Set the length of the last mbuf written and of any unused ones
+    for(; mbuf; mbuf = mbuf_next(mbuf)) {
+        mbuf_setlen(mbuf,mbufOffset);
+        mbufOffset = 0;
+    }
+    mbuf_pkthdr_setlen(packet,length);
+    
+    // The packet is released by the socket layer, even on failure
+    return sock_sendmbuf(connection->socket,NULL,packet,0,bytesSent);
+}
+
+/*! Opens a transmit batch on a connection.  Until the batch is ended,
+ *  PDUs sent on the connection are gathered into its transmit queue and
+ *  sent together (see txFlushBytes and txFlushLatencyUs).  Batches are
+ *  only opened on the workloop thread.
+ *  @param connection the connection to batch PDUs for. */
+void iSCSIVirtualHBA::BeginTransmitBatch(iSCSIConnection * connection)
+{
+    // The queue only exists in the full feature phase
+    if(connection->txBuffer && connection->txFlushBytes)
+        connection->txBatchOpen = true;
+}
+
+/*! Ends a transmit batch, sending any PDUs still in the transmit queue.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to end the batch for.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::EndTransmitBatch(iSCSISession * session,iSCSIConnection * connection)
+{
+    if(!connection->txBatchOpen)
+        return 0;
+    
+    connection->txBatchOpen = false;
+    return FlushTransmitQueue(session,connection,NULL,0);
+}
+
+/*! Gets whether a connection's transmit batch is open and holds PDUs
+ *  that have not yet been sent.
+ *  @param connection the connection to check.
+ *  @return true if PDUs are waiting to be sent, false otherwise. */
+bool iSCSIVirtualHBA::isTransmitQueuePending(iSCSIConnection * connection)
+{
+    return connection->txBatchOpen && connection->txQueuedPDUs;
+}
+
+/*! Adds a PDU to a connection's transmit queue, flushing the queue as
+ *  required by the connection's flush policy.  The basic header segment
+ *  and data segment are copied, except for data segments larger than
+ *  kTransmitCopyThreshold, which are sent (along with the queue) before
+ *  this function returns.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send on.
+ *  @param bhs the basic header segment to send.
+ *  @param data the data segment to send.
+ *  @param length the byte size of the data segment.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::QueuePDU(iSCSISession * session,
+                                  iSCSIConnection * connection,
+                                  iSCSIPDUInitiatorBHS * bhs,
+                                  const void * data,
+                                  size_t length)
+{
+    const size_t headerLength = kiSCSIPDUBasicHeaderSegmentSize +
+                                (connection->useHeaderDigest ? sizeof(UInt32) : 0);
+    size_t paddingLength = 0, digestLength = 0;
+    
+    if(!data)
+        length = 0;
+    
+    if(length) {
+        paddingLength = (4 - (length % 4)) % 4;
+        digestLength = connection->useDataDigest ? sizeof(UInt32) : 0;
+    }
+    
+    // Large data segments are sent from where they are; only their header
+    // is queued (the data follows the queue in the same socket call)
+    const bool copyData = (length <= kTransmitCopyThreshold);
+    size_t queueLength = headerLength;
+    
+    if(copyData)
+        queueLength += length + paddingLength + digestLength;
+    
+    errno_t error = 0;
+    
+    if(connection->txBufferLength + queueLength > connection->txBufferSize &&
+       (error = FlushTransmitQueue(session,connection,NULL,0)))
+        return error;
+    
+    // Timestamp the queue when it goes from empty to non-empty
+    if(connection->txQueuedPDUs == 0)
+        clock_get_system_microtime(&connection->txQueueStartSec,
+                                   &connection->txQueueStartUSec);
+    
+    UInt8 * dst = connection->txBuffer + connection->txBufferLength;
+    
+    memcpy(dst,bhs,kiSCSIPDUBasicHeaderSegmentSize);
+    dst += kiSCSIPDUBasicHeaderSegmentSize;
+    
+    if(connection->useHeaderDigest) {
+        UInt32 headerDigest = crc32c(0,bhs,kiSCSIPDUBasicHeaderSegmentSize);
+        memcpy(dst,&headerDigest,sizeof(headerDigest));
+        dst += sizeof(headerDigest);
+    }
+    
+    connection->txBufferLength += headerLength;
+    connection->txQueuedPDUs++;
+    
+    if(!copyData)
+        return FlushTransmitQueue(session,connection,data,length);
+    
+    // Copy the data segment and padding, computing the data digest on the way
+    if(length)
+    {
+        UInt32 dataDigest = 0;
+        
+        if(digestLength)
+            dataDigest = crc32c_copy(dataDigest,dst,data,length);
+        else
+            memcpy(dst,data,length);
+        dst += length;
+        
+        memset(dst,0,paddingLength);
+        
+        if(digestLength) {
+            dataDigest = crc32c(dataDigest,dst,paddingLength);
+            memcpy(dst + paddingLength,&dataDigest,sizeof(dataDigest));
+        }
+        
+        connection->txBufferLength += length + paddingLength + digestLength;
+    }
+    
+    // Flush once the queue holds enough bytes or its oldest PDU has
+    // waited long enough
+    if(connection->txBufferLength >= connection->txFlushBytes)
+        return FlushTransmitQueue(session,connection,NULL,0);
+    
+    clock_sec_t sec;
+    clock_usec_t usec;
+    clock_get_system_microtime(&sec,&usec);
+    
+    UInt64 waitUs = (UInt64)(sec - connection->txQueueStartSec)*1000000 +
+                    usec - connection->txQueueStartUSec;
+    
+    if(waitUs >= connection->txFlushLatencyUs)
+        return FlushTransmitQueue(session,connection,NULL,0);
+    
+    return 0;
+}
+
+/*! Sends the contents of a connection's transmit queue with a single
+ *  socket call, optionally followed by the data segment of the last
+ *  queued PDU (whose padding and data digest are added here).
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send on.
+ *  @param data the data segment that follows the queue, or NULL.
+ *  @param length the byte size of the data segment.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::FlushTransmitQueue(iSCSISession * session,
+                                            iSCSIConnection * connection,
+                                            const void * data,
+                                            size_t length)
+{
+    if(connection->txBufferLength == 0)
+        return 0;
+    
+    struct iovec iovec[4];
+    unsigned int iovecCnt = 0;
+    
+    iovec[iovecCnt].iov_base = connection->txBuffer;
+    iovec[iovecCnt].iov_len  = connection->txBufferLength;
+    iovecCnt++;
+    
+    UInt32 padding = 0;
+    UInt32 dataDigest = 0;
+    unsigned int dataIovecCnt = 0;
+    
+    if(data && length)
+    {
+        iovec[iovecCnt].iov_base = (void*)data;
+        iovec[iovecCnt].iov_len  = length;
+        iovecCnt++;
+        
+        UInt32 paddingLen = 4-(length % 4);
+        if(paddingLen != 4)
+        {
+            iovec[iovecCnt].iov_base = &padding;
+            iovec[iovecCnt].iov_len  = paddingLen;
+            iovecCnt++;
+        }
+        
+        if(connection->useDataDigest) {
+            dataIovecCnt = iovecCnt - 1;
+            
+            iovec[iovecCnt].iov_base = &dataDigest;
+            iovec[iovecCnt].iov_len  = sizeof(dataDigest);
+            iovecCnt++;
+        }
+    }
+    
+    // The queue is emptied whether or not the send succeeds
+    UInt32 pduCount = connection->txQueuedPDUs;
+    connection->txBufferLength = 0;
+    connection->txQueuedPDUs = 0;
+    
+    size_t bytesSent = 0;
+    errno_t error;
+    
+    if(dataIovecCnt)
+        error = SendWithDigest(connection,iovec,iovecCnt,1,dataIovecCnt,&bytesSent);
+    else {
+        struct msghdr msg;
+        memset(&msg,0,sizeof(struct msghdr));
+        msg.msg_iov = iovec;
+        msg.msg_iovlen = iovecCnt;
+        
+        error = sock_send(connection->socket,&msg,0,&bytesSent);
+    }
+    
+    if(error)
+    {
+        DBLog("iscsi: sock_send error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
+        HandleConnectionTimeout(session->sessionId,connection->cid);
+        return error;
+    }
+    
+    DBLog("iscsi: Sent %d PDUs, %zu bytes (sid: %d, cid: %d)\n",
+          pduCount,bytesSent,session->sessionId,connection->cid);
+    
+    connection->sendPDUCount += pduCount;
+    connection->sendCallCount++;
+    connection->sendByteCount += bytesSent;
+    
+    return 0;
+}
+
+/*! Receives the buffers described by an iovec array, computing the CRC32C
+ *  of a range of entries as they are copied out of socket buffers.
+ *  @param connection the connection to receive from.
+ *  @param iovec the buffers to receive into.
+ *  @param iovecCnt the number of entries in iovec.
+ *  @param digestIovecIdx the first entry covered by the digest.
+ *  @param digestIovecCnt the number of entries covered by the digest.
+ *  @param digest the CRC32C of the entries covered by the digest.
+ *  @param bytesRecv the number of bytes that were received.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::RecvWithDigest(iSCSIConnection * connection,
+                                        struct iovec * iovec,
+                                        unsigned int iovecCnt,
+                                        unsigned int digestIovecIdx,
+                                        unsigned int digestIovecCnt,
+                                        UInt32 * digest,
+                                        size_t * bytesRecv)
+{
+    size_t length = 0;
+    for(unsigned int idx = 0; idx < iovecCnt; idx++)
+        length += iovec[idx].iov_len;
+    
+    mbuf_t packet = NULL;
+    errno_t error;
+    
+    *digest = 0;
+    *bytesRecv = length;
+    
+    if((error = sock_receivembuf(connection->socket,NULL,&packet,MSG_WAITALL,bytesRecv))) {
+        if(packet)
+            mbuf_freem(packet);
+        return error;
+    }
+    
+    // Copy the packet into each buffer, computing the digest on the way
+    mbuf_t mbuf = packet;
+    size_t mbufOffset = 0;
+    
+    for(unsigned int idx = 0; idx < iovecCnt && mbuf; idx++)
+    {
+        UInt8 * dst = (UInt8 *)iovec[idx].iov_base;
+        size_t remaining = iovec[idx].iov_len;
+        
+        while(remaining && mbuf)
+        {
+            if(mbufOffset == mbuf_len(mbuf)) {
+                mbuf = mbuf_next(mbuf);
+                mbufOffset = 0;
+                continue;
+            }
+            
+            size_t bytes = min(remaining,mbuf_len(mbuf) - mbufOffset);
+            const UInt8 * src = (const UInt8 *)mbuf_data(mbuf) + mbufOffset;
+            
+            if(idx >= digestIovecIdx && idx < digestIovecIdx + digestIovecCnt)
+                *digest = crc32c_copy(*digest,dst,src,bytes);
+            else
+                memcpy(dst,src,bytes);
+            
+            dst += bytes;
+            remaining -= bytes;
+            mbufOffset += bytes;
+        }
+    }
+    
+    mbuf_freem(packet);
+    return 0;
+}
+
+/*! Receives up to the specified number of bytes from a connection without
+ *  blocking.
+ *  @param connection the connection to receive from.
+ *  @param buffer the buffer to receive into.
+ *  @param length the maximum number of bytes to receive.
+ *  @param digest if not NULL, the CRC32C of the received bytes is added
+ *  to this digest as they are copied out of the socket buffers.
+ *  @param bytesRecv the number of bytes received.
+ *  @return error code indicating result of operation (EWOULDBLOCK if
+ *  no data was available). */
+errno_t iSCSIVirtualHBA::RecvPDUBytes(iSCSIConnection * connection,
+                                      void * buffer,
+                                      size_t length,
+                                      UInt32 * digest,
+                                      size_t * bytesRecv)
+{
+    *bytesRecv = 0;
+    
+    if(!buffer || length == 0)
+        return EINVAL;
+    
+    if(!digest)
+    {
+        struct msghdr msg;
+        struct iovec  iovec;
+        memset(&msg,0,sizeof(struct msghdr));
+        
+        iovec.iov_base = buffer;
+        iovec.iov_len  = length;
+        msg.msg_iov    = &iovec;
+        msg.msg_iovlen = 1;
+        
+        return sock_receive(connection->socket,&msg,MSG_DONTWAIT,bytesRecv);
+    }
+    
+    // Compute the digest while copying out of the socket buffers
+    mbuf_t packet = NULL;
+    size_t packetLength = length;
+    errno_t error;
+    
+    if((error = sock_receivembuf(connection->socket,NULL,&packet,MSG_DONTWAIT,&packetLength))) {
+        if(packet)
+            mbuf_freem(packet);
+        return error;
+    }
+    
+    UInt8 * dst = (UInt8 *)buffer;
+    
+    for(mbuf_t mbuf = packet; mbuf && *bytesRecv < packetLength; mbuf = mbuf_next(mbuf))
+    {
+        size_t bytes = min(mbuf_len(mbuf),packetLength - *bytesRecv);
+        *digest = crc32c_copy(*digest,dst,mbuf_data(mbuf),bytes);
+        dst += bytes;
+        *bytesRecv += bytes;
+    }
+    
+    if(packet)
+        mbuf_freem(packet);
+    
+    return 0;
+}
+
+void iSCSIVirtualHBA::ProcessTaskMgmtRsp(iSCSISession * session,
+                                         iSCSIConnection * connection,
+                                         iSCSIPDU::iSCSIPDUTaskMgmtRspBHS * bhs)
+{
+    // Look up LUN and function code of the request in its task slot
+    iSCSITaskSlot * slot = FindTaskSlot(session,bhs->initiatorTaskTag);
+    
+    if(!slot || slot->taskType != kInitiatorTaskTypeTaskMgmt) {
+        DBLog("iscsi: Task management response for unknown task %#x (sid: %d, cid: %d)\n",
+              bhs->initiatorTaskTag,session->sessionId,connection->cid);
+        return;
+    }
+    
+    UInt8 taskMgmtFunction = slot->taskMgmtFunction;
+    SCSILogicalUnitNumber LUN = slot->LUN;
+    UInt32 referencedTaskTag = slot->referencedTaskTag;
+    
+    ReleaseTaskSlot(session,bhs->initiatorTaskTag);
+    
+    enum iSCSIPDUTaskMgmtRspCodes rspCode = (iSCSIPDUTaskMgmtRspCodes)bhs->response;
+    
+    // Task reassignment is internal to the initiator (see ReassignConnectionTasks())
+    if(taskMgmtFunction == kiSCSIPDUTaskMgmtFuncTaskReassign) {
+        connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+        CompleteTaskReassign(session,connection,referencedTaskTag,
+                             rspCode == kiSCSIPDUTaskMgmtFuncComplete);
+        return;
+    }
+    
+    // Setup the SCSI response code based on response from PDU
+    SCSIServiceResponse serviceResponse;
+    
+    switch(rspCode)
+    {
+        case kiSCSIPDUTaskMgmtFuncComplete:
+            serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
+        break;
+        case kiSCSIPDUTaskMgmtFuncRejected:
+            serviceResponse = kSCSIServiceResponse_FUNCTION_REJECTED;
+        break;
+        case kiSCSIPDUTaskMgmtInvalidLUN:
+        case kiSCSIPDUTaskMgmtAuthFail:
+        case kiSCSIPDUTaskMgmtFuncUnsupported:
+        case kiSCSIPDUTaskMgmtInvalidTask:
+        case kiSCSIPDUTaskMgmtReassignUnsupported:
+        case kiSCSIPDUTaskMgmtTaskAllegiant:
+        default:
+            serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+        break;
+    };
+
+    // Tell the SCSI stack that the function completed or failed
+    CompleteTaskMgmtRequest(session,LUN,taskMgmtFunction,serviceResponse);
+    
+    // Task is complete, remove it from the queue
+    connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+}
+
+void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
+                                   iSCSIConnection * connection,
+                                   iSCSIPDU::iSCSIPDUNOPInBHS * bhs,
+                                   UInt8 * data)
+{
+    // Data payload could be ping data or other data, if it exists
+    const size_t length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+    
+    // Response to a previous ping from this initiator
+    if(bhs->targetTransferTag == kiSCSIPDUTargetTransferTagReserved)
+    {
+        // Will use this to calculate latency; our initiated NOP contained
+        // a timestamp that is sent back to us (a reply without it still
+        // answers the ping, but gives no round-trip time)
+        if(length == (sizeof(clock_sec_t) + sizeof(clock_usec_t)))
+        {
+            clock_sec_t secs_stamp, secs;
+            clock_usec_t usecs_stamp, usecs;
+            
+            // Grab timestamp from NOP-in PDU
+            memcpy(&secs_stamp,data,sizeof(secs_stamp));
+            memcpy(&usecs_stamp,data+sizeof(secs_stamp),sizeof(usecs_stamp));
+            
+            // Grab current system uptime
+            clock_get_system_microtime(&secs,&usecs);
+            
+            SInt64 RTTUs = ((SInt64)secs - (SInt64)secs_stamp)*1000000 + ((SInt64)usecs - (SInt64)usecs_stamp);
+            
+            if(RTTUs >= 0 && RTTUs <= UINT32_MAX) {
+                UpdateConnectionRTT(connection,(UInt32)RTTUs);
+                ResizeSocketBuffers(connection);
+            }
+            
+            DBLog("iscsi: Connection RTT: %lld us, smoothed %d us, variance %d us (sid: %d, cid: %d)\n",
+                  RTTUs,connection->smoothedRTTUs,connection->RTTVarianceUs,
+                  session->sessionId,connection->cid);
+        }
+        else
+            DBLog("iscsi: NOP-in ping data has unexpected length %zu (sid: %d, cid: %d)\n",
+                  length,session->sessionId,connection->cid);
+        
+        // The connection is alive
+        connection->livenessProbePending = false;
+        
+        // Remove latency measurement task from queue
+        connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+        ReleaseTaskSlot(session,bhs->initiatorTaskTag);
+    }
+    // The target initiated this ping, just copy parameters and respond
+    else {
+
+        iSCSIPDUNOPOutBHS bhsRsp = iSCSIPDUNOPOutBHSInit;
+        bhsRsp.opCode |= kiSCSIPDUImmediateDeliveryFlag;
+        bhsRsp.LUN = bhs->LUN;
+        bhsRsp.targetTransferTag = bhs->targetTransferTag;
+        bhsRsp.initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+        
+        if(SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsRsp,NULL,data,length))
+            DBLog("iscsi: Failed to send NOP response (sid: %d, cid: %d)\n",
+                  session->sessionId,connection->cid);
+    }
+}
+
+void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
+                                          iSCSIConnection * connection,
+                                          iSCSIPDU::iSCSIPDUSCSIRspBHS * bhs,
+                                          UInt8 * data)
+{
+    // Byte size of sense data (SAM)
+    const UInt8 senseDataHeaderSize = 2;
+    
+    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+    
+    if(length > 0)
+        DBLog("iscsi: Received sense data (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+
+    // Grab parallel task associated with this PDU, indexed by task tag
+    SCSIParallelTaskIdentifier parallelTask =
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+    
+    if(!parallelTask)
+    {
+        DBLog("iscsi: Task not found (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        return;
+    }
+    
+    SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
+    
+    // Request data-in PDUs (and R2Ts) at the end of the sequence that were
+    // skipped; ExpDataSN is the number of PDUs the target sent for the task
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    UInt32 expDataSN = OSSwapBigToHostInt32(bhs->expDataSN);
+    
+    if(session->errorRecoveryLevel > 0 && (SInt32)(expDataSN - taskData->expDataSN) > 0)
+        TrackDataSequence(session,connection,parallelTask,expDataSN - 1,false);
+
+    // Process sense data if the PDU came with any...
+    bool senseDataPresent = false;
+    if(length >= senseDataHeaderSize)
+    {
+        // First two bytes of the data segment are the size of the sense data
+        UInt16 senseDataLength = *((UInt16*)&data[0]);
+        senseDataLength = OSSwapBigToHostInt16(senseDataLength);
+        
+        if(length < senseDataLength + senseDataHeaderSize) {
+            DBLog("iscsi: Received invalid sense data (sid: %d, cid: %d)\n",
+                  session->sessionId,connection->cid);
+        }
+        else {
+        
+            // Remaining data is sense data, advance pointer by two bytes to get this
+            SCSI_Sense_Data * newSenseData = (SCSI_Sense_Data *)(data + senseDataHeaderSize);
+        
+            // Incorporate sense data into the task
+            SetAutoSenseData(parallelTask,newSenseData,senseDataLength);
+            
+            senseDataPresent = true;
+            
+            DBLog("iscsi: Processed sense data (sid: %d, cid: %d)\n",
+                  session->sessionId,connection->cid);
+        }
+    }
+    
+    // Set the SCSI completion status and service response, let SCSI stack
+    // know that we're done with this task...
+    
+    SCSITaskStatus completionStatus = (SCSITaskStatus)bhs->status;
+    
+    // If sense data has been included along with a check condition response,
+    // the macOS SCSI stack expects that the task status is "GOOD". Otherwise,
+    // it queries for auto sense data.
+    if(completionStatus == kSCSITaskStatus_CHECK_CONDITION && senseDataPresent)
+        completionStatus = kSCSITaskStatus_GOOD;
+    
+    SCSIServiceResponse serviceResponse;
+
+    if(bhs->response == kiSCSIPDUSCSICmdCompleted)
+        serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
+    else
+        serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    
+    // The task is completed once the PDUs that were requested again arrive
+    if(taskData->missingDataPDUs) {
+        taskData->completionPending = true;
+        taskData->pendingTaskStatus = completionStatus;
+        taskData->pendingServiceResponse = serviceResponse;
+        
+        ArmTaskTimer(session,bhs->initiatorTaskTag,session->taskDeadlineMs);
+        return;
+    }
+    
+    CompleteParallelTask(session,connection,parallelTask,completionStatus,serviceResponse);
+    
+    // Task is complete, remove it from the queue
+    connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+    
+    DBLog("iscsi: Processed SCSI response (sid: %d, cid: %d)\n",
+          session->sessionId,connection->cid);
+
+}
+
+void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
+                                    iSCSIConnection * connection,
+                                    iSCSIPDU::iSCSIPDUDataInBHS * bhs,
+                                    UInt8 * data)
+{
+    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+
+    // Grab parallel task associated with this PDU, indexed by task tag
+    SCSIParallelTaskIdentifier parallelTask =
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+    
+    if(length == 0)
+    {
+        DBLog("iscsi: Missing data segment in data-in PDU (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        return;
+    }
+    
+    // If task not found, the data segment has already been discarded
+    if(!parallelTask)
+    {
+        DBLog("iscsi: Task not found (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        return;
+    }
+    
+    // System buffer offset for this PDU data segment...
+    UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+    
+    // The data segment was received directly into the task's buffer if it
+    // has been mapped (see BeginPDU()); otherwise copy it from the bounce buffer
+    if(data == connection->dataRecvBuffer)
+        GetDataBuffer(parallelTask)->writeBytes(dataOffset,data,length);
+    
+    // PDUs that were requested again arrive after the ones that follow them
+    if(dataOffset + length > GetRealizedDataTransferCount(parallelTask))
+        SetRealizedDataTransferCount(parallelTask,dataOffset+length);
+    
+    OSAddAtomic64(-(SInt64)length,&connection->dataToTransfer);
+    
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    
+    if(session->errorRecoveryLevel > 0)
+    {
+        UInt32 dataSN = OSSwapBigToHostInt32(bhs->dataSN);
+        TrackDataSequence(session,connection,parallelTask,dataSN,true);
+        
+        // The acknowledgement covers every PDU up to this one, so it is held
+        // back while any of those are missing
+        if(bhs->flags & kiSCSIPDUDataInAckFlag) {
+            taskData->dataACKPending = true;
+            taskData->dataACKTargetTransferTag = bhs->targetTransferTag;
+            taskData->dataACKLUN = bhs->LUN;
+            taskData->dataACKBegRun = dataSN + 1;
+        }
+        
+        if(taskData->dataACKPending && !taskData->missingDataPDUs) {
+            SendSNACK(session,connection,kiSCSIPDUSNACKTypeDataACK,
+                      kiSCSIPDUInitiatorTaskTagReserved,taskData->dataACKLUN,
+                      taskData->dataACKTargetTransferTag,taskData->dataACKBegRun,0);
+            taskData->dataACKPending = false;
+        }
+    }
+    
+    // If the PDU contains a status response, complete this task (once the
+    // PDUs that were requested again arrive)
+    if((bhs->flags & kiSCSIPDUDataInFinalFlag) && (bhs->flags & kiSCSIPDUDataInStatusFlag))
+    {
+        SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
+        
+        taskData->completionPending = true;
+        taskData->pendingTaskStatus = (SCSITaskStatus)bhs->status;
+        taskData->pendingServiceResponse = kSCSIServiceResponse_TASK_COMPLETE;
+    }
+    
+    if(taskData->completionPending && !taskData->missingDataPDUs)
+    {
+        CompleteParallelTask(session,
+                             connection,
                              parallelTask,
-                             (SCSITaskStatus)bhs->status,
-                             kSCSIServiceResponse_TASK_COMPLETE);
+                             taskData->pendingTaskStatus,
+                             taskData->pendingServiceResponse);
+        
+        // Task is complete, remove it from the queue
+        connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+        
+        DBLog("iscsi: Processed data-in PDU (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+    }
+    // The deadline bounds the time a task goes without progress
+    else
+        ArmTaskTimer(session,bhs->initiatorTaskTag,session->taskDeadlineMs);
+}
+
+/*! Tracks the DataSN (or R2TSN) of a data-in PDU (or R2T) of a task
+ *  and asks the target to send PDUs that were skipped again.
+ *  @param session the session associated with the task.
+ *  @param connection the connection that received the PDU.
+ *  @param parallelTask the task.
+ *  @param sequenceNumber the DataSN or R2TSN of the PDU.
+ *  @param received true if the PDU was received, false if it was
+ *  discarded and should be sent again as well. */
+void iSCSIVirtualHBA::TrackDataSequence(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        SCSIParallelTaskIdentifier parallelTask,
+                                        UInt32 sequenceNumber,
+                                        bool received)
+{
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    UInt64 LUN = BuildLUNField(GetLogicalUnitNumber(parallelTask));
+    
+    // A PDU that was requested before; request it once more if it was
+    // discarded again
+    if((SInt32)(sequenceNumber - taskData->expDataSN) < 0)
+    {
+        if(!received)
+            SendSNACK(session,connection,kiSCSIPDUSNACKTypeDataR2T,taskData->initiatorTaskTag,
+                      LUN,kiSCSIPDUTargetTransferTagReserved,sequenceNumber,1);
+        else if(taskData->missingDataPDUs)
+            taskData->missingDataPDUs--;
+        return;
+    }
+    
+    // Request the PDUs that were skipped (and this one, if it was discarded)
+    UInt32 runLength = sequenceNumber - taskData->expDataSN + (received ? 0 : 1);
+    
+    if(runLength) {
+        SendSNACK(session,connection,kiSCSIPDUSNACKTypeDataR2T,taskData->initiatorTaskTag,
+                  LUN,kiSCSIPDUTargetTransferTagReserved,taskData->expDataSN,runLength);
+        taskData->missingDataPDUs += runLength;
+    }
+    
+    taskData->expDataSN = sequenceNumber + 1;
+}
+
+/*! Sends a SNACK request PDU.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send the SNACK on.
+ *  @param type the type of SNACK (see iSCSIPDUSNACKTypes).
+ *  @param initiatorTaskTag the initiator task tag of the task the SNACK
+ *  refers to (reserved for status SNACKs and DataACKs).
+ *  @param LUN the LUN field of the SNACK.
+ *  @param targetTransferTag the target transfer tag (DataACKs only).
+ *  @param begRun the first sequence number requested or acknowledged.
+ *  @param runLength the number of PDUs requested (zero for all PDUs). */
+void iSCSIVirtualHBA::SendSNACK(iSCSISession * session,
+                                iSCSIConnection * connection,
+                                UInt8 type,
+                                UInt32 initiatorTaskTag,
+                                UInt64 LUN,
+                                UInt32 targetTransferTag,
+                                UInt32 begRun,
+                                UInt32 runLength)
+{
+    iSCSIPDUSNACKReqBHS bhs = iSCSIPDUSNACKReqBHSInit;
+    bhs.flags |= type;
+    bhs.LUN = LUN;
+    bhs.initiatorTaskTag = initiatorTaskTag;
+    bhs.targetTransferTag = targetTransferTag;
+    bhs.begRun = OSSwapHostToBigInt32(begRun);
+    bhs.runLength = OSSwapHostToBigInt32(runLength);
+    
+    DBLog("iscsi: Sending SNACK type %d for %d PDUs from %d (sid: %d, cid: %d)\n",
+          type,runLength,begRun,session->sessionId,connection->cid);
+    
+    if(SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,NULL,0))
+        DBLog("iscsi: Failed to send SNACK (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+}
+
+/*! Handles a PDU whose data digest failed.  The PDU is discarded; at
+ *  error recovery level 1 and above the target is asked to send it again
+ *  (data-in PDUs with a data SNACK, SCSI responses with a status SNACK).
+ *  A NOP-in answering one of our NOP-outs still shows that the connection
+ *  is alive.  The header of the PDU is in the connection's receive context.
+ *  @param session the session that received the PDU.
+ *  @param connection the connection that received the PDU. */
+void iSCSIVirtualHBA::HandleDataDigestError(iSCSISession * session,iSCSIConnection * connection)
+{
+    // The header was processed by BeginPDU(), so the sequence numbers have
+    // been updated and StatSN is in host byte order
+    iSCSIPDUTargetBHS * bhs = &connection->recvContext.bhs;
+    
+    switch(bhs->opCode)
+    {
+        case kiSCSIPDUOpCodeDataIn:
+        {
+            if(session->errorRecoveryLevel == 0)
+                break;
+            
+            SCSIParallelTaskIdentifier parallelTask =
+                FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+            
+            if(!parallelTask)
+                break;
+            
+            // Data received directly into the task's buffer is overwritten
+            // when the PDU is sent again
+            iSCSIPDUDataInBHS * bhsDataIn = (iSCSIPDUDataInBHS*)bhs;
+            TrackDataSequence(session,connection,parallelTask,
+                              OSSwapBigToHostInt32(bhsDataIn->dataSN),false);
+            
+            ArmTaskTimer(session,bhs->initiatorTaskTag,session->taskDeadlineMs);
+            break;
+        }
+        case kiSCSIPDUOpCodeSCSIRsp:
+            if(session->errorRecoveryLevel > 0)
+                SendSNACK(session,connection,kiSCSIPDUSNACKTypeStatus,
+                          kiSCSIPDUInitiatorTaskTagReserved,0,
+                          kiSCSIPDUTargetTransferTagReserved,bhs->statSN,1);
+            break;
+            
+        case kiSCSIPDUOpCodeNOPIn:
+        {
+            if(bhs->initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+                break;
+            
+            iSCSITaskSlot * slot = FindTaskSlot(session,bhs->initiatorTaskTag);
+            
+            if(!slot || slot->taskType != kInitiatorTaskTypeLatency)
+                break;
+            
+            // The timestamp can't be trusted, but the connection is alive
+            connection->livenessProbePending = false;
+            connection->taskQueue->completeTask(bhs->initiatorTaskTag);
+            ReleaseTaskSlot(session,bhs->initiatorTaskTag);
+            break;
+        }
+        default:
+            break;
+    };
+}
+
+/*! Process an incoming asynchronous message PDU.
+ *  @param session the session associated with the async PDU.
+ *  @param connection the connection associated with the async PDU.
+ *  @param bhs the basic header segment of the async PDU.
+ *  @param data the data segment of the PDU, if any. */
+void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
+                                      iSCSIConnection * connection,
+                                      iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs,
+                                      UInt8 * data)
+{
+    // Any data associated with the PDU (e.g., sense data for SCSI asynchronous
+    // message) is unused
+
+    iSCSIPDUAsyncMsgEvent asyncEvent = (iSCSIPDUAsyncMsgEvent)(bhs->asyncEvent);
+    
+    DBLog("iscsi: Async Message (code %#x) received (sid: %d, cid: %d)\n",
+        asyncEvent,session->sessionId,connection->cid);
+    
+    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)getClient();
+    if(!client) {
+        DBLog("iscsi: client is not available; async message may not be processed correctly\n");
+    }
+
+    switch(asyncEvent)
+    {
+        // The target will drop all connections for this session
+        case kiSCSIPDUAsyncMsgDropAllConnections:
+            ReleaseSession(session->sessionId);
+            break;
+
+        // The target will drop the specified connection
+        case kiSCSIPDUAsynMsgDropConnection:
+            ReleaseConnection(session->sessionId,connection->cid);
+            break;
+            
+        case kiSCSIPDUAsyncMsgLogout:
+            DeactivateConnection(session->sessionId,connection->cid);
+            break;
+            
+        // Target requests parameter negotiation
+        case kiSCSIPDUAsyncMsgNegotiateParams:
+            DeactivateConnection(session->sessionId,connection->cid);
+            break;
+            
+        // No support for asynchronous SCSI messages; do nothing
+        case kiSCSIPDUAsyncMsgSCSIAsyncMsg: break;
+            
+        // No support for proprietary vendor codes; do nothing
+        case kiSCSIPDUAsyncMsgVendorCode: break;
+
+        default: break;
+    };
+    
+    // Only send out a notification to the daemon if the
+    // message is not vendor-specific or a SCSI message.
+    if(asyncEvent != kiSCSIPDUAsyncMsgSCSIAsyncMsg && asyncEvent != kiSCSIPDUAsyncMsgVendorCode)
+        client->sendAsyncMessageNotification(session->sessionId,connection->cid,asyncEvent);
+}
+
+/*! Process an incoming R2T PDU.
+ *  @param session the session associated with the R2T PDU.
+ *  @param connection the connection associated with the R2T PDU.
+ *  @param bhs the basic header segment of the R2T PDU. */
+void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
+                                 iSCSIConnection * connection,
+                                 iSCSIPDU::iSCSIPDUR2TBHS * bhs)
+{
+    // Grab parallel task associated with this PDU, indexed by task tag
+    SCSIParallelTaskIdentifier parallelTask =
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+    
+    if(!parallelTask)
+    {
+        DBLog("iscsi: Couldn't find requested task to process (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        return;
+    }
+    
+    // The deadline bounds the time a task goes without progress
+    ArmTaskTimer(session,bhs->initiatorTaskTag,session->taskDeadlineMs);
+    
+    // R2Ts share a sequence with data-in PDUs; request skipped ones again
+    if(session->errorRecoveryLevel > 0)
+        TrackDataSequence(session,connection,parallelTask,OSSwapBigToHostInt32(bhs->R2TSN),true);
+    
+    // Measure how long the target took to solicit the data, not counting
+    // the time spent sending it unsolicited data (see
+    // ShouldSendUnsolicitedData())
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    
+    if(!taskData->R2TLatencySampled && taskData->reassignState == kiSCSITaskReassignNone)
+    {
+        clock_sec_t nowSec;
+        clock_usec_t nowUSec;
+        clock_get_system_microtime(&nowSec,&nowUSec);
+        
+        UInt64 latencyUs = (UInt64)(nowSec - taskData->startTimeSec)*1000000 + nowUSec - taskData->startTimeUSec;
+        
+        if(connection->bytesPerSecond != 0) {
+            UInt64 sendTimeUs = (UInt64)taskData->unsolicitedDataLength*1000000/connection->bytesPerSecond;
+            latencyUs = (latencyUs > sendTimeUs) ? latencyUs - sendTimeUs : 0;
+        }
+        
+        if(latencyUs > UINT32_MAX)
+            latencyUs = UINT32_MAX;
+        
+        UpdateConnectionR2TLatency(connection,(UInt32)latencyUs);
+        taskData->R2TLatencySampled = true;
+    }
+    
+    // Obtain requested data offset and requested lengths
+    UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+    UInt32 dataLength = OSSwapBigToHostInt32(bhs->desiredDataLength);
+    
+    // Queue the data-out sequence rather than sending it here, so that the
+    // sequences for several R2Ts (and tasks) are interleaved with receive
+    // processing.  The target may not solicit more than MaxOutstandingR2T
+    // sequences at once; a task it does so for can't be completed
+    if(!QueueDataOutForTask(session,connection,parallelTask,dataOffset,dataLength,
+                            bhs->LUN,bhs->targetTransferTag))
+        HandleTaskProtocolError(session,connection,parallelTask,"R2T exceeds MaxOutstandingR2T");
+}
+
+/*! Queues a sequence of data-out PDUs for a SCSI task.  The PDUs are
+ *  sent by the connection's task queue (see SendQueuedDataOut()).
+ *  @param session the session associated with the task.
+ *  @param connection the connection the data will be sent on.
+ *  @param parallelTask the task whose data is to be sent.
+ *  @param dataOffset offset of the data in the task's buffer.
+ *  @param dataLength number of bytes to send.
+ *  @param LUN the LUN field for the data-out PDUs.
+ *  @param targetTransferTag the target transfer tag of the R2T, or
+ *  kiSCSIPDUTargetTransferTagReserved for unsolicited data.
+ *  @return true if the sequence was queued, false if the target has
+ *  solicited more than MaxOutstandingR2T sequences for the task (or the
+ *  task already has as many sequences queued as it can hold). */
+bool iSCSIVirtualHBA::QueueDataOutForTask(iSCSISession * session,
+                                          iSCSIConnection * connection,
+                                          SCSIParallelTaskIdentifier parallelTask,
+                                          UInt32 dataOffset,
+                                          UInt32 dataLength,
+                                          UInt64 LUN,
+                                          UInt32 targetTransferTag)
+{
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
+    
+    DBLog("iscsi: Dataoffset: %d (sid: %d, cid: %d)\n",dataOffset,session->sessionId,connection->cid);
+    DBLog("iscsi: Desired data length: %d (sid: %d, cid: %d)\n",dataLength,session->sessionId,connection->cid);
+    
+    // The target may not have more than MaxOutstandingR2T R2Ts outstanding
+    // for a task (an R2T is outstanding until its sequence has been sent)
+    UInt8 outstandingR2Ts = 0;
+    
+    for(UInt8 seq = 0; seq < taskData->dataOutCount; seq++) {
+        UInt8 idx = (taskData->dataOutHead + seq) % taskData->kMaxDataOutSequences;
+        if(taskData->dataOutSequences[idx].targetTransferTag != kiSCSIPDUTargetTransferTagReserved)
+            outstandingR2Ts++;
+    }
+    
+    if(taskData->dataOutCount == taskData->kMaxDataOutSequences ||
+       (targetTransferTag != kiSCSIPDUTargetTransferTagReserved &&
+        outstandingR2Ts >= session->maxOutStandingR2T)) {
+        DBLog("iscsi: Too many outstanding R2Ts for task %#x (sid: %d, cid: %d)\n",
+              taskData->initiatorTaskTag,session->sessionId,connection->cid);
+        return false;
+    }
+    
+    if(dataLength == 0)
+        return true;
+    
+    UInt8 idx = (taskData->dataOutHead + taskData->dataOutCount) % taskData->kMaxDataOutSequences;
+    
+    iSCSIHBADataOutSequence * sequence = &taskData->dataOutSequences[idx];
+    sequence->targetTransferTag = targetTransferTag;
+    sequence->dataOffset = dataOffset;
+    sequence->dataLength = dataLength;
+    sequence->dataSN = 0;
+    
+    taskData->dataOutCount++;
+    taskData->LUN = LUN;
+    
+    if(!taskData->dataOutQueued) {
+        queue_enter(&connection->dataOutQueue,taskData,iSCSIHBATaskData *,dataOutChain);
+        taskData->dataOutQueued = true;
+    }
+    
+    connection->taskQueue->signalDataOutPending();
+    return true;
+}
+
+/*! Assigns a slot in the session's task slot table to a task and
+ *  builds the task's initiator task tag from the slot number.  Latency
+ *  measurements and task management requests are assigned slots from
+ *  the reserved range.
+ *  @param session the session associated with the task.
+ *  @param taskType the type of task.
+ *  @param LUN the logical unit that the task is addressed to.
+ *  @param connection the connection the task was assigned to.
+ *  @param parallelTask the SCSI task (NULL for other types of tasks).
+ *  @return the initiator task tag of the task, or
+ *  kiSCSIPDUInitiatorTaskTagReserved if all slots are in use. */
+UInt32 iSCSIVirtualHBA::AllocateTaskSlot(iSCSISession * session,
+                                         InitiatorTaskTypes taskType,
+                                         SCSILogicalUnitNumber LUN,
+                                         iSCSIConnection * connection,
+                                         SCSIParallelTaskIdentifier parallelTask)
+{
+    UInt8 pool = (taskType == kInitiatorTaskTypeSCSITask) ? kiSCSITaskSlotPoolSCSI
+                                                          : kiSCSITaskSlotPoolReserved;
+    
+    IOSimpleLockLock(session->taskSlotLock);
+    
+    UInt16 slotIdx = session->freeTaskSlot[pool];
+    
+    if(slotIdx == kMaxTaskSlots) {
+        IOSimpleLockUnlock(session->taskSlotLock);
+        return kiSCSIPDUInitiatorTaskTagReserved;
+    }
+    
+    iSCSITaskSlot * slot = &session->taskSlots[slotIdx];
+    session->freeTaskSlot[pool] = slot->nextFreeSlot;
+    
+    IOSimpleLockUnlock(session->taskSlotLock);
+    
+    slot->taskType = taskType;
+    slot->taskMgmtFunction = 0;
+    slot->LUN = LUN;
+    slot->parallelTask = parallelTask;
+    slot->taskData = parallelTask ? (iSCSIHBATaskData*)GetHBADataPointer(parallelTask) : NULL;
+    slot->connection = connection;
+    
+    // The generation and slot numbers make up the tag; the last generation
+    // of the last slot would produce the reserved tag, so it is skipped
+    UInt32 initiatorTaskTag = (slot->generation << kTaskSlotBits) | slotIdx;
+    
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved) {
+        slot->generation = 0;
+        initiatorTaskTag = slotIdx;
+    }
+    
+    slot->initiatorTaskTag = initiatorTaskTag;
+    return initiatorTaskTag;
+}
+
+/*! Frees the task slot occupied by a task.
+ *  @param session the session associated with the task.
+ *  @param initiatorTaskTag the initiator task tag of the task. */
+void iSCSIVirtualHBA::ReleaseTaskSlot(iSCSISession * session,UInt32 initiatorTaskTag)
+{
+    iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
+    
+    if(!slot)
+        return;
+    
+    UInt16 slotIdx = ParseInitiatorTaskTagForSlot(initiatorTaskTag);
+    UInt8 pool = (slotIdx < kMaxTaskSlots - kReservedTaskSlots) ? kiSCSITaskSlotPoolSCSI
+                                                                : kiSCSITaskSlotPoolReserved;
+    
+    // Advance the generation so that PDUs carrying the old tag don't match
+    slot->initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+    slot->parallelTask = NULL;
+    slot->taskData = NULL;
+    slot->connection = NULL;
+    slot->generation = (slot->generation + 1) & kTaskSlotGenerationMask;
+    slot->nextFreeSlot = kMaxTaskSlots;
+    
+    IOSimpleLockLock(session->taskSlotLock);
+    
+    session->taskTimers.cancel(&slot->timer);
+    
+    if(session->freeTaskSlot[pool] == kMaxTaskSlots)
+        session->freeTaskSlot[pool] = slotIdx;
+    else
+        session->taskSlots[session->lastFreeTaskSlot[pool]].nextFreeSlot = slotIdx;
+    
+    session->lastFreeTaskSlot[pool] = slotIdx;
+    
+    IOSimpleLockUnlock(session->taskSlotLock);
+}
+
+/*! Gets the initiator task tag of the SCSI task that the SCSI layer
+ *  identifies by a tagged task identifier.
+ *  @param session the session associated with the task.
+ *  @param LUN the logical unit that the task is addressed to.
+ *  @param taggedTaskID the SCSI layer's identifier for the task.
+ *  @return the initiator task tag of the task, or
+ *  kiSCSIPDUInitiatorTaskTagReserved if no such task is in progress. */
+UInt32 iSCSIVirtualHBA::FindInitiatorTaskTagForTaggedTask(iSCSISession * session,
+                                                          SCSILogicalUnitNumber LUN,
+                                                          SCSITaggedTaskIdentifier taggedTaskID)
+{
+    // Only used to abort tasks, so a scan of the table is acceptable
+    for(UInt16 slotIdx = 0; slotIdx < kMaxTaskSlots - kReservedTaskSlots; slotIdx++)
+    {
+        iSCSITaskSlot * slot = &session->taskSlots[slotIdx];
+        SCSIParallelTaskIdentifier parallelTask = slot->parallelTask;
+        
+        if(parallelTask && slot->LUN == LUN &&
+           GetTaggedTaskIdentifier(parallelTask) == taggedTaskID)
+            return slot->initiatorTaskTag;
+    }
+    return kiSCSIPDUInitiatorTaskTagReserved;
+}
+
+/*! Queues a task management request on the session's leading
+ *  connection, assigning it an initiator task tag from the reserved slots.
+ *  The request is sent by the connection's task queue, on the work loop
+ *  that processes the session's I/O (see BeginTaskMgmtRequest()).
+ *  @param session the session to send on.
+ *  @param LUN the logical unit that the request is addressed to.
+ *  @param taskMgmtFunction the task management function code.
+ *  @param referencedTaskTag the initiator task tag of the task that the
+ *  request refers to (abort task requests only).
+ *  @return kSCSIServiceResponse_Request_In_Process if the request was
+ *  queued, or a failure response otherwise. */
+SCSIServiceResponse iSCSIVirtualHBA::SendTaskMgmtRequest(iSCSISession * session,
+                                                         SCSILogicalUnitNumber LUN,
+                                                         UInt8 taskMgmtFunction,
+                                                         UInt32 referencedTaskTag)
+{
+    iSCSIConnection * connection = session->connections[0];
+    
+    if(!connection)
+        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    
+    // The slot records the function, LUN and referenced task for the PDU
+    // and for the response
+    UInt32 initiatorTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeTaskMgmt,LUN,connection,NULL);
+    
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    
+    iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
+    slot->taskMgmtFunction = taskMgmtFunction;
+    slot->referencedTaskTag = referencedTaskTag;
+    
+    connection->taskQueue->queueTask(initiatorTaskTag);
+    
+	return kSCSIServiceResponse_Request_In_Process;
+}
+
+/*! Sends a queued task management request PDU.
+ *  @param session the session to send on.
+ *  @param connection the connection to send on.
+ *  @param slot the task slot of the request. */
+void iSCSIVirtualHBA::BeginTaskMgmtRequest(iSCSISession * session,
+                                           iSCSIConnection * connection,
+                                           iSCSITaskSlot * slot)
+{
+    UInt32 initiatorTaskTag = slot->initiatorTaskTag;
+    
+    // Task management requests are sent as immediate commands (see
+    // iSCSIPDUTaskMgmtReqBHSInit), so that tasks can be aborted while the
+    // target's command window is closed
+    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.LUN = BuildLUNField(slot->LUN);
+    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | slot->taskMgmtFunction;
+    bhs.initiatorTaskTag = initiatorTaskTag;
+    bhs.referencedTaskTag = slot->referencedTaskTag;
+    
+    // The target resends the task's PDUs starting with ExpDataSN
+    if(slot->taskMgmtFunction == kiSCSIPDUTaskMgmtFuncTaskReassign) {
+        iSCSITaskSlot * referencedSlot = FindTaskSlot(session,slot->referencedTaskTag);
         
-        // Task is complete, remove it from the queue
-        connection->taskQueue->completeCurrentTask();
+        if(referencedSlot && referencedSlot->taskData)
+            bhs.expDataSN = OSSwapHostToBigInt32(referencedSlot->taskData->expDataSN);
+    }
+    
+    if(!SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0)) {
+        ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+        return;
+    }
+    
+    // The request could not be sent
+    connection->taskQueue->completeTask(initiatorTaskTag);
+    
+    CompleteTaskMgmtRequest(session,slot->LUN,slot->taskMgmtFunction,
+                            kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+    
+    ReleaseTaskSlot(session,initiatorTaskTag);
+}
+
+/*! Reports the outcome of a task management request to the SCSI layer,
+ *  on the HBA's work loop.
+ *  @param session the session that the request was sent on.
+ *  @param LUN the logical unit that the request was addressed to.
+ *  @param taskMgmtFunction the task management function code.
+ *  @param serviceResponse the SCSI service response. */
+void iSCSIVirtualHBA::CompleteTaskMgmtRequest(iSCSISession * session,
+                                              SCSILogicalUnitNumber LUN,
+                                              UInt8 taskMgmtFunction,
+                                              SCSIServiceResponse serviceResponse)
+{
+    GetCommandGate()->runAction(&CompleteTaskMgmtRequestAction,
+                                session,
+                                (void *)(uintptr_t)LUN,
+                                (void *)(uintptr_t)taskMgmtFunction,
+                                (void *)(uintptr_t)serviceResponse);
+}
+
+/*! Command gate action for CompleteTaskMgmtRequest(). */
+IOReturn iSCSIVirtualHBA::CompleteTaskMgmtRequestAction(OSObject * owner,
+                                                        void * session,
+                                                        void * LUN,
+                                                        void * taskMgmtFunction,
+                                                        void * serviceResponse)
+{
+    iSCSIVirtualHBA * hba = (iSCSIVirtualHBA *)owner;
+    SCSITargetIdentifier targetId = ((iSCSISession *)session)->sessionId;
+    SCSILogicalUnitNumber taskLUN = (SCSILogicalUnitNumber)(uintptr_t)LUN;
+    SCSIServiceResponse response = (SCSIServiceResponse)(uintptr_t)serviceResponse;
+    
+    switch((UInt8)(uintptr_t)taskMgmtFunction)
+    {
+        case kiSCSIPDUTaskMgmtFuncAbortTask:
+            hba->CompleteAbortTask(targetId,taskLUN,0,response);
+        break;
+        case kiSCSIPDUTaskMgmtFuncAbortTaskSet:
+            hba->CompleteAbortTaskSet(targetId,taskLUN,response);
+        break;
+        case kiSCSIPDUTaskMgmtFuncClearACA:
+            hba->CompleteClearACA(targetId,taskLUN,response);
+        break;
+        case kiSCSIPDUTaskMgmtFuncClearTaskSet:
+            hba->CompleteClearTaskSet(targetId,taskLUN,response);
+        break;
+        case kiSCSIPDUTaskMgmtFuncLUNReset:
+            hba->CompleteLogicalUnitReset(targetId,taskLUN,response);
+        break;
+        case kiSCSIPDUTaskMgmtFuncTargetWarmReset:
+            hba->CompleteTargetReset(targetId,response);
+        break;
+    };
+    return kIOReturnSuccess;
+}
+
+/*! Moves the tasks of a failed connection to another connection of the
+ *  session (error recovery level 2).  Tasks that were not sent are
+ *  started on the other connection.  Tasks that were sent are held there
+ *  while the failed connection is logged out; each is then reassigned
+ *  with a TASK REASSIGN request and the target resends unacknowledged
+ *  data-in PDUs, R2Ts for data-out it did not receive, and status.
+ *  Must be called before the failed connection is deactivated.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection that failed.
+ *  @return true if the tasks were moved, false if they should be failed
+ *  (recovery is not supported or no other connection is available). */
+bool iSCSIVirtualHBA::ReassignConnectionTasks(iSCSISession * session,iSCSIConnection * connection)
+{
+    if(session->errorRecoveryLevel < 2 || !connection->taskQueue->isEnabled())
+        return false;
+    
+    iSCSIConnection * recoveryConnection = NULL;
+    
+    for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * conn = session->connections[connectionId];
         
-        DBLog("iscsi: Processed data-in PDU (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
+        if(conn != connection && IsConnectionSchedulable(conn)) {
+            recoveryConnection = conn;
+            break;
+        }
     }
     
-    // Send acknowledgement to target if one is required
-    if(bhs->flags & kiSCSIPDUDataInAckFlag)
+    if(!recoveryConnection)
+        return false;
+    
+    // The target won't reassign the tasks until the failed connection has
+    // been logged out, which is done on the connection the tasks move to
+    UInt32 logoutTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeLogout,0,recoveryConnection,NULL);
+    
+    if(logoutTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return false;
+    
+    iSCSITaskSlot * logoutSlot = FindTaskSlot(session,logoutTaskTag);
+    logoutSlot->logoutConnectionId = connection->cid;
+    logoutSlot->logoutComplete = false;
+    
+    DBLog("iscsi: Moving tasks to connection %d (sid: %d, cid: %d)\n",
+          recoveryConnection->cid,session->sessionId,connection->cid);
+    
+    for(UInt16 slotIdx = 0; slotIdx < kMaxTaskSlots - kReservedTaskSlots; slotIdx++)
     {
-//TODO: error recovery
+        iSCSITaskSlot * slot = &session->taskSlots[slotIdx];
+        SCSIParallelTaskIdentifier parallelTask = slot->parallelTask;
+        
+        if(!parallelTask || slot->connection != connection)
+            continue;
+        
+        iSCSIHBATaskData * taskData = slot->taskData;
+        
+        // Data-out that was queued is sent again in answer to the target's
+        // recovery R2Ts (the data is taken from the task's buffer)
+        DequeueDataOutForTask(connection,parallelTask);
+        
+        slot->connection = recoveryConnection;
+        taskData->connectionId = recoveryConnection->cid;
+        
+        UInt64 requested = GetRequestedDataTransferCount(parallelTask);
+        UInt64 realized = GetRealizedDataTransferCount(parallelTask);
+        
+        if(realized < requested)
+            OSAddAtomic64(requested - realized,&recoveryConnection->dataToTransfer);
+        
+        // Tasks that were never sent are simply started on the other connection
+        if(!connection->taskQueue->completeTask(slot->initiatorTaskTag)) {
+            recoveryConnection->taskQueue->queueTask(slot->initiatorTaskTag);
+            continue;
+        }
+        
+        taskData->reassignState = kiSCSITaskReassignWaitingForLogout;
+        taskData->failedConnectionId = connection->cid;
+        
+        recoveryConnection->taskQueue->adoptTask(slot->initiatorTaskTag);
+        ArmTaskTimer(session,slot->initiatorTaskTag,session->taskDeadlineMs);
     }
+    
+    recoveryConnection->taskQueue->queueTask(logoutTaskTag);
+    return true;
 }
 
-/*! Process an incoming asynchronous message PDU.
- *  @param session the session associated with the async PDU.
- *  @param connection the connection associated with the async PDU.
- *  @param bhs the basic header segment of the async PDU. */
-void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
-                                      iSCSIConnection * connection,
-                                      iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs)
+/*! Sends a queued logout request that removes a failed connection.
+ *  @param session the session to send on.
+ *  @param connection the connection to send on.
+ *  @param slot the task slot of the request. */
+void iSCSIVirtualHBA::BeginLogoutRequest(iSCSISession * session,
+                                         iSCSIConnection * connection,
+                                         iSCSITaskSlot * slot)
 {
-    // Grab any data associated with the PDU (e.g., sense data for SCSI
-    // asynchronous message)
-    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS *)bhs);
-    UInt8 * data = NULL;
+    UInt32 initiatorTaskTag = slot->initiatorTaskTag;
     
-    if(length) {
-        if(!(data = (UInt8*)IOMalloc(length))) {
-            DBLog("iscsi: couldn't allocate memory for PDU data (ProcessAsyncMsg)\n");
+    iSCSIPDULogoutReqBHS bhs = iSCSIPDULogoutReqBHSInit;
+    bhs.reasonCode |= kiSCSIPDULogoutRemoveConnectionForRecovery;
+    bhs.initiatorTaskTag = initiatorTaskTag;
+    bhs.CID = OSSwapHostToBigInt16(slot->logoutConnectionId);
+    
+    DBLog("iscsi: Logging out connection %d for recovery (sid: %d, cid: %d)\n",
+          slot->logoutConnectionId,session->sessionId,connection->cid);
+    
+    // If the send fails this connection is dropped as well, which fails
+    // (or moves) the tasks and releases the slot
+    if(!SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
+        ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+}
+
+/*! Process an incoming logout response PDU.
+ *  @param session the session associated with the logout response.
+ *  @param connection the connection associated with the logout response.
+ *  @param bhs the basic header segment of the logout response. */
+void iSCSIVirtualHBA::ProcessLogoutRsp(iSCSISession * session,
+                                       iSCSIConnection * connection,
+                                       iSCSIPDU::iSCSIPDULogoutRspBHS * bhs)
+{
+    iSCSITaskSlot * slot = FindTaskSlot(session,bhs->initiatorTaskTag);
+    
+    if(!slot || slot->taskType != kInitiatorTaskTypeLogout) {
+        DBLog("iscsi: Logout response for unknown task %#x (sid: %d, cid: %d)\n",
+              bhs->initiatorTaskTag,session->sessionId,connection->cid);
+        return;
+    }
+    
+    if(bhs->response != kiSCSIPDULogoutRspSuccess) {
+        DBLog("iscsi: Logout of connection %d failed with code %#x (sid: %d, cid: %d)\n",
+              slot->logoutConnectionId,bhs->response,session->sessionId,connection->cid);
+        FinishConnectionRecovery(session,connection,bhs->initiatorTaskTag,false);
+        return;
+    }
+    
+    // Tasks may only be reassigned once Time2Wait has elapsed (see
+    // HandleTaskDeadline())
+    UInt16 time2Wait = OSSwapBigToHostInt16(bhs->time2Wait);
+    
+    if(time2Wait) {
+        slot->logoutComplete = true;
+        ArmTaskTimer(session,bhs->initiatorTaskTag,time2Wait*1000);
+        return;
+    }
+    
+    FinishConnectionRecovery(session,connection,bhs->initiatorTaskTag,true);
+}
+
+/*! Ends the logout of a failed connection.  If the connection was logged
+ *  out its tasks are reassigned, otherwise they are failed.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection the logout request was sent on.
+ *  @param initiatorTaskTag the initiator task tag of the logout request.
+ *  @param loggedOut true if the failed connection was logged out. */
+void iSCSIVirtualHBA::FinishConnectionRecovery(iSCSISession * session,
+                                               iSCSIConnection * connection,
+                                               UInt32 initiatorTaskTag,
+                                               bool loggedOut)
+{
+    iSCSITaskSlot * logoutSlot = FindTaskSlot(session,initiatorTaskTag);
+    
+    if(!logoutSlot)
+        return;
+    
+    ConnectionIdentifier failedConnectionId = logoutSlot->logoutConnectionId;
+    
+    connection->taskQueue->completeTask(initiatorTaskTag);
+    ReleaseTaskSlot(session,initiatorTaskTag);
+    
+    for(UInt16 slotIdx = 0; slotIdx < kMaxTaskSlots - kReservedTaskSlots; slotIdx++)
+    {
+        iSCSITaskSlot * slot = &session->taskSlots[slotIdx];
+        SCSIParallelTaskIdentifier parallelTask = slot->parallelTask;
+        
+        if(!parallelTask || slot->connection != connection ||
+           slot->taskData->reassignState != kiSCSITaskReassignWaitingForLogout ||
+           slot->taskData->failedConnectionId != failedConnectionId)
+            continue;
+        
+        if(loggedOut) {
+            slot->taskData->reassignState = kiSCSITaskReassignWaitingForRequest;
+            continue;
+        }
+        
+        connection->taskQueue->completeTask(slot->initiatorTaskTag);
+        
+        CompleteParallelTask(session,
+                             connection,
+                             parallelTask,
+                             kSCSITaskStatus_DeliveryFailure,
+                             kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+    }
+    
+    if(loggedOut)
+        QueueTaskReassignRequests(session,connection);
+}
+
+/*! Queues TASK REASSIGN requests for tasks waiting to be reassigned to
+ *  a connection, for as long as reserved task slots are available.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection the tasks are reassigned to. */
+void iSCSIVirtualHBA::QueueTaskReassignRequests(iSCSISession * session,iSCSIConnection * connection)
+{
+    for(UInt16 slotIdx = 0; slotIdx < kMaxTaskSlots - kReservedTaskSlots; slotIdx++)
+    {
+        iSCSITaskSlot * slot = &session->taskSlots[slotIdx];
+        
+        if(!slot->parallelTask || slot->connection != connection ||
+           slot->taskData->reassignState != kiSCSITaskReassignWaitingForRequest)
+            continue;
+        
+        // The remaining tasks are queued as requests are answered
+        UInt32 requestTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeTaskMgmt,slot->LUN,connection,NULL);
+        
+        if(requestTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
             return;
+        
+        iSCSITaskSlot * requestSlot = FindTaskSlot(session,requestTaskTag);
+        requestSlot->taskMgmtFunction = kiSCSIPDUTaskMgmtFuncTaskReassign;
+        requestSlot->referencedTaskTag = slot->initiatorTaskTag;
+        
+        // PDUs that were requested with a SNACK can't be requested again
+        // individually; an ExpDataSN of zero asks for all of the task's PDUs
+        iSCSIHBATaskData * taskData = slot->taskData;
+        
+        if(taskData->missingDataPDUs) {
+            taskData->expDataSN = 0;
+            taskData->missingDataPDUs = 0;
         }
-        RecvPDUData(session,connection,data,length,MSG_WAITALL);
+        
+        // Status and acknowledgements are sent again as well
+        taskData->completionPending = false;
+        taskData->dataACKPending = false;
+        taskData->reassignState = kiSCSITaskReassignRequested;
+        
+        connection->taskQueue->queueTask(requestTaskTag);
     }
+}
 
-    iSCSIPDUAsyncMsgEvent asyncEvent = (iSCSIPDUAsyncMsgEvent)(bhs->asyncEvent);
-    
-    DBLog("iscsi: Async Message (code %#x) received (sid: %d, cid: %d)\n",
-        asyncEvent,session->sessionId,connection->cid);
+/*! Handles the outcome of a TASK REASSIGN request.
+ *  @param session the session associated with the task.
+ *  @param connection the connection the task was reassigned to.
+ *  @param initiatorTaskTag the initiator task tag of the reassigned task.
+ *  @param reassigned true if the target reassigned the task. */
+void iSCSIVirtualHBA::CompleteTaskReassign(iSCSISession * session,
+                                           iSCSIConnection * connection,
+                                           UInt32 initiatorTaskTag,
+                                           bool reassigned)
+{
+    SCSIParallelTaskIdentifier parallelTask = FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
     
-    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)getClient();
-    if(!client) {
-        DBLog("iscsi: client is not available; async message may not be processed correctly\n");
+    if(parallelTask && reassigned) {
+        ((iSCSIHBATaskData*)GetHBADataPointer(parallelTask))->reassignState = kiSCSITaskReassignNone;
+        ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+    }
+    else if(parallelTask) {
+        DBLog("iscsi: Task %#x could not be reassigned (sid: %d, cid: %d)\n",
+              initiatorTaskTag,session->sessionId,connection->cid);
+        
+        connection->taskQueue->completeTask(initiatorTaskTag);
+        
+        CompleteParallelTask(session,
+                             connection,
+                             parallelTask,
+                             kSCSITaskStatus_DeliveryFailure,
+                             kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
     }
+    
+    // The request's slot is free for the next task
+    QueueTaskReassignRequests(session,connection);
+}
 
-    switch(asyncEvent)
+/*! Renegotiates the MaxRecvDataSegmentLength of an active connection with a
+ *  text request.  The declaration takes effect once the target answers;
+ *  until then the connection keeps its current length.  The target's own
+ *  MaxRecvDataSegmentLength, if it is sent back, is adopted as well.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to renegotiate.
+ *  @param length the MaxRecvDataSegmentLength to declare.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::RenegotiateMaxRecvDataSegmentLength(iSCSISession * session,
+                                                             iSCSIConnection * connection,
+                                                             UInt32 length)
+{
+    if(length < kRFC3720_MaxRecvDataSegmentLength_Min || length > kMaxRenegotiatedDataSegmentLength)
+        return EINVAL;
+    
+    UInt32 initiatorTaskTag = AllocateTaskSlot(session,kInitiatorTaskTypeText,0,connection,NULL);
+    
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return EAGAIN;
+    
+    // The pending flag and the task timer belong to the session's work
+    // loop; both are handled when the request is started there
+    FindTaskSlot(session,initiatorTaskTag)->textMaxRecvDataSegmentLength = length;
+    connection->taskQueue->queueTask(initiatorTaskTag);
+    return 0;
+}
+
+/*! Sends a queued text request that renegotiates MaxRecvDataSegmentLength.
+ *  Marks the connection's text negotiation as pending and arms the task
+ *  timer; the request is dropped if another negotiation is outstanding.
+ *  The bounce buffer for received data segments is grown first, since the
+ *  target may use the new length as soon as it has the request.
+ *  @param session the session to send on.
+ *  @param connection the connection to send on.
+ *  @param slot the task slot of the request. */
+void iSCSIVirtualHBA::BeginTextRequest(iSCSISession * session,
+                                       iSCSIConnection * connection,
+                                       iSCSITaskSlot * slot)
+{
+    UInt32 initiatorTaskTag = slot->initiatorTaskTag;
+    UInt32 length = slot->textMaxRecvDataSegmentLength;
+    
+    // Only one text negotiation may be in progress on a connection; a
+    // request queued while another is outstanding is dropped
+    if(connection->textNegotiationPending) {
+        DBLog("iscsi: Text negotiation already in progress (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        connection->taskQueue->completeTask(initiatorTaskTag);
+        ReleaseTaskSlot(session,initiatorTaskTag);
+        return;
+    }
+    
+    connection->textNegotiationPending = true;
+    ArmTaskTimer(session,initiatorTaskTag,session->taskDeadlineMs);
+    
+    if(length > connection->dataRecvBufferSize)
     {
-        // The target will drop all connections for this session
-        case kiSCSIPDUAsyncMsgDropAllConnections:
-            ReleaseSession(session->sessionId);
-            break;
+        UInt8 * buffer = (UInt8*)IOMalloc(length);
+        
+        if(!buffer) {
+            FinishTextRequest(session,connection,initiatorTaskTag);
+            return;
+        }
+        
+        // Carry over a data segment that is partially received
+        if(connection->dataRecvBuffer) {
+            if(connection->recvContext.data == connection->dataRecvBuffer) {
+                memcpy(buffer,connection->dataRecvBuffer,connection->dataRecvBufferSize);
+                iSCSIPDURecvSetDataBuffer(&connection->recvContext,buffer);
+            }
+            IOFree(connection->dataRecvBuffer,connection->dataRecvBufferSize);
+        }
+        
+        connection->dataRecvBuffer = buffer;
+        connection->dataRecvBufferSize = length;
+    }
+    
+    char data[64];
+    int dataLength = snprintf(data,sizeof(data),"MaxRecvDataSegmentLength=%u",length) + 1;
+    
+    iSCSIPDUTextReqBHS bhs = iSCSIPDUTextReqBHSInit;
+    bhs.initiatorTaskTag = initiatorTaskTag;
+    
+    DBLog("iscsi: Renegotiating MaxRecvDataSegmentLength %d -> %d (sid: %d, cid: %d)\n",
+          connection->maxRecvDataSegmentLength,length,session->sessionId,connection->cid);
+    
+    // If the send fails the connection is dropped, which releases the slot
+    SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,data,dataLength);
+}
 
-        // The target will drop the specified connection
-        case kiSCSIPDUAsynMsgDropConnection:
-            ReleaseConnection(session->sessionId,connection->cid);
-            break;
-            
-        case kiSCSIPDUAsyncMsgLogout:
-            DeactivateConnection(session->sessionId,connection->cid);
-            break;
-            
-        // Target requests parameter negotiation
-        case kiSCSIPDUAsyncMsgNegotiateParams:
-            DeactivateConnection(session->sessionId,connection->cid);
-            break;
+/*! Process an incoming text response PDU.
+ *  @param session the session associated with the text response.
+ *  @param connection the connection associated with the text response.
+ *  @param bhs the basic header segment of the text response.
+ *  @param data the data segment of the text response. */
+void iSCSIVirtualHBA::ProcessTextRsp(iSCSISession * session,
+                                     iSCSIConnection * connection,
+                                     iSCSIPDU::iSCSIPDUTextRspBHS * bhs,
+                                     UInt8 * data)
+{
+    iSCSITaskSlot * slot = FindTaskSlot(session,bhs->initiatorTaskTag);
+    
+    if(!slot || slot->taskType != kInitiatorTaskTypeText) {
+        DBLog("iscsi: Text response for unknown task %#x (sid: %d, cid: %d)\n",
+              bhs->initiatorTaskTag,session->sessionId,connection->cid);
+        return;
+    }
+    
+    // A single request and response is expected; a longer exchange is
+    // abandoned and the current lengths are kept
+    if(!(bhs->flags & kiSCSIPDUTextFinalFlag) || bhs->targetTransferTag != kiSCSIPDUTargetTransferTagReserved) {
+        DBLog("iscsi: Text negotiation not completed (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        FinishTextRequest(session,connection,bhs->initiatorTaskTag);
+        return;
+    }
+    
+    // Our declaration applies now
+    connection->maxRecvDataSegmentLength = slot->textMaxRecvDataSegmentLength;
+    
+    // The target may declare a new length of its own in return (key-value
+    // pairs are separated by null characters)
+    const char key[] = "MaxRecvDataSegmentLength=";
+    const size_t keyLength = sizeof(key) - 1;
+    const size_t length = data ? GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs) : 0;
+    size_t offset = 0;
+    
+    while(offset < length)
+    {
+        const char * pair = (const char *)data + offset;
+        size_t pairLength = strnlen(pair,length - offset);
+        
+        if(pairLength > keyLength && pairLength - keyLength < 10 && !strncmp(pair,key,keyLength))
+        {
+            UInt32 sendLength = 0;
+            size_t idx;
             
-        // No support for asynchronous SCSI messages; do nothing
-        case kiSCSIPDUAsyncMsgSCSIAsyncMsg: break;
+            for(idx = keyLength; idx < pairLength && pair[idx] >= '0' && pair[idx] <= '9'; idx++)
+                sendLength = sendLength*10 + (pair[idx] - '0');
             
-        // No support for proprietary vendor codes; do nothing
-        case kiSCSIPDUAsyncMsgVendorCode: break;
+            if(idx == pairLength && sendLength >= kRFC3720_MaxRecvDataSegmentLength_Min &&
+               sendLength <= kMaxRenegotiatedDataSegmentLength)
+                SetMaxSendDataSegmentLength(session,connection,sendLength);
+        }
+        offset += pairLength + 1;
+    }
+    
+    DBLog("iscsi: MaxRecvDataSegmentLength %d, MaxSendDataSegmentLength %d (sid: %d, cid: %d)\n",
+          connection->maxRecvDataSegmentLength,connection->maxSendDataSegmentLength,
+          session->sessionId,connection->cid);
+    
+    FinishTextRequest(session,connection,bhs->initiatorTaskTag);
+}
 
-        default: break;
-    };
+/*! Adopts a MaxRecvDataSegmentLength that the target declared while the
+ *  connection is active, growing the bounce buffer for data-out PDUs as
+ *  needed (the current length is kept if the buffer can't be grown).
+ *  @param session the session associated with the connection.
+ *  @param connection the connection.
+ *  @param length the target's MaxRecvDataSegmentLength. */
+void iSCSIVirtualHBA::SetMaxSendDataSegmentLength(iSCSISession * session,
+                                                  iSCSIConnection * connection,
+                                                  UInt32 length)
+{
+    // Large data segments are never left in the transmit queue (see
+    // QueuePDU()), so the buffer may be replaced between sends
+    if(length > connection->dataSendBufferSize)
+    {
+        UInt8 * buffer = (UInt8*)IOMalloc(length);
+        
+        if(!buffer)
+            return;
+        
+        if(connection->dataSendBuffer)
+            IOFree(connection->dataSendBuffer,connection->dataSendBufferSize);
+        
+        connection->dataSendBuffer = buffer;
+        connection->dataSendBufferSize = length;
+    }
     
-    // Only send out a notification to the daemon if the
-    // message is not vendor-specific or a SCSI message.
-    if(asyncEvent != kiSCSIPDUAsyncMsgSCSIAsyncMsg && asyncEvent != kiSCSIPDUAsyncMsgVendorCode)
-        client->sendAsyncMessageNotification(session->sessionId,connection->cid,asyncEvent);
+    connection->maxSendDataSegmentLength = length;
+    connection->immediateDataLength = min(connection->maxSendDataSegmentLength,
+                                          session->firstBurstLength);
+}
 
-    if(data)
-        IOFree(data,length);
+/*! Ends a text negotiation and frees its task slot.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection the text request was sent on.
+ *  @param initiatorTaskTag the initiator task tag of the text request. */
+void iSCSIVirtualHBA::FinishTextRequest(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        UInt32 initiatorTaskTag)
+{
+    connection->textNegotiationPending = false;
+    connection->taskQueue->completeTask(initiatorTaskTag);
+    ReleaseTaskSlot(session,initiatorTaskTag);
 }
 
-/*! Process an incoming R2T PDU.
- *  @param session the session associated with the R2T PDU.
- *  @param connection the connection associated with the R2T PDU.
- *  @param bhs the basic header segment of the R2T PDU. */
-void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
-                                 iSCSIConnection * connection,
-                                 iSCSIPDU::iSCSIPDUR2TBHS * bhs)
+/*! Returns a completed task to the SCSI layer, on the HBA's work loop.
+ *  The SCSI layer expects completions on the HBA's work loop, which need
+ *  not be the work loop that processes the session's I/O.
+ *  @param parallelRequest the request to complete.
+ *  @param completionStatus status of the request.
+ *  @param serviceResponse the SCSI service response. */
+void iSCSIVirtualHBA::ReturnParallelTask(SCSIParallelTaskIdentifier parallelRequest,
+                                         SCSITaskStatus completionStatus,
+                                         SCSIServiceResponse serviceResponse)
+{
+    // The gate is recursive, so this is a direct call when the session
+    // shares the HBA's work loop
+    GetCommandGate()->runAction(&ReturnParallelTaskAction,
+                                parallelRequest,
+                                (void *)(uintptr_t)completionStatus,
+                                (void *)(uintptr_t)serviceResponse);
+}
+
+/*! Command gate action for ReturnParallelTask(). */
+IOReturn iSCSIVirtualHBA::ReturnParallelTaskAction(OSObject * owner,
+                                                   void * parallelRequest,
+                                                   void * completionStatus,
+                                                   void * serviceResponse,
+                                                   void *)
+{
+    ((iSCSIVirtualHBA *)owner)->super::CompleteParallelTask(
+        (SCSIParallelTaskIdentifier)parallelRequest,
+        (SCSITaskStatus)(uintptr_t)completionStatus,
+        (SCSIServiceResponse)(uintptr_t)serviceResponse);
+    
+    return kIOReturnSuccess;
+}
+
+/*! Takes a work loop from the HBA's pool for a session.  Sessions are
+ *  spread across the pool: an unused work loop is preferred, then a new
+ *  one (until the pool holds kMaxSessionWorkLoops), and otherwise the
+ *  work loop serving the fewest sessions.
+ *  @return the work loop, or NULL if none could be created. */
+IOWorkLoop * iSCSIVirtualHBA::AcquireSessionWorkLoop()
 {
-    // Grab parallel task associated with this PDU, indexed by task tag
-    SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+    UInt16 unusedIdx = kMaxSessionWorkLoops;
+    UInt16 emptyIdx = kMaxSessionWorkLoops;
+    UInt16 leastUsedIdx = kMaxSessionWorkLoops;
     
-    if(!parallelTask)
+    for(UInt16 idx = 0; idx < kMaxSessionWorkLoops; idx++)
     {
-        DBLog("iscsi: Couldn't find requested task to process (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-        return;
+        if(!sessionWorkLoops[idx]) {
+            if(emptyIdx == kMaxSessionWorkLoops)
+                emptyIdx = idx;
+        }
+        else if(sessionWorkLoopUsers[idx] == 0) {
+            if(unusedIdx == kMaxSessionWorkLoops)
+                unusedIdx = idx;
+        }
+        else if(leastUsedIdx == kMaxSessionWorkLoops ||
+                sessionWorkLoopUsers[idx] < sessionWorkLoopUsers[leastUsedIdx])
+            leastUsedIdx = idx;
     }
     
-    // Obtain requested data offset and requested lengths
-    UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
-    UInt32 dataLength = OSSwapBigToHostInt32(bhs->desiredDataLength);
+    UInt16 idx = unusedIdx;
+    
+    if(idx == kMaxSessionWorkLoops)
+        idx = emptyIdx;
+    
+    // Create a new work loop (and thread) if there's room in the pool; if
+    // that fails, share the least used work loop
+    if(idx != kMaxSessionWorkLoops && !sessionWorkLoops[idx])
+    {
+        if(!(sessionWorkLoops[idx] = IOWorkLoop::workLoop()))
+            idx = leastUsedIdx;
+        else
+            DBLog("iscsi: Created session work loop %d\n",idx);
+    }
+    
+    if(idx == kMaxSessionWorkLoops)
+        idx = leastUsedIdx;
     
-    ProcessDataOutForTask(session,connection,parallelTask,dataOffset,dataLength,
-                          bhs->LUN,bhs->initiatorTaskTag,bhs->targetTransferTag);
+    if(idx == kMaxSessionWorkLoops)
+        return NULL;
+    
+    OSIncrementAtomic((SInt32 *)&sessionWorkLoopUsers[idx]);
+    return sessionWorkLoops[idx];
+}
 
+/*! Returns a work loop taken by AcquireSessionWorkLoop() to the pool.
+ *  @param workLoop the work loop. */
+void iSCSIVirtualHBA::ReleaseSessionWorkLoop(IOWorkLoop * workLoop)
+{
+    // Work loops are kept until the HBA is terminated, since a session may
+    // be released on its own work loop's thread
+    for(UInt16 idx = 0; idx < kMaxSessionWorkLoops; idx++)
+    {
+        if(sessionWorkLoops[idx] == workLoop) {
+            OSDecrementAtomic((SInt32 *)&sessionWorkLoopUsers[idx]);
+            return;
+        }
+    }
 }
 
-void iSCSIVirtualHBA::ProcessDataOutForTask(iSCSISession * session,
-                                            iSCSIConnection * connection,
-                                            SCSIParallelTaskIdentifier parallelTask,
-                                            UInt32 dataOffset,
-                                            UInt32 dataLength,
-                                            UInt64 LUN,
-                                            UInt32 initiatorTaskTag,
-                                            UInt32 targetTransferTag)
+/*! Removes a task from its connection's data-out queue, discarding
+ *  any sequences that have not been sent.
+ *  @param connection the connection associated with the task.
+ *  @param parallelTask the task to remove. */
+void iSCSIVirtualHBA::DequeueDataOutForTask(iSCSIConnection * connection,
+                                            SCSIParallelTaskIdentifier parallelTask)
 {
-    // Keep track of data to transfer each PDU and sequence number
-    UInt32 dataSegmentLength = connection->maxSendDataSegmentLength;
-    UInt32 dataSN = 0;
+    iSCSIHBATaskData * taskData = (iSCSIHBATaskData*)GetHBADataPointer(parallelTask);
     
-    DBLog("iscsi: Dataoffset: %d (sid: %d, cid: %d)\n",dataOffset,session->sessionId,connection->cid);
-    DBLog("iscsi: Desired data length: %d (sid: %d, cid: %d)\n",dataLength,session->sessionId,connection->cid);
+    if(taskData->dataOutQueued) {
+        queue_remove(&connection->dataOutQueue,taskData,iSCSIHBATaskData *,dataOutChain);
+        taskData->dataOutQueued = false;
+    }
     
-    // Create data PDUs and send them until all desired data has been sent
-    iSCSIPDUDataOutBHS bhsDataOut = iSCSIPDUDataOutBHSInit;
-    bhsDataOut.LUN              = LUN;
-    bhsDataOut.initiatorTaskTag = initiatorTaskTag;
-    bhsDataOut.targetTransferTag = targetTransferTag;
+    taskData->dataOutCount = 0;
+}
 
-    // Get descriptor to data to be sent; create buffer for use with each PDU
-    IOMemoryDescriptor  * dataDesc   = GetDataBuffer(parallelTask);
-    UInt8 * data = (UInt8*)IOMalloc(connection->maxSendDataSegmentLength);
-    
-    // The amount of data that needs to be transferred...
-    while(dataLength != 0)
+/*! Sends data-out PDUs for the tasks in a connection's data-out queue.
+ *  Tasks take turns sending one PDU each, and at most kMaxDataOutPDUsPerPass
+ *  PDUs are sent before returning to the workloop.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send on.
+ *  @return true if data-out PDUs remain to be sent, false otherwise. */
+bool iSCSIVirtualHBA::SendQueuedDataOut(iSCSISession * session,iSCSIConnection * connection)
+{
+    for(UInt32 pduCount = 0; pduCount < kMaxDataOutPDUsPerPass; pduCount++)
     {
-        bhsDataOut.bufferOffset = OSSwapHostToBigInt32(dataOffset);
-        bhsDataOut.dataSN = OSSwapHostToBigInt32(dataSN);
+        if(queue_empty(&connection->dataOutQueue))
+            break;
         
-        // Special case for the final PDU
-        if(dataLength <= dataSegmentLength)
-        {
-            dataSegmentLength = dataLength;
+        iSCSIHBATaskData * taskData = NULL;
+        queue_remove_first(&connection->dataOutQueue,taskData,iSCSIHBATaskData *,dataOutChain);
+        taskData->dataOutQueued = false;
+        
+        SCSIParallelTaskIdentifier parallelTask =
+            FindTaskForInitiatorTaskTag(session,taskData->initiatorTaskTag);
+        
+        if(!parallelTask)
+            continue;
+        
+        iSCSIHBADataOutSequence * sequence = &taskData->dataOutSequences[taskData->dataOutHead];
+        UInt32 dataSegmentLength = min(connection->maxSendDataSegmentLength,sequence->dataLength);
+        
+        iSCSIPDUDataOutBHS bhsDataOut   = iSCSIPDUDataOutBHSInit;
+        bhsDataOut.LUN                  = taskData->LUN;
+        bhsDataOut.initiatorTaskTag     = taskData->initiatorTaskTag;
+        bhsDataOut.targetTransferTag    = sequence->targetTransferTag;
+        bhsDataOut.bufferOffset         = OSSwapHostToBigInt32(sequence->dataOffset);
+        bhsDataOut.dataSN               = OSSwapHostToBigInt32(sequence->dataSN);
+        
+        // Special case for the final PDU of the sequence
+        if(dataSegmentLength == sequence->dataLength)
             bhsDataOut.flags = kiSCSIPDUDataOutFinalFlag;
+        
+        // Data is sent straight from the task's buffer when it is mapped
+        const void * data = GetDataOutBuffer(connection,parallelTask,sequence->dataOffset,dataSegmentLength);
+        
+        // Drop the task's remaining sequences; the task will time out
+        if(!data) {
+            DBLog("iscsi: Data-out buffer unavailable (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
+            taskData->dataOutCount = 0;
+            continue;
         }
         
-        dataDesc->readBytes(dataOffset,data,dataSegmentLength);
+        // The connection is dropped if the send fails
         errno_t error = SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsDataOut,
                                 NULL,data,dataSegmentLength);
         
         if(error) {
             DBLog("iscsi: Send error: %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
-            break;
+            return false;
         }
         
-        dataLength -= dataSegmentLength;
-        dataOffset += dataSegmentLength;
-        
         // Update driver stack & connection with amount transferred
         IncrementRealizedDataTransferCount(parallelTask,dataSegmentLength);
-        connection->dataToTransfer -= dataSegmentLength;
-
-        // Increment the data sequence number
-        dataSN++;
+        OSAddAtomic64(-(SInt64)dataSegmentLength,&connection->dataToTransfer);
+        
+        sequence->dataOffset += dataSegmentLength;
+        sequence->dataLength -= dataSegmentLength;
+        sequence->dataSN++;
+        
+        if(sequence->dataLength == 0) {
+            taskData->dataOutHead = (taskData->dataOutHead + 1) % taskData->kMaxDataOutSequences;
+            taskData->dataOutCount--;
+        }
+        
+        // Go to the back of the line if the task has more to send
+        if(taskData->dataOutCount) {
+            queue_enter(&connection->dataOutQueue,taskData,iSCSIHBATaskData *,dataOutChain);
+            taskData->dataOutQueued = true;
+        }
     }
     
-    // Cleanup buffer
-    IOFree(data,connection->maxSendDataSegmentLength);
+    return !queue_empty(&connection->dataOutQueue);
 }
 
 /*! Process an incoming reject PDU.
  *  @param session the session associated with the R2T PDU.
  *  @param connection the connection associated with the R2T PDU.
- *  @param bhs the basic header segment of the reject PDU. */
+ *  @param bhs the basic header segment of the reject PDU.
+ *  @param data the data segment of the PDU, if any. */
 void iSCSIVirtualHBA::ProcessReject(iSCSISession * session,
                                     iSCSIConnection * connection,
-                                    iSCSIPDU::iSCSIPDURejectBHS * bhs)
+                                    iSCSIPDU::iSCSIPDURejectBHS * bhs,
+                                    UInt8 * data)
 {
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
     
@@ -1239,9 +3763,6 @@ void iSCSIVirtualHBA::ProcessReject(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
-    RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
-    
     enum iSCSIPDURejectCode rejectCode = (enum iSCSIPDURejectCode)bhs->reason;
     
     switch(rejectCode) {
@@ -1266,15 +3787,20 @@ void iSCSIVirtualHBA::ProcessReject(iSCSISession * session,
  *  the peer the timestamp is compared to the current system time to determine
  *  the latency.
  *  @param session the session associated with the connection to measure.
- *  @param connection the connection to measure. */
+ *  @param connection the connection to measure
+ *  @param initiatorTaskTag the initiator task tag of the measurement. */
 void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
-                                               iSCSIConnection * connection)
+                                               iSCSIConnection * connection,
+                                               UInt32 initiatorTaskTag)
 {
     // Setup a NOP out PDU (LUN field is unused with a value of 0 and the target
     // transfer tag takes on the reserved value fo this type of NOP out)
+    // (the NOP out is an immediate command, so that the connection can be
+    // probed while the target's command window is closed)
     iSCSIPDUNOPOutBHS bhs = iSCSIPDUNOPOutBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
-    bhs.initiatorTaskTag  = 0;
+    bhs.initiatorTaskTag  = initiatorTaskTag;
     
     // Calculate current uptime and send it to the target with this NOP out.
     // The target will echo the value and this allows us to estimate the
@@ -1291,6 +3817,154 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,data,length);
 }
 
+/*! Selects the connection that a new task is assigned to, using the
+ *  connection scheduling policy configured for the session.
+ *  @param session the session that the task belongs to.
+ *  @param parallelTask the task to be assigned.
+ *  @return the selected connection, or NULL if none is available. */
+iSCSIConnection * iSCSIVirtualHBA::SelectConnectionForTask(iSCSISession * session,
+                                                           SCSIParallelTaskIdentifier parallelTask)
+{
+    iSCSIConnection * connection = NULL;
+    
+    switch(session->connectionSchedulingPolicy)
+    {
+        case kiSCSIConnectionSchedulingRoundRobin:
+            connection = SelectConnectionRoundRobin(session);
+            break;
+        case kiSCSIConnectionSchedulingLatencyWeighted:
+            connection = SelectConnectionLatencyWeighted(session,GetRequestedDataTransferCount(parallelTask));
+            break;
+        case kiSCSIConnectionSchedulingLeastOutstandingBytes:
+        default:
+            connection = SelectConnectionLeastOutstandingBytes(session);
+    };
+    
+    return connection;
+}
+
+/*! Round-robin scheduling policy: selects the next available connection
+ *  following the one that was selected last.
+ *  @param session the session that the task belongs to.
+ *  @return the selected connection, or NULL if none is available. */
+iSCSIConnection * iSCSIVirtualHBA::SelectConnectionRoundRobin(iSCSISession * session)
+{
+    for(UInt32 count = 1; count <= kMaxConnectionsPerSession; count++)
+    {
+        UInt32 idx = (session->lastScheduledConnectionIdx + count) % kMaxConnectionsPerSession;
+        
+        if(IsConnectionSchedulable(session->connections[idx])) {
+            session->lastScheduledConnectionIdx = idx;
+            return session->connections[idx];
+        }
+    }
+    return NULL;
+}
+
+/*! Least-outstanding-bytes scheduling policy: selects the connection
+ *  with the fewest bytes left to transfer.
+ *  @param session the session that the task belongs to.
+ *  @return the selected connection, or NULL if none is available. */
+iSCSIConnection * iSCSIVirtualHBA::SelectConnectionLeastOutstandingBytes(iSCSISession * session)
+{
+    iSCSIConnection * connection = NULL;
+    UInt64 minDataToTransfer = 0;
+    
+    for(UInt32 idx = 0; idx < kMaxConnectionsPerSession; idx++)
+    {
+        iSCSIConnection * conn = session->connections[idx];
+        
+        if(!IsConnectionSchedulable(conn))
+            continue;
+        
+        // The backlog changes on the session's work loop as this runs; read
+        // it once so that each connection is compared by a single value
+        UInt64 dataToTransfer = conn->dataToTransfer;
+        
+        // Ties (e.g., idle connections) are broken by the number of tasks
+        // outstanding on each connection
+        if(!connection || dataToTransfer < minDataToTransfer ||
+           (dataToTransfer == minDataToTransfer &&
+            conn->taskQueue->getOutstandingTaskCount() < connection->taskQueue->getOutstandingTaskCount()))
+        {
+            connection = conn;
+            minDataToTransfer = dataToTransfer;
+        }
+    }
+    return connection;
+}
+
+/*! Latency-weighted scheduling policy: selects the connection that is
+ *  expected to complete the task first, based on the connection's
+ *  measured latency, throughput and current backlog.
+ *  @param session the session that the task belongs to.
+ *  @param transferLength the number of bytes the task will transfer.
+ *  @return the selected connection, or NULL if none is available. */
+iSCSIConnection * iSCSIVirtualHBA::SelectConnectionLatencyWeighted(iSCSISession * session,
+                                                                   UInt64 transferLength)
+{
+    iSCSIConnection * connection = NULL;
+    UInt64 minTimeToComplete = UINT64_MAX;
+    
+    for(UInt32 idx = 0; idx < kMaxConnectionsPerSession; idx++)
+    {
+        iSCSIConnection * conn = session->connections[idx];
+        
+        if(!IsConnectionSchedulable(conn))
+            continue;
+        
+        // Estimated time (us) for this task to complete on this connection:
+        // one round trip plus the time to move the connection's backlog and
+        // this task at the measured rate.  Connections that have not been
+        // measured yet are assumed to be fast so that they get measured.
+        UInt64 timeToComplete = conn->smoothedRTTUs;
+        UInt64 dataToTransfer = conn->dataToTransfer;
+        UInt32 bytesPerSecond = conn->bytesPerSecond;
+        
+        if(bytesPerSecond != 0)
+            timeToComplete += (dataToTransfer + transferLength) * 1000000 / bytesPerSecond;
+        
+        if(timeToComplete < minTimeToComplete) {
+            minTimeToComplete = timeToComplete;
+            connection = conn;
+        }
+    }
+    return connection;
+}
+
+/*! Gets whether a connection can be assigned new tasks.
+ *  @param connection the connection to check.
+ *  @return true if the connection is active. */
+bool iSCSIVirtualHBA::IsConnectionSchedulable(iSCSIConnection * connection)
+{
+    return (connection && connection->dataRecvEventSource &&
+            connection->taskQueue && connection->taskQueue->isEnabled());
+}
+
+/*! Decides whether a write sends unsolicited data-out PDUs (up to the
+ *  session's FirstBurstLength) or waits for the target to solicit data
+ *  with an R2T.  Writes that fit in the first burst always send their
+ *  data unsolicited, so that they complete in one round trip.  Larger
+ *  writes do too unless the target has been slow to send R2Ts, which
+ *  indicates it is short of buffers for unsolicited data.
+ *  @param session the session associated with the task.
+ *  @param connection the connection the task was assigned to.
+ *  @param transferSize the number of bytes the task writes.
+ *  @return true if unsolicited data-out PDUs should be sent. */
+bool iSCSIVirtualHBA::ShouldSendUnsolicitedData(iSCSISession * session,
+                                                iSCSIConnection * connection,
+                                                UInt32 transferSize)
+{
+    if(transferSize <= session->firstBurstLength)
+        return true;
+    
+    // Until R2Ts have been measured, assume the target keeps up
+    UInt64 R2TLatencyLimitUs = (UInt64)connection->smoothedRTTUs*kUnsolicitedDataR2TLatencyFactor +
+                               kUnsolicitedDataR2TSlackUs;
+    
+    return connection->smoothedR2TLatencyUs <= R2TLatencyLimitUs;
+}
+
 
 //////////////////////////////// iSCSI FUNCTIONS ///////////////////////////////
 
@@ -1349,10 +4023,56 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
     // Reset all connections
     memset(newSession->connections,0,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     
+    // Setup the task slot table, with all slots free
+    newSession->taskSlots = (iSCSITaskSlot *)IOMalloc(kMaxTaskSlots*sizeof(iSCSITaskSlot));
+    
+    if(!newSession->taskSlots)
+        goto SESSION_TASK_SLOTS_ALLOC_FAILURE;
+    
+    if(!(newSession->taskSlotLock = IOSimpleLockAlloc()))
+        goto SESSION_TASK_SLOT_LOCK_ALLOC_FAILURE;
+    
+    memset(newSession->taskSlots,0,kMaxTaskSlots*sizeof(iSCSITaskSlot));
+    
+    for(UInt16 slotIdx = 0; slotIdx < kMaxTaskSlots; slotIdx++) {
+        newSession->taskSlots[slotIdx].initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+        newSession->taskSlots[slotIdx].nextFreeSlot = slotIdx + 1;
+    }
+    
+    // The last few slots make up a separate list, reserved for latency
+    // measurements and task management requests
+    newSession->taskSlots[kMaxTaskSlots - kReservedTaskSlots - 1].nextFreeSlot = kMaxTaskSlots;
+    
+    newSession->freeTaskSlot[kiSCSITaskSlotPoolSCSI] = 0;
+    newSession->lastFreeTaskSlot[kiSCSITaskSlotPoolSCSI] = kMaxTaskSlots - kReservedTaskSlots - 1;
+    newSession->freeTaskSlot[kiSCSITaskSlotPoolReserved] = kMaxTaskSlots - kReservedTaskSlots;
+    newSession->lastFreeTaskSlot[kiSCSITaskSlotPoolReserved] = kMaxTaskSlots - 1;
+    
+    // Setup task deadlines; the SCSI layer's timeout is used until the
+    // target's latencies are known
+    newSession->taskTimers.init(GetTaskTimerTick());
+    newSession->taskTimerScheduledTick = 0;
+    newSession->taskLatencySamples = 0;
+    newSession->taskDeadlineMs = kiSCSITaskTimeoutMs;
+    memset(newSession->lunLatencyStats,0,sizeof(newSession->lunLatencyStats));
+    
+    newSession->taskTimerEventSource = IOTimerEventSource::timerEventSource(this,&iSCSIVirtualHBA::TaskTimerExpired);
+    
+    if(!newSession->taskTimerEventSource)
+        goto SESSION_TASK_TIMER_ALLOC_FAILURE;
+    
     // Setup session parameters with defaults
     newSession->sessionId = sessionIdx;
     newSession->numActiveConnections = 0;
     newSession->active = false;
+    newSession->connectionSchedulingPolicy = kiSCSIConnectionSchedulingLeastOutstandingBytes;
+    newSession->lastScheduledConnectionIdx = 0;
+    newSession->workLoopPolicy = kiSCSIWorkLoopShared;
+    newSession->workLoop = GetWorkLoop();
+    
+    if(newSession->workLoop->addEventSource(newSession->taskTimerEventSource) != kIOReturnSuccess)
+        goto SESSION_TASK_TIMER_ADD_FAILURE;
+    
     newSession->cmdSN = 0;
     newSession->expCmdSN = 0;
     newSession->maxCmdSN = 0;
@@ -1391,9 +4111,21 @@ SESSION_CREATE_CONNECTION_FAILURE:
 
     // Remove target from lookup table
     targetList->removeObject(targetIQN);
-    IOFree(newSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     sessionList[sessionIdx] = nullptr;
     *sessionId = kiSCSIInvalidSessionId;
+    newSession->workLoop->removeEventSource(newSession->taskTimerEventSource);
+    
+SESSION_TASK_TIMER_ADD_FAILURE:
+    newSession->taskTimerEventSource->release();
+    
+SESSION_TASK_TIMER_ALLOC_FAILURE:
+    IOSimpleLockFree(newSession->taskSlotLock);
+    
+SESSION_TASK_SLOT_LOCK_ALLOC_FAILURE:
+    IOFree(newSession->taskSlots,kMaxTaskSlots*sizeof(iSCSITaskSlot));
+    
+SESSION_TASK_SLOTS_ALLOC_FAILURE:
+    IOFree(newSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
  
 SESSION_CONNECTION_LIST_ALLOC_FAILURE:
     IOFree(newSession,sizeof(iSCSISession));
@@ -1419,6 +4151,61 @@ void iSCSIVirtualHBA::ReleaseAllSessions()
     }
 }
 
+/*! Selects the work loop that processes a session's I/O, moving the event
+ *  sources of the session's connections to that work loop.
+ *  @param session the session.
+ *  @param workLoopPolicy the policy used to select the work loop (see
+ *  enum iSCSIWorkLoopPolicies).
+ *  @return error code indicating result of operation (EBUSY if any of
+ *  the session's connections are active). */
+errno_t iSCSIVirtualHBA::SetSessionWorkLoopPolicy(iSCSISession * session,UInt8 workLoopPolicy)
+{
+    if(workLoopPolicy >= kiSCSIWorkLoopInvalid)
+        return EINVAL;
+    
+    if(workLoopPolicy == session->workLoopPolicy)
+        return 0;
+    
+    // Event sources are only moved while they are disabled
+    if(session->numActiveConnections > 0)
+        return EBUSY;
+    
+    IOWorkLoop * workLoop = GetWorkLoop();
+    
+    if(workLoopPolicy == kiSCSIWorkLoopPerSession && !(workLoop = AcquireSessionWorkLoop()))
+        return ENOMEM;
+    
+    // No tasks are in progress, so the task timer isn't scheduled
+    session->workLoop->removeEventSource(session->taskTimerEventSource);
+    workLoop->addEventSource(session->taskTimerEventSource);
+    
+    for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(!connection)
+            continue;
+        
+        session->workLoop->removeEventSource(connection->taskQueue);
+        session->workLoop->removeEventSource(connection->dataRecvEventSource);
+        session->workLoop->removeEventSource(connection->pingTimerEventSource);
+        
+        workLoop->addEventSource(connection->taskQueue);
+        workLoop->addEventSource(connection->dataRecvEventSource);
+        workLoop->addEventSource(connection->pingTimerEventSource);
+    }
+    
+    if(session->workLoop != GetWorkLoop())
+        ReleaseSessionWorkLoop(session->workLoop);
+    
+    session->workLoop = workLoop;
+    session->workLoopPolicy = workLoopPolicy;
+    
+    DBLog("iscsi: Set work loop policy %d (sid: %d)\n",workLoopPolicy,session->sessionId);
+    
+    return 0;
+}
+
 /*! Releases an iSCSI session, including all connections associated with that
  *  session.
  *  @param sessionId the session qualifier part of the ISID. */
@@ -1446,8 +4233,21 @@ void iSCSIVirtualHBA::ReleaseSession(SessionIdentifier sessionId)
     // Prevent others from accessing the session
     sessionList[sessionId] = NULL;
     
-    // Free connection list and session object
+    theSession->taskTimerEventSource->cancelTimeout();
+    theSession->workLoop->removeEventSource(theSession->taskTimerEventSource);
+    theSession->taskTimerEventSource->release();
+    
+    if(theSession->workLoop != GetWorkLoop())
+        ReleaseSessionWorkLoop(theSession->workLoop);
+    
+    for(UInt8 LUN = 0; LUN < theSession->kMaxLatencyStatsLUNs; LUN++)
+        if(theSession->lunLatencyStats[LUN])
+            IOFree(theSession->lunLatencyStats[LUN],sizeof(iSCSIHBALatencyStatistics));
+    
+    // Free connection list, task slot table and session object
     IOFree(theSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
+    IOFree(theSession->taskSlots,kMaxTaskSlots*sizeof(iSCSITaskSlot));
+    IOSimpleLockFree(theSession->taskSlotLock);
     IOFree(theSession,sizeof(iSCSISession));
     
     // Remove target name from dictionary
@@ -1519,6 +4319,40 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     newConn->useIFMarker = kRFC3720_IFMarker;
     newConn->OFMarkInt = kRFC3720_OFMarkInt;
     newConn->IFMarkInt = kRFC3720_IFMarkInt;
+    newConn->dataRecvBuffer = NULL;
+    newConn->dataRecvBufferSize = 0;
+    newConn->dataSendBuffer = NULL;
+    newConn->dataSendBufferSize = 0;
+    newConn->recvBuffer = NULL;
+    newConn->recvBufferSize = 0;
+    newConn->recvBufferOffset = 0;
+    newConn->recvBufferLength = 0;
+    newConn->recvWakeupCount = 0;
+    newConn->recvPDUCount = 0;
+    newConn->recvCallCount = 0;
+    newConn->recvByteCount = 0;
+    newConn->txBuffer = NULL;
+    newConn->txBufferSize = 0;
+    newConn->txBufferLength = 0;
+    newConn->txQueuedPDUs = 0;
+    newConn->txBatchOpen = false;
+    newConn->txFlushBytes = kTransmitFlushBytes;
+    newConn->txFlushLatencyUs = kTransmitFlushLatencyUs;
+    newConn->livenessProbePending = false;
+    newConn->textNegotiationPending = false;
+    newConn->smoothedRTTUs = 0;
+    newConn->RTTVarianceUs = 0;
+    newConn->RTTSampleCount = 0;
+    newConn->smoothedR2TLatencyUs = 0;
+    newConn->pingIntervalMs = kPingIntervalMs;
+    newConn->socketBufferSize = 0;
+    newConn->socketBufferSizeApplied = 0;
+    newConn->socketBufferLimit = kSocketBufferLimit;
+    newConn->sendPDUCount = 0;
+    newConn->sendCallCount = 0;
+    newConn->sendByteCount = 0;
+    ResetLatencyStatistics(&newConn->latencyStats);
+    queue_init(&newConn->dataOutQueue);
     
     session->connections[index] = newConn;
     *connectionId = index;
@@ -1533,7 +4367,7 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     if(!newConn->taskQueue->init(this,(iSCSITaskQueue::Action)&BeginTaskOnWorkloopThread,session,newConn))
         goto TASKQUEUE_INIT_FAILURE;
     
-    if(GetWorkLoop()->addEventSource(newConn->taskQueue) != kIOReturnSuccess)
+    if(session->workLoop->addEventSource(newConn->taskQueue) != kIOReturnSuccess)
         goto TASKQUEUE_ADD_FAILURE;
     
     newConn->taskQueue->disable();
@@ -1545,11 +4379,18 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     if(!newConn->dataRecvEventSource->init(this,(iSCSIIOEventSource::Action)&ProcessTaskOnWorkloopThread,session,newConn))
         goto EVENTSOURCE_INIT_FAILURE;
     
-    if(GetWorkLoop()->addEventSource(newConn->dataRecvEventSource) != kIOReturnSuccess)
+    if(session->workLoop->addEventSource(newConn->dataRecvEventSource) != kIOReturnSuccess)
         goto EVENTSOURCE_ADD_FAILURE;
     
     newConn->dataRecvEventSource->disable();
     
+    // The ping timer is started when the connection is activated
+    if(!(newConn->pingTimerEventSource = IOTimerEventSource::timerEventSource(this,&iSCSIVirtualHBA::PingTimerExpired)))
+        goto PINGTIMER_ALLOC_FAILURE;
+    
+    if(session->workLoop->addEventSource(newConn->pingTimerEventSource) != kIOReturnSuccess)
+        goto PINGTIMER_ADD_FAILURE;
+    
     // Create a new socket (per RFC3720, only TCP sockets are used.
     // Domain can be either IPv4 or IPv6.
     error = sock_socket(portalSockaddr->ss_family,
@@ -1599,7 +4440,13 @@ SOCKET_BIND_FAILURE:
     sock_close(newConn->socket);
     
 SOCKET_CREATE_FAILURE:
-    GetWorkLoop()->removeEventSource(newConn->dataRecvEventSource);
+    session->workLoop->removeEventSource(newConn->pingTimerEventSource);
+    
+PINGTIMER_ADD_FAILURE:
+    newConn->pingTimerEventSource->release();
+    
+PINGTIMER_ALLOC_FAILURE:
+    session->workLoop->removeEventSource(newConn->dataRecvEventSource);
     
 EVENTSOURCE_ADD_FAILURE:
     
@@ -1607,7 +4454,7 @@ EVENTSOURCE_INIT_FAILURE:
     newConn->dataRecvEventSource->release();
     
 EVENTSOURCE_ALLOC_FAILURE:
-    GetWorkLoop()->removeEventSource(newConn->taskQueue);
+    session->workLoop->removeEventSource(newConn->taskQueue);
     
 TASKQUEUE_ADD_FAILURE:
     
@@ -1651,15 +4498,31 @@ void iSCSIVirtualHBA::ReleaseConnection(SessionIdentifier sessionId,
     
     sock_close(connection->socket);
 
-    GetWorkLoop()->removeEventSource(connection->dataRecvEventSource);
-    GetWorkLoop()->removeEventSource(connection->taskQueue);
+    connection->pingTimerEventSource->cancelTimeout();
+    
+    session->workLoop->removeEventSource(connection->pingTimerEventSource);
+    session->workLoop->removeEventSource(connection->dataRecvEventSource);
+    session->workLoop->removeEventSource(connection->taskQueue);
     
     DBLog("iscsi: Removed event sources (sid: %d, cid: %d)\n",sessionId,connectionId);
     
+    connection->pingTimerEventSource->release();
     connection->dataRecvEventSource->release();
     connection->taskQueue->release();
     connection->dataToTransfer = 0;
     
+    if(connection->dataRecvBuffer)
+        IOFree(connection->dataRecvBuffer,connection->dataRecvBufferSize);
+    
+    if(connection->dataSendBuffer)
+        IOFree(connection->dataSendBuffer,connection->dataSendBufferSize);
+    
+    if(connection->recvBuffer)
+        IOFree(connection->recvBuffer,connection->recvBufferSize);
+    
+    if(connection->txBuffer)
+        IOFree(connection->txBuffer,connection->txBufferSize);
+    
     IOFree(connection,sizeof(iSCSIConnection));
     
     DBLog("iscsi: Released connection (sid: %d, cid: %d)\n",sessionId,connectionId);
@@ -1692,6 +4555,74 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SessionIdentifier sessionId,Connecti
     connection->immediateDataLength = min(connection->maxSendDataSegmentLength,
                                           session->firstBurstLength);
     
+    // Size the bounce buffer for data-in PDUs to the negotiated
+    // MaxRecvDataSegmentLength (this may change when a connection is
+    // reinstated, so reallocate if needed)
+    if(connection->dataRecvBufferSize != connection->maxRecvDataSegmentLength)
+    {
+        if(connection->dataRecvBuffer)
+            IOFree(connection->dataRecvBuffer,connection->dataRecvBufferSize);
+        
+        connection->dataRecvBufferSize = connection->maxRecvDataSegmentLength;
+        connection->dataRecvBuffer = (UInt8*)IOMalloc(connection->dataRecvBufferSize);
+        
+        if(!connection->dataRecvBuffer) {
+            connection->dataRecvBufferSize = 0;
+            return EAGAIN;
+        }
+    }
+    
+    // Likewise for data-out PDUs whose buffer could not be mapped; immediate
+    // data is bounded by MaxSendDataSegmentLength as well
+    if(connection->dataSendBufferSize != connection->maxSendDataSegmentLength)
+    {
+        if(connection->dataSendBuffer)
+            IOFree(connection->dataSendBuffer,connection->dataSendBufferSize);
+        
+        connection->dataSendBufferSize = connection->maxSendDataSegmentLength;
+        connection->dataSendBuffer = (UInt8*)IOMalloc(connection->dataSendBufferSize);
+        
+        if(!connection->dataSendBuffer) {
+            connection->dataSendBufferSize = 0;
+            return EAGAIN;
+        }
+    }
+    
+    // Staging buffer for received data (see ProcessTaskOnWorkloopThread())
+    if(!connection->recvBuffer)
+    {
+        connection->recvBufferSize = kRecvBufferSize;
+        connection->recvBuffer = (UInt8*)IOMalloc(connection->recvBufferSize);
+        
+        if(!connection->recvBuffer) {
+            connection->recvBufferSize = 0;
+            return EAGAIN;
+        }
+    }
+    
+    // Transmit queue for PDUs sent during a pass of the workloop
+    if(!connection->txBuffer)
+    {
+        connection->txBufferSize = kTransmitBufferSize;
+        connection->txBuffer = (UInt8*)IOMalloc(connection->txBufferSize);
+        
+        if(!connection->txBuffer) {
+            connection->txBufferSize = 0;
+            return EAGAIN;
+        }
+    }
+    
+    // Start receiving PDUs incrementally; PDUs received so far (i.e., during
+    // login) have been received in full
+    iSCSIPDURecvReset(&connection->recvContext,connection->useHeaderDigest,connection->useDataDigest);
+    connection->recvBufferOffset = 0;
+    connection->recvBufferLength = 0;
+    connection->txBufferLength = 0;
+    connection->txQueuedPDUs = 0;
+    connection->txBatchOpen = false;
+    
+    ApplySocketPolicy(session,connection);
+    
     connection->taskQueue->enable();
     connection->dataRecvEventSource->enable();
     
@@ -1706,6 +4637,9 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SessionIdentifier sessionId,Connecti
     }
 
     OSIncrementAtomic(&session->numActiveConnections);
+    
+    if(connection->pingIntervalMs)
+        connection->pingTimerEventSource->setTimeoutMS(connection->pingIntervalMs);
 
     return 0;
 }
@@ -1759,16 +4693,38 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SessionIdentifier sessionId,Connec
 
     connection->dataRecvEventSource->disable();
     connection->taskQueue->disable();
+    connection->pingTimerEventSource->cancelTimeout();
+    
+    // Discard PDUs that have not been sent
+    connection->txBufferLength = 0;
+    connection->txQueuedPDUs = 0;
+    connection->txBatchOpen = false;
     
     // Tell driver stack that tasks have been rejected (stack will reattempt
     // the task on a different connection, if one is available)
     UInt32 initiatorTaskTag = 0;
     SCSIParallelTaskIdentifier task;
  
-    while((initiatorTaskTag = connection->taskQueue->completeCurrentTask()) != 0)
+    while(connection->taskQueue->removeNextTask(&initiatorTaskTag))
     {
-        task = FindTaskForControllerIdentifier(sessionId, initiatorTaskTag);
-        if(!task)
+        task = FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
+        
+        // Latency measurements and task management requests that were
+        // never answered
+        if(!task) {
+            iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
+            
+            if(slot && slot->taskType == kInitiatorTaskTypeTaskMgmt)
+                CompleteTaskMgmtRequest(session,slot->LUN,slot->taskMgmtFunction,
+                                        kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+            
+            ReleaseTaskSlot(session,initiatorTaskTag);
+            continue;
+        }
+        
+        // Tasks that were moved to another connection before they were
+        // started (see ReassignConnectionTasks())
+        if(FindTaskSlot(session,initiatorTaskTag)->connection != connection)
             continue;
         
         // Notify the SCSI driver stack that we couldn't finish these tasks
@@ -1780,6 +4736,10 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SessionIdentifier sessionId,Connec
                              kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
     }
 
+    // Any NOP-out or text request that was outstanding has been discarded
+    connection->livenessProbePending = false;
+    connection->textNegotiationPending = false;
+    
     OSDecrementAtomic(&session->numActiveConnections);
     
     // If this is the last active connection, un-mount the target
@@ -1846,7 +4806,9 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
         return EINVAL;
     
     // Set the command sequence number & expected status sequence number
-    if(bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut) {
+    // (data-out PDUs and SNACKs don't carry a command sequence number)
+    if(bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut &&
+       bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeSNACKReq) {
         bhs->cmdSN = OSSwapHostToBigInt32(session->cmdSN);
         
         // Advance cmdSN if PDU is not marked for immediate delivery
@@ -1857,6 +4819,13 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     bhs->expStatSN = OSSwapHostToBigInt32(connection->expStatSN);
     
     SetDataSegmentLength((iSCSIPDUInitiatorBHS*)bhs,(UInt32)length);
+    
+    // Gather the PDU with others sent during this pass of the workloop
+    if(connection->txBatchOpen) {
+        DBLog("iscsi: Queued PDU type %#x (sid: %d, cid: %d)\n",
+              bhs->opCodeAndDeliveryMarker,session->sessionId,connection->cid);
+        return QueuePDU(session,connection,bhs,data,length);
+    }
 
     // Send data over the network, return true if all bytes were sent
     struct msghdr msg;
@@ -1889,9 +4858,15 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     
     // If theres data to send...
     UInt32 padding = 0;
+    UInt32 dataDigest = 0;
+    unsigned int dataIovecIdx = 0;
+    unsigned int dataIovecCnt = 0;
     
     if(data && length)
     {
+        // The data digest covers the data segment and its padding
+        dataIovecIdx = iovecCnt;
+        
         // Add data segment
         iovec[iovecCnt].iov_base = (void*)data;
         iovec[iovecCnt].iov_len  = length;
@@ -1908,14 +4883,10 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
 
         DBLog("iscsi: Sending data length: %zu\n",length);
 
-        // Leave room for a data digest
+        // Leave room for a data digest; it is computed (including padding)
+        // while the data segment is copied into the socket buffers
         if(connection->useDataDigest) {
-            UInt32 dataDigest;
-            
-            // Compute digest
-            dataDigest = crc32c(0,data,length);
-            
-            DBLog("iscsi: Data digest: %#x\n",dataDigest);
+            dataIovecCnt = iovecCnt - dataIovecIdx;
             
             iovec[iovecCnt].iov_base = &dataDigest;
             iovec[iovecCnt].iov_len  = sizeof(dataDigest);
@@ -1928,28 +4899,43 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     size_t bytesSent = 0;
     errno_t error;
     
-    if((error = sock_send(connection->socket,&msg,0,&bytesSent)))
+    if(dataIovecCnt) {
+        error = SendWithDigest(connection,iovec,iovecCnt,dataIovecIdx,dataIovecCnt,&bytesSent);
+        DBLog("iscsi: Data digest: %#x\n",dataDigest);
+    }
+    else
+        error = sock_send(connection->socket,&msg,0,&bytesSent);
+    
+    if(error)
     {
         DBLog("iscsi: sock_send error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
         HandleConnectionTimeout(session->sessionId,connection->cid);
         return error;
     }
     
+    connection->sendPDUCount++;
+    connection->sendCallCount++;
+    connection->sendByteCount += bytesSent;
+    
     return error;
 }
 
 
-/*! Gets whether a PDU is available for receiption on a particular
- *  connection.
+/*! Gets whether PDU bytes are available for receiption on a particular
+ *  connection (PDUs may arrive in pieces; see recvContext).
  *  @param the connection to check.
- *  @return true if a PDU is available, false otherwise. */
+ *  @return true if data is available, false otherwise. */
 bool iSCSIVirtualHBA::isPDUAvailable(iSCSIConnection * connection)
 {
-    int bytesAtSocket;
+    // Data may have been staged but not yet processed
+    if(connection->recvBufferOffset < connection->recvBufferLength)
+        return true;
+    
+    int bytesAtSocket = 0;
     sock_ioctl(connection->socket,FIONREAD,&bytesAtSocket);
 
-    // Guarantee that the data equal to a basic header segment is available
-    return bytesAtSocket >= kiSCSIPDUBasicHeaderSegmentSize;
+    // Any part of a PDU can be processed (see ProcessTaskOnWorkloopThread())
+    return bytesAtSocket > 0;
 }
 
 
@@ -2013,9 +4999,6 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     if(bytesRecv < kiSCSIPDUBasicHeaderSegmentSize)// || bhs->totalAHSLength != 0)
     {
         DBLog("iscsi: Received incomplete PDU header: %zu bytes (sid: %d, cid: %d)\n",bytesRecv,session->sessionId,connection->cid);
-        
-// TODO: handle error
-        
         return EIO;
     }
     
@@ -2027,35 +5010,87 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         {
             DBLog("iscsi: Failed header digest (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
             
-// TODO: handle error
-            
+            // PDUs are received here for the daemon (login, text and logout
+            // requests), which retries the request; SNACKs are only used in
+            // the full feature phase (see HandleDataDigestError())
             return EIO;
         }
     }
     
-    // Update command sequence numbers only if the PDU was not a data PDU
-    // (unless the data PDU contains a SCSI service response)
+    UpdateSequenceNumbers(session,connection,bhs);
+    return error;
+}
 
+/*! Updates the session's command sequence numbers and the connection's
+ *  status sequence number from a PDU received from the target.  The
+ *  sequence number fields of the header are converted to host byte order.
+ *  @param session the session that received the PDU.
+ *  @param connection the connection that received the PDU.
+ *  @param bhs the basic header segment of the PDU. */
+void iSCSIVirtualHBA::UpdateSequenceNumbers(iSCSISession * session,
+                                            iSCSIConnection * connection,
+                                            iSCSIPDUTargetBHS * bhs)
+{
+    // Read and update the command sequence numbers (these are valid in
+    // every PDU sent by the target, including data PDUs)
+    bhs->maxCmdSN = OSSwapBigToHostInt32(bhs->maxCmdSN);
+    bhs->expCmdSN = OSSwapBigToHostInt32(bhs->expCmdSN);
+    
+    // Sequence numbers wrap, so compare using serial number arithmetic.  Per
+    // RFC3720 the PDU values are ignored if MaxCmdSN < ExpCmdSN - 1.
+    if((SInt32)(bhs->maxCmdSN - (bhs->expCmdSN - 1)) >= 0)
+    {
+        if((SInt32)(bhs->expCmdSN - session->expCmdSN) > 0)
+            OSWriteLittleInt32(&session->expCmdSN,0,bhs->expCmdSN);
+        
+        // The target opened the command window; let every connection of the
+        // session know so that queued tasks can be started
+        if((SInt32)(bhs->maxCmdSN - session->maxCmdSN) > 0)
+        {
+            OSWriteLittleInt32(&session->maxCmdSN,0,bhs->maxCmdSN);
+            
+            for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+            {
+                iSCSIConnection * conn = session->connections[connectionId];
+                if(conn && conn->taskQueue)
+                    conn->taskQueue->signalCommandWindowOpen();
+            }
+        }
+    }
+    
+    // Update status sequence number only if the PDU was not a data PDU
+    // (unless the data PDU contains a SCSI service response)
     if(bhs->opCode == kiSCSIPDUOpCodeDataIn) {
         iSCSIPDUDataInBHS * bhsDataIn = (iSCSIPDUDataInBHS *)bhs;
         if((bhsDataIn->flags & kiSCSIPDUDataInStatusFlag) == 0)
-            return error;
+            return;
     }
- 
-    // Read and update the command sequence numbers
-    bhs->maxCmdSN = OSSwapBigToHostInt32(bhs->maxCmdSN);
-    bhs->expCmdSN = OSSwapBigToHostInt32(bhs->expCmdSN);
+    
     bhs->statSN = OSSwapBigToHostInt32(bhs->statSN);
     
-    if(bhs->maxCmdSN > session->maxCmdSN)
-        OSWriteLittleInt32(&session->maxCmdSN,0,bhs->maxCmdSN);
-    if(bhs->expCmdSN > session->expCmdSN)
-        OSWriteLittleInt32(&session->expCmdSN,0,bhs->expCmdSN);
+    if(bhs->opCode == kiSCSIPDUOpCodeR2T || bhs->statSN == 0xffffffff || bhs->initiatorTaskTag == 0xffffffff)
+        return;
     
-    if(bhs->opCode != kiSCSIPDUOpCodeR2T && bhs->statSN != 0xffffffff && bhs->initiatorTaskTag != 0xffffffff)
+    // Before the full feature phase (or without error recovery), status is
+    // only counted
+    if(session->errorRecoveryLevel == 0 || !connection->dataRecvEventSource->isEnabled()) {
         OSIncrementAtomic(&connection->expStatSN);
+        return;
+    }
     
-    return error;
+    // Status that was requested again is processed, but is already counted
+    SInt32 gap = (SInt32)(bhs->statSN - connection->expStatSN);
+    
+    if(gap < 0)
+        return;
+    
+    // Ask the target to send status PDUs that were skipped again
+    if(gap > 0)
+        SendSNACK(session,connection,kiSCSIPDUSNACKTypeStatus,
+                  kiSCSIPDUInitiatorTaskTagReserved,0,
+                  kiSCSIPDUTargetTransferTagReserved,connection->expStatSN,(UInt32)gap);
+    
+    OSWriteLittleInt32(&connection->expStatSN,0,bhs->statSN + 1);
 }
 
 /*! Receives a data segment over a kernel socket.  If the specified length is 
@@ -2084,7 +5119,10 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     msg.msg_iov = iovec;
     unsigned int iovecCnt = 0;
 
-    // Setup to receive data block
+    // Setup to receive data block (the data digest covers this block and
+    // its padding)
+    unsigned int dataIovecIdx = iovecCnt;
+    
     iovec[iovecCnt].iov_base  = data;
     iovec[iovecCnt].iov_len   = length;
     iovecCnt++;
@@ -2100,6 +5138,7 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     }
     
     UInt32 dataDigest = 0;
+    unsigned int dataIovecCnt = iovecCnt - dataIovecIdx;
     
     // Retrieve data digest, if one exists
     if(connection->useDataDigest)
@@ -2113,9 +5152,17 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     
     size_t bytesRecv;
     errno_t error = 0;
+    UInt32 calcDigest = 0;
+    
+    // With a data digest, it is computed (including padding) while the data
+    // is copied out of the socket buffers
+    if(connection->useDataDigest)
+        error = RecvWithDigest(connection,iovec,iovecCnt,dataIovecIdx,dataIovecCnt,&calcDigest,&bytesRecv);
+    else
+        error = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecv);
     
     // Handle connection problems
-    if((error = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecv)))
+    if(error)
     {
         if(error != EWOULDBLOCK) {
             DBLog("iscsi: sock_receive error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
@@ -2129,15 +5176,11 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     // Verify digest if present
     if(connection->useDataDigest)
     {
-        // Compute digest including padding...
-        UInt32 calcDigest = crc32c(0,data,length);
-        
         if(dataDigest != calcDigest)
         {
             DBLog("iscsi: Failed data digest (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
             
-// TODO: handle error
-            
+            // Reported to the daemon, which retries the request
             return EIO;
         }
     }
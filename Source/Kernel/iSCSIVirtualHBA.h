@@ -116,7 +116,8 @@ public:
      *  process at any one time. */
 	virtual UInt32 ReportMaximumTaskCount();
 
-    /*! Returns the data size associated with a particular task (0). */
+    /*! Returns the data size associated with a particular task
+     *  (see iSCSIHBATaskData). */
 	virtual UInt32 ReportHBASpecificTaskDataSize();
 
     /*! Returns the device data size (0). */
@@ -169,9 +170,12 @@ public:
     /*! Called by our software interrupt source (iSCSIIOEventSource) to let us
      *  know that data has become available for a particular session and
      *  connection - this allows us to continue or complete processing the task.
+     *  PDUs are received incrementally without blocking (see the connection's
+     *  recvContext), so a stalled connection does not hold up the workloop.
      *  @param owner an instance of this class.
      *  @param session session associated with connection that received data.
-     *  @param connection the connection that received data. */
+     *  @param connection the connection that received data.
+     *  @return true if more data may be waiting at the socket. */
     static bool ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
                                              iSCSISession * session,
                                              iSCSIConnection * connection);
@@ -188,6 +192,162 @@ public:
                               SCSIParallelTaskIdentifier parallelRequest,
                               SCSITaskStatus completionStatus,
                               SCSIServiceResponse serviceResponse);
+    
+    /*! Handles a task that the SCSI layer timed out.  Called by the task's
+     *  connection's task queue (see HandleTimeout()), on the work loop that
+     *  processes the session's I/O.
+     *  @param session the session associated with the task.
+     *  @param connection the connection associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task. */
+    void HandleTaskTimeout(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           UInt32 initiatorTaskTag);
+    
+    /*! Fails a SCSI task whose PDUs from the target break the negotiated
+     *  protocol (e.g., an R2T beyond MaxOutstandingR2T).  The error is
+     *  logged and the task is returned to the SCSI layer as a delivery
+     *  failure.  Must be called on the session's work loop.
+     *  @param session the session associated with the task.
+     *  @param connection the connection associated with the task.
+     *  @param parallelTask the task to fail.
+     *  @param reason describes the protocol error, for the log. */
+    void HandleTaskProtocolError(iSCSISession * session,
+                                 iSCSIConnection * connection,
+                                 SCSIParallelTaskIdentifier parallelTask,
+                                 const char * reason);
+    
+    /*! Sets the deadline of a task in the session's timer wheel, replacing
+     *  any deadline the task already has.  Must be called on the session's
+     *  work loop.
+     *  @param session the session associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task.
+     *  @param timeoutMs time from now until the deadline (ms). */
+    void ArmTaskTimer(iSCSISession * session,
+                      UInt32 initiatorTaskTag,
+                      UInt32 timeoutMs);
+    
+    /*! Called by a session's timer event source, on the session's work loop,
+     *  when a task deadline may have passed.
+     *  @param owner an instance of this class.
+     *  @param sender the session's timer event source. */
+    static void TaskTimerExpired(OSObject * owner,IOTimerEventSource * sender);
+    
+    /*! Advances a session's timer wheel to the current time, handles the
+     *  deadlines that have passed and schedules the next pass.
+     *  @param session the session. */
+    void ProcessTaskTimers(iSCSISession * session);
+    
+    /*! Handles a task that missed its deadline.  A NOP-out that goes
+     *  unanswered means the connection is dead, and the connection is
+     *  timed out.  Any other task only means that the target is slow or
+     *  that the connection is dead, so a NOP-out is sent to find out; slow
+     *  tasks are left to the SCSI layer's timeout (see HandleTimeout()).
+     *  @param session the session associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task. */
+    void HandleTaskDeadline(iSCSISession * session,UInt32 initiatorTaskTag);
+    
+    /*! Queues a NOP-out that measures the latency of a connection (see
+     *  MeasureConnectionLatency()), with a deadline for the target's answer.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to measure.
+     *  @return true if the NOP-out was queued, false if the reserved task
+     *  slots are all in use. */
+    bool QueueLatencyProbe(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Called by a connection's ping timer, on the session's work loop, to
+     *  send a NOP-out on the connection (unless one is outstanding).
+     *  @param owner an instance of this class.
+     *  @param sender the connection's ping timer. */
+    static void PingTimerExpired(OSObject * owner,IOTimerEventSource * sender);
+    
+    /*! Adds a round-trip time measurement to a connection's smoothed
+     *  round-trip time and mean deviation (as TCP does, see RFC6298).
+     *  @param connection the connection.
+     *  @param RTTUs the measured round-trip time (us). */
+    void UpdateConnectionRTT(iSCSIConnection * connection,UInt32 RTTUs);
+    
+    /*! Applies the socket policy of a connection as it enters the full
+     *  feature phase.  Nagle's algorithm is disabled, since PDUs are already
+     *  gathered into batches (see BeginTransmitBatch()).  TCP keepalive is
+     *  enabled so that a dead connection is dropped within the session's
+     *  DefaultTime2Retain, while its tasks can still be moved to another
+     *  connection, even if NOP-outs are disabled.  An explicit socket buffer
+     *  size is applied now (see ResizeSocketBuffers()).
+     *  @param session the session associated with the connection.
+     *  @param connection the connection. */
+    void ApplySocketPolicy(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Sizes a connection's socket send and receive buffers.  An explicit
+     *  size set through the user client is applied once, when it changes.
+     *  Otherwise a buffer is set only if kSocketBufferBDPMultiple times the
+     *  bandwidth-delay product, measured from the connection's throughput and
+     *  smoothed round-trip time, is larger than the buffer's current size, up
+     *  to the connection's socket buffer limit.  Setting a buffer turns off
+     *  the system's autotuning of it, so a buffer the system has already
+     *  grown is left alone, and buffers are never shrunk, since that would
+     *  close the TCP window on data already in flight.
+     *  @param connection the connection. */
+    void ResizeSocketBuffers(iSCSIConnection * connection);
+    
+    /*! Adds a measurement of the time a target took to send the first R2T
+     *  of a write to the connection's smoothed R2T latency.
+     *  @param connection the connection.
+     *  @param latencyUs the measured latency (us). */
+    void UpdateConnectionR2TLatency(iSCSIConnection * connection,UInt32 latencyUs);
+    
+    /*! Gets the time to wait for a NOP-out to be answered before the
+     *  connection is timed out.  This is the retransmission timeout derived
+     *  from the connection's round-trip time (see UpdateConnectionRTT()),
+     *  clamped between kTaskDeadlineMinMs and kiSCSITaskTimeoutMs, or the
+     *  session's task deadline until the round-trip time is known.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection.
+     *  @return the timeout (ms). */
+    UInt32 GetPingTimeoutMs(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Computes the time a task of a session may go without progress
+     *  before its connection is checked: kTaskDeadlineMultiplier times the
+     *  99.9th percentile of the latencies counted by the latency statistics
+     *  of the session's connections, clamped between kTaskDeadlineMinMs and
+     *  kiSCSITaskTimeoutMs.  Until enough latencies have been recorded
+     *  kiSCSITaskTimeoutMs is used.
+     *  @param session the session. */
+    void UpdateTaskDeadline(iSCSISession * session);
+    
+    /*! Gets the current time in ticks of the task timer wheels.
+     *  @return the current tick. */
+    static UInt64 GetTaskTimerTick();
+    
+    /*! Adds a completed task to the latency statistics of the connection
+     *  it was sent on and of the logical unit it was addressed to.  This is
+     *  called only from the session's work loop, so the statistics have a
+     *  single writer and are updated without locks.  The session's task
+     *  deadline is periodically recomputed from the statistics.
+     *  @param session the session associated with the task.
+     *  @param connection the connection the task was sent on.
+     *  @param parallelTask the completed task.
+     *  @param latencyUs the time the task took to complete (microseconds). */
+    void RecordTaskStatistics(iSCSISession * session,
+                              iSCSIConnection * connection,
+                              SCSIParallelTaskIdentifier parallelTask,
+                              UInt64 latencyUs);
+    
+    /*! Resets latency statistics, marking the current time as the time
+     *  that collection began.
+     *  @param stats the statistics to reset. */
+    static void ResetLatencyStatistics(iSCSIHBALatencyStatistics * stats);
+    
+    /*! Gets the latency histogram bucket that counts a latency (see
+     *  kiSCSIHBALatencyBuckets).
+     *  @param latencyUs the latency (microseconds).
+     *  @return the bucket index. */
+    static UInt8 GetLatencyBucket(UInt64 latencyUs);
+    
+    /*! Gets the largest latency that a latency histogram bucket counts (see
+     *  kiSCSIHBALatencyBuckets).
+     *  @param bucket the bucket index.
+     *  @return the latency (microseconds). */
+    static UInt64 GetLatencyBucketLimit(UInt8 bucket);
 
     
     /////////////////////  FUNCTIONS TO MANIPULATE ISCSI ///////////////////////
@@ -214,6 +374,15 @@ public:
     /*! Releases all iSCSI sessions. */
     void ReleaseAllSessions();
     
+    /*! Selects the work loop that processes a session's I/O, moving the event
+     *  sources of the session's connections to that work loop.
+     *  @param session the session.
+     *  @param workLoopPolicy the policy used to select the work loop (see
+     *  enum iSCSIWorkLoopPolicies).
+     *  @return error code indicating result of operation (EBUSY if any of
+     *  the session's connections are active). */
+    errno_t SetSessionWorkLoopPolicy(iSCSISession * session,UInt8 workLoopPolicy);
+    
     /*! Releases an iSCSI session, including all connections associated with that
      *  session.  Connections may be active or inactive when this function is
      *  called.
@@ -291,10 +460,10 @@ public:
                     const void * data,
                     size_t length);
 
-    /*! Gets whether a PDU is available for receiption on a particular
-     *  connection.
+    /*! Gets whether PDU bytes are available for receiption on a particular
+     *  connection (PDUs may arrive in pieces; see recvContext).
      *  @param the connection to check.
-     *  @return true if a PDU is available, false otherwise. */
+     *  @return true if data is available, false otherwise. */
     static bool isPDUAvailable(iSCSIConnection * connection);
     
     /*! Receives a basic header segment over a kernel socket.
@@ -326,6 +495,27 @@ public:
     
 private:
     
+    /*! Types of tasks that are assigned an initiator task tag. */
+    enum InitiatorTaskTypes {
+        
+        /*! A SCSI task. */
+        kInitiatorTaskTypeSCSITask = 0,
+    
+        /*! A latency measurement (NOP out). */
+        kInitiatorTaskTypeLatency = 1,
+    
+        /*! A task management request. */
+        kInitiatorTaskTypeTaskMgmt = 2,
+        
+        /*! A logout request that removes a failed connection so that its
+         *  tasks can be reassigned (see ReassignConnectionTasks()). */
+        kInitiatorTaskTypeLogout = 3,
+        
+        /*! A text request that renegotiates the MaxRecvDataSegmentLength of
+         *  an active connection (see RenegotiateMaxRecvDataSegmentLength()). */
+        kInitiatorTaskTypeText = 4
+    };
+    
     /*! Process an incoming task management response PDU.
      *  @param session the session associated with the task mgmt response.
      *  @param connection the connection associated with the task mgmt response.
@@ -341,35 +531,86 @@ private:
      *  us allowing us to measure the latency of the connection.
      *  @param session the session associated with the NOP in.
      *  @param connection the connection associated with the NOP in.
-     *  @param bhs the basic header segment of the NOP in. */
+     *  @param bhs the basic header segment of the NOP in.
+     *  @param data the data segment of the PDU, if any. */
     void ProcessNOPIn(iSCSISession * session,
                       iSCSIConnection * connection,
-                      iSCSIPDU::iSCSIPDUNOPInBHS * bhs);
+                      iSCSIPDU::iSCSIPDUNOPInBHS * bhs,
+                      UInt8 * data);
     
     /*! Process an incoming SCSI response PDU.
      *  @param session the session associated with the SCSI response.
      *  @param connection the connection associated with the SCSI response.
-     *  @param bhs the basic header segment of the SCSI response. */
+     *  @param bhs the basic header segment of the SCSI response.
+     *  @param data the data segment of the PDU, if any. */
     void ProcessSCSIResponse(iSCSISession * session,
                              iSCSIConnection * connection,
-                             iSCSIPDU::iSCSIPDUSCSIRspBHS * bhs);
+                             iSCSIPDU::iSCSIPDUSCSIRspBHS * bhs,
+                             UInt8 * data);
 
     /*! Process an incoming data PDU.
      *  @param session the session associated with the data PDU.
      *  @param connection the connection associated with the data PDU.
-     *  @param bhs the basic header segment of the data PDU. */
+     *  @param bhs the basic header segment of the data PDU.
+     *  @param data the data segment of the PDU (received into the task's buffer or into
+     *  the connection's bounce buffer). */
     void ProcessDataIn(iSCSISession * session,
                        iSCSIConnection * connection,
-                       iSCSIPDU::iSCSIPDUDataInBHS * bhs);
+                       iSCSIPDU::iSCSIPDUDataInBHS * bhs,
+                       UInt8 * data);
     
     /*! Process an incoming asynchronous message PDU.
      *  @param session the session associated with the async PDU.
      *  @param connection the connection associated with the async PDU.
-     *  @param bhs the basic header segment of the async PDU. */
+     *  @param bhs the basic header segment of the async PDU.
+     *  @param data the data segment of the PDU, if any. */
     void ProcessAsyncMsg(iSCSISession * session,
                          iSCSIConnection * connection,
-                         iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs);
+                         iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs,
+                         UInt8 * data);
 
+    /*! Handles a PDU whose data digest failed.  The PDU is discarded; at
+     *  error recovery level 1 and above the target is asked to send it again
+     *  (data-in PDUs with a data SNACK, SCSI responses with a status SNACK).
+     *  A NOP-in answering one of our NOP-outs still shows that the connection
+     *  is alive.  The header of the PDU is in the connection's receive context.
+     *  @param session the session that received the PDU.
+     *  @param connection the connection that received the PDU. */
+    void HandleDataDigestError(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Tracks the DataSN (or R2TSN) of a data-in PDU (or R2T) of a task
+     *  and asks the target to send PDUs that were skipped again.
+     *  @param session the session associated with the task.
+     *  @param connection the connection that received the PDU.
+     *  @param parallelTask the task.
+     *  @param sequenceNumber the DataSN or R2TSN of the PDU.
+     *  @param received true if the PDU was received, false if it was
+     *  discarded and should be sent again as well. */
+    void TrackDataSequence(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           SCSIParallelTaskIdentifier parallelTask,
+                           UInt32 sequenceNumber,
+                           bool received);
+    
+    /*! Sends a SNACK request PDU.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send the SNACK on.
+     *  @param type the type of SNACK (see iSCSIPDUSNACKTypes).
+     *  @param initiatorTaskTag the initiator task tag of the task the SNACK
+     *  refers to (reserved for status SNACKs and DataACKs).
+     *  @param LUN the LUN field of the SNACK.
+     *  @param targetTransferTag the target transfer tag (DataACKs only).
+     *  @param begRun the first sequence number requested or acknowledged.
+     *  @param runLength the number of PDUs requested (zero for all PDUs). */
+    void SendSNACK(iSCSISession * session,
+                   iSCSIConnection * connection,
+                   UInt8 type,
+                   UInt32 initiatorTaskTag,
+                   UInt64 LUN,
+                   UInt32 targetTransferTag,
+                   UInt32 begRun,
+                   UInt32 runLength);
+    
     /*! Process an incoming R2T PDU.
      *  @param session the session associated with the R2T PDU.
      *  @param connection the connection associated with the R2T PDU.
@@ -381,20 +622,410 @@ private:
     /*! Process an incoming reject PDU.
      *  @param session the session associated with the reject PDU.
      *  @param connection the connection associated with the reject PDU.
-     *  @param bhs the basic header segment of the reject PDU. */
+     *  @param bhs the basic header segment of the reject PDU.
+     *  @param data the data segment of the PDU, if any. */
     void ProcessReject(iSCSISession * session,
                        iSCSIConnection * connection,
-                       iSCSIPDU::iSCSIPDURejectBHS * bhs);
+                       iSCSIPDU::iSCSIPDURejectBHS * bhs,
+                       UInt8 * data);
+    
+    /*! Updates the session's command sequence numbers and the connection's
+     *  status sequence number from a PDU received from the target.  The
+     *  sequence number fields of the header are converted to host byte order.
+     *  @param session the session that received the PDU.
+     *  @param connection the connection that received the PDU.
+     *  @param bhs the basic header segment of the PDU. */
+    void UpdateSequenceNumbers(iSCSISession * session,
+                               iSCSIConnection * connection,
+                               iSCSIPDUTargetBHS * bhs);
+    
+    /*! Receives up to the specified number of bytes from a connection without
+     *  blocking.
+     *  @param connection the connection to receive from.
+     *  @param buffer the buffer to receive into.
+     *  @param length the maximum number of bytes to receive.
+     *  @param digest if not NULL, the CRC32C of the received bytes is added
+     *  to this digest as they are copied out of the socket buffers.
+     *  @param bytesRecv the number of bytes received.
+     *  @return error code indicating result of operation (EWOULDBLOCK if
+     *  no data was available). */
+    errno_t RecvPDUBytes(iSCSIConnection * connection,
+                         void * buffer,
+                         size_t length,
+                         UInt32 * digest,
+                         size_t * bytesRecv);
+    
+    /*! Called once the header of an incoming PDU has been received.  Updates
+     *  sequence numbers and selects the buffer that will receive the data
+     *  segment of the PDU, if any (data-in PDUs are received directly into
+     *  the task's buffer when possible).
+     *  @param session the session that is receiving the PDU.
+     *  @param connection the connection that is receiving the PDU.
+     *  @return true if the PDU may be received, false if the header is
+     *  invalid and the connection should be dropped. */
+    bool BeginPDU(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Processes a PDU once it has been received in full.
+     *  @param session the session that received the PDU.
+     *  @param connection the connection that received the PDU. */
+    void ProcessPDU(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Maps the data buffer of a task into the kernel's address space so
+     *  that PDU data segments can be transferred to and from the buffer
+     *  directly.  The mapping is kept until the task is completed.
+     *  @param parallelTask the task whose data buffer should be mapped.
+     *  @return true if the buffer was mapped. */
+    bool MapDataBufferForTask(SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Releases the mapping created by MapDataBufferForTask(), if any.
+     *  @param parallelTask the task whose data buffer should be unmapped. */
+    void UnmapDataBufferForTask(SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Gets a pointer to a range of a task's data buffer that is to be sent
+     *  to the target.  The pointer refers to the task's mapped buffer when
+     *  possible; otherwise the data is copied into the connection's send
+     *  bounce buffer.  The pointer is valid until the next call.
+     *  @param connection the connection the data will be sent on.
+     *  @param parallelTask the task whose data is to be sent.
+     *  @param dataOffset offset of the data in the task's buffer.
+     *  @param dataLength number of bytes to send.
+     *  @return a pointer to the data, or NULL if it is not available. */
+    const void * GetDataOutBuffer(iSCSIConnection * connection,
+                                  SCSIParallelTaskIdentifier parallelTask,
+                                  UInt32 dataOffset,
+                                  UInt32 dataLength);
+    
+    /*! Sends the buffers described by an iovec array, computing the CRC32C
+     *  of a range of entries as they are copied into socket buffers.  The
+     *  entry that follows the range must be a four-byte data digest; it is
+     *  filled in with the result before it is sent.
+     *  @param connection the connection to send on.
+     *  @param iovec the buffers to send.
+     *  @param iovecCnt the number of entries in iovec.
+     *  @param digestIovecIdx the first entry covered by the digest.
+     *  @param digestIovecCnt the number of entries covered by the digest.
+     *  @param bytesSent the number of bytes that were sent.
+     *  @return error code indicating result of operation. */
+    errno_t SendWithDigest(iSCSIConnection * connection,
+                           struct iovec * iovec,
+                           unsigned int iovecCnt,
+                           unsigned int digestIovecIdx,
+                           unsigned int digestIovecCnt,
+                           size_t * bytesSent);
+    
+    /*! Opens a transmit batch on a connection.  Until the batch is ended,
+     *  PDUs sent on the connection are gathered into its transmit queue and
+     *  sent together (see txFlushBytes and txFlushLatencyUs).  Batches are
+     *  only opened on the workloop thread.
+     *  @param connection the connection to batch PDUs for. */
+    void BeginTransmitBatch(iSCSIConnection * connection);
+    
+    /*! Ends a transmit batch, sending any PDUs still in the transmit queue.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to end the batch for.
+     *  @return error code indicating result of operation. */
+    errno_t EndTransmitBatch(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Gets whether a connection's transmit batch is open and holds PDUs
+     *  that have not yet been sent.
+     *  @param connection the connection to check.
+     *  @return true if PDUs are waiting to be sent, false otherwise. */
+    static bool isTransmitQueuePending(iSCSIConnection * connection);
     
-    /*! Process data out PDUs for a SCSI task. */
-    void ProcessDataOutForTask(iSCSISession * session,
+    /*! Adds a PDU to a connection's transmit queue, flushing the queue as
+     *  required by the connection's flush policy.  The basic header segment
+     *  and data segment are copied, except for data segments larger than
+     *  kTransmitCopyThreshold, which are sent (along with the queue) before
+     *  this function returns.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send on.
+     *  @param bhs the basic header segment to send.
+     *  @param data the data segment to send.
+     *  @param length the byte size of the data segment.
+     *  @return error code indicating result of operation. */
+    errno_t QueuePDU(iSCSISession * session,
+                     iSCSIConnection * connection,
+                     iSCSIPDUInitiatorBHS * bhs,
+                     const void * data,
+                     size_t length);
+    
+    /*! Sends the contents of a connection's transmit queue with a single
+     *  socket call, optionally followed by the data segment of the last
+     *  queued PDU (whose padding and data digest are added here).
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send on.
+     *  @param data the data segment that follows the queue, or NULL.
+     *  @param length the byte size of the data segment.
+     *  @return error code indicating result of operation. */
+    errno_t FlushTransmitQueue(iSCSISession * session,
                                iSCSIConnection * connection,
-                               SCSIParallelTaskIdentifier parallelTask,
-                               UInt32 dataOffset,
-                               UInt32 dataLength,
-                               UInt64 LUN,
-                               UInt32 initiatorTaskTag,
-                               UInt32 targetTransferTag);
+                               const void * data,
+                               size_t length);
+    
+    /*! Receives the buffers described by an iovec array, computing the CRC32C
+     *  of a range of entries as they are copied out of socket buffers.
+     *  @param connection the connection to receive from.
+     *  @param iovec the buffers to receive into.
+     *  @param iovecCnt the number of entries in iovec.
+     *  @param digestIovecIdx the first entry covered by the digest.
+     *  @param digestIovecCnt the number of entries covered by the digest.
+     *  @param digest the CRC32C of the entries covered by the digest.
+     *  @param bytesRecv the number of bytes that were received.
+     *  @return error code indicating result of operation. */
+    errno_t RecvWithDigest(iSCSIConnection * connection,
+                           struct iovec * iovec,
+                           unsigned int iovecCnt,
+                           unsigned int digestIovecIdx,
+                           unsigned int digestIovecCnt,
+                           UInt32 * digest,
+                           size_t * bytesRecv);
+    
+    /*! Queues a sequence of data-out PDUs for a SCSI task.  The PDUs are
+     *  sent by the connection's task queue (see SendQueuedDataOut()).
+     *  @param session the session associated with the task.
+     *  @param connection the connection the data will be sent on.
+     *  @param parallelTask the task whose data is to be sent.
+     *  @param dataOffset offset of the data in the task's buffer.
+     *  @param dataLength number of bytes to send.
+     *  @param LUN the LUN field for the data-out PDUs.
+     *  @param targetTransferTag the target transfer tag of the R2T, or
+     *  kiSCSIPDUTargetTransferTagReserved for unsolicited data.
+     *  @return true if the sequence was queued, false if the target has
+     *  solicited more than MaxOutstandingR2T sequences for the task (or the
+     *  task already has as many sequences queued as it can hold). */
+    bool QueueDataOutForTask(iSCSISession * session,
+                             iSCSIConnection * connection,
+                             SCSIParallelTaskIdentifier parallelTask,
+                             UInt32 dataOffset,
+                             UInt32 dataLength,
+                             UInt64 LUN,
+                             UInt32 targetTransferTag);
+    
+    /*! Assigns a slot in the session's task slot table to a task and
+     *  builds the task's initiator task tag from the slot number.  Latency
+     *  measurements and task management requests are assigned slots from
+     *  the reserved range.
+     *  @param session the session associated with the task.
+     *  @param taskType the type of task.
+     *  @param LUN the logical unit that the task is addressed to.
+     *  @param connection the connection the task was assigned to.
+     *  @param parallelTask the SCSI task (NULL for other types of tasks).
+     *  @return the initiator task tag of the task, or
+     *  kiSCSIPDUInitiatorTaskTagReserved if all slots are in use. */
+    UInt32 AllocateTaskSlot(iSCSISession * session,
+                            InitiatorTaskTypes taskType,
+                            SCSILogicalUnitNumber LUN,
+                            iSCSIConnection * connection,
+                            SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Frees the task slot occupied by a task.
+     *  @param session the session associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task. */
+    void ReleaseTaskSlot(iSCSISession * session,UInt32 initiatorTaskTag);
+    
+    /*! Gets the initiator task tag of the SCSI task that the SCSI layer
+     *  identifies by a tagged task identifier.
+     *  @param session the session associated with the task.
+     *  @param LUN the logical unit that the task is addressed to.
+     *  @param taggedTaskID the SCSI layer's identifier for the task.
+     *  @return the initiator task tag of the task, or
+     *  kiSCSIPDUInitiatorTaskTagReserved if no such task is in progress. */
+    UInt32 FindInitiatorTaskTagForTaggedTask(iSCSISession * session,
+                                             SCSILogicalUnitNumber LUN,
+                                             SCSITaggedTaskIdentifier taggedTaskID);
+    
+    /*! Queues a task management request on the session's leading
+     *  connection, assigning it an initiator task tag from the reserved slots.
+     *  The request is sent by the connection's task queue, on the work loop
+     *  that processes the session's I/O (see BeginTaskMgmtRequest()).
+     *  @param session the session to send on.
+     *  @param LUN the logical unit that the request is addressed to.
+     *  @param taskMgmtFunction the task management function code.
+     *  @param referencedTaskTag the initiator task tag of the task that the
+     *  request refers to (abort task requests only).
+     *  @return kSCSIServiceResponse_Request_In_Process if the request was
+     *  queued, or a failure response otherwise. */
+    SCSIServiceResponse SendTaskMgmtRequest(iSCSISession * session,
+                                            SCSILogicalUnitNumber LUN,
+                                            UInt8 taskMgmtFunction,
+                                            UInt32 referencedTaskTag);
+    
+    /*! Sends a queued task management request PDU.
+     *  @param session the session to send on.
+     *  @param connection the connection to send on.
+     *  @param slot the task slot of the request. */
+    void BeginTaskMgmtRequest(iSCSISession * session,
+                              iSCSIConnection * connection,
+                              iSCSITaskSlot * slot);
+    
+    /*! Reports the outcome of a task management request to the SCSI layer,
+     *  on the HBA's work loop.
+     *  @param session the session that the request was sent on.
+     *  @param LUN the logical unit that the request was addressed to.
+     *  @param taskMgmtFunction the task management function code.
+     *  @param serviceResponse the SCSI service response. */
+    void CompleteTaskMgmtRequest(iSCSISession * session,
+                                 SCSILogicalUnitNumber LUN,
+                                 UInt8 taskMgmtFunction,
+                                 SCSIServiceResponse serviceResponse);
+    
+    /*! Command gate action for CompleteTaskMgmtRequest(). */
+    static IOReturn CompleteTaskMgmtRequestAction(OSObject * owner,
+                                                  void * session,
+                                                  void * LUN,
+                                                  void * taskMgmtFunction,
+                                                  void * serviceResponse);
+    
+    /*! Moves the tasks of a failed connection to another connection of the
+     *  session (error recovery level 2).  Tasks that were not sent are
+     *  started on the other connection.  Tasks that were sent are held there
+     *  while the failed connection is logged out; each is then reassigned
+     *  with a TASK REASSIGN request and the target resends unacknowledged
+     *  data-in PDUs, R2Ts for data-out it did not receive, and status.
+     *  Must be called before the failed connection is deactivated.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection that failed.
+     *  @return true if the tasks were moved, false if they should be failed
+     *  (recovery is not supported or no other connection is available). */
+    bool ReassignConnectionTasks(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Sends a queued logout request that removes a failed connection.
+     *  @param session the session to send on.
+     *  @param connection the connection to send on.
+     *  @param slot the task slot of the request. */
+    void BeginLogoutRequest(iSCSISession * session,
+                            iSCSIConnection * connection,
+                            iSCSITaskSlot * slot);
+    
+    /*! Process an incoming logout response PDU.
+     *  @param session the session associated with the logout response.
+     *  @param connection the connection associated with the logout response.
+     *  @param bhs the basic header segment of the logout response. */
+    void ProcessLogoutRsp(iSCSISession * session,
+                          iSCSIConnection * connection,
+                          iSCSIPDU::iSCSIPDULogoutRspBHS * bhs);
+    
+    /*! Ends the logout of a failed connection.  If the connection was logged
+     *  out its tasks are reassigned, otherwise they are failed.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection the logout request was sent on.
+     *  @param initiatorTaskTag the initiator task tag of the logout request.
+     *  @param loggedOut true if the failed connection was logged out. */
+    void FinishConnectionRecovery(iSCSISession * session,
+                                  iSCSIConnection * connection,
+                                  UInt32 initiatorTaskTag,
+                                  bool loggedOut);
+    
+    /*! Queues TASK REASSIGN requests for tasks waiting to be reassigned to
+     *  a connection, for as long as reserved task slots are available.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection the tasks are reassigned to. */
+    void QueueTaskReassignRequests(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Handles the outcome of a TASK REASSIGN request.
+     *  @param session the session associated with the task.
+     *  @param connection the connection the task was reassigned to.
+     *  @param initiatorTaskTag the initiator task tag of the reassigned task.
+     *  @param reassigned true if the target reassigned the task. */
+    void CompleteTaskReassign(iSCSISession * session,
+                              iSCSIConnection * connection,
+                              UInt32 initiatorTaskTag,
+                              bool reassigned);
+    
+    /*! Renegotiates the MaxRecvDataSegmentLength of an active connection with a
+     *  text request.  The declaration takes effect once the target answers;
+     *  until then the connection keeps its current length.  The target's own
+     *  MaxRecvDataSegmentLength, if it is sent back, is adopted as well.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to renegotiate.
+     *  @param length the MaxRecvDataSegmentLength to declare.
+     *  @return error code indicating result of operation. */
+    errno_t RenegotiateMaxRecvDataSegmentLength(iSCSISession * session,
+                                                iSCSIConnection * connection,
+                                                UInt32 length);
+    
+    /*! Sends a queued text request that renegotiates MaxRecvDataSegmentLength.
+     *  Marks the connection's text negotiation as pending and arms the task
+     *  timer; the request is dropped if another negotiation is outstanding.
+     *  The bounce buffer for received data segments is grown first, since the
+     *  target may use the new length as soon as it has the request.
+     *  @param session the session to send on.
+     *  @param connection the connection to send on.
+     *  @param slot the task slot of the request. */
+    void BeginTextRequest(iSCSISession * session,
+                          iSCSIConnection * connection,
+                          iSCSITaskSlot * slot);
+    
+    /*! Process an incoming text response PDU.
+     *  @param session the session associated with the text response.
+     *  @param connection the connection associated with the text response.
+     *  @param bhs the basic header segment of the text response.
+     *  @param data the data segment of the text response. */
+    void ProcessTextRsp(iSCSISession * session,
+                        iSCSIConnection * connection,
+                        iSCSIPDU::iSCSIPDUTextRspBHS * bhs,
+                        UInt8 * data);
+    
+    /*! Adopts a MaxRecvDataSegmentLength that the target declared while the
+     *  connection is active, growing the bounce buffer for data-out PDUs as
+     *  needed (the current length is kept if the buffer can't be grown).
+     *  @param session the session associated with the connection.
+     *  @param connection the connection.
+     *  @param length the target's MaxRecvDataSegmentLength. */
+    void SetMaxSendDataSegmentLength(iSCSISession * session,
+                                     iSCSIConnection * connection,
+                                     UInt32 length);
+    
+    /*! Ends a text negotiation and frees its task slot.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection the text request was sent on.
+     *  @param initiatorTaskTag the initiator task tag of the text request. */
+    void FinishTextRequest(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           UInt32 initiatorTaskTag);
+    
+    /*! Returns a completed task to the SCSI layer, on the HBA's work loop.
+     *  The SCSI layer expects completions on the HBA's work loop, which need
+     *  not be the work loop that processes the session's I/O.
+     *  @param parallelRequest the request to complete.
+     *  @param completionStatus status of the request.
+     *  @param serviceResponse the SCSI service response. */
+    void ReturnParallelTask(SCSIParallelTaskIdentifier parallelRequest,
+                            SCSITaskStatus completionStatus,
+                            SCSIServiceResponse serviceResponse);
+    
+    /*! Command gate action for ReturnParallelTask(). */
+    static IOReturn ReturnParallelTaskAction(OSObject * owner,
+                                             void * parallelRequest,
+                                             void * completionStatus,
+                                             void * serviceResponse,
+                                             void *);
+    
+    /*! Takes a work loop from the HBA's pool for a session.  Sessions are
+     *  spread across the pool: an unused work loop is preferred, then a new
+     *  one (until the pool holds kMaxSessionWorkLoops), and otherwise the
+     *  work loop serving the fewest sessions.
+     *  @return the work loop, or NULL if none could be created. */
+    IOWorkLoop * AcquireSessionWorkLoop();
+    
+    /*! Returns a work loop taken by AcquireSessionWorkLoop() to the pool.
+     *  @param workLoop the work loop. */
+    void ReleaseSessionWorkLoop(IOWorkLoop * workLoop);
+    
+    /*! Removes a task from its connection's data-out queue, discarding
+     *  any sequences that have not been sent.
+     *  @param connection the connection associated with the task.
+     *  @param parallelTask the task to remove. */
+    void DequeueDataOutForTask(iSCSIConnection * connection,
+                               SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Sends data-out PDUs for the tasks in a connection's data-out queue.
+     *  Tasks take turns sending one PDU each, and at most kMaxDataOutPDUsPerPass
+     *  PDUs are sent before returning to the workloop.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send on.
+     *  @return true if data-out PDUs remain to be sent, false otherwise. */
+    bool SendQueuedDataOut(iSCSISession * session,iSCSIConnection * connection);
     
     /*! Adjusts the timeouts associated with a particular connection.  This
      *  function uses a NOP out PDU to measure the latency of particular
@@ -402,11 +1033,64 @@ private:
      *  a PDU with the current timestamp which is then echoed back by the
      *  target. The response PDU is processed by ProcessNOPIn().
      *  @param session the session to tune.
-     *  @param connection the connection to tune. */
+     *  @param connection the connection to tune.
+     *  @param initiatorTaskTag the initiator task tag of the measurement. */
     void MeasureConnectionLatency(iSCSISession * session,
-                                  iSCSIConnection * connection);
-    
+                                  iSCSIConnection * connection,
+                                  UInt32 initiatorTaskTag);
+
+    /*! Selects the connection that a new task is assigned to, using the
+     *  connection scheduling policy configured for the session.  CmdSN is
+     *  assigned when a command is sent on the workloop (which is shared by
+     *  all connections), so the choice of connection does not affect
+     *  command ordering.
+     *  @param session the session that the task belongs to.
+     *  @param parallelTask the task to be assigned.
+     *  @return the selected connection, or NULL if none is available. */
+    iSCSIConnection * SelectConnectionForTask(iSCSISession * session,
+                                              SCSIParallelTaskIdentifier parallelTask);
+
+    /*! Round-robin scheduling policy: selects the next available connection
+     *  following the one that was selected last.
+     *  @param session the session that the task belongs to.
+     *  @return the selected connection, or NULL if none is available. */
+    iSCSIConnection * SelectConnectionRoundRobin(iSCSISession * session);
+
+    /*! Least-outstanding-bytes scheduling policy: selects the connection
+     *  with the fewest bytes left to transfer.
+     *  @param session the session that the task belongs to.
+     *  @return the selected connection, or NULL if none is available. */
+    iSCSIConnection * SelectConnectionLeastOutstandingBytes(iSCSISession * session);
+
+    /*! Latency-weighted scheduling policy: selects the connection that is
+     *  expected to complete the task first, based on the connection's
+     *  measured latency, throughput and current backlog.
+     *  @param session the session that the task belongs to.
+     *  @param transferLength the number of bytes the task will transfer.
+     *  @return the selected connection, or NULL if none is available. */
+    iSCSIConnection * SelectConnectionLatencyWeighted(iSCSISession * session,
+                                                      UInt64 transferLength);
+
+    /*! Gets whether a connection can be assigned new tasks.
+     *  @param connection the connection to check.
+     *  @return true if the connection is active. */
+    bool IsConnectionSchedulable(iSCSIConnection * connection);
     
+    /*! Decides whether a write sends unsolicited data-out PDUs (up to the
+     *  session's FirstBurstLength) or waits for the target to solicit data
+     *  with an R2T.  Writes that fit in the first burst always send their
+     *  data unsolicited, so that they complete in one round trip.  Larger
+     *  writes do too unless the target has been slow to send R2Ts, which
+     *  indicates it is short of buffers for unsolicited data.
+     *  @param session the session associated with the task.
+     *  @param connection the connection the task was assigned to.
+     *  @param transferSize the number of bytes the task writes.
+     *  @return true if unsolicited data-out PDUs should be sent. */
+    bool ShouldSendUnsolicitedData(iSCSISession * session,
+                                   iSCSIConnection * connection,
+                                   UInt32 transferSize);
+
+
 	
     /*! Maximum allowable sessions. */
     static const UInt16 kMaxSessions;
@@ -430,48 +1114,142 @@ private:
     /*! Default task timeout for new tasks (milliseconds). */
     static const UInt32 kiSCSITaskTimeoutMs;
     
+    /*! Duration of a tick of the task timer wheels (milliseconds). */
+    static const UInt32 kTaskTimerTickMs;
+    
+    /*! Shortest task deadline (milliseconds). */
+    static const UInt32 kTaskDeadlineMinMs;
+    
+    /*! Multiple of the 99.9th percentile task latency used as the deadline. */
+    static const UInt32 kTaskDeadlineMultiplier;
+    
+    /*! Default interval between NOP-outs sent on a connection (milliseconds). */
+    static const UInt32 kPingIntervalMs;
+    
+    /*! Multiple of the round-trip time, plus kUnsolicitedDataR2TSlackUs, that
+     *  the wait for a target's first R2T may reach before large writes stop
+     *  sending unsolicited data. */
+    static const UInt32 kUnsolicitedDataR2TLatencyFactor;
+    
+    /*! Time allowed for a target to solicit data, on top of the round-trip
+     *  time, before large writes stop sending unsolicited data (microseconds). */
+    static const UInt32 kUnsolicitedDataR2TSlackUs;
+    
+    /*! Default limit on the size that a connection's socket buffers are
+     *  grown to from its bandwidth-delay product (bytes). */
+    static const UInt32 kSocketBufferLimit;
+    
+    /*! Multiple of the bandwidth-delay product that the socket buffers are
+     *  sized to (the measured throughput understates the path's capacity). */
+    static const UInt32 kSocketBufferBDPMultiple;
+    
+    /*! Number of unanswered TCP keepalive probes after which a connection is
+     *  dropped. */
+    static const UInt32 kKeepAliveProbeCount;
+    
+    /*! Number of task latencies recorded before deadlines are derived
+     *  from them. */
+    static const UInt32 kTaskDeadlineMinSamples;
+    
+    /*! Number of task latencies recorded between deadline updates. */
+    static const UInt32 kTaskDeadlineUpdateInterval;
+    
     /*! Default timeout for new connections (seconds). */
     static const UInt32 kiSCSITCPTimeoutSec;
-
     
-    /*! Used as part of the iSCSI layer intiator task tag to specify the 
-     *  type of task. */
-    enum InitiatorTaskTypes {
-        
-        /*! Used as part of the iSCSI task tag for all SCSI tasks. */
-        kInitiatorTaskTypeSCSITask = 0,
+    /*! Maximum number of PDUs processed for a connection before the workloop
+     *  is given a chance to service other connections. */
+    static const UInt32 kMaxPDUsPerReceive;
     
-        /*! Used as part of the iSCSI task tag for latency measurement task. */
-        kInitiatorTaskTypeLatency = 1,
+    /*! Size of each connection's receive staging buffer (bytes). */
+    static const UInt32 kRecvBufferSize;
     
-        /*! Used as part of the iSCSI task tag for all task management operations. */
-        kInitiatorTaskTypeTaskMgmt = 2
-    };
+    /*! Largest MaxRecvDataSegmentLength (or MaxSendDataSegmentLength) that
+     *  is renegotiated on an active connection (bytes). */
+    static const UInt32 kMaxRenegotiatedDataSegmentLength;
+    
+    /*! Data segments (or what remains of them) at least this large are
+     *  received directly into their destination rather than staged. */
+    static const UInt32 kRecvDirectThreshold;
+    
+    /*! Size of each connection's transmit queue (bytes). */
+    static const UInt32 kTransmitBufferSize;
+    
+    /*! Data segments larger than this are not copied into the transmit queue;
+     *  the queue is flushed along with the PDU instead. */
+    static const UInt32 kTransmitCopyThreshold;
+    
+    /*! Default byte bound for flushing the transmit queue. */
+    static const UInt32 kTransmitFlushBytes;
+    
+    /*! Default latency bound for flushing the transmit queue (microseconds). */
+    static const UInt32 kTransmitFlushLatencyUs;
+    
+    /*! Maximum number of data-out PDUs sent for a connection before the
+     *  workloop is given a chance to process received PDUs. */
+    static const UInt32 kMaxDataOutPDUsPerPass;
+    
+    /*! Number of bits of an initiator task tag that hold the task's slot
+     *  number (the remaining bits hold a generation number). */
+    static const UInt8 kTaskSlotBits;
+    
+    /*! Number of entries in each session's task slot table. */
+    static const UInt16 kMaxTaskSlots;
+    
+    /*! Maximum number of work loops in the pool used by sessions that have
+     *  their own work loop. */
+    static const UInt16 kMaxSessionWorkLoops;
     
-    /*! Creates the iSCSI layer's initiator task tag for a PDU using the task
-     *  code, LUN, and the SCSI layer's task identifier. */
-    inline UInt32 BuildInitiatorTaskTag(InitiatorTaskTypes taskType,
-                                        SCSILogicalUnitNumber LUN,
-                                        SCSITaggedTaskIdentifier taskId)
+    /*! Number of slots (at the end of each table) reserved for latency
+     *  measurements and task management requests. */
+    static const UInt16 kReservedTaskSlots;
+    
+    /*! Mask applied to a slot's generation number, which fills the bits of
+     *  the initiator task tag above the slot number. */
+    static const UInt32 kTaskSlotGenerationMask;
+
+    
+    inline UInt16 ParseInitiatorTaskTagForSlot(UInt32 initiatorTaskTag)
     {
-        // The task tag is constructed using the HBA controller task ID, the
-        // LUN and a taskCode that maps to differnet *types* of iSCSI tasks
-        return ( (UInt32)taskId | ((UInt32)LUN)<<16 | ((UInt32)taskType)<<24 );
+        return (UInt16)(initiatorTaskTag & (kMaxTaskSlots - 1));
     }
     
-    inline InitiatorTaskTypes ParseInitiatorTaskTagForTaskType(UInt32 initiatorTaskTag)
+    /*! Gets the slot of the task that an initiator task tag refers to.
+     *  @param session the session associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task.
+     *  @return the task's slot, or NULL if no such task is in progress. */
+    inline iSCSITaskSlot * FindTaskSlot(iSCSISession * session,UInt32 initiatorTaskTag)
     {
-        return (InitiatorTaskTypes)((initiatorTaskTag>>24) & 0xFF);
+        iSCSITaskSlot * slot = &session->taskSlots[ParseInitiatorTaskTagForSlot(initiatorTaskTag)];
+        
+        // Free slots hold the reserved tag, which is never assigned to a task
+        if(slot->initiatorTaskTag != initiatorTaskTag ||
+           initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+            return NULL;
+        
+        return slot;
     }
     
-    inline SCSILogicalUnitNumber ParseInitiatorTaskTagForLUN(UInt32 initiatorTaskTag)
+    /*! Builds the LUN field of a PDU from a logical unit number.  LUNs below
+     *  256 use the peripheral device addressing method and larger LUNs the
+     *  flat space addressing method (SAM-2).
+     *  @param LUN the logical unit number.
+     *  @return the LUN field, in network byte order. */
+    inline UInt64 BuildLUNField(SCSILogicalUnitNumber LUN)
     {
-        return (UInt32)((initiatorTaskTag>>16) & 0xFF);
+        UInt64 addressedLUN = (LUN < 256) ? LUN : (0x4000 | (LUN & 0x3FFF));
+        return OSSwapHostToBigInt64(addressedLUN << 48);
     }
     
-    inline SCSITaggedTaskIdentifier ParseInitiatorTaskTagForTaskId(UInt32 initiatorTaskTag)
+    /*! Gets the SCSI task that an initiator task tag refers to.
+     *  @param session the session associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the task.
+     *  @return the task, or NULL if no such task is in progress. */
+    inline SCSIParallelTaskIdentifier FindTaskForInitiatorTaskTag(iSCSISession * session,
+                                                                  UInt32 initiatorTaskTag)
     {
-        return (UInt32)(initiatorTaskTag & 0xFFFF);
+        iSCSITaskSlot * slot = FindTaskSlot(session,initiatorTaskTag);
+        return slot ? slot->parallelTask : NULL;
     }
     
     inline void SetDataSegmentLength(iSCSIPDUInitiatorBHS * bhs,UInt32 length)
@@ -501,6 +1279,13 @@ private:
     /*! Lookup table mapping target names (IQN names) to session identifiers. */
     OSDictionary * targetList;
     
+    /*! Pool of work loops used by sessions that have their own work loop
+     *  (created as they are needed). */
+    IOWorkLoop ** sessionWorkLoops;
+    
+    /*! Number of sessions using each work loop in the pool. */
+    UInt32 * sessionWorkLoopUsers;
+    
     friend class iSCSITaskQueue;
 };
 
@@ -81,6 +81,27 @@ CFStringRef kiSCSIPVDigestNone = CFSTR("None");
 /*! Preference key value for digest. */
 CFStringRef kiSCSIPVDigestCRC32C = CFSTR("CRC32C");
 
+/*! Preference key name for the connection scheduling policy. */
+CFStringRef kiSCSIPKConnectionScheduling = CFSTR("Connection Scheduling");
+
+/*! Preference key value for round-robin connection scheduling. */
+CFStringRef kiSCSIPVConnectionSchedulingRoundRobin = CFSTR("Round Robin");
+
+/*! Preference key value for least-outstanding-bytes connection scheduling. */
+CFStringRef kiSCSIPVConnectionSchedulingLeastOutstandingBytes = CFSTR("Least Outstanding Bytes");
+
+/*! Preference key value for latency-weighted connection scheduling. */
+CFStringRef kiSCSIPVConnectionSchedulingLatencyWeighted = CFSTR("Latency Weighted");
+
+/*! Preference key name for the work loop policy. */
+CFStringRef kiSCSIPKWorkLoop = CFSTR("Work Loop");
+
+/*! Preference key value for sessions that share the driver's work loop. */
+CFStringRef kiSCSIPVWorkLoopShared = CFSTR("Shared");
+
+/*! Preference key value for sessions that run on their own work loop. */
+CFStringRef kiSCSIPVWorkLoopPerSession = CFSTR("Per Session");
+
 /*! Preference key name for iSCSI authentication. */
 CFStringRef kiSCSIPKAuth = CFSTR("Authentication");
 
@@ -221,6 +242,8 @@ CFMutableDictionaryRef iSCSIPreferencesCreateTargetDict()
     CFDictionaryAddValue(targetDict,kiSCSIPKErrorRecoveryLevel,errorRecoveryLevel);
     CFDictionaryAddValue(targetDict,kiSCSIPKHeaderDigest,kiSCSIPVDigestNone);
     CFDictionaryAddValue(targetDict,kiSCSIPKDataDigest,kiSCSIPVDigestNone);
+    CFDictionaryAddValue(targetDict,kiSCSIPKConnectionScheduling,kiSCSIPVConnectionSchedulingLeastOutstandingBytes);
+    CFDictionaryAddValue(targetDict,kiSCSIPKWorkLoop,kiSCSIPVWorkLoopShared);
 
     CFRelease(maxConnections);
     CFRelease(errorRecoveryLevel);
@@ -494,6 +517,94 @@ void iSCSIPreferencesSetDataDigestForTarget(iSCSIPreferencesRef preferences,CFSt
     }
 }
 
+enum iSCSIConnectionSchedulingPolicies iSCSIPreferencesGetConnectionSchedulingForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    // Get the dictionary containing information about the target
+    CFDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+
+    // Targets created before this preference existed use the default policy
+    enum iSCSIConnectionSchedulingPolicies policy = kiSCSIConnectionSchedulingLeastOutstandingBytes;
+
+    if(targetDict) {
+        CFStringRef value = CFDictionaryGetValue(targetDict,kiSCSIPKConnectionScheduling);
+
+        if(value) {
+
+            if(CFStringCompare(value,kiSCSIPVConnectionSchedulingRoundRobin,0) == kCFCompareEqualTo)
+                policy = kiSCSIConnectionSchedulingRoundRobin;
+            else if(CFStringCompare(value,kiSCSIPVConnectionSchedulingLatencyWeighted,0) == kCFCompareEqualTo)
+                policy = kiSCSIConnectionSchedulingLatencyWeighted;
+        }
+    }
+    return policy;
+}
+
+void iSCSIPreferencesSetConnectionSchedulingForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      enum iSCSIConnectionSchedulingPolicies policy)
+{
+    // Get the dictionary containing information about the target
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+
+    if(targetDict)
+    {
+        CFStringRef value = NULL;
+
+        switch(policy)
+        {
+            case kiSCSIConnectionSchedulingRoundRobin: value = kiSCSIPVConnectionSchedulingRoundRobin; break;
+            case kiSCSIConnectionSchedulingLeastOutstandingBytes: value = kiSCSIPVConnectionSchedulingLeastOutstandingBytes; break;
+            case kiSCSIConnectionSchedulingLatencyWeighted: value = kiSCSIPVConnectionSchedulingLatencyWeighted; break;
+            case kiSCSIConnectionSchedulingInvalid: break;
+        };
+
+        if(value) {
+            CFDictionarySetValue(targetDict,kiSCSIPKConnectionScheduling,value);
+        }
+    }
+}
+
+enum iSCSIWorkLoopPolicies iSCSIPreferencesGetWorkLoopForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    // Get the dictionary containing information about the target
+    CFDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+
+    // Targets created before this preference existed share the work loop
+    enum iSCSIWorkLoopPolicies policy = kiSCSIWorkLoopShared;
+
+    if(targetDict) {
+        CFStringRef value = CFDictionaryGetValue(targetDict,kiSCSIPKWorkLoop);
+
+        if(value && CFStringCompare(value,kiSCSIPVWorkLoopPerSession,0) == kCFCompareEqualTo)
+            policy = kiSCSIWorkLoopPerSession;
+    }
+    return policy;
+}
+
+void iSCSIPreferencesSetWorkLoopForTarget(iSCSIPreferencesRef preferences,
+                                          CFStringRef targetIQN,
+                                          enum iSCSIWorkLoopPolicies policy)
+{
+    // Get the dictionary containing information about the target
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+
+    if(targetDict)
+    {
+        CFStringRef value = NULL;
+
+        switch(policy)
+        {
+            case kiSCSIWorkLoopShared: value = kiSCSIPVWorkLoopShared; break;
+            case kiSCSIWorkLoopPerSession: value = kiSCSIPVWorkLoopPerSession; break;
+            case kiSCSIWorkLoopInvalid: break;
+        };
+
+        if(value) {
+            CFDictionarySetValue(targetDict,kiSCSIPKWorkLoop,value);
+        }
+    }
+}
+
 enum iSCSIDigestTypes iSCSIPreferencesGetHeaderDigestForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
 {
     // Get the dictionary containing information about the target
@@ -228,6 +228,36 @@ void iSCSIPreferencesSetHeaderDigestForTarget(iSCSIPreferencesRef preferences,
                                               CFStringRef targetIQN,
                                               enum iSCSIDigestTypes digestType);
 
+/*! Gets the policy used to assign tasks to connections for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the connection scheduling policy. */
+enum iSCSIConnectionSchedulingPolicies iSCSIPreferencesGetConnectionSchedulingForTarget(iSCSIPreferencesRef preferences,
+                                                                                        CFStringRef targetIQN);
+
+/*! Sets the policy used to assign tasks to connections for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param policy the connection scheduling policy. */
+void iSCSIPreferencesSetConnectionSchedulingForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      enum iSCSIConnectionSchedulingPolicies policy);
+
+/*! Gets the work loop policy for sessions to the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the work loop policy. */
+enum iSCSIWorkLoopPolicies iSCSIPreferencesGetWorkLoopForTarget(iSCSIPreferencesRef preferences,
+                                                                CFStringRef targetIQN);
+
+/*! Sets the work loop policy for sessions to the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param policy the work loop policy. */
+void iSCSIPreferencesSetWorkLoopForTarget(iSCSIPreferencesRef preferences,
+                                          CFStringRef targetIQN,
+                                          enum iSCSIWorkLoopPolicies policy);
+
 /*! Modifies the target IQN for the specified target.
  *  @param preferences an iSCSI preferences object.
  *  @param existingIQN the IQN of the existing target to modify.
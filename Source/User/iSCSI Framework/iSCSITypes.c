@@ -588,6 +588,8 @@ CFDataRef iSCSIDiscoveryRecCreateData(iSCSIMutableDiscoveryRecRef discoveryRec)
 CFStringRef kiSCSISessionConfigErrorRecoveryKey = CFSTR("Error Recovery Level");
 CFStringRef kiSCSISessionConfigPortalGroupTagKey = CFSTR("Target Portal Group Tag");
 CFStringRef kiSCSISessionConfigMaxConnectionsKey = CFSTR("Maximum Connections");
+CFStringRef kiSCSISessionConfigSchedulingPolicyKey = CFSTR("Connection Scheduling Policy");
+CFStringRef kiSCSISessionConfigWorkLoopPolicyKey = CFSTR("Work Loop Policy");
 
 /*! Convenience function.  Creates a new iSCSISessionConfigRef with the above keys. */
 iSCSIMutableSessionConfigRef iSCSISessionConfigCreateMutable()
@@ -596,6 +598,8 @@ iSCSIMutableSessionConfigRef iSCSISessionConfigCreateMutable()
     iSCSISessionConfigSetErrorRecoveryLevel(config,kRFC3720_ErrorRecoveryLevel);
     iSCSISessionConfigSetMaxConnections(config,kRFC3720_MaxConnections);
     iSCSISessionConfigSetTargetPortalGroupTag(config,0);
+    iSCSISessionConfigSetConnectionSchedulingPolicy(config,kiSCSIConnectionSchedulingLeastOutstandingBytes);
+    iSCSISessionConfigSetWorkLoopPolicy(config,kiSCSIWorkLoopShared);
     return config;
 }
 
@@ -660,6 +664,44 @@ void iSCSISessionConfigSetMaxConnections(iSCSIMutableSessionConfigRef target,
     CFRelease(maxConnectionsNum);
 }
 
+/*! Gets the policy used to assign tasks to the connections of a session. */
+enum iSCSIConnectionSchedulingPolicies iSCSISessionConfigGetConnectionSchedulingPolicy(iSCSISessionConfigRef target)
+{
+    int policy = kiSCSIConnectionSchedulingLeastOutstandingBytes;
+    CFNumberRef policyNum = CFDictionaryGetValue(target,kiSCSISessionConfigSchedulingPolicyKey);
+    if(policyNum)
+        CFNumberGetValue(policyNum,kCFNumberIntType,&policy);
+    return (enum iSCSIConnectionSchedulingPolicies)policy;
+}
+
+/*! Sets the policy used to assign tasks to the connections of a session. */
+void iSCSISessionConfigSetConnectionSchedulingPolicy(iSCSIMutableSessionConfigRef target,
+                                                     enum iSCSIConnectionSchedulingPolicies policy)
+{
+    CFNumberRef policyNum = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&policy);
+    CFDictionarySetValue(target,kiSCSISessionConfigSchedulingPolicyKey,policyNum);
+    CFRelease(policyNum);
+}
+
+/*! Gets the work loop policy of a session. */
+enum iSCSIWorkLoopPolicies iSCSISessionConfigGetWorkLoopPolicy(iSCSISessionConfigRef target)
+{
+    int policy = kiSCSIWorkLoopShared;
+    CFNumberRef policyNum = CFDictionaryGetValue(target,kiSCSISessionConfigWorkLoopPolicyKey);
+    if(policyNum)
+        CFNumberGetValue(policyNum,kCFNumberIntType,&policy);
+    return (enum iSCSIWorkLoopPolicies)policy;
+}
+
+/*! Sets the work loop policy of a session. */
+void iSCSISessionConfigSetWorkLoopPolicy(iSCSIMutableSessionConfigRef target,
+                                         enum iSCSIWorkLoopPolicies policy)
+{
+    CFNumberRef policyNum = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&policy);
+    CFDictionarySetValue(target,kiSCSISessionConfigWorkLoopPolicyKey,policyNum);
+    CFRelease(policyNum);
+}
+
 /*! Releases memory associated with an iSCSI session configuration object.
  *  @param config an iSCSI session configuration object. */
 void iSCSISessionConfigRelease(iSCSISessionConfigRef config)
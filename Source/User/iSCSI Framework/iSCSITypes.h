@@ -512,6 +512,20 @@ UInt32 iSCSISessionConfigGetMaxConnections(iSCSISessionConfigRef config);
 void iSCSISessionConfigSetMaxConnections(iSCSIMutableSessionConfigRef config,
                                          UInt32 maxConnections);
 
+/*! Gets the policy used to assign tasks to the connections of a session. */
+enum iSCSIConnectionSchedulingPolicies iSCSISessionConfigGetConnectionSchedulingPolicy(iSCSISessionConfigRef config);
+
+/*! Sets the policy used to assign tasks to the connections of a session. */
+void iSCSISessionConfigSetConnectionSchedulingPolicy(iSCSIMutableSessionConfigRef config,
+                                                     enum iSCSIConnectionSchedulingPolicies policy);
+
+/*! Gets the work loop policy of a session. */
+enum iSCSIWorkLoopPolicies iSCSISessionConfigGetWorkLoopPolicy(iSCSISessionConfigRef config);
+
+/*! Sets the work loop policy of a session. */
+void iSCSISessionConfigSetWorkLoopPolicy(iSCSIMutableSessionConfigRef config,
+                                         enum iSCSIWorkLoopPolicies policy);
+
 /*! Releases memory associated with an iSCSI session configuration object.
  *  @param config an iSCSI session configuration object. */
 void iSCSISessionConfigRelease(iSCSISessionConfigRef config);
@@ -57,6 +57,9 @@ static const UInt16 kiSCSIMaxSessions = 16;
 /*! Max number of connections per session. */
 static const UInt32 kiSCSIMaxConnectionsPerSession = 2;
 
+/*! Max number of outstanding R2Ts per task (offered as MaxOutstandingR2T). */
+static const UInt16 kiSCSIMaxOutstandingR2T = 16;
+
 /*! An enumeration of configurable session parameters. */
 enum iSCSIHBASessionParameters {
     
@@ -99,6 +102,50 @@ enum iSCSIHBASessionParameters {
     /*! Target portal group tag (TPGT). */
     kiSCSIHBASOTargetPortalGroupTag,
     
+    /*! Policy used to assign tasks to connections (UInt8, see
+     *  enum iSCSIConnectionSchedulingPolicies). */
+    kiSCSIHBASOConnectionSchedulingPolicy,
+    
+    /*! Policy used to select the work loop (thread) that processes the
+     *  session's I/O (UInt8, see enum iSCSIWorkLoopPolicies).  May only be
+     *  changed while none of the session's connections are active. */
+    kiSCSIHBASOWorkLoopPolicy,
+    
+};
+
+/*! Policies used to select the connection that a new task is assigned to
+ *  when a session has more than one connection (MC/S). */
+enum iSCSIConnectionSchedulingPolicies {
+    
+    /*! Tasks are assigned to each connection in turn. */
+    kiSCSIConnectionSchedulingRoundRobin = 0,
+    
+    /*! Tasks are assigned to the connection with the fewest bytes
+     *  that remain to be transferred. */
+    kiSCSIConnectionSchedulingLeastOutstandingBytes = 1,
+    
+    /*! Tasks are assigned to the connection expected to complete the task
+     *  first, based on its measured latency and throughput. */
+    kiSCSIConnectionSchedulingLatencyWeighted = 2,
+    
+    /*! Invalid scheduling policy. */
+    kiSCSIConnectionSchedulingInvalid
+};
+
+/*! Policies used to select the work loop that processes a session's I/O
+ *  (sending, receiving and digests for all of the session's connections). */
+enum iSCSIWorkLoopPolicies {
+    
+    /*! The session shares the HBA's work loop with every other session. */
+    kiSCSIWorkLoopShared = 0,
+    
+    /*! The session is given a work loop of its own from a pool kept by the
+     *  HBA.  Sessions are spread across the pool, so that each session has
+     *  its own thread until the pool is exhausted. */
+    kiSCSIWorkLoopPerSession = 1,
+    
+    /*! Invalid work loop policy. */
+    kiSCSIWorkLoopInvalid
 };
 
 
@@ -126,11 +173,127 @@ enum iSCSIHBAConnectionParameters {
     /*! Maximum data segment length allowed by the target (UInt32). */
     kiSCSIHBACOMaxSendDataSegmentLength,
     
-    /*! Maximum data segment length initiator can receive (UInt32). */
+    /*! Maximum data segment length initiator can receive (UInt32).  Setting
+     *  this on an active connection renegotiates it with a text request;
+     *  the new value is reported once the target has answered. */
     kiSCSIHBACOMaxRecvDataSegmentLength,
     
     /*! Initial expStatSN. */
-    kiSCSIHBACOInitialExpStatSN
+    kiSCSIHBACOInitialExpStatSN,
+    
+    /*! Number of times the connection was woken up to receive data (UInt64,
+     *  read-only).  PDUs per wakeup is kiSCSIHBACORecvPDUCount divided by
+     *  this value. */
+    kiSCSIHBACORecvWakeupCount,
+    
+    /*! Number of PDUs received in the full feature phase (UInt64, read-only). */
+    kiSCSIHBACORecvPDUCount,
+    
+    /*! Number of socket receive calls that returned data (UInt64, read-only).
+     *  Bytes per receive is kiSCSIHBACORecvByteCount divided by this value. */
+    kiSCSIHBACORecvCallCount,
+    
+    /*! Number of bytes returned by socket receive calls (UInt64, read-only). */
+    kiSCSIHBACORecvByteCount,
+    
+    /*! PDUs sent during a pass of the workloop are gathered and sent together
+     *  once this many bytes are queued (UInt32, zero disables coalescing). */
+    kiSCSIHBACOTransmitFlushBytes,
+    
+    /*! Queued PDUs are sent once the oldest has waited this long, even if
+     *  the byte bound has not been reached (UInt32, microseconds). */
+    kiSCSIHBACOTransmitFlushLatency,
+    
+    /*! Number of PDUs sent on the connection (UInt64, read-only).  PDUs per
+     *  send is this value divided by kiSCSIHBACOSendCallCount. */
+    kiSCSIHBACOSendPDUCount,
+    
+    /*! Number of socket send calls made on the connection (UInt64, read-only). */
+    kiSCSIHBACOSendCallCount,
+    
+    /*! Number of bytes sent on the connection (UInt64, read-only). */
+    kiSCSIHBACOSendByteCount,
+    
+    /*! Number of task queue entries allocated by the connection (UInt64,
+     *  read-only).  This stops increasing once the connection's pool has
+     *  grown to its peak load. */
+    kiSCSIHBACOTaskPoolAllocationCount,
+    
+    /*! Number of tasks queued while the connection's pool was empty (UInt64,
+     *  read-only). */
+    kiSCSIHBACOTaskPoolMissCount,
+    
+    /*! Largest number of task queue entries in use at once (UInt32,
+     *  read-only). */
+    kiSCSIHBACOTaskPoolHighWaterMark,
+    
+    /*! Interval between NOP-outs that measure the round-trip time of the
+     *  connection and check that it is alive (UInt32, milliseconds, zero
+     *  disables). */
+    kiSCSIHBACOPingInterval,
+    
+    /*! Smoothed round-trip time of the connection (UInt32, microseconds,
+     *  read-only).  Zero until the first NOP-out is answered. */
+    kiSCSIHBACOSmoothedRTT,
+    
+    /*! Mean deviation of the round-trip time of the connection (UInt32,
+     *  microseconds, read-only). */
+    kiSCSIHBACORTTVariance,
+    
+    /*! Number of round-trip times measured on the connection (UInt64,
+     *  read-only). */
+    kiSCSIHBACORTTSampleCount,
+    
+    /*! Maximum segment size of the connection's TCP path (UInt32, bytes,
+     *  read-only). */
+    kiSCSIHBACOPathMaxSegmentSize,
+    
+    /*! Size of the connection's socket receive buffer (UInt32, bytes,
+     *  read-only). */
+    kiSCSIHBACOSocketRecvBufferSize,
+    
+    /*! Smoothed time the target takes to send the first R2T of a write
+     *  (UInt32, microseconds, read-only).  Zero until the first R2T
+     *  arrives.  Writes larger than FirstBurstLength wait for the R2T
+     *  instead of sending unsolicited data while this is well above the
+     *  round-trip time. */
+    kiSCSIHBACOSmoothedR2TLatency,
+    
+    /*! Largest size that the connection's socket send and receive buffers
+     *  are grown to as the connection's bandwidth-delay product is
+     *  measured (UInt32, bytes).  Takes effect at the next round-trip time
+     *  measurement; buffers are never shrunk.  Not used while an explicit
+     *  size is set (see kiSCSIHBACOSocketBufferSize). */
+    kiSCSIHBACOSocketBufferLimit,
+    
+    /*! Size to set the connection's socket send and receive buffers to
+     *  (UInt32, bytes).  Zero, the default, leaves the buffers to the
+     *  system's autotuning and only grows them when the measured
+     *  bandwidth-delay product exceeds them.  A nonzero size turns the
+     *  autotuning off for the socket.  Takes effect at the next round-trip
+     *  time measurement. */
+    kiSCSIHBACOSocketBufferSize,
+    
+    /*! Size of the connection's socket send buffer (UInt32, bytes,
+     *  read-only). */
+    kiSCSIHBACOSocketSendBufferSize,
+    
+    /*! Whether Nagle's algorithm is disabled on the connection's socket
+     *  (bool, read-only). */
+    kiSCSIHBACONoDelay,
+    
+    /*! Time the connection may be idle before TCP keepalive probes are
+     *  sent (UInt32, seconds, read-only).  Derived from the session's
+     *  DefaultTime2Retain. */
+    kiSCSIHBACOKeepAliveIdleTime,
+    
+    /*! Interval between TCP keepalive probes (UInt32, seconds,
+     *  read-only). */
+    kiSCSIHBACOKeepAliveInterval,
+    
+    /*! Number of unanswered TCP keepalive probes after which the
+     *  connection is dropped (UInt32, read-only). */
+    kiSCSIHBACOKeepAliveCount
     
 };
 
@@ -170,6 +170,27 @@ CFStringRef kOptValueDigestNone = CFSTR("None");
 /*! Digest value for CRC32C digest. */
 CFStringRef kOptValueDigestCRC32C = CFSTR("CRC32C");
 
+/*! Connection scheduling policy command line option. */
+CFStringRef kOptKeyConnectionScheduling = CFSTR("ConnectionScheduling");
+
+/*! Connection scheduling value for round-robin scheduling. */
+CFStringRef kOptValueSchedulingRoundRobin = CFSTR("RoundRobin");
+
+/*! Connection scheduling value for least-outstanding-bytes scheduling. */
+CFStringRef kOptValueSchedulingLeastOutstandingBytes = CFSTR("LeastOutstandingBytes");
+
+/*! Connection scheduling value for latency-weighted scheduling. */
+CFStringRef kOptValueSchedulingLatencyWeighted = CFSTR("LatencyWeighted");
+
+/*! Work loop policy command line option. */
+CFStringRef kOptKeyWorkLoop = CFSTR("WorkLoop");
+
+/*! Work loop value for sessions that share the driver's work loop. */
+CFStringRef kOptValueWorkLoopShared = CFSTR("Shared");
+
+/*! Work loop value for sessions that run on their own work loop. */
+CFStringRef kOptValueWorkLoopPerSession = CFSTR("PerSession");
+
 /*! Discovery (SendTargets) enable/disable command-line option. */
 CFStringRef kOptKeySendTargetsEnable = CFSTR("SendTargets");
 
@@ -428,6 +449,30 @@ CFStringRef iSCSICtlGetStringForDigestType(enum iSCSIDigestTypes digestType)
     };
 }
 
+CFStringRef iSCSICtlGetStringForSchedulingPolicy(enum iSCSIConnectionSchedulingPolicies policy)
+{
+    switch(policy)
+    {
+        case kiSCSIConnectionSchedulingRoundRobin:
+            return kOptValueSchedulingRoundRobin; break;
+        case kiSCSIConnectionSchedulingLatencyWeighted:
+            return kOptValueSchedulingLatencyWeighted; break;
+        default:
+            return kOptValueSchedulingLeastOutstandingBytes; break;
+    };
+}
+
+CFStringRef iSCSICtlGetStringForWorkLoopPolicy(enum iSCSIWorkLoopPolicies policy)
+{
+    switch(policy)
+    {
+        case kiSCSIWorkLoopPerSession:
+            return kOptValueWorkLoopPerSession; break;
+        default:
+            return kOptValueWorkLoopShared; break;
+    };
+}
+
 void iSCSICtlDisplayiSCSILoginError(enum iSCSILoginStatusCode statusCode)
 {
     CFStringRef error = CFStringCreateWithFormat(
@@ -1309,6 +1354,38 @@ errno_t iSCSICtlModifyTargetFromOptions(AuthorizationRef authorization,
         
         validOption = true;
     }
+
+    // Check for connection scheduling policy
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyConnectionScheduling,(const void **)&value))
+    {
+        if(CFStringCompare(value,kOptValueSchedulingRoundRobin,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetConnectionSchedulingForTarget(preferences,targetIQN,kiSCSIConnectionSchedulingRoundRobin);
+        else if(CFStringCompare(value,kOptValueSchedulingLeastOutstandingBytes,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetConnectionSchedulingForTarget(preferences,targetIQN,kiSCSIConnectionSchedulingLeastOutstandingBytes);
+        else if(CFStringCompare(value,kOptValueSchedulingLatencyWeighted,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetConnectionSchedulingForTarget(preferences,targetIQN,kiSCSIConnectionSchedulingLatencyWeighted);
+        else {
+            iSCSICtlDisplayError(CFSTR("The specified connection scheduling policy is invalid"));
+            error = EINVAL;
+        }
+        
+        validOption = true;
+    }
+
+    // Check for work loop policy
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyWorkLoop,(const void **)&value))
+    {
+        if(CFStringCompare(value,kOptValueWorkLoopShared,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetWorkLoopForTarget(preferences,targetIQN,kiSCSIWorkLoopShared);
+        else if(CFStringCompare(value,kOptValueWorkLoopPerSession,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetWorkLoopForTarget(preferences,targetIQN,kiSCSIWorkLoopPerSession);
+        else {
+            iSCSICtlDisplayError(CFSTR("The specified work loop policy is invalid"));
+            error = EINVAL;
+        }
+        
+        validOption = true;
+    }
     
     if(!error && !validOption) {
         iSCSICtlDisplayError(CFSTR("No valid options have been specified."));
@@ -1691,13 +1768,17 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
     enum iSCSIErrorRecoveryLevels errorRecoveryLevelCfg = iSCSIPreferencesGetErrorRecoveryLevelForTarget(preferences,targetIQN);
     CFStringRef headerDigestStr = iSCSICtlGetStringForDigestType(iSCSIPreferencesGetHeaderDigestForTarget(preferences,targetIQN));
     CFStringRef dataDigestStr = iSCSICtlGetStringForDigestType(iSCSIPreferencesGetDataDigestForTarget(preferences,targetIQN));
+    CFStringRef schedulingStr = iSCSICtlGetStringForSchedulingPolicy(iSCSIPreferencesGetConnectionSchedulingForTarget(preferences,targetIQN));
+    CFStringRef workLoopStr = iSCSICtlGetStringForWorkLoopPolicy(iSCSIPreferencesGetWorkLoopForTarget(preferences,targetIQN));
 
     if(properties) {
         format = CFSTR("\tConfiguration:"
                        "\n\t\t%@ %@ (%d)"       // MaxConnections
                        "\n\t\t%@ %@ (%d)"       // ErrorRecoveryLevel
                        "\n\t\t%@ (%@)"          // HeaderDigest
-                       "\n\t\t%@ (%@)");        // DataDigest
+                       "\n\t\t%@ (%@)"          // DataDigest
+                       "\n\t\t%@ (%@)"          // ConnectionScheduling
+                       "\n\t\t%@ (%@)");        // WorkLoop
 
 
         CFNumberRef maxConnections = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
@@ -1707,19 +1788,25 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
                         kOptKeyMaxConnections,maxConnections,maxConnectionsCfg,
                         kOptKeyErrorRecoveryLevel,errorRecoveryLevel,errorRecoveryLevelCfg,
                         kOptKeyHeaderDigest,headerDigestStr,
-                        kOptKeyDataDigest,dataDigestStr);
+                        kOptKeyDataDigest,dataDigestStr,
+                        kOptKeyConnectionScheduling,schedulingStr,
+                        kOptKeyWorkLoop,workLoopStr);
     } else {
         format = CFSTR("\tConfiguration:"
                        "\n\t\t%@ (%d)"      // MaxConnections
                        "\n\t\t%@ (%d)"      // ErrorRecoveryLevel
                        "\n\t\t%@ (%@)"      // HeaderDigest
-                       "\n\t\t%@ (%@)");    // DataDigest
+                       "\n\t\t%@ (%@)"      // DataDigest
+                       "\n\t\t%@ (%@)"      // ConnectionScheduling
+                       "\n\t\t%@ (%@)");    // WorkLoop
 
         targetParams = CFStringCreateWithFormat(kCFAllocatorDefault,0,format,
                         kOptKeyMaxConnections,maxConnectionsCfg,
                         kOptKeyErrorRecoveryLevel,errorRecoveryLevelCfg,
                         kOptKeyHeaderDigest,headerDigestStr,
-                        kOptKeyDataDigest,dataDigestStr);
+                        kOptKeyDataDigest,dataDigestStr,
+                        kOptKeyConnectionScheduling,schedulingStr,
+                        kOptKeyWorkLoop,workLoopStr);
     }
 
     // Get authentication information
@@ -75,6 +75,9 @@ IONotificationPortRef powerNotifyPortRef;
 // Used to fire discovery timer at specified intervals
 CFRunLoopTimerRef discoveryTimer = NULL;
 
+// Used to tune the data segment lengths of active connections
+CFRunLoopTimerRef tuningTimer = NULL;
+
 // Used by discovery to notify the main daemon thread that data is ready
 CFRunLoopSourceRef discoverySource = NULL;
 
@@ -87,6 +90,10 @@ pthread_mutex_t discoveryMutex = PTHREAD_MUTEX_INITIALIZER;
 /*! Server-side timeouts (in milliseconds) for send()/recv(). */
 static const int kiSCSIDaemonTimeoutMilliSec = 250;
 
+/*! Interval (in seconds) at which active connections are measured and
+ *  their data segment lengths tuned. */
+static const CFTimeInterval kiSCSIDaemonTuningInterval = 15;
+
 /*! Dictionary used to keep track of portals and targets that
  *  were active when the system goes to sleep. */
 CFMutableDictionaryRef activeTargets = NULL;
@@ -217,6 +224,8 @@ iSCSISessionConfigRef iSCSIDCreateSessionConfig(CFStringRef targetIQN)
 
     iSCSISessionConfigSetErrorRecoveryLevel(config,iSCSIPreferencesGetErrorRecoveryLevelForTarget(preferences,targetIQN));
     iSCSISessionConfigSetMaxConnections(config,iSCSIPreferencesGetMaxConnectionsForTarget(preferences,targetIQN));
+    iSCSISessionConfigSetConnectionSchedulingPolicy(config,iSCSIPreferencesGetConnectionSchedulingForTarget(preferences,targetIQN));
+    iSCSISessionConfigSetWorkLoopPolicy(config,iSCSIPreferencesGetWorkLoopForTarget(preferences,targetIQN));
 
     return config;
 }
@@ -1319,6 +1328,13 @@ void * iSCSIDRunDiscovery(void * context)
     return NULL;
 }
 
+/*! Measures active connections and renegotiates data segment lengths that
+ *  no longer suit them (see iSCSISessionTuneConnections()). */
+void iSCSIDTuneConnections(CFRunLoopTimerRef timer,void * context)
+{
+    iSCSISessionTuneConnections(sessionManager);
+}
+
 void iSCSIDProcessDiscoveryData(void * info)
 {
     // Process discovery results if any
@@ -2144,6 +2160,12 @@ int main(void)
     discoveryContext.perform = iSCSIDProcessDiscoveryData;
     discoverySource = CFRunLoopSourceCreate(kCFAllocatorDefault,1,&discoveryContext);
     CFRunLoopAddSource(CFRunLoopGetMain(),discoverySource,kCFRunLoopDefaultMode);
+    
+    // Timer used to tune the data segment lengths of active connections
+    tuningTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                       CFAbsoluteTimeGetCurrent()+kiSCSIDaemonTuningInterval,
+                                       kiSCSIDaemonTuningInterval,0,0,&iSCSIDTuneConnections,NULL);
+    CFRunLoopAddTimer(CFRunLoopGetMain(),tuningTimer,kCFRunLoopDefaultMode);
 
     asl_log(NULL,NULL,ASL_LEVEL_INFO,"daemon started");
 
@@ -2164,6 +2186,10 @@ int main(void)
     
     CFRunLoopRun();
     
+    CFRunLoopRemoveTimer(CFRunLoopGetMain(),tuningTimer,kCFRunLoopDefaultMode);
+    CFRelease(tuningTimer);
+    tuningTimer = NULL;
+    
     iSCSISessionManagerUnscheduleWithRunloop(sessionManager,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
     iSCSISessionManagerRelease(sessionManager);
     sessionManager = NULL;
@@ -32,6 +32,7 @@
 
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOReturn.h>
+#include <math.h>
 
 struct __iSCSIHBAInterface {
     
@@ -1066,3 +1067,87 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
     
     return CFStringCreateWithCString(kCFAllocatorDefault,hostInterface,kCFStringEncodingASCII);
 }
+
+/*! Gets the latency statistics of a connection or of a logical unit.
+ *  The statistics can be read while I/O is in progress; see
+ *  iSCSIHBALatencyStatistics.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param scope whether the statistics of a connection or a logical unit
+ *  should be returned.
+ *  @param identifier the connection identifier or LUN.
+ *  @param stats the statistics (returned).
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceGetLatencyStatistics(iSCSIHBAInterfaceRef interface,
+                                              SessionIdentifier sessionId,
+                                              enum iSCSIHBALatencyScopes scope,
+                                              UInt64 identifier,
+                                              iSCSIHBALatencyStatistics * stats)
+{
+    if(!interface || sessionId == kiSCSIInvalidSessionId || !stats)
+        return kIOReturnBadArgument;
+    
+    const UInt32 inputCnt = 3;
+    UInt64 input[] = {sessionId,scope,identifier};
+    
+    size_t statsSize = sizeof(iSCSIHBALatencyStatistics);
+    
+    return IOConnectCallMethod(interface->connect,kiSCSIGetLatencyStatistics,
+                               input,inputCnt,0,0,0,0,stats,&statsSize);
+}
+
+/*! Estimates a percentile of the latencies counted by a histogram.  The
+ *  estimate is the upper bound of the bucket that holds the percentile,
+ *  so it is at most 25% above the true value.
+ *  @param histogram the latency histogram.
+ *  @param percentile the percentile (e.g., 99.9).
+ *  @return the latency at the percentile (microseconds), or 0 if the
+ *  histogram is empty. */
+UInt64 iSCSIHBAInterfaceGetLatencyPercentile(const iSCSIHBALatencyHistogram * histogram,
+                                             double percentile)
+{
+    if(!histogram)
+        return 0;
+    
+    // The buckets are summed rather than using the task count, since the
+    // two may differ slightly if the statistics were read during I/O
+    UInt64 taskCount = 0;
+    
+    for(UInt32 bucket = 0; bucket < kiSCSIHBALatencyBuckets; bucket++)
+        taskCount += histogram->buckets[bucket];
+    
+    if(taskCount == 0)
+        return 0;
+    
+    UInt64 rank = (UInt64)ceil(taskCount * percentile / 100.0);
+    
+    if(rank == 0)
+        rank = 1;
+    
+    UInt64 count = 0;
+    UInt32 bucket = 0;
+    
+    for(bucket = 0; bucket < kiSCSIHBALatencyBuckets - 1; bucket++) {
+        count += histogram->buckets[bucket];
+        if(count >= rank)
+            break;
+    }
+    
+    // Find the bucket's upper bound; past the first few buckets, each
+    // power of two is split into kiSCSIHBALatencySubBuckets buckets
+    UInt64 upperBound;
+    
+    if(bucket < kiSCSIHBALatencySubBuckets)
+        upperBound = bucket;
+    else {
+        UInt32 group = bucket / kiSCSIHBALatencySubBuckets;
+        UInt32 subBucket = bucket % kiSCSIHBALatencySubBuckets;
+        upperBound = ((UInt64)(kiSCSIHBALatencySubBuckets + subBucket + 1) << (group - 1)) - 1;
+    }
+    
+    // No latency exceeds the largest one seen
+    if(histogram->maxLatencyUs && upperBound > histogram->maxLatencyUs)
+        upperBound = histogram->maxLatencyUs;
+    
+    return upperBound;
+}
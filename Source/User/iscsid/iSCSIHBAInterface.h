@@ -386,5 +386,31 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
                                                                 SessionIdentifier sessionId,
                                                                 ConnectionIdentifier connectionId);
 
+/*! Gets the latency statistics of a connection or of a logical unit.
+ *  The statistics can be read while I/O is in progress; see
+ *  iSCSIHBALatencyStatistics.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param scope whether the statistics of a connection or a logical unit
+ *  should be returned.
+ *  @param identifier the connection identifier or LUN.
+ *  @param stats the statistics (returned).
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceGetLatencyStatistics(iSCSIHBAInterfaceRef interface,
+                                              SessionIdentifier sessionId,
+                                              enum iSCSIHBALatencyScopes scope,
+                                              UInt64 identifier,
+                                              iSCSIHBALatencyStatistics * stats);
+
+/*! Estimates a percentile of the latencies counted by a histogram.  The
+ *  estimate is the upper bound of the bucket that holds the percentile,
+ *  so it is at most 25% above the true value.
+ *  @param histogram the latency histogram.
+ *  @param percentile the percentile (e.g., 99.9).
+ *  @return the latency at the percentile (microseconds), or 0 if the
+ *  histogram is empty. */
+UInt64 iSCSIHBAInterfaceGetLatencyPercentile(const iSCSIHBALatencyHistogram * histogram,
+                                             double percentile);
+
 
 #endif /* defined(__ISCSI_HBA_INTERFACE_H__) */
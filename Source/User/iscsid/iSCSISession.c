@@ -35,10 +35,39 @@
 
 #include "iSCSI.h"
 
+#include <asl.h>
+
 /*! Maximum number of key-value pairs supported by a dictionary that is used
  *  to produce the data section of text and login PDUs. */
 const unsigned int kiSCSISessionMaxTextKeyValuePairs = 100;
 
+/*! Largest MaxRecvDataSegmentLength proposed to a target (bytes).  The kernel
+ *  keeps a buffer of this length for each connection. */
+const UInt32 kiSCSISessionMaxTunedDataSegmentLength = 262144;
+
+/*! Largest MaxBurstLength proposed to a target (bytes). */
+const UInt32 kiSCSISessionMaxTunedBurstLength = 1048576;
+
+/*! Fewest data segments that a proposed MaxBurstLength spans. */
+const UInt32 kiSCSISessionMinTunedSegmentsPerBurst = 4;
+
+/*! A connection's MaxRecvDataSegmentLength is renegotiated once the length
+ *  that suits its measurements differs from it by this factor. */
+const UInt32 kiSCSISessionRetuneFactor = 2;
+
+/*! Data segment and burst lengths proposed to a target. */
+struct iSCSINegotiateLengths {
+    
+    /*! MaxRecvDataSegmentLength declared for the connection. */
+    UInt32 maxRecvDataSegmentLength;
+    
+    /*! FirstBurstLength proposed for the session. */
+    UInt32 firstBurstLength;
+    
+    /*! MaxBurstLength proposed for the session. */
+    UInt32 maxBurstLength;
+};
+
 /*! Helper function used during session negotiation.  Returns true if BOTH
  *  the command and the response strings are "Yes" */
 Boolean iSCSILVGetEqual(CFStringRef cmdStr,CFStringRef rspStr)
@@ -111,12 +140,92 @@ Boolean iSCSILVRangeInvalid(UInt32 value,UInt32 min, UInt32 max)
     return (value < min || value > max);
 }
 
+/*! Helper function.  Chooses the data segment and burst lengths to propose
+ *  for a connection.  Data segments are sized to fill whole TCP segments of
+ *  the path, and are bounded by the kernel's buffer for each connection, by
+ *  half of the socket's receive buffer and by the bandwidth-delay product
+ *  (a segment longer than the data in flight saves no PDUs).  A burst
+ *  spans the bandwidth-delay product, so that a single task can keep the
+ *  path full.  The RFC3720 defaults are the least that is proposed.
+ *  @param hbaInterface the HBA interface.
+ *  @param sessionId the session qualifier.
+ *  @param connectionId the connection qualifier.
+ *  @param bandwidthDelayProduct the measured bandwidth-delay product of the
+ *  path (bytes), or 0 if it is not known.
+ *  @param lengths the lengths to propose (returned). */
+void iSCSINegotiateGetTunedLengths(iSCSIHBAInterfaceRef hbaInterface,
+                                   SessionIdentifier sessionId,
+                                   ConnectionIdentifier connectionId,
+                                   UInt64 bandwidthDelayProduct,
+                                   struct iSCSINegotiateLengths * lengths)
+{
+    UInt32 pathMaxSegmentSize = 0, socketRecvBufferSize = 0;
+    
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,
+                                            kiSCSIHBACOPathMaxSegmentSize,
+                                            &pathMaxSegmentSize,sizeof(pathMaxSegmentSize));
+    
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,
+                                            kiSCSIHBACOSocketRecvBufferSize,
+                                            &socketRecvBufferSize,sizeof(socketRecvBufferSize));
+    
+    UInt64 segmentLength = kiSCSISessionMaxTunedDataSegmentLength;
+    
+    if(socketRecvBufferSize && socketRecvBufferSize/2 < segmentLength)
+        segmentLength = socketRecvBufferSize/2;
+    
+    if(bandwidthDelayProduct && bandwidthDelayProduct < segmentLength)
+        segmentLength = bandwidthDelayProduct;
+    
+    // Trim the segment so that the PDU, including its header and digests,
+    // ends with a full TCP segment
+    const UInt32 framingLength = kiSCSIPDUBasicHeaderSegmentSize + 2*sizeof(UInt32);
+    UInt64 pduLength = segmentLength + framingLength;
+    
+    if(pathMaxSegmentSize && pduLength > pathMaxSegmentSize)
+        segmentLength = pduLength - (pduLength % pathMaxSegmentSize) - framingLength;
+    
+    // Whole words need no padding
+    segmentLength &= ~(UInt64)(kiSCSIPDUByteAlignment - 1);
+    
+    if(segmentLength < kRFC3720_MaxRecvDataSegmentLength)
+        segmentLength = kRFC3720_MaxRecvDataSegmentLength;
+    
+    UInt64 burstLength = bandwidthDelayProduct;
+    
+    if(burstLength < kiSCSISessionMinTunedSegmentsPerBurst*segmentLength)
+        burstLength = kiSCSISessionMinTunedSegmentsPerBurst*segmentLength;
+    
+    if(burstLength > kiSCSISessionMaxTunedBurstLength)
+        burstLength = kiSCSISessionMaxTunedBurstLength;
+    
+    // Bursts of whole data segments
+    burstLength -= burstLength % segmentLength;
+    
+    if(burstLength < kRFC3720_MaxBurstLength)
+        burstLength = kRFC3720_MaxBurstLength;
+    
+    lengths->maxRecvDataSegmentLength = (UInt32)segmentLength;
+    lengths->maxBurstLength = (UInt32)burstLength;
+    
+    // Immediate data is limited by FirstBurstLength; let it fill a segment
+    lengths->firstBurstLength = kRFC3720_FirstBurstLength;
+    
+    if(lengths->firstBurstLength < segmentLength)
+        lengths->firstBurstLength = (UInt32)segmentLength;
+    
+    if(lengths->firstBurstLength > lengths->maxBurstLength)
+        lengths->firstBurstLength = lengths->maxBurstLength;
+}
+
 /*! Helper function used by iSCSINegotiateSession to build a dictionary
  *  of session options (key-value pairs) that will be sent to the target.
  *  @param sessCfg a session configuration object.
+ *  @param lengths the burst lengths to propose.
  *  @param sessCmd a dictionary of key-value pairs used to negotiate session
  *  parameters during the iSCSI operational login negotiation. */
 void iSCSINegotiateBuildSWDictNormal(iSCSISessionConfigRef sessCfg,
+                                     const struct iSCSINegotiateLengths * lengths,
                                      CFMutableDictionaryRef sessCmd)
 {
     CFStringRef value;
@@ -133,18 +242,23 @@ void iSCSINegotiateBuildSWDictNormal(iSCSISessionConfigRef sessCfg,
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxConnections,value);
     CFRelease(value);
     
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_InitialR2T,kRFC3720_Value_Yes);
+    // Offer the most permissive unsolicited data settings; the result is
+    // whatever the target accepts (InitialR2T is ORed, ImmediateData is
+    // ANDed).  The kernel decides for each write how much of the first
+    // burst to send unsolicited.
+    CFDictionaryAddValue(sessCmd,kRFC3720_Key_InitialR2T,kRFC3720_Value_No);
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_ImmediateData,kRFC3720_Value_Yes);
     
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxBurstLength);
+    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),lengths->maxBurstLength);
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxBurstLength,value);
     CFRelease(value);
     
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_FirstBurstLength);
+    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),lengths->firstBurstLength);
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_FirstBurstLength,value);
     CFRelease(value);
     
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxOutstandingR2T);
+    // Offer as many outstanding R2Ts as the kernel can track for each task
+    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kiSCSIMaxOutstandingR2T);
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxOutstandingR2T,value);
     CFRelease(value);
     
@@ -377,9 +491,11 @@ errno_t iSCSINegotiateParseSWDictNormal(iSCSISessionManagerRef managerRef,
 /*! Helper function used by iSCSISessionNegotiateCW to build a dictionary
  *  of connection options (key-value pairs) that will be sent to the target.
  *  @param connCfg a connection configuration object.
+ *  @param lengths the data segment length to declare.
  *  @param connCmd  a dictionary that is populated with key-value pairs that
  *  will be used to negotiate connection parameters. */
 void iSCSINegotiateBuildCWDict(iSCSIConnectionConfigRef connCfg,
+                               const struct iSCSINegotiateLengths * lengths,
                                CFMutableDictionaryRef connCmd)
 {
     // Setup digest options
@@ -395,7 +511,7 @@ void iSCSINegotiateBuildCWDict(iSCSIConnectionConfigRef connCfg,
     
     // Setup maximum received data length
     CFStringRef maxRecvLength = CFStringCreateWithFormat(
-        kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxRecvDataSegmentLength);
+        kCFAllocatorDefault,NULL,CFSTR("%u"),lengths->maxRecvDataSegmentLength);
     
     CFDictionaryAddValue(connCmd,kRFC3720_Key_MaxRecvDataSegmentLength,maxRecvLength);
     
@@ -454,9 +570,10 @@ errno_t iSCSINegotiateParseCWDict(iSCSISessionManagerRef managerRef,
                                             kiSCSIHBACOUseHeaderDigest,
                                             &useHeaderDigest,sizeof(useHeaderDigest));
     
-    // This option is declarative; we sent the default length, and the target
-    // must accept our choice as it is within a valid range
-    UInt32 maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
+    // This option is declarative; the target must accept the length we sent
+    // as it is within a valid range
+    UInt32 maxRecvDataSegmentLength = CFStringGetIntValue(
+        CFDictionaryGetValue(connCmd,kRFC3720_Key_MaxRecvDataSegmentLength));
     
     iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
                                             kiSCSIHBACOMaxRecvDataSegmentLength,
@@ -505,13 +622,26 @@ errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
     // Add session parameters common to all session types
     iSCSINegotiateBuildSWDictCommon(sessCfg,sessCmd);
     
-    // If target name is specified, this is a normal session; add parameters
+    // Discovery sessions are short-lived and use the RFC3720 defaults; normal
+    // sessions propose lengths that suit the path to the target
     Boolean discoverySession = CFStringCompare(iSCSITargetGetIQN(target),kiSCSIUnspecifiedTargetIQN,0) == kCFCompareEqualTo;
+    
+    struct iSCSINegotiateLengths lengths;
+    lengths.maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
+    lengths.firstBurstLength = kRFC3720_FirstBurstLength;
+    lengths.maxBurstLength = kRFC3720_MaxBurstLength;
+    
+    if(!discoverySession) {
+        UInt64 bandwidthDelayProduct = iSCSISessionManagerGetBandwidthDelayProduct(managerRef,iSCSITargetGetIQN(target));
+        iSCSINegotiateGetTunedLengths(hbaInterface,sessionId,connectionId,bandwidthDelayProduct,&lengths);
+    }
+    
+    // If target name is specified, this is a normal session; add parameters
     if(!discoverySession)
-        iSCSINegotiateBuildSWDictNormal(sessCfg,sessCmd);
+        iSCSINegotiateBuildSWDictNormal(sessCfg,&lengths,sessCmd);
     
     // Add connection parameters
-    iSCSINegotiateBuildCWDict(connCfg,sessCmd);
+    iSCSINegotiateBuildCWDict(connCfg,&lengths,sessCmd);
     
     // Create a dictionary to store query response
     CFMutableDictionaryRef sessRsp = CFDictionaryCreateMutable(
@@ -544,6 +674,20 @@ errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
         iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
                                              kiSCSIHBASOTargetSessionId,
                                              &context.targetSessionId,sizeof(context.targetSessionId));
+        
+        // The connection scheduling policy is not negotiated; it only
+        // determines how the kernel assigns tasks to this session's connections
+        UInt8 schedulingPolicy = iSCSISessionConfigGetConnectionSchedulingPolicy(sessCfg);
+        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
+                                             kiSCSIHBASOConnectionSchedulingPolicy,
+                                             &schedulingPolicy,sizeof(schedulingPolicy));
+        
+        // The work loop must be chosen before the leading connection is
+        // activated; the kernel refuses to move a session with active connections
+        UInt8 workLoopPolicy = iSCSISessionConfigGetWorkLoopPolicy(sessCfg);
+        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
+                                             kiSCSIHBASOWorkLoopPolicy,
+                                             &workLoopPolicy,sizeof(workLoopPolicy));
         if(!error)
             error = iSCSINegotiateParseSWDictCommon(managerRef,sessionId,sessCmd,sessRsp);
     
@@ -582,8 +726,13 @@ errno_t iSCSINegotiateConnection(iSCSISessionManagerRef managerRef,
                                             &kCFTypeDictionaryKeyCallBacks,
                                             &kCFTypeDictionaryValueCallBacks);
     
+    // Declare a data segment length that suits the path to the target
+    struct iSCSINegotiateLengths lengths;
+    UInt64 bandwidthDelayProduct = iSCSISessionManagerGetBandwidthDelayProduct(managerRef,iSCSITargetGetIQN(target));
+    iSCSINegotiateGetTunedLengths(hbaInterface,sessionId,connectionId,bandwidthDelayProduct,&lengths);
+    
     // Populate dictionary with connection options based on connInfo
-    iSCSINegotiateBuildCWDict(target,connCmd);
+    iSCSINegotiateBuildCWDict(target,&lengths,connCmd);
 
     // Create a dictionary to store query response
     CFMutableDictionaryRef connRsp = CFDictionaryCreateMutable(
@@ -864,6 +1013,171 @@ errno_t iSCSISessionLogout(iSCSISessionManagerRef managerRef,
     return error;
 }
 
+/*! Helper function.  Samples the throughput and round-trip time of a
+ *  connection and renegotiates its MaxRecvDataSegmentLength if the length
+ *  that suits the measured bandwidth-delay product differs from it by
+ *  kiSCSISessionRetuneFactor or more.  The throughput before and after a
+ *  renegotiation is logged, as are the connection's task latencies when
+ *  it is renegotiated.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the session qualifier.
+ *  @param connectionId the connection qualifier.
+ *  @param targetIQN the name of the session's target. */
+void iSCSISessionTuneConnection(iSCSISessionManagerRef managerRef,
+                                SessionIdentifier sessionId,
+                                ConnectionIdentifier connectionId,
+                                CFStringRef targetIQN)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    iSCSIConnectionTuning * tuning = iSCSISessionManagerGetConnectionTuning(managerRef,sessionId,connectionId);
+    
+    if(!tuning)
+        return;
+    
+    // Only active connections are pinged, so this also skips connections
+    // that are still logging in
+    UInt32 smoothedRTT = 0;
+    UInt64 RTTSampleCount = 0;
+    
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACORTTSampleCount,
+                                            &RTTSampleCount,sizeof(RTTSampleCount));
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOSmoothedRTT,
+                                            &smoothedRTT,sizeof(smoothedRTT));
+    
+    if(RTTSampleCount == 0 || smoothedRTT == 0)
+        return;
+    
+    iSCSIHBALatencyStatistics stats;
+    
+    if(iSCSIHBAInterfaceGetLatencyStatistics(hbaInterface,sessionId,kiSCSIHBALatencyScopeConnection,
+                                             connectionId,&stats) != kIOReturnSuccess)
+        return;
+    
+    UInt64 byteCount = 0;
+    
+    for(int latencyClass = 0; latencyClass < kiSCSIHBALatencyClassCount; latencyClass++)
+        byteCount += stats.histograms[latencyClass].byteCount;
+    
+    // Start over if the connection was replaced since it was last sampled
+    if(tuning->statsStartTimeUs != stats.startTimeUs || byteCount < tuning->byteCount) {
+        memset(tuning,0,sizeof(*tuning));
+        tuning->statsStartTimeUs = stats.startTimeUs;
+        tuning->sampleTimeUs = stats.sampleTimeUs;
+        tuning->byteCount = byteCount;
+        return;
+    }
+    
+    UInt64 elapsedUs = stats.sampleTimeUs - tuning->sampleTimeUs;
+    
+    if(elapsedUs == 0)
+        return;
+    
+    UInt64 bytesPerSecond = (byteCount - tuning->byteCount)*1000000/elapsedUs;
+    
+    tuning->sampleTimeUs = stats.sampleTimeUs;
+    tuning->byteCount = byteCount;
+    
+    // An idle connection says nothing about the path
+    if(bytesPerSecond == 0)
+        return;
+    
+    UInt32 maxRecvDataSegmentLength = 0;
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,
+                                            kiSCSIHBACOMaxRecvDataSegmentLength,
+                                            &maxRecvDataSegmentLength,sizeof(maxRecvDataSegmentLength));
+    
+    if(tuning->retuneBytesPerSecond) {
+        asl_log(NULL,NULL,ASL_LEVEL_INFO,"session %u connection %u: MaxRecvDataSegmentLength %u -> %u, "
+                "throughput %llu -> %llu KB/s",sessionId,connectionId,tuning->retuneFromLength,
+                maxRecvDataSegmentLength,tuning->retuneBytesPerSecond/1024,bytesPerSecond/1024);
+        tuning->retuneBytesPerSecond = 0;
+    }
+    
+    // The peak decays, so that the estimate follows a path that slows down
+    tuning->peakBytesPerSecond -= tuning->peakBytesPerSecond/8;
+    
+    if(bytesPerSecond > tuning->peakBytesPerSecond)
+        tuning->peakBytesPerSecond = bytesPerSecond;
+    
+    // Burst lengths can only be negotiated by a leading login; the next
+    // session with this target proposes them from this measurement
+    UInt64 bandwidthDelayProduct = tuning->peakBytesPerSecond*smoothedRTT/1000000;
+    iSCSISessionManagerSetBandwidthDelayProduct(managerRef,targetIQN,bandwidthDelayProduct);
+    
+    struct iSCSINegotiateLengths lengths;
+    iSCSINegotiateGetTunedLengths(hbaInterface,sessionId,connectionId,bandwidthDelayProduct,&lengths);
+    
+    UInt32 tunedLength = lengths.maxRecvDataSegmentLength;
+    
+    if(!maxRecvDataSegmentLength ||
+       (tunedLength < maxRecvDataSegmentLength*kiSCSISessionRetuneFactor &&
+        tunedLength*kiSCSISessionRetuneFactor > maxRecvDataSegmentLength))
+        return;
+    
+    // The kernel renegotiates the length of an active connection with a
+    // text request
+    if(iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
+                                               kiSCSIHBACOMaxRecvDataSegmentLength,
+                                               &tunedLength,sizeof(tunedLength)) != kIOReturnSuccess)
+        return;
+    
+    asl_log(NULL,NULL,ASL_LEVEL_INFO,"session %u connection %u: renegotiating MaxRecvDataSegmentLength "
+            "%u -> %u (RTT %u us, throughput %llu KB/s)",sessionId,connectionId,
+            maxRecvDataSegmentLength,tunedLength,smoothedRTT,bytesPerSecond/1024);
+    
+    // Task latencies show whether the new length helped or hurt
+    const iSCSIHBALatencyHistogram * reads = &stats.histograms[kiSCSIHBALatencyClassRead];
+    const iSCSIHBALatencyHistogram * writes = &stats.histograms[kiSCSIHBALatencyClassWrite];
+    
+    asl_log(NULL,NULL,ASL_LEVEL_INFO,"session %u connection %u: read latency p50/p99/p99.9 "
+            "%llu/%llu/%llu us, write latency p50/p99/p99.9 %llu/%llu/%llu us",sessionId,connectionId,
+            iSCSIHBAInterfaceGetLatencyPercentile(reads,50),
+            iSCSIHBAInterfaceGetLatencyPercentile(reads,99),
+            iSCSIHBAInterfaceGetLatencyPercentile(reads,99.9),
+            iSCSIHBAInterfaceGetLatencyPercentile(writes,50),
+            iSCSIHBAInterfaceGetLatencyPercentile(writes,99),
+            iSCSIHBAInterfaceGetLatencyPercentile(writes,99.9));
+    
+    tuning->retuneBytesPerSecond = bytesPerSecond;
+    tuning->retuneFromLength = maxRecvDataSegmentLength;
+}
+
+/*! Samples the throughput and round-trip time of each active connection and
+ *  renegotiates the MaxRecvDataSegmentLength of connections whose measured
+ *  bandwidth-delay product calls for a different length.  The
+ *  bandwidth-delay product is also recorded for each target, and the
+ *  target's next leading login proposes burst lengths to match.  This
+ *  function should be called periodically.
+ *  @param managerRef a session manager instance. */
+void iSCSISessionTuneConnections(iSCSISessionManagerRef managerRef)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    
+    SessionIdentifier sessionIds[kiSCSIMaxSessions];
+    UInt16 sessionCount = 0;
+    
+    if(iSCSIHBAInterfaceGetSessionIds(hbaInterface,sessionIds,&sessionCount) != kIOReturnSuccess)
+        return;
+    
+    for(UInt16 sessionIdx = 0; sessionIdx < sessionCount; sessionIdx++)
+    {
+        SessionIdentifier sessionId = sessionIds[sessionIdx];
+        ConnectionIdentifier connectionIds[kiSCSIMaxConnectionsPerSession];
+        UInt32 connectionCount = 0;
+        
+        if(iSCSIHBAInterfaceGetConnectionIds(hbaInterface,sessionId,connectionIds,&connectionCount) != kIOReturnSuccess)
+            continue;
+        
+        CFStringRef targetIQN = iSCSIHBAInterfaceCreateTargetIQNForSessionId(hbaInterface,sessionId);
+        
+        for(UInt32 connectionIdx = 0; connectionIdx < connectionCount; connectionIdx++)
+            iSCSISessionTuneConnection(managerRef,sessionId,connectionIds[connectionIdx],targetIQN);
+        
+        if(targetIQN)
+            CFRelease(targetIQN);
+    }
+}
+
 /*! Callback function used by iSCSIQueryPortalForTargets to parse discovery
  *  data into an iSCSIDiscoveryRec object. */
 void iSCSIPDUDataParseToDiscoveryRecCallback(void * keyContainer,CFStringRef key,
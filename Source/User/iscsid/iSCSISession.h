@@ -95,6 +95,15 @@ errno_t iSCSISessionRemoveConnection(iSCSISessionManagerRef managerRef,
                                      ConnectionIdentifier connectionId,
                                      enum iSCSILogoutStatusCode * statusCode);
 
+/*! Samples the throughput and round-trip time of each active connection and
+ *  renegotiates the MaxRecvDataSegmentLength of connections whose measured
+ *  bandwidth-delay product calls for a different length.  The
+ *  bandwidth-delay product is also recorded for each target, and the
+ *  target's next leading login proposes burst lengths to match.  This
+ *  function should be called periodically.
+ *  @param managerRef a session manager instance. */
+void iSCSISessionTuneConnections(iSCSISessionManagerRef managerRef);
+
 /*! Queries a portal for available targets (utilizes iSCSI SendTargets).
  *  @param managerRef a session manager instance.
  *  @param portal the iSCSI portal to query.
@@ -44,7 +44,8 @@ struct __iSCSISessionManager
     iSCSISessionManagerCallBacks callbacks;
     CFStringRef initiatorName;
     CFStringRef initiatorAlias;
-    
+    iSCSIConnectionTuning connectionTuning[kiSCSIMaxSessions][kiSCSIMaxConnectionsPerSession];
+    CFMutableDictionaryRef bandwidthDelayProducts;
 };
 
 /*! This function is called handle session or connection network timeouts.
@@ -144,6 +145,10 @@ iSCSISessionManagerRef iSCSISessionManagerCreate(CFAllocatorRef allocator,
         managerRef->callbacks = callbacks;
         managerRef->initiatorName = kiSCSIInitiatorIQN;
         managerRef->initiatorAlias = kiSCSIInitiatorAlias;
+        memset(managerRef->connectionTuning,0,sizeof(managerRef->connectionTuning));
+        managerRef->bandwidthDelayProducts = CFDictionaryCreateMutable(allocator,0,
+                                                                       &kCFTypeDictionaryKeyCallBacks,
+                                                                       &kCFTypeDictionaryValueCallBacks);
     }
     else {
         CFAllocatorDeallocate(allocator,managerRef);
@@ -159,6 +164,7 @@ iSCSISessionManagerRef iSCSISessionManagerCreate(CFAllocatorRef allocator,
  *  @param managerRef an instance of an iSCSISessionManagerRef. */
 void iSCSISessionManagerRelease(iSCSISessionManagerRef managerRef)
 {
+    CFRelease(managerRef->bandwidthDelayProducts);
     CFAllocatorDeallocate(managerRef->allocator,managerRef);
 }
 
@@ -217,3 +223,55 @@ void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
     CFRelease(managerRef->initiatorAlias);
     managerRef->initiatorAlias = CFStringCreateCopy(kCFAllocatorDefault,initiatorAlias);
 }
+
+/*! Returns the measurements used to tune a connection.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier.
+ *  @return the connection's measurements, or NULL if the identifiers are
+ *  out of range. */
+iSCSIConnectionTuning * iSCSISessionManagerGetConnectionTuning(iSCSISessionManagerRef managerRef,
+                                                               SessionIdentifier sessionId,
+                                                               ConnectionIdentifier connectionId)
+{
+    if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
+        return NULL;
+    
+    return &managerRef->connectionTuning[sessionId][connectionId];
+}
+
+/*! Gets the bandwidth-delay product last measured for the path to a target.
+ *  This outlives the target's sessions, so that the next leading login can
+ *  propose burst lengths that suit the path.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @return the bandwidth-delay product (bytes), or 0 if it hasn't been
+ *  measured. */
+UInt64 iSCSISessionManagerGetBandwidthDelayProduct(iSCSISessionManagerRef managerRef,
+                                                   CFStringRef targetIQN)
+{
+    CFNumberRef value = NULL;
+    SInt64 bandwidthDelayProduct = 0;
+    
+    if(targetIQN && CFDictionaryGetValueIfPresent(managerRef->bandwidthDelayProducts,targetIQN,(const void **)&value))
+        CFNumberGetValue(value,kCFNumberSInt64Type,&bandwidthDelayProduct);
+    
+    return (UInt64)bandwidthDelayProduct;
+}
+
+/*! Records the bandwidth-delay product measured for the path to a target.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @param bandwidthDelayProduct the bandwidth-delay product (bytes). */
+void iSCSISessionManagerSetBandwidthDelayProduct(iSCSISessionManagerRef managerRef,
+                                                 CFStringRef targetIQN,
+                                                 UInt64 bandwidthDelayProduct)
+{
+    if(!targetIQN)
+        return;
+    
+    SInt64 value = (SInt64)bandwidthDelayProduct;
+    CFNumberRef number = CFNumberCreate(managerRef->allocator,kCFNumberSInt64Type,&value);
+    CFDictionarySetValue(managerRef->bandwidthDelayProducts,targetIQN,number);
+    CFRelease(number);
+}
@@ -39,6 +39,33 @@ typedef struct __iSCSISessionManager * iSCSISessionManagerRef;
 /*! Callback function called when a session or connection timeout occurs. */
 typedef void (*iSCSISessionTimeoutCallback)(iSCSITargetRef target,iSCSIPortalRef portal);
     
+/*! Measurements of a connection, taken periodically to tune the length of
+ *  the data segments it receives (see iSCSISessionTuneConnections()). */
+typedef struct iSCSIConnectionTuning
+{
+    /*! When the kernel began collecting statistics for the connection; a
+     *  change means the connection was replaced (microseconds of uptime). */
+    UInt64 statsStartTimeUs;
+    
+    /*! When the connection was last sampled (microseconds of uptime). */
+    UInt64 sampleTimeUs;
+    
+    /*! Bytes transferred by the connection's tasks when last sampled. */
+    UInt64 byteCount;
+    
+    /*! Highest throughput measured between two samples (bytes/s). */
+    UInt64 peakBytesPerSecond;
+    
+    /*! Throughput before the last renegotiation, reported along with the
+     *  throughput after it once the connection has transferred data again
+     *  (zero if no renegotiation is being followed). */
+    UInt64 retuneBytesPerSecond;
+    
+    /*! MaxRecvDataSegmentLength before the last renegotiation. */
+    UInt32 retuneFromLength;
+    
+} iSCSIConnectionTuning;
+
 /*! Callback types used by the session manager. */
 typedef struct iSCSISessionManagerCallBacks
 {
@@ -99,5 +126,33 @@ void iSCSISessionManagerSetInitiatorName(iSCSISessionManagerRef managerRef,
 void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
                                           CFStringRef initiatorAlias);
 
+/*! Returns the measurements used to tune a connection.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier.
+ *  @return the connection's measurements, or NULL if the identifiers are
+ *  out of range. */
+iSCSIConnectionTuning * iSCSISessionManagerGetConnectionTuning(iSCSISessionManagerRef managerRef,
+                                                               SessionIdentifier sessionId,
+                                                               ConnectionIdentifier connectionId);
+
+/*! Gets the bandwidth-delay product last measured for the path to a target.
+ *  This outlives the target's sessions, so that the next leading login can
+ *  propose burst lengths that suit the path.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @return the bandwidth-delay product (bytes), or 0 if it hasn't been
+ *  measured. */
+UInt64 iSCSISessionManagerGetBandwidthDelayProduct(iSCSISessionManagerRef managerRef,
+                                                   CFStringRef targetIQN);
+
+/*! Records the bandwidth-delay product measured for the path to a target.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @param bandwidthDelayProduct the bandwidth-delay product (bytes). */
+void iSCSISessionManagerSetBandwidthDelayProduct(iSCSISessionManagerRef managerRef,
+                                                 CFStringRef targetIQN,
+                                                 UInt64 bandwidthDelayProduct);
+
 
 #endif